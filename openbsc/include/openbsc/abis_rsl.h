@@ -49,6 +49,7 @@ int rsl_encryption_cmd(struct msgb *msg);
 int rsl_paging_cmd(struct gsm_bts *bts, uint8_t paging_group, uint8_t len,
 		   uint8_t *ms_ident, uint8_t chan_needed);
 int rsl_imm_assign_cmd(struct gsm_bts *bts, uint8_t len, uint8_t *val);
+void rsl_chan_rqd_discard(struct gsm_bts *bts);
 
 int rsl_data_request(struct msgb *msg, uint8_t link_id);
 int rsl_establish_request(struct gsm_lchan *lchan, uint8_t link_id);
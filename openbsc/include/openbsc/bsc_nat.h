@@ -46,6 +46,10 @@ struct bsc_nat_parsed;
 struct bsc_nat;
 struct bsc_nat_ussd_con;
 struct nat_rewrite_rule;
+struct nat_rewrite;
+struct bsc_nat_num_rewr;
+struct bsc_nat_worker;
+struct bsc_nat_worker_conn;
 
 enum {
 	NAT_CON_TYPE_NONE,
@@ -115,11 +119,21 @@ struct bsc_connection {
 	int next_transaction;
 	uint32_t pending_dlcx_count;
 	struct llist_head pending_dlcx;
+	struct llist_head mgcp_endpoints;
 
 	/* track the pending commands for this BSC */
 	struct llist_head cmd_pending;
 	int last_id;
 
+	/* the SCCP connections of this BSC */
+	struct llist_head sccp_connections;
+
+	/* the last paging command sent, see bsc_nat_forward_paging */
+	unsigned int paging_round;
+
+	/* the socket when it is handled by a worker thread */
+	struct bsc_nat_worker_conn *worker_conn;
+
 	/* a back pointer */
 	struct bsc_nat *nat;
 };
@@ -145,6 +159,7 @@ enum bsc_cfg_ctr {
 	BCFG_CTR_CON_PAG_RESP,
 	BCFG_CTR_CON_SSA,
 	BCFG_CTR_CON_OTHER,
+	BCFG_CTR_PAGING,
 };
 
 /**
@@ -186,6 +201,21 @@ struct bsc_nat_paging_group {
 	/* list of lac entries */
 	struct llist_head lists;
 	int nr;
+
+	/* backpointer */
+	struct bsc_nat *nat;
+};
+
+/**
+ * The authenticated BSCs handling a LAC, either by their own
+ * configuration or by their paging group.
+ */
+struct bsc_nat_paging_lac {
+	struct llist_head entry;
+	uint16_t lac;
+
+	int num_bscs;
+	struct bsc_connection **bscs;
 };
 
 /**
@@ -198,6 +228,14 @@ struct bsc_endpoint {
 	char *transaction_id;
 	/* the bsc we are talking to */
 	struct bsc_connection *bsc;
+
+	/* the connection the MSC assigned this endpoint to */
+	struct nat_sccp_connection *sccp;
+
+	/* hashed by the transaction_id while it is set */
+	struct llist_head trans_entry;
+	/* in the list of the bsc while it is set */
+	struct llist_head bsc_entry;
 };
 
 /**
@@ -221,6 +259,31 @@ struct bsc_nat_statistics {
 	struct {
 		struct osmo_counter *reconn;
 	} ussd;
+
+	/* paging fan out, see enum bsc_nat_paging_ctr */
+	struct rate_ctr_group *paging;
+
+	/* SCCP from the BSCs by path, see enum bsc_nat_sccp_ctr */
+	struct rate_ctr_group *sccp_path;
+};
+
+enum bsc_nat_paging_ctr {
+	NAT_PAGING_RECEIVED,
+	NAT_PAGING_FORWARDED,
+	NAT_PAGING_UNROUTED,
+};
+
+enum bsc_nat_sccp_ctr {
+	NAT_SCCP_DT1_FAST,
+	NAT_SCCP_DT1_PARSED,
+	NAT_SCCP_CR_PARSED,
+	NAT_SCCP_CC_PARSED,
+	NAT_SCCP_CREF_PARSED,
+	NAT_SCCP_RLSD_PARSED,
+	NAT_SCCP_RLC_PARSED,
+	NAT_SCCP_IT_PARSED,
+	NAT_SCCP_UDT_PARSED,
+	NAT_SCCP_OTHER_PARSED,
 };
 
 enum bsc_nat_acc_ctr {
@@ -228,6 +291,12 @@ enum bsc_nat_acc_ctr {
 	ACC_LIST_NAT_FILTER,
 };
 
+/* result of bsc_nat_acc_lst_match */
+#define NAT_ACC_ALLOW	0x1
+#define NAT_ACC_DENY	0x2
+
+struct bsc_nat_acc_match;
+
 struct bsc_nat_acc_lst {
 	struct llist_head list;
 
@@ -237,6 +306,22 @@ struct bsc_nat_acc_lst {
 	/* the name of the list */
 	const char *name;
 	struct llist_head fltr_list;
+
+	/* the fltr_list compiled into one automaton, see bsc_nat_acc_match.c */
+	int dirty;
+	unsigned int reg_gen;
+	struct bsc_nat_acc_match *match;
+	struct {
+		int states;
+		int compiled;
+		int fallback;
+		uint64_t compile_ns;
+
+		/* every 64th lookup is timed */
+		unsigned long lookups;
+		unsigned long sampled;
+		uint64_t lookup_ns;
+	} perf;
 };
 
 struct bsc_nat_acc_lst_entry {
@@ -249,6 +334,13 @@ struct bsc_nat_acc_lst_entry {
 	regex_t imsi_deny_re;
 };
 
+#define NAT_SCCP_HASH_BITS	14
+#define NAT_SCCP_HASH_SIZE	(1 << NAT_SCCP_HASH_BITS)
+
+#define NAT_PAGING_HASH_SIZE	256
+
+#define NAT_MGCP_HASH_SIZE	1024
+
 /**
  * the structure of the "nat" network
  */
@@ -256,6 +348,11 @@ struct bsc_nat {
 	/* active SCCP connections that need patching */
 	struct llist_head sccp_connections;
 
+	/* the same connections hashed by their references */
+	struct llist_head *sccp_by_patched;
+	struct llist_head *sccp_by_real;
+	struct llist_head *sccp_by_remote;
+
 	/* active BSC connections that need patching */
 	struct llist_head bsc_connections;
 
@@ -265,6 +362,12 @@ struct bsc_nat {
 	/* paging groups */
 	struct llist_head paging_groups;
 
+	/* LAC to BSC index, rebuilt on the next paging once dirty */
+	int paging_index_dirty;
+	void *paging_index;
+	struct llist_head *paging_lacs;
+	unsigned int paging_round;
+
 	/* known BSC's */
 	struct llist_head bsc_configs;
 	int num_bsc;
@@ -274,6 +377,8 @@ struct bsc_nat {
 	struct mgcp_config *mgcp_cfg;
 	uint8_t mgcp_msg[4096];
 	int mgcp_length;
+	char mgcp_rewr[4096];
+	struct msgb *mgcp_rx;
 	int mgcp_ipa;
 
 	/* msc things */
@@ -289,6 +394,10 @@ struct bsc_nat {
 
 	struct bsc_endpoint *bsc_endpoints;
 
+	/* pending MGCP transactions and DLCX responses by transaction id */
+	struct llist_head *mgcp_trans;
+	struct llist_head *pending_dlcx;
+
 	/* filter */
 	char *acc_lst_name;
 
@@ -296,20 +405,20 @@ struct bsc_nat {
 	struct rb_root imsi_black_list;
 	char *imsi_black_list_fn;
 
-	/* number rewriting */
+	/* number rewriting, the compiled rules or NULL */
 	char *num_rewr_name;
-	struct llist_head num_rewr;
+	struct bsc_nat_num_rewr *num_rewr;
 	char *num_rewr_post_name;
-	struct llist_head num_rewr_post;
+	struct bsc_nat_num_rewr *num_rewr_post;
 
 	char *smsc_rewr_name;
-	struct llist_head smsc_rewr;
+	struct bsc_nat_num_rewr *smsc_rewr;
 	char *tpdest_match_name;
-	struct llist_head tpdest_match;
+	struct bsc_nat_num_rewr *tpdest_match;
 	char *sms_clear_tp_srr_name;
-	struct llist_head sms_clear_tp_srr;
+	struct bsc_nat_num_rewr *sms_clear_tp_srr;
 	char *sms_num_rewr_name;
-	struct llist_head sms_num_rewr;
+	struct bsc_nat_num_rewr *sms_num_rewr;
 
 	/* more rewriting */
 	char *num_rewr_trie_name;
@@ -332,6 +441,13 @@ struct bsc_nat {
 
 	/* control interface */
 	struct ctrl_handle *ctrl;
+
+	/* BSC socket workers */
+	int bsc_workers;
+	int num_workers;
+	struct bsc_nat_worker *workers;
+	int (*worker_read_cb)(struct bsc_connection *bsc, struct msgb *msg);
+	void (*worker_close_cb)(struct bsc_connection *bsc, int ret);
 };
 
 struct bsc_nat_ussd_con {
@@ -355,6 +471,10 @@ void bsc_config_add_lac(struct bsc_config *cfg, int lac);
 void bsc_config_del_lac(struct bsc_config *cfg, int lac);
 int bsc_config_handles_lac(struct bsc_config *cfg, int lac);
 
+void bsc_nat_paging_index_invalidate(struct bsc_nat *nat);
+struct bsc_nat_paging_lac *bsc_nat_paging_lac_find(struct bsc_nat *nat, uint16_t lac);
+int bsc_nat_forward_paging(struct bsc_nat *nat, struct msgb *msg);
+
 struct bsc_nat *bsc_nat_alloc(void);
 struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat);
 void bsc_nat_set_msc_ip(struct bsc_nat *bsc, const char *ip);
@@ -395,6 +515,10 @@ void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bs
 struct nat_sccp_connection *patch_sccp_src_ref_to_bsc(struct msgb *, struct bsc_nat_parsed *, struct bsc_nat *);
 struct nat_sccp_connection *patch_sccp_src_ref_to_msc(struct msgb *, struct bsc_nat_parsed *, struct bsc_connection *);
 struct nat_sccp_connection *bsc_nat_find_con_by_bsc(struct bsc_nat *, struct sccp_source_reference *);
+struct nat_sccp_connection *bsc_nat_dt1_fast_path(struct bsc_connection *, struct msgb *);
+void sccp_connection_add(struct nat_sccp_connection *);
+void sccp_connection_remove(struct nat_sccp_connection *);
+void sccp_connection_set_remote(struct nat_sccp_connection *, struct sccp_source_reference *);
 
 /**
  * MGCP/Audio handling
@@ -408,8 +532,8 @@ void bsc_mgcp_free_endpoints(struct bsc_nat *nat);
 int bsc_mgcp_nat_init(struct bsc_nat *nat);
 
 struct nat_sccp_connection *bsc_mgcp_find_con(struct bsc_nat *, int endpoint_number);
-struct msgb *bsc_mgcp_rewrite(char *input, int length, int endp, const char *ip,
-			      int port, int *payload_type);
+int bsc_mgcp_rewrite(const char *input, int length, int endp, const char *ip,
+		     int port, int *payload_type, char *output, int output_len);
 void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg);
 
 void bsc_mgcp_clear_endpoints_for(struct bsc_connection *bsc);
@@ -421,6 +545,16 @@ int bsc_write(struct bsc_connection *bsc, struct msgb *msg, int id);
 int bsc_do_write(struct osmo_wqueue *queue, struct msgb *msg, int id);
 int bsc_write_msg(struct osmo_wqueue *queue, struct msgb *msg);
 int bsc_write_cb(struct osmo_fd *bfd, struct msgb *msg);
+int bsc_send_msg(struct bsc_connection *bsc, struct msgb *msg);
+
+/* BSC socket workers */
+int bsc_nat_workers_start(struct bsc_nat *nat,
+			  int (*read_cb)(struct bsc_connection *, struct msgb *),
+			  void (*close_cb)(struct bsc_connection *, int ret));
+void bsc_nat_workers_stop(struct bsc_nat *nat);
+int bsc_nat_worker_attach(struct bsc_connection *bsc);
+void bsc_nat_worker_detach(struct bsc_connection *bsc);
+int bsc_nat_worker_send(struct bsc_connection *bsc, struct msgb *msg);
 
 /* IMSI allow/deny handling */
 struct bsc_nat_acc_lst *bsc_nat_acc_lst_find(struct bsc_nat *nat, const char *name);
@@ -429,6 +563,11 @@ void bsc_nat_acc_lst_delete(struct bsc_nat_acc_lst *lst);
 
 struct bsc_nat_acc_lst_entry *bsc_nat_acc_lst_entry_create(struct bsc_nat_acc_lst *);
 int bsc_nat_lst_check_allow(struct bsc_nat_acc_lst *lst, const char *imsi);
+int bsc_nat_lst_check_deny(struct bsc_nat_acc_lst *lst, const char *imsi);
+
+/* access list matching */
+int bsc_nat_acc_lst_compile(struct bsc_nat_acc_lst *lst);
+int bsc_nat_acc_lst_match(struct bsc_nat_acc_lst *lst, const char *imsi);
 
 int bsc_nat_msc_is_connected(struct bsc_nat *nat);
 
@@ -461,9 +600,16 @@ struct bsc_nat_num_rewr_entry {
 
 	char *replace;
 	uint8_t is_prefix_lookup;
+
+	/* the expressions the rules are compiled from */
+	char *msisdn_re;
+	char *num_re;
 };
 
-void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head, const struct osmo_config_list *);
+void bsc_nat_num_rewr_entry_adapt(void *ctx, struct bsc_nat_num_rewr **rewr, const struct osmo_config_list *);
+int bsc_nat_num_rewr_apply(struct bsc_nat_num_rewr *rewr, const char *imsi,
+			   const char *number, struct nat_rewrite *trie,
+			   char *out, size_t out_len);
 
 struct bsc_nat_barr_entry {
 	struct rb_node node;
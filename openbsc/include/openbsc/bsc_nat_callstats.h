@@ -25,9 +25,15 @@
 
 #include <osmocom/sccp/sccp_types.h>
 
+struct bsc_connection;
+
 struct bsc_nat_call_stats {
 	struct llist_head entry;
 
+	/* hashed by the trans_id in the nat */
+	struct llist_head hash_entry;
+	struct bsc_connection *bsc;
+
 	struct sccp_source_reference remote_ref;
 	struct sccp_source_reference src_ref; /* as seen by the MSC */
 
@@ -68,6 +68,12 @@ struct bsc_nat_parsed {
 struct nat_sccp_connection {
 	struct llist_head list_entry;
 
+	/* the hash chains of the nat and the list of the bsc */
+	struct llist_head patched_entry;
+	struct llist_head real_entry;
+	struct llist_head remote_entry;
+	struct llist_head bsc_entry;
+
 	struct bsc_connection *bsc;
 	struct bsc_msc_connection *msc_con;
 
@@ -0,0 +1,145 @@
+/*
+ * (C) 2010-2012 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010-2012 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BSC_NAT_WORKER_H
+#define BSC_NAT_WORKER_H
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define BSC_NAT_WORKER_RING_SIZE	1024
+#define BSC_NAT_WORKER_RX_SIZE		4096
+
+struct bsc_nat;
+struct bsc_connection;
+
+enum bsc_nat_worker_msg_type {
+	/* from the main thread to the worker */
+	BSC_NAT_WORKER_ATTACH,
+	BSC_NAT_WORKER_DETACH,
+	BSC_NAT_WORKER_SEND,
+	BSC_NAT_WORKER_STOP,
+
+	/* from the worker to the main thread */
+	BSC_NAT_WORKER_RECEIVED,
+	BSC_NAT_WORKER_CLOSED,
+	BSC_NAT_WORKER_DETACHED,
+	BSC_NAT_WORKER_ERROR,
+};
+
+struct bsc_nat_worker_msg {
+	int type;
+	struct bsc_nat_worker_conn *wconn;
+
+	/*
+	 * malloc'ed, freed by the receiving side. For an error it is a
+	 * constant text and len is the errno.
+	 */
+	void *data;
+	int len;
+};
+
+struct bsc_nat_worker_ring {
+	/* written by the producer, read by the consumer */
+	unsigned int head;
+	/* written by the consumer, read by the producer */
+	unsigned int tail;
+	struct bsc_nat_worker_msg msgs[BSC_NAT_WORKER_RING_SIZE];
+};
+
+/* a chunk of data waiting to be written to the BSC */
+struct bsc_nat_worker_buf {
+	struct llist_head entry;
+	int len;
+	uint8_t data[0];
+};
+
+/*
+ * The socket state of one BSC connection. The main thread allocates it
+ * on attach and frees it once the worker reported it as detached.
+ */
+struct bsc_nat_worker_conn {
+	struct bsc_nat_worker *worker;
+
+	/* main thread only, NULL once the BSC has been closed */
+	struct bsc_connection *bsc;
+
+	/* messages not written yet, counted up by the main thread */
+	int queued;
+
+	/* worker only */
+	int fd;
+	int closed;
+	int want_write;
+	int rx_len;
+	uint8_t rx_buf[BSC_NAT_WORKER_RX_SIZE];
+	struct llist_head tx_queue;
+	int tx_offset;
+	int flush_pending;
+	struct llist_head flush_entry;
+};
+
+struct bsc_nat_worker {
+	struct bsc_nat *nat;
+	int nr;
+	int running;
+
+	pthread_t thread;
+	int epoll_fd;
+	int wake_fd;
+
+	/* the main loop is woken up through this one */
+	struct osmo_fd event_fd;
+
+	struct bsc_nat_worker_ring to_worker;
+	struct bsc_nat_worker_ring to_main;
+
+	/* set by the worker before it blocks in epoll */
+	int sleeping;
+	/* set by the main thread when to_worker was full */
+	int main_waiting;
+	/* main thread only, commands not fitting into to_worker */
+	struct llist_head backlog;
+
+	/* worker only, connections with data to write */
+	struct llist_head flush_list;
+	/* worker only, events got queued for the main thread */
+	int notify;
+	/* set by the worker when it is about to exit */
+	int stopped;
+	/* failed wake ups of the main thread, logged by the main thread */
+	unsigned int signal_errors;
+
+	/* statistics, only written by the worker, read them atomically */
+	unsigned long long rx_msgs;
+	unsigned long long rx_bytes;
+	unsigned long long tx_msgs;
+	unsigned long long tx_bytes;
+	unsigned long long wakeups;
+
+	/* statistics, only written by the main thread */
+	unsigned int bscs;
+	unsigned int backlogged;
+};
+
+#endif
@@ -45,17 +45,16 @@ struct gsm_lchan *lchan_alloc(struct gsm_bts *bts, enum gsm_chan_t type, int all
 void lchan_free(struct gsm_lchan *lchan);
 void lchan_reset(struct gsm_lchan *lchan);
 
+/* Free all channels of the TRX after its link got lost */
+void trx_link_down(struct gsm_bts_trx *trx);
+
 /* Release the given lchan */
 int lchan_release(struct gsm_lchan *lchan, int sacch_deact, enum rsl_rel_mode release_mode);
 
-struct load_counter {
-	unsigned int total;
-	unsigned int used;
-};
-
-struct pchan_load {
-	struct load_counter pchan[GSM_PCHAN_UNKNOWN];
-};
+/* Keep bts->chan_load up to date after a state change */
+void ts_update_chan_load(struct gsm_bts_trx_ts *ts);
+void bts_update_chan_load(struct gsm_bts *bts);
+int bts_chan_load_check(struct gsm_bts *bts);
 
 void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts);
 void network_chan_load(struct pchan_load *pl, struct gsm_network *net);
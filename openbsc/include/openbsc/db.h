@@ -34,18 +34,38 @@ int db_init(const char *name);
 int db_prepare(void);
 int db_fini(void);
 
+/* use the write-ahead log, the default, has to be set before db_prepare */
+void db_set_wal(int wal);
+
+/* execute the writes and the asynchronous reads in a thread */
+int db_start_worker(void);
+void db_flush_worker(void);
+
 /* subscriber management */
 struct gsm_subscriber *db_create_subscriber(const char *imsi);
 struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 					 const char *subscr);
+struct db_subscr_lookup;
+struct db_subscr_lookup *db_get_subscriber_async(struct gsm_network *net,
+			enum gsm_subscriber_field field, const char *id,
+			void (*cb)(struct gsm_subscriber *subscr, void *data),
+			void *data);
+void db_get_subscriber_cancel(struct db_subscr_lookup *lookup);
 int db_sync_subscriber(struct gsm_subscriber *subscriber);
-int db_subscriber_expire(void *priv, void (*callback)(void *priv, long long unsigned int id));
+int db_subscriber_expire(unsigned int max,
+			 void (*cb)(void *priv, unsigned long long *ids,
+				    unsigned int num, unsigned int backlog),
+			 void *priv);
+int db_subscriber_expire_ids(unsigned long long *ids, unsigned int num);
 int db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber);
 int db_subscriber_alloc_exten(struct gsm_subscriber *subscriber);
+/* the TMSIs and extensions held by the allocators */
+void db_get_identity_stats(unsigned int *tmsis, unsigned int *extensions);
 int db_subscriber_alloc_token(struct gsm_subscriber *subscriber, uint32_t* token);
 int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char *imei);
 int db_sync_equipment(struct gsm_equipment *equip);
 int db_subscriber_update(struct gsm_subscriber *subscriber);
+int db_subscriber_update_async(struct gsm_subscriber *subscriber);
 
 /* auth info */
 int db_get_authinfo_for_subscr(struct gsm_auth_info *ainfo,
@@ -62,6 +82,11 @@ int db_sms_store(struct gsm_sms *sms);
 struct gsm_sms *db_sms_get(struct gsm_network *net, unsigned long long id);
 struct gsm_sms *db_sms_get_unsent(struct gsm_network *net, unsigned long long min_id);
 struct gsm_sms *db_sms_get_unsent_by_subscr(struct gsm_network *net, unsigned long long min_subscr_id, unsigned int failed);
+int db_sms_get_unsent_by_subscr_async(struct gsm_network *net,
+				      unsigned long long min_subscr_id,
+				      unsigned int failed,
+				      void (*cb)(struct gsm_sms *sms, void *data),
+				      void *data);
 struct gsm_sms *db_sms_get_unsent_for_subscr(struct gsm_subscriber *subscr);
 int db_sms_mark_sent(struct gsm_sms *sms);
 int db_sms_inc_deliver_attempts(struct gsm_sms *sms);
@@ -74,6 +99,7 @@ int db_apdu_blob_store(struct gsm_subscriber *subscr,
 /* Statistics counter storage */
 struct osmo_counter;
 int db_store_counter(struct osmo_counter *ctr);
+int db_store_counters(void);
 struct rate_ctr_group;
 int db_store_rate_ctr_group(struct rate_ctr_group *ctrg);
 
@@ -0,0 +1,86 @@
+/* (C) 2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DB_WORKER_H
+#define _DB_WORKER_H
+
+#include <osmocom/core/linuxlist.h>
+
+#include <dbi/dbi.h>
+#include <stdint.h>
+
+/*
+ * A request executed by the database thread. It is allocated by the
+ * main thread and handed back to it once done. The worker must not
+ * touch anything but the request and its own connection.
+ */
+struct db_req {
+	struct llist_head entry;
+
+	/* short description for the log */
+	const char *what;
+
+	/* runs on the worker, returns < 0 on failure */
+	int (*run)(dbi_conn conn, struct db_req *req);
+	/* runs in the main loop, optional */
+	void (*done)(struct db_req *req);
+	void *data;
+
+	int rc;
+	/* assigned on submit, counting up from 1 */
+	uint64_t seq;
+	uint64_t queued;
+	uint64_t started;
+	uint64_t finished;
+};
+
+struct db_worker_stats {
+	unsigned int depth;
+	unsigned int max_depth;
+	unsigned long long queries;
+	unsigned long long failed;
+	unsigned long long batches;
+	unsigned int max_batch;
+	unsigned long long latency_us;
+	unsigned long long max_latency_us;
+	unsigned long long exec_us;
+	unsigned long long max_exec_us;
+};
+
+int db_worker_start(const char *dir, const char *name);
+void db_worker_stop(void);
+int db_worker_running(void);
+
+/* the request is talloc_free'd after its done callback */
+int db_worker_submit(struct db_req *req);
+
+/* the sequence number of the last submitted request, 0 for none */
+uint64_t db_worker_submitted(void);
+
+/*
+ * Wait until the worker executed the request with the given sequence
+ * number and everything before it. Returns 1 when it had to wait.
+ */
+int db_worker_wait(uint64_t seq);
+
+/* wait until the worker executed all requests submitted so far */
+void db_worker_flush(void);
+
+void db_worker_get_stats(struct db_worker_stats *stats);
+
+#endif
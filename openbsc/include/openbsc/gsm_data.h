@@ -59,11 +59,21 @@ struct gsm_auth_tuple {
  *	- Get imei/tmsi
  *	- Accept/Reject according to global policy
  */
+struct db_subscr_lookup;
+
 struct gsm_loc_updating_operation {
         struct osmo_timer_list updating_timer;
 	unsigned int waiting_for_imsi : 1;
 	unsigned int waiting_for_imei : 1;
 	unsigned int key_seq : 4;
+
+	/* the subscriber is looked up in the database */
+	struct db_subscr_lookup *lookup;
+	/* the subscriber is created for this IMSI when it is unknown */
+	char imsi[GSM48_MI_SIZE];
+	/* received before the subscriber is known */
+	char imei[GSM48_MI_SIZE];
+	struct gsm48_classmark1 classmark1;
 };
 
 /*
@@ -144,6 +154,11 @@ struct gsmnet_stats {
 		struct osmo_counter *total;
 		struct osmo_counter *no_channel;
 	} chreq;
+	struct {
+		struct osmo_counter *imm_ass;
+		struct osmo_counter *imm_ass_rej;
+		struct osmo_counter *rejected;	/* CHAN RQDs in the IMM ASS REJ */
+	} agch;
 	struct {
 		struct osmo_counter *attempted;
 		struct osmo_counter *no_channel;	/* no channel available */
@@ -167,6 +182,10 @@ struct gsmnet_stats {
 		struct osmo_counter *completed;
 		struct osmo_counter *expired;
 	} paging;
+	struct {
+		struct osmo_counter *expired;	/* location update timed out */
+		struct osmo_counter *expire_backlog;	/* still to be expired */
+	} subscr;
 	struct {
 		struct osmo_counter *submitted; /* MO SMS submissions */
 		struct osmo_counter *no_receiver;
@@ -201,6 +220,15 @@ enum gsm_auth_policy {
 #define GSM_T3113_DEFAULT 60
 #define GSM_T3122_DEFAULT 10
 
+/* ms to collect CHAN RQDs before allocating for them */
+#define GSM_CHAN_RQD_WINDOW_DEFAULT 10
+
+/* subscribers expired per run of the expiry timer */
+#define GSM_SUBSCR_EXPIRE_BATCH_DEFAULT 1000
+
+#define GSM_BTS_HASH_BITS	7
+#define GSM_BTS_HASH_SIZE	(1 << GSM_BTS_HASH_BITS)
+
 struct gsm_network {
 	/* global parameters */
 	uint16_t country_code;
@@ -241,6 +269,11 @@ struct gsm_network {
 	unsigned int num_bts;
 	struct llist_head bts_list;
 
+	/* the BTS by number, by LAC and by BCCH ARFCN and BSIC */
+	struct gsm_bts **bts_by_nr;
+	struct llist_head bts_by_lac[GSM_BTS_HASH_SIZE];
+	struct llist_head bts_by_arfcn[GSM_BTS_HASH_SIZE];
+
 	/* timer values */
 	int T3101;
 	int T3103;
@@ -257,6 +290,8 @@ struct gsm_network {
 
 	/* timer to expire old location updates */
 	struct osmo_timer_list subscr_expire_timer;
+	/* upper bound of subscribers expired per run of the timer */
+	int subscr_expire_batch;
 
 	/* Radio Resource Location Protocol (TS 04.31) */
 	struct {
@@ -276,6 +311,9 @@ struct gsm_network {
 
 	/* subscriber related features */
 	int keep_subscr;
+	/* upper bound of unused subscribers kept, 0 for no limit */
+	int keep_subscr_max;
+	int num_idle_subscr;
 	struct gsm_sms_queue *sms_queue;
 
 	/* control interface */
@@ -341,6 +379,8 @@ enum gsm_bts_type parse_btstype(const char *arg);
 const char *btstype2str(enum gsm_bts_type type);
 struct gsm_bts *gsm_bts_by_lac(struct gsm_network *net, unsigned int lac,
 				struct gsm_bts *start_bts);
+/* Call after the LAC, the BSIC or the ARFCN of C0 has changed */
+void gsm_bts_update_index(struct gsm_bts *bts);
 
 extern void *tall_bsc_ctx;
 extern int ipacc_rtp_direct;
@@ -344,6 +344,13 @@ struct gsm_bts_trx_ts {
 	struct gsm_e1_subslot e1_link;
 
 	struct gsm_lchan lchan[TS_MAX_LCHAN];
+
+	/* what this timeslot counts in the chan_load of the BTS */
+	struct {
+		enum gsm_phys_chan_config pchan;
+		uint8_t total;
+		uint8_t used;
+	} load;
 };
 
 /* One TRX in a BTS */
@@ -544,10 +551,35 @@ struct bts_location {
 	double height;
 };
 
+/* used and total lchans by pchan */
+struct load_counter {
+	unsigned int total;
+	unsigned int used;
+};
+
+struct pchan_load {
+	struct load_counter pchan[GSM_PCHAN_UNKNOWN];
+};
+
+/* emergency calls, location updates and everything else */
+#define CHAN_RQD_NUM_PRIO	3
+
+/* CHAN RQDs collected for the next allocation round, see abis_rsl.c */
+struct gsm_bts_chan_rqd_state {
+	struct llist_head queue[CHAN_RQD_NUM_PRIO];
+	unsigned int num_queued;
+	/* how long to collect them, in ms */
+	unsigned int window;
+	struct osmo_timer_list window_timer;
+};
+
 /* One BTS */
 struct gsm_bts {
 	/* list header in net->bts_list */
 	struct llist_head list;
+	/* list headers in net->bts_by_lac and net->bts_by_arfcn */
+	struct llist_head lac_entry;
+	struct llist_head arfcn_entry;
 
 	/* Geographical location of the BTS */
 	struct llist_head loc_list;
@@ -587,6 +619,12 @@ struct gsm_bts {
 	/* paging state and control */
 	struct gsm_bts_paging_state paging;
 
+	/* lchans of the running timeslots, see ts_update_chan_load() */
+	struct pchan_load chan_load;
+
+	/* coalescing of the channel requests */
+	struct gsm_bts_chan_rqd_state chan_rqd;
+
 	/* CCCH is on C0 */
 	struct gsm_bts_trx *c0;
 
@@ -599,6 +637,17 @@ struct gsm_bts {
 	/* buffers where we put the pre-computed SI */
 	sysinfo_buf_t si_buf[_MAX_SYSINFO_TYPE];
 
+	/* the generated SI in si_buf, see gsm_bts_si_changed() */
+	struct {
+		/* bitmask of the SI that are still up to date */
+		uint32_t clean;
+		/* bitmask of the clean SI that are needed */
+		uint32_t valid;
+		int len[_MAX_SYSINFO_TYPE];
+		/* the automatic neighbor list is up to date */
+		int neigh_clean;
+	} si_cache;
+
 	/* TimeZone hours, mins, and bts specific */
 	struct {
 		int hr;
@@ -769,6 +818,7 @@ uint8_t gsm_lchan2chan_nr(const struct gsm_lchan *lchan);
  */
 int gsm_parse_reg(void *ctx, regex_t *reg, char **str,
 		int argc, const char **argv) __attribute__ ((warn_unused_result));
+extern unsigned int gsm_parse_reg_gen;
 
 
 
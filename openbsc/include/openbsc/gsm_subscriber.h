@@ -45,6 +45,10 @@ struct gsm_subscriber {
 	/* Temporary field which is not stored in the DB/HLR */
 	uint32_t flags;
 
+	/* the TMSI and extension it holds in the allocators of the HLR */
+	uint32_t db_tmsi;
+	uint32_t db_exten;
+
 	/* Every user can only have one equipment in use at any given
 	 * point in time */
 	struct gsm_equipment equipment;
@@ -52,6 +56,9 @@ struct gsm_subscriber {
 	/* for internal management */
 	int use_count;
 	struct llist_head entry;
+	struct llist_head imsi_entry;
+	struct llist_head tmsi_entry;
+	struct llist_head idle_entry;
 
 	/* pending requests */
 	int in_callback;
@@ -79,6 +86,12 @@ struct gsm_subscriber *subscr_get_by_tmsi(struct gsm_network *net,
 					  uint32_t tmsi);
 struct gsm_subscriber *subscr_get_by_imsi(struct gsm_network *net,
 					  const char *imsi);
+struct db_subscr_lookup;
+typedef void subscr_lookup_cb(struct gsm_subscriber *subscr, void *data);
+struct db_subscr_lookup *subscr_get_by_tmsi_async(struct gsm_network *net,
+				uint32_t tmsi, subscr_lookup_cb *cb, void *data);
+struct db_subscr_lookup *subscr_get_by_imsi_async(struct gsm_network *net,
+				const char *imsi, subscr_lookup_cb *cb, void *data);
 struct gsm_subscriber *subscr_get_by_extension(struct gsm_network *net,
 					       const char *ext);
 struct gsm_subscriber *subscr_get_by_id(struct gsm_network *net,
@@ -93,6 +106,8 @@ struct gsm_subscriber *subscr_active_by_tmsi(struct gsm_network *net,
 					     uint32_t tmsi);
 struct gsm_subscriber *subscr_active_by_imsi(struct gsm_network *net,
 					     const char *imsi);
+void subscr_set_imsi(struct gsm_subscriber *subscr, const char *imsi);
+void subscr_set_tmsi(struct gsm_subscriber *subscr, uint32_t tmsi);
 
 int subscr_pending_requests(struct gsm_subscriber *subscr);
 int subscr_pending_clear(struct gsm_subscriber *subscr);
@@ -102,12 +117,17 @@ int subscr_pending_kick(struct gsm_subscriber *subscr);
 char *subscr_name(struct gsm_subscriber *subscr);
 
 int subscr_purge_inactive(struct gsm_network *net);
+int subscr_trim_inactive(struct gsm_network *net);
 void subscr_update_from_db(struct gsm_subscriber *subscr);
 void subscr_expire(struct gsm_network *net);
 int subscr_update_expire_lu(struct gsm_subscriber *subscr, struct gsm_bts *bts);
 
 /* internal */
 struct gsm_subscriber *subscr_alloc(void);
+struct gsm_subscriber *subscr_find_by_imsi(struct gsm_network *net,
+					   const char *imsi);
+struct gsm_subscriber *subscr_find_by_tmsi(struct gsm_network *net,
+					   uint32_t tmsi);
 extern struct llist_head active_subscribers;
 
 #endif /* _GSM_SUBSCR_H */
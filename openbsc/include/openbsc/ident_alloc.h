@@ -0,0 +1,58 @@
+/* (C) 2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _IDENT_ALLOC_H
+#define _IDENT_ALLOC_H
+
+#include <stdint.h>
+
+/*
+ * Hands out unique numbers out of [min, max] without asking the
+ * database. The numbers in use are kept in a hash set, new ones are
+ * taken from a scrambled sequence so consecutive allocations do not
+ * look alike. max must be smaller than UINT32_MAX.
+ */
+struct ident_alloc {
+	void *ctx;
+	uint32_t min;
+	uint32_t max;
+
+	/* position in the scrambled sequence */
+	uint32_t seq;
+	uint32_t key;
+	unsigned int bits;
+
+	/* open addressing, UINT32_MAX marks a free slot */
+	uint32_t *slots;
+	unsigned int size;
+	unsigned int used;
+};
+
+int ident_alloc_init(struct ident_alloc *alloc, void *ctx,
+		     uint32_t min, uint32_t max, uint32_t seed);
+void ident_alloc_reset(struct ident_alloc *alloc);
+
+/* returns -EEXIST if the number is already taken, -ERANGE if outside */
+int ident_alloc_reserve(struct ident_alloc *alloc, uint32_t value);
+void ident_alloc_release(struct ident_alloc *alloc, uint32_t value);
+int ident_alloc_in_use(struct ident_alloc *alloc, uint32_t value);
+
+/* returns -ENOSPC once all numbers are taken */
+int ident_alloc_get(struct ident_alloc *alloc, uint32_t *value);
+
+#endif
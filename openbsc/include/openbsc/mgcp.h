@@ -33,6 +33,9 @@
 #define RTP_PORT_DEFAULT 4000
 #define RTP_PORT_NET_DEFAULT 16000
 
+/* upper limit of datagrams moved with one recvmmsg/sendmmsg */
+#define MGCP_RTP_BATCH_MAX 64
+
 /**
  * Calculate the RTP audio port for the given multiplex
  * and the direction. This allows a semi static endpoint
@@ -64,6 +67,10 @@ static inline int rtp_calculate_port(int multiplex, int base)
 struct mgcp_endpoint;
 struct mgcp_config;
 struct mgcp_trunk_config;
+struct mgcp_rtp_batch;
+struct mgcp_worker;
+struct mgcp_rtp_demux;
+struct mgcp_timer_wheel;
 
 #define MGCP_ENDP_CRCX 1
 #define MGCP_ENDP_DLCX 2
@@ -101,6 +108,10 @@ struct mgcp_port_range {
 	int range_start;
 	int range_end;
 	int last_port;
+
+	/* receive all ports on one shared socket, 0 to disable */
+	int demux_port;
+	struct mgcp_rtp_demux *demux;
 };
 
 struct mgcp_trunk_config {
@@ -123,6 +134,9 @@ struct mgcp_trunk_config {
 	int force_constant_ssrc; /* 0: don't, 1: once */
 	int force_aligned_timing;
 
+	/* maximum jitter buffer depth in ms, 0 to forward at once */
+	int jitter_buffer_ms;
+
 	/* spec handling */
 	int force_realloc;
 
@@ -156,6 +170,21 @@ struct mgcp_config {
 	struct mgcp_port_range transcoder_ports;
 	int endp_dscp;
 
+	/* datagrams drained per wakeup, a value <= 1 reads one at a time */
+	int rtp_batch;
+	struct mgcp_rtp_batch *rtp_batch_buf;
+
+	/* RTP forwarding threads, zero forwards in the main loop */
+	int rtp_workers;
+	int num_workers;
+	struct mgcp_worker *workers;
+
+	/* SO_REUSEPORT sockets per demultiplexed direction */
+	int demux_sockets;
+
+	/* playout timers of the jitter buffers in the main loop */
+	struct mgcp_timer_wheel *jb_wheel;
+
 	mgcp_change change_cb;
 	mgcp_policy policy_cb;
 	mgcp_reset reset_cb;
@@ -187,6 +216,10 @@ int mgcp_reset_transcoder(struct mgcp_config *cfg);
 void mgcp_format_stats(struct mgcp_endpoint *endp, char *stats, size_t size);
 int mgcp_parse_stats(struct msgb *msg, uint32_t *ps, uint32_t *os, uint32_t *pr, uint32_t *_or, int *loss, uint32_t *jitter);
 
+/* start after daemonizing, the threads do not survive a fork */
+int mgcp_workers_start(struct mgcp_config *cfg);
+void mgcp_workers_stop(struct mgcp_config *cfg);
+
 /*
  * format helper functions
  */
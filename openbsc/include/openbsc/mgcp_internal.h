@@ -24,6 +24,10 @@
 #define OPENBSC_MGCP_DATA_H
 
 #include <osmocom/core/select.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
+
+#include <pthread.h>
 
 #define CI_UNUSED 0
 
@@ -71,6 +75,10 @@ struct mgcp_rtp_end {
 	/* statistics */
 	unsigned int packets;
 	unsigned int octets;
+	unsigned int syscalls;
+	unsigned int jb_late;
+	unsigned int jb_underruns;
+	unsigned int jb_overruns;
 	struct in_addr addr;
 
 	/* in network byte order */
@@ -97,6 +105,13 @@ struct mgcp_rtp_end {
 
 	int local_port;
 	int local_alloc;
+
+	/* set when the sockets are shared, see mgcp_port_range */
+	struct mgcp_rtp_demux *demux;
+	struct llist_head demux_entry;
+
+	/* holds the packets sent by this end, NULL when disabled */
+	struct mgcp_jitter_buffer *jb;
 };
 
 enum {
@@ -160,8 +175,169 @@ struct mgcp_endpoint {
 
 	/* tap for the endpoint */
 	struct mgcp_rtp_tap taps[MGCP_TAP_COUNT];
+
+	/* the worker forwarding our RTP, NULL for the main loop */
+	struct mgcp_worker *worker;
+	int worker_pause;
+};
+
+#define MGCP_DEMUX_SOCKETS_MAX	16
+#define MGCP_DEMUX_BUCKETS	1024
+
+/*
+ * Shared receive sockets for one direction. The kernel steers the
+ * advertised ports to them (TPROXY) and the original destination
+ * port selects the mgcp_rtp_end. The ends are hashed by their RTP
+ * port, the base port of the range may be odd.
+ */
+struct mgcp_rtp_demux {
+	struct mgcp_config *cfg;
+	int is_bts;
+	int port;
+
+	int num_fds;
+	struct osmo_fd fds[MGCP_DEMUX_SOCKETS_MAX];
+
+	struct llist_head buckets[MGCP_DEMUX_BUCKETS];
+
+	/* statistics */
+	unsigned int ends;
+	unsigned int unknown;
+};
+
+#define MGCP_WHEEL_SLOTS	64
+#define MGCP_WHEEL_TICK_MS	5
+
+struct mgcp_wheel_timer {
+	struct llist_head entry;
+	int pending;
+	uint32_t expires;	/* in ticks */
+	void (*cb)(struct mgcp_wheel_timer *timer);
+	void *data;
 };
 
+struct mgcp_timer_wheel {
+	struct llist_head slots[MGCP_WHEEL_SLOTS];
+	uint32_t tick;		/* the next tick to run */
+	unsigned int pending;
+
+	/* milli seconds, get_current_ts() unless a test replaces it */
+	uint32_t (*now)(void);
+
+	/* the main loop wheel is driven by an osmo_timer */
+	int main_loop;
+	struct osmo_timer_list timer;
+};
+
+#define MGCP_JB_SLOTS		32
+#define MGCP_JB_PKT_SIZE	256
+#define MGCP_JB_PLAYOUT_MS	20
+
+struct mgcp_jb_packet {
+	int len;
+	uint16_t seq;
+	char data[MGCP_JB_PKT_SIZE];
+};
+
+struct mgcp_jitter_buffer {
+	struct mgcp_endpoint *endp;
+	struct mgcp_rtp_end *end;
+	struct mgcp_rtp_tap *tap;
+	struct mgcp_wheel_timer timer;
+
+	/* depth in packets */
+	int max_depth;
+	int target;
+	int count;
+
+	int playing;
+	uint16_t next_seq;
+	uint32_t next_playout;	/* in ms of the wheel clock */
+	struct mgcp_jb_packet pkts[MGCP_JB_SLOTS];
+
+	/* inter-arrival jitter in 1/16 ms */
+	uint32_t last_arrival;
+	int32_t jitter;
+};
+
+#define MGCP_WORKER_RING_SIZE	256
+
+enum mgcp_worker_cmd_type {
+	MGCP_WORKER_ATTACH,
+	MGCP_WORKER_DETACH,
+	MGCP_WORKER_STOP,
+};
+
+struct mgcp_worker_cmd {
+	int type;
+	struct mgcp_endpoint *endp;
+};
+
+#define MGCP_WORKER_LOG_SIZE	64
+#define MGCP_WORKER_LOG_LEN	256
+
+/* a log line of a worker, written out by the main thread */
+struct mgcp_worker_log {
+	int level;
+	char text[MGCP_WORKER_LOG_LEN];
+};
+
+struct mgcp_worker {
+	struct mgcp_config *cfg;
+	int nr;
+	int running;
+
+	pthread_t thread;
+	int epoll_fd;
+	int wake_fd;
+	int ack_fd;
+
+	/* the DETACH commands pushed by the main thread and acked */
+	unsigned int detach_seq;
+	unsigned int detach_acked;
+
+	/* written by the main thread, read by the worker */
+	unsigned int ring_head;
+	/* written by the worker, read by the main thread */
+	unsigned int ring_tail;
+	struct mgcp_worker_cmd ring[MGCP_WORKER_RING_SIZE];
+
+	/* log lines go the other way, the main loop waits on log_fd */
+	struct osmo_fd log_fd;
+	unsigned int log_head;
+	unsigned int log_tail;
+	unsigned int log_dropped;
+	struct mgcp_worker_log logs[MGCP_WORKER_LOG_SIZE];
+
+	struct mgcp_rtp_batch *batch;
+	struct mgcp_timer_wheel wheel;
+
+	/* statistics, only written by the worker, read them atomically */
+	unsigned long long packets;
+	unsigned long long wakeups;
+	unsigned int commands;
+
+	/* number of endpoints owned */
+	unsigned int endpoints;
+};
+
+/*
+ * The logging is not thread safe. Code that runs on the workers uses
+ * LOGP_RTP and the line is handed to the main loop to be written.
+ */
+extern __thread struct mgcp_worker *mgcp_worker_self;
+void mgcp_worker_log(int level, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+const char *mgcp_inet_ntoa(struct in_addr addr);
+
+#define LOGP_RTP(level, fmt, args...) \
+	do { \
+		if (mgcp_worker_self) \
+			mgcp_worker_log(level, fmt, ## args); \
+		else \
+			LOGP(DMGCP, level, fmt, ## args); \
+	} while (0)
+
 #define ENDPOINT_NUMBER(endp) abs(endp - endp->tcfg->endpoints)
 
 struct mgcp_msg_ptr {
@@ -175,6 +351,36 @@ int mgcp_bind_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port);
 int mgcp_bind_trans_bts_rtp_port(struct mgcp_endpoint *enp, int rtp_port);
 int mgcp_bind_trans_net_rtp_port(struct mgcp_endpoint *enp, int rtp_port);
 int mgcp_free_rtp_port(struct mgcp_rtp_end *end);
+struct mgcp_rtp_batch *mgcp_rtp_batch_alloc(void *ctx);
+struct mgcp_rtp_end *mgcp_demux_lookup(struct mgcp_rtp_demux *demux,
+				       int port, int *is_rtp);
+
+uint32_t get_current_ts(void);
+
+void mgcp_wheel_init(struct mgcp_timer_wheel *wheel, int main_loop);
+void mgcp_wheel_set_clock(struct mgcp_timer_wheel *wheel, uint32_t (*now)(void));
+void mgcp_wheel_add_at(struct mgcp_timer_wheel *wheel,
+		       struct mgcp_wheel_timer *timer, uint32_t at);
+void mgcp_wheel_del(struct mgcp_timer_wheel *wheel,
+		    struct mgcp_wheel_timer *timer);
+void mgcp_wheel_run(struct mgcp_timer_wheel *wheel);
+int mgcp_wheel_timeout(struct mgcp_timer_wheel *wheel);
+
+void mgcp_jb_config(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end);
+void mgcp_jb_free(struct mgcp_rtp_end *end);
+int mgcp_jb_put(struct mgcp_jitter_buffer *jb, char *buf, int len);
+void mgcp_jb_detach(struct mgcp_rtp_end *end);
+void mgcp_jb_attach(struct mgcp_rtp_end *end);
+void mgcp_rtp_end_playout(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
+			  struct mgcp_rtp_tap *tap, char *buf, int len);
+
+/*
+ * Stop the owning worker from using the endpoint while we change it.
+ * Fails with -ETIMEDOUT when the worker did not answer in time, the
+ * endpoint still has to be resumed then.
+ */
+int mgcp_endp_pause(struct mgcp_endpoint *endp);
+void mgcp_endp_resume(struct mgcp_endpoint *endp);
 
 /* For transcoding we need to manage an in and an output that are connected */
 static inline int endp_back_channel(int endpoint)
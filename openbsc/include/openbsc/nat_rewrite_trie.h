@@ -22,25 +22,49 @@
 
 #include <osmocom/core/linuxrbtree.h>
 
+#include <stdint.h>
+#include <stddef.h>
+
 struct vty;
 
 struct nat_rewrite_rule {
-	/* For digits 0-9 and + */
-	struct nat_rewrite_rule *rules[11];
-
-	char empty;
 	char prefix[14];
 	char rewrite[6];
 };
 
+/*
+ * A node of the trie. The children of a node are stored next to each
+ * other starting at first_child, the bitmap tells which digits (and
+ * the '+' at bit 10) have one. A subtree with a single rule is cut
+ * to a leaf and the rest of the number is compared to its prefix.
+ */
+#define NAT_REWRITE_LEAF	0x1
+
+struct nat_rewrite_node {
+	uint16_t bitmap;
+	uint16_t flags;
+	uint32_t first_child;
+	int32_t rule;
+};
+
 struct nat_rewrite {
-	struct nat_rewrite_rule rule;
 	size_t prefixes;
+
+	/* one array for the nodes, one for the rules in dump order */
+	uint32_t num_nodes;
+	const struct nat_rewrite_node *nodes;
+	uint32_t num_rules;
+	const struct nat_rewrite_rule *rules;
+
+	/* set when the arrays are mapped from a compiled file */
+	void *map;
+	size_t map_len;
 };
 
 
 struct nat_rewrite *nat_rewrite_parse(void *ctx, const char *filename);
-struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *, const char *prefix);
+int nat_rewrite_save(struct nat_rewrite *rewr, const char *filename);
+const struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *, const char *prefix);
 void nat_rewrite_dump(struct nat_rewrite *rewr);
 void nat_rewrite_dump_vty(struct vty *vty, struct nat_rewrite *rewr);
 
@@ -41,6 +41,8 @@ struct gsm_paging_request {
 	struct gsm_bts *bts;
 	/* what kind of channel type do we ask the MS to establish */
 	int chan_type;
+	/* the paging group (PCH block) of the subscriber on this BTS */
+	unsigned int page_group;
 
 	/* Timer 3113: how long do we try to page? */
 	struct osmo_timer_list T3113;
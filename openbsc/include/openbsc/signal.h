@@ -112,6 +112,7 @@ enum signal_subscr {
 	S_SUBSCR_ATTACHED,
 	S_SUBSCR_DETACHED,
 	S_SUBSCR_IDENTITY,		/* we've received some identity information */
+	S_SUBSCR_EXPIRED,		/* a batch of location updates timed out */
 };
 
 /* SS_SCALL signals */
@@ -149,6 +150,13 @@ struct paging_signal_data {
 	struct gsm_subscriber_connection *conn;
 };
 
+/* the subscribers are not necessarily loaded, only the ids are known */
+struct subscr_expire_signal_data {
+	struct gsm_network *net;
+	unsigned long long *ids;
+	unsigned int num;
+};
+
 struct scall_signal_data {
 	struct gsm_subscriber *subscr;
 	struct gsm_subscriber_connection *conn;
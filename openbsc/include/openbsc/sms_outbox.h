@@ -0,0 +1,46 @@
+/* (C) 2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SMS_OUTBOX_H
+#define _SMS_OUTBOX_H
+
+/*
+ * The unsent SMS of the SMS table by receiver. It is filled by the
+ * database code on startup and kept up to date when a SMS is stored or
+ * sent, so the SMS queue can find the next SMS without a query.
+ */
+
+int sms_outbox_init(void *ctx);
+void sms_outbox_reset(void);
+int sms_outbox_active(void);
+
+int sms_outbox_add(unsigned long long subscr_id, unsigned long long sms_id,
+		   unsigned int attempts, int attached);
+void sms_outbox_remove(unsigned long long sms_id);
+void sms_outbox_inc_attempts(unsigned long long sms_id);
+void sms_outbox_set_attached(unsigned long long subscr_id, int attached);
+
+/* the first SMS of the first attached subscriber >= min_subscr_id */
+int sms_outbox_next(unsigned long long min_subscr_id, unsigned int failed,
+		    unsigned long long *sms_id);
+/* the first SMS for this subscriber if it is attached */
+int sms_outbox_first(unsigned long long subscr_id, unsigned long long *sms_id);
+
+void sms_outbox_get_stats(unsigned int *sms, unsigned int *subscribers);
+
+#endif
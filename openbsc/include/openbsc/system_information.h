@@ -4,7 +4,25 @@
 #include <osmocom/gsm/sysinfo.h>
 
 struct gsm_bts;
+struct gsm_bts_trx;
+struct gsm_network;
+
+/* the configuration the SI are generated from */
+enum gsm_si_input {
+	SI_IN_CELL_CHAN	= 1 << 0,	/* ARFCNs of this BTS and the band */
+	SI_IN_NEIGH	= 1 << 1,	/* neighbor lists */
+	SI_IN_CELL_OPTS	= 1 << 2,	/* LAI, RACH control, cell options */
+	SI_IN_GPRS	= 1 << 3,
+};
+
+#define SI_IN_ALL	(SI_IN_CELL_CHAN | SI_IN_NEIGH | SI_IN_CELL_OPTS | SI_IN_GPRS)
 
 int gsm_generate_si(struct gsm_bts *bts, enum osmo_sysinfo_type type);
+/* generate and send the SI of this TRX, see bsc_init.c */
+int gsm_bts_trx_set_system_infos(struct gsm_bts_trx *trx);
+
+/* regenerate the SI depending on these inputs the next time */
+void gsm_bts_si_changed(struct gsm_bts *bts, unsigned int inputs);
+void gsm_net_si_changed(struct gsm_network *net, unsigned int inputs);
 
 #endif
@@ -41,6 +41,7 @@
 #include <osmocom/gsm/abis_nm.h>
 #include <osmocom/core/talloc.h>
 #include <openbsc/abis_nm.h>
+#include <openbsc/chan_alloc.h>
 #include <openbsc/misdn.h>
 #include <openbsc/signal.h>
 #include <osmocom/abis/e1_input.h>
@@ -257,6 +258,7 @@ static int abis_nm_rx_statechg_rep(struct msgb *mb)
 		nm_state->availability = new_state.availability;
 		if (nm_state->administrative == 0)
 			nm_state->administrative = new_state.administrative;
+		bts_update_chan_load(bts);
 	}
 #if 0
 	if (op_state == 1) {
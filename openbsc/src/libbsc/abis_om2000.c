@@ -39,6 +39,7 @@
 #include <openbsc/debug.h>
 #include <openbsc/abis_nm.h>
 #include <openbsc/abis_om2000.h>
+#include <openbsc/chan_alloc.h>
 #include <openbsc/signal.h>
 #include <osmocom/abis/e1_input.h>
 
@@ -756,6 +757,7 @@ static void update_mo_state(struct gsm_bts *bts, struct abis_om2k_mo *mo,
 	osmo_signal_dispatch(SS_NM, S_NM_STATECHG_ADM, &nsd);
 
 	nm_state->availability = new_state.availability;
+	bts_update_chan_load(bts);
 }
 
 static void update_op_state(struct gsm_bts *bts, const struct abis_om2k_mo *mo,
@@ -781,6 +783,7 @@ static void update_op_state(struct gsm_bts *bts, const struct abis_om2k_mo *mo,
 	}
 
 	nm_state->operational = new_state.operational;
+	bts_update_chan_load(bts);
 }
 
 static void signal_op_state(struct gsm_bts *bts, struct abis_om2k_mo *mo)
@@ -896,7 +896,11 @@ int rsl_release_request(struct gsm_lchan *lchan, uint8_t link_id,
 
 int rsl_lchan_set_state(struct gsm_lchan *lchan, int state)
 {
+	int was_free = lchan->state == LCHAN_S_NONE;
+
 	lchan->state = state;
+	if (was_free != (state == LCHAN_S_NONE))
+		ts_update_chan_load(lchan->ts);
 	return 0;
 }
 
@@ -1340,65 +1344,66 @@ static int rsl_send_imm_ass_rej(struct gsm_bts *bts,
 	/* we need to subtract 1 byte from sizeof(*iar) since ia includes the l2_plen field */
 	iar->l2_plen = GSM48_LEN2PLEN((sizeof(*iar)-1));
 
+	osmo_counter_inc(bts->network->stats.agch.imm_ass_rej);
+	bts->network->stats.agch.rejected->value += num_req_refs;
 	return rsl_imm_assign_cmd(bts, sizeof(*iar), (uint8_t *) iar);
 }
 
-/* MS has requested a channel on the RACH */
-static int rsl_rx_chan_rqd(struct msgb *msg)
-{
-	struct e1inp_sign_link *sign_link = msg->dst;
-	struct gsm_bts *bts = sign_link->trx->bts;
-	struct abis_rsl_dchan_hdr *rqd_hdr = msgb_l2(msg);
-	struct gsm48_req_ref *rqd_ref;
-	enum gsm_chan_t lctype;
-	enum gsm_chreq_reason_t chreq_reason;
-	struct gsm_lchan *lchan;
-	uint8_t rqd_ta;
-	int is_lu;
-
-	uint16_t arfcn;
-	uint8_t subch;
+/* allocate right away once this many CHAN RQDs are waiting */
+#define CHAN_RQD_MAX_QUEUED	64
 
-	/* parse request reference to be used in immediate assign */
-	if (rqd_hdr->data[0] != RSL_IE_REQ_REFERENCE)
-		return -EINVAL;
+/* a CHAN RQD waiting for the end of the coalescing window */
+struct chan_rqd {
+	struct llist_head entry;
 
-	rqd_ref = (struct gsm48_req_ref *) &rqd_hdr->data[1];
+	struct gsm48_req_ref ref;
+	uint8_t ta;
+	enum gsm_chan_t lctype;
+	enum gsm_chreq_reason_t reason;
+};
 
-	/* parse access delay and use as TA */
-	if (rqd_hdr->data[sizeof(struct gsm48_req_ref)+1] != RSL_IE_ACCESS_DELAY)
-		return -EINVAL;
-	rqd_ta = rqd_hdr->data[sizeof(struct gsm48_req_ref)+2];
+static int chan_rqd_prio(enum gsm_chreq_reason_t reason)
+{
+	switch (reason) {
+	case GSM_CHREQ_REASON_EMERG:
+		return 0;
+	case GSM_CHREQ_REASON_LOCATION_UPD:
+		return 1;
+	default:
+		return 2;
+	}
+}
 
-	/* determine channel type (SDCCH/TCH_F/TCH_H) based on
-	 * request reference RA */
-	lctype = get_ctype_by_chreq(bts->network, rqd_ref->ra);
-	chreq_reason = get_reason_by_chreq(rqd_ref->ra, bts->network->neci);
+/* allocate and activate a channel, -ENOSPC if there is none */
+static int chan_rqd_activate(struct gsm_bts *bts, struct chan_rqd *rqd)
+{
+	enum gsm_chan_t lctype = rqd->lctype;
+	struct gsm_lchan *lchan;
+	uint8_t rqd_ta = rqd->ta;
+	int allow_bigger;
 
-	osmo_counter_inc(bts->network->stats.chreq.total);
+	uint16_t arfcn;
+	uint8_t subch;
 
 	/*
 	 * We want LOCATION UPDATES to succeed and will assign a TCH
 	 * if we have no SDCCH available.
 	 */
-	is_lu = !!(chreq_reason == GSM_CHREQ_REASON_LOCATION_UPD);
+	allow_bigger = rqd->reason == GSM_CHREQ_REASON_LOCATION_UPD;
 
 	/* check availability / allocate channel */
-	lchan = lchan_alloc(bts, lctype, is_lu);
-	if (!lchan && (rqd_ref->ra & 0xf0) == 0x30) {
+	lchan = lchan_alloc(bts, lctype, allow_bigger);
+	if (!lchan && (rqd->ref.ra & 0xf0) == 0x30) {
 		LOGP(DRSL, LOGL_NOTICE, "BTS %d CHAN RQD: no resources for %s 0x%x, retrying with %s\n",
-		     msg->lchan->ts->trx->bts->nr, gsm_lchant_name(lctype), rqd_ref->ra, gsm_lchant_name(GSM_LCHAN_TCH_F));
+		     bts->nr, gsm_lchant_name(lctype), rqd->ref.ra, gsm_lchant_name(GSM_LCHAN_TCH_F));
 		lctype = GSM_LCHAN_TCH_F;
-		lchan = lchan_alloc(bts, lctype, is_lu);
+		lchan = lchan_alloc(bts, lctype, allow_bigger);
 	}
 	if (!lchan) {
 		LOGP(DRSL, LOGL_NOTICE, "BTS %d CHAN RQD: no resources for %s 0x%x\n",
-		     msg->lchan->ts->trx->bts->nr, gsm_lchant_name(lctype), rqd_ref->ra);
+		     bts->nr, gsm_lchant_name(lctype), rqd->ref.ra);
 		osmo_counter_inc(bts->network->stats.chreq.no_channel);
-		/* FIXME gather multiple CHAN RQD and reject up to 4 at the same time */
-		if (bts->network->T3122)
-			rsl_send_imm_ass_rej(bts, 1, rqd_ref, bts->network->T3122 & 0xff);
-		return -ENOMEM;
+		return -ENOSPC;
 	}
 
 	if (lchan->state != LCHAN_S_NONE)
@@ -1415,7 +1420,7 @@ static int rsl_rx_chan_rqd(struct msgb *msg)
 	}
 
 	rsl_lchan_set_state(lchan, LCHAN_S_ACT_REQ);
-	memcpy(lchan->rqd_ref, rqd_ref, sizeof(*rqd_ref));
+	memcpy(lchan->rqd_ref, &rqd->ref, sizeof(rqd->ref));
 	lchan->rqd_ta = rqd_ta;
 
 	arfcn = lchan->ts->trx->arfcn;
@@ -1434,8 +1439,8 @@ static int rsl_rx_chan_rqd(struct msgb *msg)
 
 	DEBUGP(DRSL, "%s Activating ARFCN(%u) SS(%u) lctype %s "
 		"r=%s ra=0x%02x ta=%d\n", gsm_lchan_name(lchan), arfcn, subch,
-		gsm_lchant_name(lchan->type), gsm_chreq_name(chreq_reason),
-		rqd_ref->ra, rqd_ta);
+		gsm_lchant_name(lchan->type), gsm_chreq_name(rqd->reason),
+		rqd->ref.ra, rqd_ta);
 
 	/* BS11 requires TA shifted by 2 bits */
 	if (bts->type == GSM_BTS_TYPE_BS11)
@@ -1445,6 +1450,122 @@ static int rsl_rx_chan_rqd(struct msgb *msg)
 	return 0;
 }
 
+/*
+ * Allocate for the CHAN RQDs of the window by priority and reject the
+ * ones without a channel, four per IMMEDIATE ASSIGN REJECT.
+ */
+static void rsl_chan_rqd_flush(struct gsm_bts *bts)
+{
+	struct gsm48_req_ref rej_refs[4];
+	unsigned int i, num_rej = 0;
+	struct chan_rqd *rqd, *tmp;
+	uint8_t wait_ind = bts->network->T3122 & 0xff;
+
+	osmo_timer_del(&bts->chan_rqd.window_timer);
+
+	for (i = 0; i < ARRAY_SIZE(bts->chan_rqd.queue); ++i) {
+		llist_for_each_entry_safe(rqd, tmp, &bts->chan_rqd.queue[i], entry) {
+			if (chan_rqd_activate(bts, rqd) == -ENOSPC
+			    && bts->network->T3122)
+				rej_refs[num_rej++] = rqd->ref;
+
+			if (num_rej == ARRAY_SIZE(rej_refs)) {
+				rsl_send_imm_ass_rej(bts, num_rej, rej_refs, wait_ind);
+				num_rej = 0;
+			}
+
+			llist_del(&rqd->entry);
+			talloc_free(rqd);
+		}
+	}
+	bts->chan_rqd.num_queued = 0;
+
+	if (num_rej > 0)
+		rsl_send_imm_ass_rej(bts, num_rej, rej_refs, wait_ind);
+}
+
+/* drop the CHAN RQDs of the window without answering them */
+void rsl_chan_rqd_discard(struct gsm_bts *bts)
+{
+	struct chan_rqd *rqd, *tmp;
+	unsigned int i;
+
+	osmo_timer_del(&bts->chan_rqd.window_timer);
+
+	for (i = 0; i < ARRAY_SIZE(bts->chan_rqd.queue); ++i) {
+		llist_for_each_entry_safe(rqd, tmp, &bts->chan_rqd.queue[i], entry) {
+			llist_del(&rqd->entry);
+			talloc_free(rqd);
+		}
+	}
+
+	if (bts->chan_rqd.num_queued > 0)
+		LOGP(DRSL, LOGL_NOTICE, "BTS %d discarded %u CHAN RQD\n",
+		     bts->nr, bts->chan_rqd.num_queued);
+	bts->chan_rqd.num_queued = 0;
+}
+
+static void chan_rqd_window_cb(void *data)
+{
+	rsl_chan_rqd_flush(data);
+}
+
+/* MS has requested a channel on the RACH */
+static int rsl_rx_chan_rqd(struct msgb *msg)
+{
+	struct e1inp_sign_link *sign_link = msg->dst;
+	struct gsm_bts *bts = sign_link->trx->bts;
+	struct abis_rsl_dchan_hdr *rqd_hdr = msgb_l2(msg);
+	struct gsm48_req_ref *rqd_ref;
+	struct chan_rqd *rqd;
+
+	/* parse request reference to be used in immediate assign */
+	if (rqd_hdr->data[0] != RSL_IE_REQ_REFERENCE)
+		return -EINVAL;
+
+	rqd_ref = (struct gsm48_req_ref *) &rqd_hdr->data[1];
+
+	/* parse access delay and use as TA */
+	if (rqd_hdr->data[sizeof(struct gsm48_req_ref)+1] != RSL_IE_ACCESS_DELAY)
+		return -EINVAL;
+
+	rqd = talloc_zero(bts, struct chan_rqd);
+	if (!rqd) {
+		LOGP(DRSL, LOGL_ERROR, "Failed to allocate the CHAN RQD.\n");
+		return -ENOMEM;
+	}
+
+	memcpy(&rqd->ref, rqd_ref, sizeof(rqd->ref));
+	rqd->ta = rqd_hdr->data[sizeof(struct gsm48_req_ref)+2];
+
+	/* determine channel type (SDCCH/TCH_F/TCH_H) based on
+	 * request reference RA */
+	rqd->lctype = get_ctype_by_chreq(bts->network, rqd_ref->ra);
+	rqd->reason = get_reason_by_chreq(rqd_ref->ra, bts->network->neci);
+
+	osmo_counter_inc(bts->network->stats.chreq.total);
+
+	/* collect the requests of the window and allocate for all of them */
+	llist_add_tail(&rqd->entry,
+		       &bts->chan_rqd.queue[chan_rqd_prio(rqd->reason)]);
+	bts->chan_rqd.num_queued += 1;
+
+	if (bts->chan_rqd.window == 0
+	    || bts->chan_rqd.num_queued >= CHAN_RQD_MAX_QUEUED) {
+		rsl_chan_rqd_flush(bts);
+		return 0;
+	}
+
+	if (!osmo_timer_pending(&bts->chan_rqd.window_timer)) {
+		bts->chan_rqd.window_timer.cb = chan_rqd_window_cb;
+		bts->chan_rqd.window_timer.data = bts;
+		osmo_timer_schedule(&bts->chan_rqd.window_timer, 0,
+				    bts->chan_rqd.window * 1000);
+	}
+
+	return 0;
+}
+
 static int rsl_send_imm_assignment(struct gsm_lchan *lchan)
 {
 	struct gsm_bts *bts = lchan->ts->trx->bts;
@@ -1477,6 +1598,7 @@ static int rsl_send_imm_assignment(struct gsm_lchan *lchan)
 	osmo_timer_schedule(&lchan->T3101, bts->network->T3101, 0);
 
 	/* send IMMEDIATE ASSIGN CMD on RSL to BTS (to send on CCCH to MS) */
+	osmo_counter_inc(bts->network->stats.agch.imm_ass);
 	return rsl_imm_assign_cmd(bts, sizeof(*ia)+ia->mob_alloc_len, (uint8_t *) ia);
 }
 
@@ -120,16 +120,22 @@ static int rsl_si(struct gsm_bts_trx *trx, enum osmo_sysinfo_type i, int si_len)
 }
 
 /* set all system information types */
-static int set_system_infos(struct gsm_bts_trx *trx)
+int gsm_bts_trx_set_system_infos(struct gsm_bts_trx *trx)
 {
 	int i, rc;
 	struct gsm_bts *bts = trx->bts;
 	uint8_t gen_si[_MAX_SYSINFO_TYPE], n_si = 0, n;
 	int si_len[_MAX_SYSINFO_TYPE];
-
-	bts->si_common.cell_sel_par.ms_txpwr_max_ccch =
-			ms_pwr_ctl_lvl(bts->band, bts->ms_max_power);
-	bts->si_common.cell_sel_par.neci = bts->network->neci;
+	int ms_txpwr_max_ccch;
+
+	/* these are derived from the BTS and the network configuration */
+	ms_txpwr_max_ccch = ms_pwr_ctl_lvl(bts->band, bts->ms_max_power);
+	if (bts->si_common.cell_sel_par.ms_txpwr_max_ccch != ms_txpwr_max_ccch
+	    || bts->si_common.cell_sel_par.neci != bts->network->neci) {
+		bts->si_common.cell_sel_par.ms_txpwr_max_ccch = ms_txpwr_max_ccch;
+		bts->si_common.cell_sel_par.neci = bts->network->neci;
+		gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
+	}
 
 	/* First, we determine which of the SI messages we actually need */
 
@@ -268,7 +274,7 @@ static void bootstrap_rsl(struct gsm_bts_trx *trx)
 		rsl_nokia_si_begin(trx);
 	}
 
-	set_system_infos(trx);
+	gsm_bts_trx_set_system_infos(trx);
 
 	if (trx->bts->type == GSM_BTS_TYPE_NOKIA_SITE) {
 		/* channel unspecific, power reduction in 2 dB steps */
@@ -286,7 +292,6 @@ static int inp_sig_cb(unsigned int subsys, unsigned int signal,
 {
 	struct input_signal_data *isd = signal_data;
 	struct gsm_bts_trx *trx = isd->trx;
-	int ts_no, lchan_no;
 
 	if (subsys != SS_L_INPUT)
 		return -EINVAL;
@@ -322,23 +327,7 @@ static int inp_sig_cb(unsigned int subsys, unsigned int signal,
 		else if (isd->link_type == E1INP_SIGN_RSL)
 			osmo_counter_inc(trx->bts->network->stats.bts.rsl_fail);
 
-		/*
-		 * free all allocated channels. change the nm_state so the
-		 * trx and trx_ts becomes unusable and chan_alloc.c can not
-		 * allocate from it.
-		 */
-		for (ts_no = 0; ts_no < ARRAY_SIZE(trx->ts); ++ts_no) {
-			struct gsm_bts_trx_ts *ts = &trx->ts[ts_no];
-
-			for (lchan_no = 0; lchan_no < ARRAY_SIZE(ts->lchan); ++lchan_no) {
-				if (ts->lchan[lchan_no].state != LCHAN_S_NONE)
-					lchan_free(&ts->lchan[lchan_no]);
-				lchan_reset(&ts->lchan[lchan_no]);
-			}
-		}
-
-		gsm_bts_mo_reset(trx->bts);
-
+		trx_link_down(trx);
 		abis_nm_clear_queue(trx->bts);
 		break;
 	default:
@@ -448,6 +437,7 @@ static int bootstrap_bts(struct gsm_bts *bts)
 
 	/* Initialize the BTS state */
 	gsm_bts_mo_reset(bts);
+	bts_update_chan_load(bts);
 
 	return 0;
 }
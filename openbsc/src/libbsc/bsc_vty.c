@@ -270,6 +270,8 @@ static void bts_dump_vty(struct vty *vty, struct gsm_bts *bts)
 	vty_out(vty, "RACH Max transmissions: %u%s",
 		rach_max_trans_raw2val(bts->si_common.rach_control.max_trans),
 		VTY_NEWLINE);
+	vty_out(vty, "RACH coalescing window: %u ms, %u requests waiting%s",
+		bts->chan_rqd.window, bts->chan_rqd.num_queued, VTY_NEWLINE);
 	if (bts->si_common.rach_control.cell_bar)
 		vty_out(vty, "  CELL IS BARRED%s", VTY_NEWLINE);
 	vty_out(vty, "Channel Description Attachment: %s%s",
@@ -569,6 +571,9 @@ static void config_write_bts_single(struct vty *vty, struct gsm_bts *bts)
 	if (bts->rach_ldavg_slots != -1)
 		vty_out(vty, "  rach nm load average %u%s",
 			bts->rach_ldavg_slots, VTY_NEWLINE);
+	if (bts->chan_rqd.window != GSM_CHAN_RQD_WINDOW_DEFAULT)
+		vty_out(vty, "  rach coalescing-window %u%s",
+			bts->chan_rqd.window, VTY_NEWLINE);
 	if (bts->si_common.rach_control.cell_bar)
 		vty_out(vty, "  cell barred 1%s", VTY_NEWLINE);
 	if ((bts->si_common.rach_control.t2 & 0x4) == 0)
@@ -813,6 +818,12 @@ static int config_write_net(struct vty *vty)
 	vty_out(vty, " dtx-used %u%s", gsmnet->dtx_enabled, VTY_NEWLINE);
 	vty_out(vty, " subscriber-keep-in-ram %d%s",
 		gsmnet->keep_subscr, VTY_NEWLINE);
+	if (gsmnet->keep_subscr_max)
+		vty_out(vty, " subscriber-keep-in-ram-max %d%s",
+			gsmnet->keep_subscr_max, VTY_NEWLINE);
+	if (gsmnet->subscr_expire_batch != GSM_SUBSCR_EXPIRE_BATCH_DEFAULT)
+		vty_out(vty, " subscriber-expire-batch %d%s",
+			gsmnet->subscr_expire_batch, VTY_NEWLINE);
 
 	return CMD_SUCCESS;
 }
@@ -1324,6 +1335,7 @@ DEFUN(cfg_net_ncc,
 	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
 
 	gsmnet->country_code = atoi(argv[0]);
+	gsm_net_si_changed(gsmnet, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -1339,6 +1351,7 @@ DEFUN(cfg_net_mnc,
 	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
 
 	gsmnet->network_code = atoi(argv[0]);
+	gsm_net_si_changed(gsmnet, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -1618,6 +1631,29 @@ DEFUN(cfg_net_subscr_keep,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_net_subscr_keep_max,
+      cfg_net_subscr_keep_max_cmd,
+      "subscriber-keep-in-ram-max <0-10000000>",
+      "Limit the number of unused subscribers kept in RAM.\n"
+      "Number of subscribers, the oldest unused one is dropped first. 0 for no limit\n")
+{
+	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
+	gsmnet->keep_subscr_max = atoi(argv[0]);
+	subscr_trim_inactive(gsmnet);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_net_subscr_expire_batch,
+      cfg_net_subscr_expire_batch_cmd,
+      "subscriber-expire-batch <1-100000>",
+      "Limit the number of subscribers expired at once.\n"
+      "Number of subscribers, the rest is expired a second later\n")
+{
+	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
+	gsmnet->subscr_expire_batch = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 /* per-BTS configuration */
 DEFUN(cfg_bts,
       cfg_bts_cmd,
@@ -1637,6 +1673,8 @@ DEFUN(cfg_bts,
 		/* allocate a new one */
 		bts = gsm_bts_alloc_register(gsmnet, GSM_BTS_TYPE_UNKNOWN,
 					     HARDCODED_TSC, HARDCODED_BSIC);
+		/* it is in the neighbor lists of the others */
+		gsm_net_si_changed(gsmnet, SI_IN_NEIGH);
 	} else
 		bts = gsm_bts_num(gsmnet, bts_nr);
 
@@ -1665,6 +1703,8 @@ DEFUN(cfg_bts_type,
 	if (rc < 0)
 		return CMD_WARNING;
 
+	gsm_bts_si_changed(bts, SI_IN_ALL);
+
 	return CMD_SUCCESS;
 }
 
@@ -1683,6 +1723,7 @@ DEFUN(cfg_bts_band,
 	}
 
 	bts->band = band;
+	gsm_bts_si_changed(bts, SI_IN_CELL_CHAN);
 
 	return CMD_SUCCESS;
 }
@@ -1701,6 +1742,7 @@ DEFUN(cfg_bts_ci,
 		return CMD_WARNING;
 	}
 	bts->cell_identity = ci;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -1726,6 +1768,8 @@ DEFUN(cfg_bts_lac,
 	}
 
 	bts->location_area_code = lac;
+	gsm_bts_update_index(bts);
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -1759,6 +1803,7 @@ DEFUN(cfg_bts_bsic,
 		return CMD_WARNING;
 	}
 	bts->bsic = bsic;
+	gsm_bts_update_index(bts);
 
 	return CMD_SUCCESS;
 }
@@ -1981,6 +2026,7 @@ DEFUN(cfg_bts_rach_tx_integer,
 {
 	struct gsm_bts *bts = vty->index;
 	bts->si_common.rach_control.tx_integer = atoi(argv[0]) & 0xf;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 	return CMD_SUCCESS;
 }
 
@@ -1997,6 +2043,7 @@ DEFUN(cfg_bts_rach_max_trans,
 {
 	struct gsm_bts *bts = vty->index;
 	bts->si_common.rach_control.max_trans = rach_max_trans_val2raw(atoi(argv[0]));
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 	return CMD_SUCCESS;
 }
 
@@ -2012,6 +2059,7 @@ DEFUN(cfg_bts_chan_desc_att,
 {
 	struct gsm_bts *bts = vty->index;
 	bts->si_common.chan_desc.att = atoi(argv[0]);
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 	return CMD_SUCCESS;
 }
 
@@ -2026,6 +2074,7 @@ DEFUN(cfg_bts_chan_desc_bs_pa_mfrms,
 	int bs_pa_mfrms = atoi(argv[0]);
 
 	bts->si_common.chan_desc.bs_pa_mfrms = bs_pa_mfrms - 2;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 	return CMD_SUCCESS;
 }
 
@@ -2040,6 +2089,7 @@ DEFUN(cfg_bts_chan_desc_bs_ag_blks_res,
 	int bs_ag_blks_res = atoi(argv[0]);
 
 	bts->si_common.chan_desc.bs_ag_blks_res = bs_ag_blks_res;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 	return CMD_SUCCESS;
 }
 
@@ -2071,6 +2121,18 @@ DEFUN(cfg_bts_rach_nm_ldavg,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_bts_rach_coalesce,
+      cfg_bts_rach_coalesce_cmd,
+      "rach coalescing-window <0-1000>",
+	RACH_STR
+      "Collect the channel requests before allocating for them\n"
+      "Window in ms, 0 to allocate for every request right away\n")
+{
+	struct gsm_bts *bts = vty->index;
+	bts->chan_rqd.window = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_bts_cell_barred, cfg_bts_cell_barred_cmd,
       "cell barred (0|1)",
       "Should this cell be barred from access?\n"
@@ -2082,6 +2144,7 @@ DEFUN(cfg_bts_cell_barred, cfg_bts_cell_barred_cmd,
 	struct gsm_bts *bts = vty->index;
 
 	bts->si_common.rach_control.cell_bar = atoi(argv[0]);
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2101,6 +2164,7 @@ DEFUN(cfg_bts_rach_ec_allowed, cfg_bts_rach_ec_allowed_cmd,
 		bts->si_common.rach_control.t2 |= 0x4;
 	else
 		bts->si_common.rach_control.t2 &= ~0x4;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2146,6 +2210,7 @@ DEFUN(cfg_bts_rach_ac_class, cfg_bts_rach_ac_class_cmd,
 			bts->si_common.rach_control.t2 &= ~(0x1 << (control_class - 8));
 		else
 			bts->si_common.rach_control.t2 |= (0x1 << (control_class - 8));
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2175,6 +2240,7 @@ DEFUN(cfg_bts_cell_resel_hyst, cfg_bts_cell_resel_hyst_cmd,
 	struct gsm_bts *bts = vty->index;
 
 	bts->si_common.cell_sel_par.cell_resel_hyst = atoi(argv[0])/2;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2189,6 +2255,7 @@ DEFUN(cfg_bts_rxlev_acc_min, cfg_bts_rxlev_acc_min_cmd,
 	struct gsm_bts *bts = vty->index;
 
 	bts->si_common.cell_sel_par.rxlev_acc_min = atoi(argv[0]);
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2202,6 +2269,7 @@ DEFUN(cfg_bts_cell_bar_qualify, cfg_bts_cell_bar_qualify_cmd,
 
 	bts->si_common.cell_ro_sel_par.present = 1;
 	bts->si_common.cell_ro_sel_par.cbq = atoi(argv[0]);
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2217,6 +2285,7 @@ DEFUN(cfg_bts_cell_resel_ofs, cfg_bts_cell_resel_ofs_cmd,
 
 	bts->si_common.cell_ro_sel_par.present = 1;
 	bts->si_common.cell_ro_sel_par.cell_resel_off = atoi(argv[0])/2;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2231,6 +2300,7 @@ DEFUN(cfg_bts_temp_ofs, cfg_bts_temp_ofs_cmd,
 
 	bts->si_common.cell_ro_sel_par.present = 1;
 	bts->si_common.cell_ro_sel_par.temp_offs = atoi(argv[0])/10;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2245,6 +2315,7 @@ DEFUN(cfg_bts_temp_ofs_inf, cfg_bts_temp_ofs_inf_cmd,
 
 	bts->si_common.cell_ro_sel_par.present = 1;
 	bts->si_common.cell_ro_sel_par.temp_offs = 7;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2259,6 +2330,7 @@ DEFUN(cfg_bts_penalty_time, cfg_bts_penalty_time_cmd,
 
 	bts->si_common.cell_ro_sel_par.present = 1;
 	bts->si_common.cell_ro_sel_par.penalty_time = (atoi(argv[0])-20)/20;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2275,6 +2347,7 @@ DEFUN(cfg_bts_penalty_time_rsvd, cfg_bts_penalty_time_rsvd_cmd,
 
 	bts->si_common.cell_ro_sel_par.present = 1;
 	bts->si_common.cell_ro_sel_par.penalty_time = 31;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2289,6 +2362,7 @@ DEFUN(cfg_bts_per_loc_upd, cfg_bts_per_loc_upd_cmd,
 	struct gsm_bts *bts = vty->index;
 
 	bts->si_common.chan_desc.t3212 = atoi(argv[0]) / 6;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2303,6 +2377,7 @@ DEFUN(cfg_bts_no_per_loc_upd, cfg_bts_no_per_loc_upd_cmd,
 	struct gsm_bts *bts = vty->index;
 
 	bts->si_common.chan_desc.t3212 = 0;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2315,6 +2390,7 @@ DEFUN(cfg_bts_radio_link_timeout, cfg_bts_radio_link_timeout_cmd,
 	struct gsm_bts *bts = vty->index;
 
 	bts->si_common.cell_options.radio_link_timeout = (atoi(argv[0])>>2) - 1;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
 
 	return CMD_SUCCESS;
 }
@@ -2531,6 +2607,7 @@ DEFUN(cfg_bts_gprs_rac, cfg_bts_gprs_rac_cmd,
 	}
 
 	bts->gprs.rac = atoi(argv[0]);
+	gsm_bts_si_changed(bts, SI_IN_GPRS);
 
 	return CMD_SUCCESS;
 }
@@ -2551,6 +2628,7 @@ DEFUN(cfg_bts_gprs_net_ctrl_ord, cfg_bts_gprs_net_ctrl_ord_cmd,
 	}
 
 	bts->gprs.net_ctrl_ord = atoi(argv[0] + 2);
+	gsm_bts_si_changed(bts, SI_IN_GPRS);
 
 	return CMD_SUCCESS;
 }
@@ -2580,6 +2658,7 @@ DEFUN(cfg_bts_gprs_mode, cfg_bts_gprs_mode_cmd,
 	}
 
 	bts->gprs.mode = mode;
+	gsm_bts_si_changed(bts, SI_IN_GPRS);
 
 	return CMD_SUCCESS;
 }
@@ -2628,6 +2707,7 @@ DEFUN(cfg_bts_si_mode, cfg_bts_si_mode_cmd,
 		bts->si_mode_static |= (1 << type);
 	else
 		bts->si_mode_static &= ~(1 << type);
+	gsm_bts_si_changed(bts, SI_IN_ALL);
 
 	return CMD_SUCCESS;
 }
@@ -2692,6 +2772,7 @@ DEFUN(cfg_bts_neigh_mode, cfg_bts_neigh_mode_cmd,
 	}
 
 	bts->neigh_list_manual_mode = mode;
+	gsm_bts_si_changed(bts, SI_IN_NEIGH);
 
 	return CMD_SUCCESS;
 }
@@ -2716,6 +2797,7 @@ DEFUN(cfg_bts_neigh, cfg_bts_neigh_cmd,
 		bitvec_set_bit_pos(bv, arfcn, 1);
 	else
 		bitvec_set_bit_pos(bv, arfcn, 0);
+	gsm_bts_si_changed(bts, SI_IN_NEIGH);
 
 	return CMD_SUCCESS;
 }
@@ -2741,6 +2823,7 @@ DEFUN(cfg_bts_si5_neigh, cfg_bts_si5_neigh_cmd,
 		bitvec_set_bit_pos(bv, arfcn, 1);
 	else
 		bitvec_set_bit_pos(bv, arfcn, 0);
+	gsm_bts_si_changed(bts, SI_IN_NEIGH);
 
 	return CMD_SUCCESS;
 }
@@ -3452,8 +3535,13 @@ DEFUN(cfg_trx_arfcn,
 	/* FIXME: check if this ARFCN is supported by this TRX */
 
 	trx->arfcn = arfcn;
+	gsm_bts_si_changed(trx->bts, SI_IN_CELL_CHAN);
+	if (trx == trx->bts->c0) {
+		gsm_bts_update_index(trx->bts);
+		/* the BCCH is in the neighbor lists of the others */
+		gsm_net_si_changed(trx->bts->network, SI_IN_NEIGH);
+	}
 
-	/* FIXME: patch ARFCN into SYSTEM INFORMATION */
 	/* FIXME: use OML layer to update the ARFCN */
 	/* FIXME: use RSL layer to update SYSTEM INFORMATION */
 
@@ -3593,6 +3681,7 @@ DEFUN(cfg_ts_pchan,
 		return CMD_WARNING;
 
 	ts->pchan = pchanc;
+	ts_update_chan_load(ts);
 
 	return CMD_SUCCESS;
 }
@@ -3612,6 +3701,7 @@ DEFUN_HIDDEN(cfg_ts_pchan_compat,
 		return CMD_WARNING;
 
 	ts->pchan = pchanc;
+	ts_update_chan_load(ts);
 
 	return CMD_SUCCESS;
 }
@@ -3690,6 +3780,7 @@ DEFUN(cfg_ts_arfcn_add,
 	int arfcn = atoi(argv[0]);
 
 	bitvec_set_bit_pos(&ts->hopping.arfcns, arfcn, 1);
+	gsm_bts_si_changed(ts->trx->bts, SI_IN_CELL_CHAN);
 
 	return CMD_SUCCESS;
 }
@@ -3704,6 +3795,7 @@ DEFUN(cfg_ts_arfcn_del,
 	int arfcn = atoi(argv[0]);
 
 	bitvec_set_bit_pos(&ts->hopping.arfcns, arfcn, 0);
+	gsm_bts_si_changed(ts->trx->bts, SI_IN_CELL_CHAN);
 
 	return CMD_SUCCESS;
 }
@@ -3735,6 +3827,10 @@ void openbsc_vty_print_statistics(struct vty *vty, struct gsm_network *net)
 	vty_out(vty, "Channel Requests        : %lu total, %lu no channel%s",
 		osmo_counter_get(net->stats.chreq.total),
 		osmo_counter_get(net->stats.chreq.no_channel), VTY_NEWLINE);
+	vty_out(vty, "AGCH                    : %lu imm ass, %lu imm ass rej for %lu requests%s",
+		osmo_counter_get(net->stats.agch.imm_ass),
+		osmo_counter_get(net->stats.agch.imm_ass_rej),
+		osmo_counter_get(net->stats.agch.rejected), VTY_NEWLINE);
 	vty_out(vty, "Channel Failures        : %lu rf_failures, %lu rll failures%s",
 		osmo_counter_get(net->stats.chan.rf_fail),
 		osmo_counter_get(net->stats.chan.rll_err), VTY_NEWLINE);
@@ -3940,6 +4036,8 @@ int bsc_vty_init(const struct log_info *cat)
 	install_element(GSMNET_NODE, &cfg_net_T3141_cmd);
 	install_element(GSMNET_NODE, &cfg_net_dtx_cmd);
 	install_element(GSMNET_NODE, &cfg_net_subscr_keep_cmd);
+	install_element(GSMNET_NODE, &cfg_net_subscr_keep_max_cmd);
+	install_element(GSMNET_NODE, &cfg_net_subscr_expire_batch_cmd);
 	install_element(GSMNET_NODE, &cfg_net_pag_any_tch_cmd);
 
 	install_element(GSMNET_NODE, &cfg_bts_cmd);
@@ -3970,6 +4068,7 @@ int bsc_vty_init(const struct log_info *cat)
 	install_element(BTS_NODE, &cfg_bts_chan_desc_bs_ag_blks_res_cmd);
 	install_element(BTS_NODE, &cfg_bts_rach_nm_b_thresh_cmd);
 	install_element(BTS_NODE, &cfg_bts_rach_nm_ldavg_cmd);
+	install_element(BTS_NODE, &cfg_bts_rach_coalesce_cmd);
 	install_element(BTS_NODE, &cfg_bts_cell_barred_cmd);
 	install_element(BTS_NODE, &cfg_bts_rach_ec_allowed_cmd);
 	install_element(BTS_NODE, &cfg_bts_rach_ac_class_cmd);
@@ -35,6 +35,8 @@
 
 #include <osmocom/core/talloc.h>
 
+#include "../../bscconfig.h"
+
 static int ts_is_usable(struct gsm_bts_trx_ts *ts)
 {
 	/* FIXME: How does this behave for BS-11 ? */
@@ -72,6 +74,7 @@ struct gsm_bts_trx_ts *ts_c0_alloc(struct gsm_bts *bts,
 		return NULL;
 
 	ts->pchan = pchan;
+	ts_update_chan_load(ts);
 
 	return ts;
 }
@@ -129,6 +132,7 @@ struct gsm_bts_trx_ts *ts_alloc(struct gsm_bts *bts,
 
 			if (ts->pchan == GSM_PCHAN_NONE) {
 				ts->pchan = pchan;
+				ts_update_chan_load(ts);
 				/* set channel attribute on OML */
 				abis_nm_set_channel_attr(ts, abis_nm_chcomb4pchan(pchan));
 				return ts;
@@ -142,6 +146,7 @@ struct gsm_bts_trx_ts *ts_alloc(struct gsm_bts *bts,
 void ts_free(struct gsm_bts_trx_ts *ts)
 {
 	ts->pchan = GSM_PCHAN_NONE;
+	ts_update_chan_load(ts);
 }
 
 static const uint8_t subslots_per_pchan[] = {
@@ -155,6 +160,97 @@ static const uint8_t subslots_per_pchan[] = {
 	[GSM_PCHAN_TCH_F_PDCH] = 1,
 };
 
+/* the timeslots that count for the load, see bts_chan_load_scan() */
+static int ts_counts_load(struct gsm_bts_trx_ts *ts)
+{
+	struct gsm_bts_trx *trx = ts->trx;
+
+	return nm_is_running(&trx->mo.nm_state)
+		&& nm_is_running(&trx->bb_transc.mo.nm_state)
+		&& nm_is_running(&ts->mo.nm_state)
+		&& ts->pchan < ARRAY_SIZE(subslots_per_pchan);
+}
+
+/* replace what the timeslot counted in the load of its BTS */
+static void ts_recount_load(struct gsm_bts_trx_ts *ts)
+{
+	struct gsm_bts *bts = ts->trx->bts;
+	struct load_counter *pl;
+	int total = 0, used = 0, j;
+
+	if (ts->load.total) {
+		pl = &bts->chan_load.pchan[ts->load.pchan];
+		pl->total -= ts->load.total;
+		pl->used -= ts->load.used;
+	}
+
+	if (ts_counts_load(ts)) {
+		total = subslots_per_pchan[ts->pchan];
+		for (j = 0; j < total; j++)
+			if (ts->lchan[j].state != LCHAN_S_NONE)
+				used++;
+	}
+
+	ts->load.pchan = ts->pchan;
+	ts->load.total = total;
+	ts->load.used = used;
+	if (total) {
+		pl = &bts->chan_load.pchan[ts->pchan];
+		pl->total += total;
+		pl->used += used;
+	}
+}
+
+/*
+ * This needs to be called whenever the pchan of the timeslot, the NM
+ * state of the timeslot or the state of one of its lchans changes.
+ */
+void ts_update_chan_load(struct gsm_bts_trx_ts *ts)
+{
+	ts_recount_load(ts);
+
+#ifdef CHAN_LOAD_CHECK
+	bts_chan_load_check(ts->trx->bts);
+#endif
+}
+
+/* after a NM state change of the BTS or one of its TRX */
+void bts_update_chan_load(struct gsm_bts *bts)
+{
+	struct gsm_bts_trx *trx;
+	int i;
+
+	llist_for_each_entry(trx, &bts->trx_list, list)
+		for (i = 0; i < ARRAY_SIZE(trx->ts); i++)
+			ts_recount_load(&trx->ts[i]);
+
+#ifdef CHAN_LOAD_CHECK
+	bts_chan_load_check(bts);
+#endif
+}
+
+/*
+ * On ip.access the load covers the timeslots the search below looks
+ * at, so there is no free lchan if the counters say so. Other BTS do
+ * not report the state of every timeslot and need the search.
+ */
+static int bts_may_have_free_lchan(struct gsm_bts *bts,
+				   enum gsm_phys_chan_config pchan)
+{
+	struct load_counter *pl = &bts->chan_load.pchan[pchan];
+
+	if (!is_ipaccess_bts(bts) || pl->used < pl->total)
+		return 1;
+
+	/* the dynamic TCH/F + PDCH is used as TCH/F too */
+	if (pchan == GSM_PCHAN_TCH_F) {
+		pl = &bts->chan_load.pchan[GSM_PCHAN_TCH_F_PDCH];
+		return pl->used < pl->total;
+	}
+
+	return 0;
+}
+
 static struct gsm_lchan *
 _lc_find_trx(struct gsm_bts_trx *trx, enum gsm_phys_chan_config pchan)
 {
@@ -196,6 +292,9 @@ _lc_find_bts(struct gsm_bts *bts, enum gsm_phys_chan_config pchan)
 	struct gsm_bts_trx_ts *ts;
 	struct gsm_lchan *lc;
 
+	if (!bts_may_have_free_lchan(bts, pchan))
+		goto alloc_ts;
+
 	if (bts->chan_alloc_reverse) {
 		llist_for_each_entry_reverse(trx, &bts->trx_list, list) {
 			lc = _lc_find_trx(trx, pchan);
@@ -210,6 +309,8 @@ _lc_find_bts(struct gsm_bts *bts, enum gsm_phys_chan_config pchan)
 		}
 	}
 
+alloc_ts:
+
 	/* we cannot allocate more of these */
 	if (pchan == GSM_PCHAN_CCCH_SDCCH4)
 		return NULL;
@@ -368,6 +469,7 @@ void lchan_reset(struct gsm_lchan *lchan)
 
 	lchan->type = GSM_LCHAN_NONE;
 	lchan->state = LCHAN_S_NONE;
+	ts_update_chan_load(lchan->ts);
 
 	if (lchan->abis_ip.rtp_socket) {
 		rtp_socket_free(lchan->abis_ip.rtp_socket);
@@ -375,6 +477,33 @@ void lchan_reset(struct gsm_lchan *lchan)
 	}
 }
 
+/*
+ * The OML or RSL link of the TRX got lost. Free all allocated channels
+ * and reset the NM state so the trx and trx_ts become unusable and
+ * nothing can be allocated from them, the load of the BTS follows. The
+ * CHAN RQDs still waiting for a channel are dropped.
+ */
+void trx_link_down(struct gsm_bts_trx *trx)
+{
+	int ts_no, lchan_no;
+
+	for (ts_no = 0; ts_no < ARRAY_SIZE(trx->ts); ++ts_no) {
+		struct gsm_bts_trx_ts *ts = &trx->ts[ts_no];
+
+		for (lchan_no = 0; lchan_no < ARRAY_SIZE(ts->lchan); ++lchan_no) {
+			if (ts->lchan[lchan_no].state != LCHAN_S_NONE)
+				lchan_free(&ts->lchan[lchan_no]);
+			lchan_reset(&ts->lchan[lchan_no]);
+		}
+	}
+
+	/* the CHAN RQDs waiting for the window can not be answered */
+	rsl_chan_rqd_discard(trx->bts);
+
+	gsm_bts_mo_reset(trx->bts);
+	bts_update_chan_load(trx->bts);
+}
+
 /* Drive the release process of the lchan */
 static void _lchan_handle_release(struct gsm_lchan *lchan,
 				  int sacch_deact, int mode)
@@ -444,7 +573,8 @@ struct gsm_subscriber_connection *connection_for_subscr(struct gsm_subscriber *s
 	return NULL;
 }
 
-void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts)
+/* count the lchans of the BTS the slow way */
+static void bts_chan_load_scan(struct pchan_load *cl, const struct gsm_bts *bts)
 {
 	struct gsm_bts_trx *trx;
 
@@ -458,13 +588,16 @@ void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts)
 
 		for (i = 0; i < ARRAY_SIZE(trx->ts); i++) {
 			struct gsm_bts_trx_ts *ts = &trx->ts[i];
-			struct load_counter *pl = &cl->pchan[ts->pchan];
+			struct load_counter *pl;
 			int j;
 
 			/* skip administratively deactivated timeslots */
 			if (!nm_is_running(&ts->mo.nm_state))
 				continue;
+			if (ts->pchan >= ARRAY_SIZE(subslots_per_pchan))
+				continue;
 
+			pl = &cl->pchan[ts->pchan];
 			for (j = 0; j < subslots_per_pchan[ts->pchan]; j++) {
 				struct gsm_lchan *lchan = &ts->lchan[j];
 
@@ -482,6 +615,42 @@ void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts)
 	}
 }
 
+/* compare the counters with a full scan, returns -1 on a mismatch */
+int bts_chan_load_check(struct gsm_bts *bts)
+{
+	struct pchan_load pl;
+	int i, rc = 0;
+
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load_scan(&pl, bts);
+
+	for (i = 0; i < ARRAY_SIZE(pl.pchan); i++) {
+		struct load_counter *cnt = &bts->chan_load.pchan[i];
+
+		if (cnt->total == pl.pchan[i].total
+		    && cnt->used == pl.pchan[i].used)
+			continue;
+
+		LOGP(DRLL, LOGL_ERROR, "BTS %u %s load %u/%u but the scan "
+			"found %u/%u.\n", bts->nr, gsm_pchan_name(i),
+			cnt->used, cnt->total,
+			pl.pchan[i].used, pl.pchan[i].total);
+		rc = -1;
+	}
+
+	return rc;
+}
+
+void bts_chan_load(struct pchan_load *cl, const struct gsm_bts *bts)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cl->pchan); i++) {
+		cl->pchan[i].total += bts->chan_load.pchan[i].total;
+		cl->pchan[i].used += bts->chan_load.pchan[i].used;
+	}
+}
+
 void network_chan_load(struct pchan_load *pl, struct gsm_network *net)
 {
 	struct gsm_bts *bts;
@@ -491,4 +660,3 @@ void network_chan_load(struct pchan_load *pl, struct gsm_network *net)
 	llist_for_each_entry(bts, &net->bts_list, list)
 		bts_chan_load(pl, bts);
 }
-
@@ -34,12 +34,85 @@
 LLIST_HEAD(active_subscribers);
 void *tall_subscr_ctx;
 
+/*
+ * The active subscribers are additionally hashed by IMSI and TMSI so
+ * the lookups do not need to walk the whole list. Subscribers without
+ * any user that are kept in RAM are put on the idle list. Whenever one
+ * is added there the oldest ones of the same network above the limit
+ * are freed, so the limit is never exceeded.
+ */
+#define SUBSCR_HASH_MIN_BITS	8
+
+static LLIST_HEAD(idle_subscribers);
+static struct llist_head *imsi_hash;
+static struct llist_head *tmsi_hash;
+static unsigned int hash_bits;
+static unsigned int hash_count;
+
 /* for the gsm_subscriber.c */
 struct llist_head *subscr_bsc_active_subscribers(void)
 {
 	return &active_subscribers;
 }
 
+static unsigned int imsi_hash_key(const char *imsi)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*imsi) {
+		hash ^= (uint8_t) *imsi++;
+		hash *= 16777619u;
+	}
+
+	return hash & ((1 << hash_bits) - 1);
+}
+
+static unsigned int tmsi_hash_key(uint32_t tmsi)
+{
+	return (tmsi * 2654435761u) >> (32 - hash_bits);
+}
+
+static void hash_add(struct gsm_subscriber *subscr)
+{
+	llist_add_tail(&subscr->imsi_entry,
+		       &imsi_hash[imsi_hash_key(subscr->imsi)]);
+	if (subscr->tmsi != GSM_RESERVED_TMSI)
+		llist_add_tail(&subscr->tmsi_entry,
+			       &tmsi_hash[tmsi_hash_key(subscr->tmsi)]);
+}
+
+static int hash_resize(unsigned int bits)
+{
+	struct llist_head *new_imsi, *new_tmsi;
+	struct gsm_subscriber *subscr;
+	unsigned int i, size = 1 << bits;
+
+	new_imsi = talloc_array(tall_subscr_ctx, struct llist_head, size);
+	new_tmsi = talloc_array(tall_subscr_ctx, struct llist_head, size);
+	if (!new_imsi || !new_tmsi) {
+		talloc_free(new_imsi);
+		talloc_free(new_tmsi);
+		return -1;
+	}
+
+	for (i = 0; i < size; ++i) {
+		INIT_LLIST_HEAD(&new_imsi[i]);
+		INIT_LLIST_HEAD(&new_tmsi[i]);
+	}
+
+	talloc_free(imsi_hash);
+	talloc_free(tmsi_hash);
+	imsi_hash = new_imsi;
+	tmsi_hash = new_tmsi;
+	hash_bits = bits;
+
+	llist_for_each_entry(subscr, &active_subscribers, entry) {
+		INIT_LLIST_HEAD(&subscr->tmsi_entry);
+		hash_add(subscr);
+	}
+
+	return 0;
+}
 
 char *subscr_name(struct gsm_subscriber *subscr)
 {
@@ -49,10 +122,40 @@ char *subscr_name(struct gsm_subscriber *subscr)
 	return subscr->imsi;
 }
 
+static void subscr_free(struct gsm_subscriber *subscr);
+
+/*
+ * Drop the oldest unused subscribers of the network until it is within
+ * its limit. Subscribers of other networks are skipped and the one that
+ * has just been put is never dropped.
+ */
+static int trim_idle(struct gsm_network *net, struct gsm_subscriber *keep)
+{
+	struct gsm_subscriber *subscr, *tmp;
+	int trimmed = 0;
+
+	if (!net->keep_subscr_max)
+		return 0;
+
+	llist_for_each_entry_safe(subscr, tmp, &idle_subscribers, idle_entry) {
+		if (net->num_idle_subscr <= net->keep_subscr_max)
+			break;
+		if (subscr->net != net || subscr == keep)
+			continue;
+		subscr_free(subscr);
+		trimmed += 1;
+	}
+
+	return trimmed;
+}
+
 struct gsm_subscriber *subscr_alloc(void)
 {
 	struct gsm_subscriber *s;
 
+	if (!imsi_hash && hash_resize(SUBSCR_HASH_MIN_BITS) != 0)
+		return NULL;
+
 	s = talloc_zero(tall_subscr_ctx, struct gsm_subscriber);
 	if (!s)
 		return NULL;
@@ -60,6 +163,14 @@ struct gsm_subscriber *subscr_alloc(void)
 	llist_add_tail(&s->entry, &active_subscribers);
 	s->use_count = 1;
 	s->tmsi = GSM_RESERVED_TMSI;
+	s->db_tmsi = GSM_RESERVED_TMSI;
+	INIT_LLIST_HEAD(&s->tmsi_entry);
+	INIT_LLIST_HEAD(&s->idle_entry);
+	hash_add(s);
+
+	/* a failed resize keeps the old table, the chains just get longer */
+	if (++hash_count > (1u << hash_bits))
+		hash_resize(hash_bits + 1);
 
 	INIT_LLIST_HEAD(&s->requests);
 
@@ -68,15 +179,78 @@ struct gsm_subscriber *subscr_alloc(void)
 
 static void subscr_free(struct gsm_subscriber *subscr)
 {
+	if (!llist_empty(&subscr->idle_entry)) {
+		llist_del(&subscr->idle_entry);
+		subscr->net->num_idle_subscr -= 1;
+	}
+
+	llist_del(&subscr->imsi_entry);
+	llist_del(&subscr->tmsi_entry);
 	llist_del(&subscr->entry);
+	hash_count -= 1;
 	talloc_free(subscr);
 }
 
+void subscr_set_imsi(struct gsm_subscriber *subscr, const char *imsi)
+{
+	llist_del(&subscr->imsi_entry);
+	strncpy(subscr->imsi, imsi, GSM_IMSI_LENGTH);
+	subscr->imsi[GSM_IMSI_LENGTH - 1] = '\0';
+	llist_add_tail(&subscr->imsi_entry,
+		       &imsi_hash[imsi_hash_key(subscr->imsi)]);
+}
+
+void subscr_set_tmsi(struct gsm_subscriber *subscr, uint32_t tmsi)
+{
+	llist_del_init(&subscr->tmsi_entry);
+	subscr->tmsi = tmsi;
+	if (tmsi != GSM_RESERVED_TMSI)
+		llist_add_tail(&subscr->tmsi_entry,
+			       &tmsi_hash[tmsi_hash_key(tmsi)]);
+}
+
+/* a NULL network matches the subscribers of all networks */
+struct gsm_subscriber *subscr_find_by_imsi(struct gsm_network *net,
+					   const char *imsi)
+{
+	struct gsm_subscriber *subscr;
+
+	if (!imsi_hash)
+		return NULL;
+
+	llist_for_each_entry(subscr, &imsi_hash[imsi_hash_key(imsi)], imsi_entry) {
+		if (strcmp(subscr->imsi, imsi) == 0 && (!net || subscr->net == net))
+			return subscr;
+	}
+
+	return NULL;
+}
+
+struct gsm_subscriber *subscr_find_by_tmsi(struct gsm_network *net,
+					   uint32_t tmsi)
+{
+	struct gsm_subscriber *subscr;
+
+	if (!tmsi_hash || tmsi == GSM_RESERVED_TMSI)
+		return NULL;
+
+	llist_for_each_entry(subscr, &tmsi_hash[tmsi_hash_key(tmsi)], tmsi_entry) {
+		if (subscr->tmsi == tmsi && (!net || subscr->net == net))
+			return subscr;
+	}
+
+	return NULL;
+}
+
 struct gsm_subscriber *subscr_get(struct gsm_subscriber *subscr)
 {
 	subscr->use_count++;
 	DEBUGP(DREF, "subscr %s usage increases usage to: %d\n",
 			subscr->extension, subscr->use_count);
+	if (!llist_empty(&subscr->idle_entry)) {
+		llist_del_init(&subscr->idle_entry);
+		subscr->net->num_idle_subscr -= 1;
+	}
 	return subscr;
 }
 
@@ -85,8 +259,19 @@ struct gsm_subscriber *subscr_put(struct gsm_subscriber *subscr)
 	subscr->use_count--;
 	DEBUGP(DREF, "subscr %s usage decreased usage to: %d\n",
 			subscr->extension, subscr->use_count);
-	if (subscr->use_count <= 0 && !subscr->net->keep_subscr)
+	if (subscr->use_count > 0)
+		return NULL;
+
+	if (!subscr->net->keep_subscr) {
 		subscr_free(subscr);
+		return NULL;
+	}
+
+	if (llist_empty(&subscr->idle_entry)) {
+		llist_add_tail(&subscr->idle_entry, &idle_subscribers);
+		subscr->net->num_idle_subscr += 1;
+		trim_idle(subscr->net, subscr);
+	}
 	return NULL;
 }
 
@@ -95,17 +280,15 @@ struct gsm_subscriber *subscr_get_or_create(struct gsm_network *net,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0 && subscr->net == net)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_imsi(net, imsi);
+	if (subscr)
+		return subscr_get(subscr);
 
 	subscr = subscr_alloc();
 	if (!subscr)
 		return NULL;
 
-	strncpy(subscr->imsi, imsi, GSM_IMSI_LENGTH);
-	subscr->imsi[GSM_IMSI_LENGTH - 1] = '\0';
+	subscr_set_imsi(subscr, imsi);
 	subscr->net = net;
 	return subscr;
 }
@@ -114,24 +297,21 @@ struct gsm_subscriber *subscr_active_by_tmsi(struct gsm_network *net, uint32_t t
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (subscr->tmsi == tmsi && subscr->net == net)
-			return subscr_get(subscr);
-	}
-
-	return NULL;
+	subscr = subscr_find_by_tmsi(net, tmsi);
+	return subscr ? subscr_get(subscr) : NULL;
 }
 
 struct gsm_subscriber *subscr_active_by_imsi(struct gsm_network *net, const char *imsi)
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0 && subscr->net == net)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_imsi(net, imsi);
+	return subscr ? subscr_get(subscr) : NULL;
+}
 
-	return NULL;
+int subscr_trim_inactive(struct gsm_network *net)
+{
+	return trim_idle(net, NULL);
 }
 
 int subscr_purge_inactive(struct gsm_network *net)
@@ -139,8 +319,8 @@ int subscr_purge_inactive(struct gsm_network *net)
 	struct gsm_subscriber *subscr, *tmp;
 	int purged = 0;
 
-	llist_for_each_entry_safe(subscr, tmp, subscr_bsc_active_subscribers(), entry) {
-		if (subscr->net == net && subscr->use_count <= 0) {
+	llist_for_each_entry_safe(subscr, tmp, &idle_subscribers, idle_entry) {
+		if (subscr->net == net) {
 			subscr_free(subscr);
 			purged += 1;
 		}
@@ -54,6 +54,11 @@ void *tall_paging_ctx;
 
 #define PAGING_TIMER 0, 500000
 
+/* duration of a 51-multiframe in microseconds */
+#define PAGING_MFRM_US		235385
+/* 9 paging blocks per multiframe and up to 9 multiframes per cycle */
+#define PAGING_MAX_GROUPS	81
+
 /*
  * Kill one paging request update the internal list...
  */
@@ -70,7 +75,6 @@ static void page_ms(struct gsm_paging_request *request)
 {
 	uint8_t mi[128];
 	unsigned int mi_len;
-	unsigned int page_group;
 	struct gsm_bts *bts = request->bts;
 
 	/* the bts is down.. we will just wait for the paging to expire */
@@ -85,9 +89,68 @@ static void page_ms(struct gsm_paging_request *request)
 	else
 		mi_len = gsm48_generate_mid_from_tmsi(mi, request->subscr->tmsi);
 
-	page_group = gsm0502_calc_paging_group(&bts->si_common.chan_desc,
-						str_to_imsi(request->subscr->imsi));
-	gsm0808_page(bts, page_group, mi_len, mi, request->chan_type);
+	gsm0808_page(bts, request->page_group, mi_len, mi, request->chan_type);
+}
+
+/*
+ * The identities of one PCH block. A Paging Request Type 1 carries two
+ * identities of any kind, Type 2 two TMSIs and one IMSI and Type 3 four
+ * TMSIs (GSM 04.08 9.1.22 - 9.1.24). The BTS builds these messages out
+ * of the paging commands it has for a paging group.
+ */
+struct paging_block {
+	uint8_t tmsis;
+	uint8_t imsis;
+};
+
+static int paging_block_fits(unsigned int tmsis, unsigned int imsis)
+{
+	switch (imsis) {
+	case 0:
+		return tmsis <= 4;
+	case 1:
+		return tmsis <= 2;
+	case 2:
+		return tmsis == 0;
+	default:
+		return 0;
+	}
+}
+
+static int paging_block_full(struct paging_block *block)
+{
+	return !paging_block_fits(block->tmsis + 1, block->imsis)
+		&& !paging_block_fits(block->tmsis, block->imsis + 1);
+}
+
+static int paging_block_add(struct paging_block *block,
+			    struct gsm_paging_request *request)
+{
+	if (request->subscr->tmsi == GSM_RESERVED_TMSI) {
+		if (!paging_block_fits(block->tmsis, block->imsis + 1))
+			return 0;
+		block->imsis += 1;
+	} else {
+		if (!paging_block_fits(block->tmsis + 1, block->imsis))
+			return 0;
+		block->tmsis += 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Every paging group gets one PCH block per paging cycle of
+ * BS_PA_MFRMS multiframes, that is how fast the pages can go out.
+ */
+static void paging_schedule_cycle(struct gsm_bts_paging_state *paging_bts)
+{
+	struct gsm_bts *bts = paging_bts->bts;
+	unsigned long usecs;
+
+	usecs = (bts->si_common.chan_desc.bs_pa_mfrms + 2) * PAGING_MFRM_US;
+	osmo_timer_schedule(&paging_bts->work_timer,
+			    usecs / 1000000, usecs % 1000000);
 }
 
 static void paging_schedule_if_needed(struct gsm_bts_paging_state *paging_bts)
@@ -112,12 +175,9 @@ static void paging_give_credit(void *data)
 
 static int can_send_pag_req(struct gsm_bts *bts, int rsl_type)
 {
-	struct pchan_load pl;
+	const struct pchan_load *pl = &bts->chan_load;
 	int count;
 
-	memset(&pl, 0, sizeof(pl));
-	bts_chan_load(&pl, bts);
-
 	switch (rsl_type) {
 	case RSL_CHANNEED_TCH_F:
 	case RSL_CHANNEED_TCH_ForH:
@@ -140,19 +200,19 @@ static int can_send_pag_req(struct gsm_bts *bts, int rsl_type)
 	/* could available SDCCH */
 count_sdcch:
 	count = 0;
-	count += pl.pchan[GSM_PCHAN_SDCCH8_SACCH8C].total
-			- pl.pchan[GSM_PCHAN_SDCCH8_SACCH8C].used;
-	count += pl.pchan[GSM_PCHAN_CCCH_SDCCH4].total
-			- pl.pchan[GSM_PCHAN_CCCH_SDCCH4].used;
+	count += pl->pchan[GSM_PCHAN_SDCCH8_SACCH8C].total
+			- pl->pchan[GSM_PCHAN_SDCCH8_SACCH8C].used;
+	count += pl->pchan[GSM_PCHAN_CCCH_SDCCH4].total
+			- pl->pchan[GSM_PCHAN_CCCH_SDCCH4].used;
 	return bts->paging.free_chans_need > count;
 
 count_tch:
 	count = 0;
-	count += pl.pchan[GSM_PCHAN_TCH_F].total
-			- pl.pchan[GSM_PCHAN_TCH_F].used;
+	count += pl->pchan[GSM_PCHAN_TCH_F].total
+			- pl->pchan[GSM_PCHAN_TCH_F].used;
 	if (bts->network->neci)
-		count += pl.pchan[GSM_PCHAN_TCH_H].total
-				- pl.pchan[GSM_PCHAN_TCH_H].used;
+		count += pl->pchan[GSM_PCHAN_TCH_H].total
+				- pl->pchan[GSM_PCHAN_TCH_H].used;
 	return bts->paging.free_chans_need > count;
 }
 
@@ -160,12 +220,17 @@ count_tch:
  * This is kicked by the periodic PAGING LOAD Indicator
  * coming from abis_rsl.c
  *
- * We attempt to iterate once over the list of items but
- * only upto available_slots.
+ * We go once over the list of items and fill one PCH block per
+ * paging group but send no more than available_slots. The paged
+ * requests go to the back of the list.
  */
 static void paging_handle_pending_requests(struct gsm_bts_paging_state *paging_bts)
 {
-	struct gsm_paging_request *request = NULL;
+	struct paging_block blocks[PAGING_MAX_GROUPS];
+	struct gsm_paging_request *request, *tmp;
+	struct gsm_bts *bts = paging_bts->bts;
+	unsigned int groups, full = 0;
+	LLIST_HEAD(paged);
 
 	/*
 	 * Determine if the pending_requests list is empty and
@@ -189,26 +254,40 @@ static void paging_handle_pending_requests(struct gsm_bts_paging_state *paging_b
 		return;
 	}
 
-	request = llist_entry(paging_bts->pending_requests.next,
-			      struct gsm_paging_request, entry);
+	groups = gsm48_number_of_paging_subchannels(&bts->si_common.chan_desc);
+	if (groups > PAGING_MAX_GROUPS)
+		groups = PAGING_MAX_GROUPS;
+	memset(blocks, 0, sizeof(blocks));
 
-	/* we need to determine the number of free channels */
-	if (paging_bts->free_chans_need != -1) {
-		if (can_send_pag_req(request->bts, request->chan_type) != 0)
-			goto skip_paging;
-	}
+	llist_for_each_entry_safe(request, tmp, &paging_bts->pending_requests, entry) {
+		struct paging_block *block;
 
-	/* handle the paging request now */
-	page_ms(request);
-	paging_bts->available_slots--;
-	request->attempts++;
+		if (paging_bts->available_slots == 0 || full >= groups)
+			break;
+
+		/* we need to determine the number of free channels */
+		if (paging_bts->free_chans_need != -1
+		    && can_send_pag_req(bts, request->chan_type) != 0)
+			continue;
+
+		block = &blocks[request->page_group % PAGING_MAX_GROUPS];
+		if (!paging_block_add(block, request))
+			continue;
+		if (paging_block_full(block))
+			full += 1;
+
+		/* handle the paging request now */
+		page_ms(request);
+		paging_bts->available_slots--;
+		request->attempts++;
+		llist_move_tail(&request->entry, &paged);
+	}
 
-	/* take the current and add it to the back */
-	llist_del(&request->entry);
-	llist_add_tail(&request->entry, &paging_bts->pending_requests);
+	/* take the paged ones and add them to the back */
+	llist_for_each_entry_safe(request, tmp, &paged, entry)
+		llist_move_tail(&request->entry, &paging_bts->pending_requests);
 
-skip_paging:
-	osmo_timer_schedule(&paging_bts->work_timer, PAGING_TIMER);
+	paging_schedule_cycle(paging_bts);
 }
 
 static void paging_worker(void *data)
@@ -287,6 +366,8 @@ static int _paging_request(struct gsm_bts *bts, struct gsm_subscriber *subscr,
 	req->subscr = subscr_get(subscr);
 	req->bts = bts;
 	req->chan_type = type;
+	req->page_group = gsm0502_calc_paging_group(&bts->si_common.chan_desc,
+						    str_to_imsi(subscr->imsi));
 	req->cbfn = cbfn;
 	req->cbfn_param = data;
 	req->T3113.cb = paging_T3113_expired;
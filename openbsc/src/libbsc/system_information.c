@@ -36,6 +36,7 @@
 #include <openbsc/abis_rsl.h>
 #include <openbsc/rest_octets.h>
 #include <openbsc/arfcn_range_encode.h>
+#include <openbsc/system_information.h>
 
 /*
  * DCS1800 and PCS1900 have overlapping ARFCNs. We would need to set the
@@ -340,7 +341,8 @@ static int generate_bcch_chan_list(uint8_t *chan_list, struct gsm_bts *bts,
 		bv = &bts->si_common.neigh_list;
 
 	/* Generate list of neighbor cells if we are in automatic mode */
-	if (bts->neigh_list_manual_mode == NL_MODE_AUTOMATIC) {
+	if (bts->neigh_list_manual_mode == NL_MODE_AUTOMATIC
+	    && !bts->si_cache.neigh_clean) {
 		/* Zero-initialize the bit-vector */
 		memset(bv->data, 0, bv->data_len);
 
@@ -350,6 +352,7 @@ static int generate_bcch_chan_list(uint8_t *chan_list, struct gsm_bts *bts,
 				continue;
 			bitvec_set_bit_pos(bv, cur_bts->c0->arfcn, 1);
 		}
+		bts->si_cache.neigh_clean = 1;
 	}
 
 	/* then we generate a GSM 04.08 frequency list from the bitvec */
@@ -815,9 +818,64 @@ static const gen_si_fn_t gen_si_fn[_MAX_SYSINFO_TYPE] = {
 	[SYSINFO_TYPE_13] = &generate_si13,
 };
 
+/*
+ * The inputs of every SI. SI2bis and SI5bis patch SI2 and SI5, so they
+ * need to share their inputs, and SI3 tells if there is a SI2ter.
+ */
+static const unsigned int si_inputs[_MAX_SYSINFO_TYPE] = {
+	[SYSINFO_TYPE_1] = SI_IN_CELL_CHAN | SI_IN_CELL_OPTS,
+	[SYSINFO_TYPE_2] = SI_IN_CELL_CHAN | SI_IN_NEIGH | SI_IN_CELL_OPTS,
+	[SYSINFO_TYPE_2bis] = SI_IN_CELL_CHAN | SI_IN_NEIGH | SI_IN_CELL_OPTS,
+	[SYSINFO_TYPE_2ter] = SI_IN_CELL_CHAN | SI_IN_NEIGH | SI_IN_CELL_OPTS,
+	[SYSINFO_TYPE_3] = SI_IN_CELL_CHAN | SI_IN_NEIGH | SI_IN_CELL_OPTS
+				| SI_IN_GPRS,
+	[SYSINFO_TYPE_4] = SI_IN_CELL_OPTS | SI_IN_GPRS,
+	[SYSINFO_TYPE_5] = SI_IN_CELL_CHAN | SI_IN_NEIGH,
+	[SYSINFO_TYPE_5bis] = SI_IN_CELL_CHAN | SI_IN_NEIGH,
+	[SYSINFO_TYPE_5ter] = SI_IN_CELL_CHAN | SI_IN_NEIGH,
+	[SYSINFO_TYPE_6] = SI_IN_CELL_OPTS,
+	[SYSINFO_TYPE_13] = SI_IN_GPRS,
+};
+
+void gsm_bts_si_changed(struct gsm_bts *bts, unsigned int inputs)
+{
+	int i;
+
+	for (i = 0; i < _MAX_SYSINFO_TYPE; i++)
+		if (si_inputs[i] & inputs)
+			bts->si_cache.clean &= ~(1 << i);
+
+	if (inputs & SI_IN_NEIGH)
+		bts->si_cache.neigh_clean = 0;
+}
+
+void gsm_net_si_changed(struct gsm_network *net, unsigned int inputs)
+{
+	struct gsm_bts *bts;
+
+	llist_for_each_entry(bts, &net->bts_list, list)
+		gsm_bts_si_changed(bts, inputs);
+}
+
+/*
+ * The SI are only generated again once their inputs changed, this
+ * saves the work for every further TRX and every reconnect of the BTS.
+ */
 int gsm_generate_si(struct gsm_bts *bts, enum osmo_sysinfo_type si_type)
 {
 	gen_si_fn_t gen_si;
+	uint32_t bit = 1 << si_type;
+	int rc;
+
+	gen_si = gen_si_fn[si_type];
+	if (!gen_si)
+		return -EINVAL;
+
+	if (bts->si_cache.clean & bit) {
+		if (!(bts->si_cache.valid & bit))
+			bts->si_valid &= ~bit;
+		return bts->si_cache.len[si_type];
+	}
 
 	switch (bts->gprs.mode) {
 	case BTS_GPRS_EGPRS:
@@ -836,9 +894,17 @@ int gsm_generate_si(struct gsm_bts *bts, enum osmo_sysinfo_type si_type)
 	       &bts->si_common.cell_ro_sel_par,
 	       sizeof(struct gsm48_si_selection_params));
 
-	gen_si = gen_si_fn[si_type];
-	if (!gen_si)
-		return -EINVAL;
+	rc = gen_si(bts->si_buf[si_type], bts);
+	if (rc < 0)
+		return rc;
+
+	/* the SI2bis, SI2ter, SI5bis and SI5ter might not be needed */
+	bts->si_cache.len[si_type] = rc;
+	bts->si_cache.clean |= bit;
+	if (bts->si_valid & bit)
+		bts->si_cache.valid |= bit;
+	else
+		bts->si_cache.valid &= ~bit;
 
-	return gen_si(bts->si_buf[si_type], bts);
+	return rc;
 }
@@ -74,6 +74,7 @@ struct gsm_network *gsm_network_init(uint16_t country_code, uint16_t network_cod
 				     int (*mncc_recv)(struct gsm_network *, struct msgb *))
 {
 	struct gsm_network *net;
+	int i;
 
 	net = talloc_zero(tall_bsc_ctx, struct gsm_network);
 	if (!net)
@@ -100,6 +101,8 @@ struct gsm_network *gsm_network_init(uint16_t country_code, uint16_t network_cod
 	net->T3122 = GSM_T3122_DEFAULT;
 	/* FIXME: initialize all other timers! */
 
+	net->subscr_expire_batch = GSM_SUBSCR_EXPIRE_BATCH_DEFAULT;
+
 	/* default set of handover parameters */
 	net->handover.win_rxlev_avg = 10;
 	net->handover.win_rxqual_avg = 1;
@@ -111,9 +114,16 @@ struct gsm_network *gsm_network_init(uint16_t country_code, uint16_t network_cod
 	INIT_LLIST_HEAD(&net->trans_list);
 	INIT_LLIST_HEAD(&net->upqueue);
 	INIT_LLIST_HEAD(&net->bts_list);
+	for (i = 0; i < GSM_BTS_HASH_SIZE; i++) {
+		INIT_LLIST_HEAD(&net->bts_by_lac[i]);
+		INIT_LLIST_HEAD(&net->bts_by_arfcn[i]);
+	}
 
 	net->stats.chreq.total = osmo_counter_alloc("net.chreq.total");
 	net->stats.chreq.no_channel = osmo_counter_alloc("net.chreq.no_channel");
+	net->stats.agch.imm_ass = osmo_counter_alloc("net.agch.imm_ass");
+	net->stats.agch.imm_ass_rej = osmo_counter_alloc("net.agch.imm_ass_rej");
+	net->stats.agch.rejected = osmo_counter_alloc("net.agch.rejected");
 	net->stats.handover.attempted = osmo_counter_alloc("net.handover.attempted");
 	net->stats.handover.no_channel = osmo_counter_alloc("net.handover.no_channel");
 	net->stats.handover.timeout = osmo_counter_alloc("net.handover.timeout");
@@ -129,6 +139,8 @@ struct gsm_network *gsm_network_init(uint16_t country_code, uint16_t network_cod
 	net->stats.paging.detached = osmo_counter_alloc("net.paging.detached");
 	net->stats.paging.completed = osmo_counter_alloc("net.paging.completed");
 	net->stats.paging.expired = osmo_counter_alloc("net.paging.expired");
+	net->stats.subscr.expired = osmo_counter_alloc("net.subscr.expired");
+	net->stats.subscr.expire_backlog = osmo_counter_alloc("net.subscr.expire_backlog");
 	net->stats.sms.submitted = osmo_counter_alloc("net.sms.submitted");
 	net->stats.sms.no_receiver = osmo_counter_alloc("net.sms.no_receiver");
 	net->stats.sms.delivered = osmo_counter_alloc("net.sms.delivered");
@@ -150,32 +162,62 @@ struct gsm_network *gsm_network_init(uint16_t country_code, uint16_t network_cod
 	return net;
 }
 
-struct gsm_bts *gsm_bts_num(struct gsm_network *net, int num)
+static unsigned int bts_hash(uint32_t key)
 {
-	struct gsm_bts *bts;
+	return (key * 2654435761u) >> (32 - GSM_BTS_HASH_BITS);
+}
 
-	if (num >= net->num_bts)
-		return NULL;
+static unsigned int bts_arfcn_hash(uint16_t arfcn, uint8_t bsic)
+{
+	return bts_hash(arfcn << 6 | bsic);
+}
 
-	llist_for_each_entry(bts, &net->bts_list, list) {
-		if (bts->nr == num)
-			return bts;
-	}
+/*
+ * The hash chains are sorted by BTS number, so the lookups find the
+ * BTS in the same order as a walk over the bts_list.
+ */
+void gsm_bts_update_index(struct gsm_bts *bts)
+{
+	struct gsm_network *net = bts->network;
+	struct llist_head *head;
+	struct gsm_bts *other;
+
+	llist_del(&bts->lac_entry);
+	head = &net->bts_by_lac[bts_hash(bts->location_area_code)];
+	llist_for_each_entry_reverse(other, head, lac_entry)
+		if (other->nr < bts->nr)
+			break;
+	llist_add(&bts->lac_entry, &other->lac_entry);
+
+	llist_del(&bts->arfcn_entry);
+	head = &net->bts_by_arfcn[bts_arfcn_hash(bts->c0->arfcn, bts->bsic)];
+	llist_for_each_entry_reverse(other, head, arfcn_entry)
+		if (other->nr < bts->nr)
+			break;
+	llist_add(&bts->arfcn_entry, &other->arfcn_entry);
+}
 
-	return NULL;
+struct gsm_bts *gsm_bts_num(struct gsm_network *net, int num)
+{
+	if (num < 0 || num >= net->num_bts)
+		return NULL;
+
+	return net->bts_by_nr[num];
 }
 
 /* Get reference to a neighbor cell on a given BCCH ARFCN */
 struct gsm_bts *gsm_bts_neighbor(const struct gsm_bts *bts,
 				 uint16_t arfcn, uint8_t bsic)
 {
+	struct gsm_network *net = bts->network;
 	struct gsm_bts *neigh;
 	/* FIXME: use some better heuristics here to determine which cell
 	 * using this ARFCN really is closest to the target cell.  For
 	 * now we simply assume that each ARFCN will only be used by one
 	 * cell */
 
-	llist_for_each_entry(neigh, &bts->network->bts_list, list) {
+	llist_for_each_entry(neigh, &net->bts_by_arfcn[bts_arfcn_hash(arfcn, bsic)],
+			     arfcn_entry) {
 		if (neigh->c0->arfcn == arfcn &&
 		    neigh->bsic == bsic)
 			return neigh;
@@ -230,25 +272,31 @@ struct gsm_bts_trx *gsm_bts_trx_by_nr(struct gsm_bts *bts, int nr)
 struct gsm_bts *gsm_bts_by_lac(struct gsm_network *net, unsigned int lac,
 				struct gsm_bts *start_bts)
 {
-	int i;
+	struct llist_head *head, *pos;
 	struct gsm_bts *bts;
-	int skip = 0;
-
-	if (start_bts)
-		skip = 1;
+	int i;
 
-	for (i = 0; i < net->num_bts; i++) {
-		bts = gsm_bts_num(net, i);
+	if (lac == GSM_LAC_RESERVED_ALL_BTS)
+		return gsm_bts_num(net, start_bts ? start_bts->nr + 1 : 0);
 
-		if (skip) {
-			if (start_bts == bts)
-				skip = 0;
-			continue;
+	/* the LAC of the start has been changed, go the long way */
+	if (start_bts && start_bts->location_area_code != lac) {
+		for (i = start_bts->nr + 1; i < net->num_bts; i++) {
+			bts = gsm_bts_num(net, i);
+			if (bts->location_area_code == lac)
+				return bts;
 		}
+		return NULL;
+	}
 
-		if (lac == GSM_LAC_RESERVED_ALL_BTS || bts->location_area_code == lac)
+	head = &net->bts_by_lac[bts_hash(lac)];
+	pos = start_bts ? &start_bts->lac_entry : head;
+	for (pos = pos->next; pos != head; pos = pos->next) {
+		bts = llist_entry(pos, struct gsm_bts, lac_entry);
+		if (bts->location_area_code == lac)
 			return bts;
 	}
+
 	return NULL;
 }
 
@@ -371,11 +419,19 @@ struct gsm_bts *gsm_bts_alloc_register(struct gsm_network *net, enum gsm_bts_typ
 					uint8_t tsc, uint8_t bsic)
 {
 	struct gsm_bts_model *model = bts_model_find(type);
+	struct gsm_bts **bts_by_nr;
 	struct gsm_bts *bts;
+	int i;
 
 	if (!model && type != GSM_BTS_TYPE_UNKNOWN)
 		return NULL;
 
+	bts_by_nr = talloc_realloc(net, net->bts_by_nr, struct gsm_bts *,
+				   net->num_bts + 1);
+	if (!bts_by_nr)
+		return NULL;
+	net->bts_by_nr = bts_by_nr;
+
 	bts = gsm_bts_alloc(net);
 	if (!bts)
 		return NULL;
@@ -410,11 +466,19 @@ struct gsm_bts *gsm_bts_alloc_register(struct gsm_network *net, enum gsm_bts_typ
 	bts->si_common.cell_options.radio_link_timeout = 7; /* Use RADIO LINK TIMEOUT of 32 */
 
 	llist_add_tail(&bts->list, &net->bts_list);
+	net->bts_by_nr[bts->nr] = bts;
+	INIT_LLIST_HEAD(&bts->lac_entry);
+	INIT_LLIST_HEAD(&bts->arfcn_entry);
+	gsm_bts_update_index(bts);
 
 	INIT_LLIST_HEAD(&bts->abis_queue);
 
 	INIT_LLIST_HEAD(&bts->loc_list);
 
+	for (i = 0; i < ARRAY_SIZE(bts->chan_rqd.queue); ++i)
+		INIT_LLIST_HEAD(&bts->chan_rqd.queue[i]);
+	bts->chan_rqd.window = GSM_CHAN_RQD_WINDOW_DEFAULT;
+
 	return bts;
 }
 
@@ -435,10 +499,14 @@ int gsm48_ra_id_by_bts(uint8_t *buf, struct gsm_bts *bts)
 	return gsm48_construct_ra(buf, &raid);
 }
 
+/* changes with every gsm_parse_reg() so caches of the regexps notice it */
+unsigned int gsm_parse_reg_gen;
+
 int gsm_parse_reg(void *ctx, regex_t *reg, char **str, int argc, const char **argv)
 {
 	int ret;
 
+	gsm_parse_reg_gen += 1;
 	ret = 0;
 	if (*str) {
 		talloc_free(*str);
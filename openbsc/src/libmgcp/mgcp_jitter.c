@@ -0,0 +1,405 @@
+/* A Media Gateway Control Protocol Media Gateway: RFC 3435 */
+/* Jitter buffer and the timer wheel driving its playout */
+
+/*
+ * (C) 2009-2012 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2009-2012 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+
+/*
+ * Timer wheel
+ *
+ * All jitter buffers of a thread share one wheel with a slot per
+ * MGCP_WHEEL_TICK_MS. Adding and removing a timer is O(1) and a tick
+ * only looks at the timers of its slot. The wheel of the main loop is
+ * driven by a single osmo_timer, the workers use the epoll timeout.
+ */
+
+static uint32_t wheel_now(struct mgcp_timer_wheel *wheel)
+{
+	return wheel->now() / MGCP_WHEEL_TICK_MS;
+}
+
+static void wheel_insert(struct mgcp_timer_wheel *wheel,
+			 struct mgcp_wheel_timer *timer)
+{
+	llist_add_tail(&timer->entry,
+		       &wheel->slots[timer->expires & (MGCP_WHEEL_SLOTS - 1)]);
+}
+
+static void main_wheel_cb(void *data)
+{
+	struct mgcp_timer_wheel *wheel = data;
+	int timeout;
+
+	mgcp_wheel_run(wheel);
+
+	timeout = mgcp_wheel_timeout(wheel);
+	if (timeout >= 0)
+		osmo_timer_schedule(&wheel->timer, 0, timeout * 1000);
+}
+
+void mgcp_wheel_init(struct mgcp_timer_wheel *wheel, int main_loop)
+{
+	int i;
+
+	memset(wheel, 0, sizeof(*wheel));
+	for (i = 0; i < MGCP_WHEEL_SLOTS; ++i)
+		INIT_LLIST_HEAD(&wheel->slots[i]);
+	wheel->now = get_current_ts;
+	wheel->tick = wheel_now(wheel);
+
+	wheel->main_loop = main_loop;
+	wheel->timer.cb = main_wheel_cb;
+	wheel->timer.data = wheel;
+}
+
+/* Only call it with nothing pending, the slots are kept as they are */
+void mgcp_wheel_set_clock(struct mgcp_timer_wheel *wheel, uint32_t (*now)(void))
+{
+	wheel->now = now;
+	wheel->tick = wheel_now(wheel);
+}
+
+/* Expire the timer at the absolute time at in ms of the wheel clock */
+void mgcp_wheel_add_at(struct mgcp_timer_wheel *wheel,
+		       struct mgcp_wheel_timer *timer, uint32_t at)
+{
+	uint32_t now = wheel_now(wheel);
+	int32_t ticks;
+
+	if (timer->pending)
+		mgcp_wheel_del(wheel, timer);
+
+	/* the wheel does not wrap, one turn is the maximum */
+	ticks = (at + MGCP_WHEEL_TICK_MS - 1) / MGCP_WHEEL_TICK_MS - now;
+	ticks = OSMO_MIN(OSMO_MAX(ticks, 1), MGCP_WHEEL_SLOTS - 1);
+
+	timer->expires = now + ticks;
+	timer->pending = 1;
+	wheel_insert(wheel, timer);
+	wheel->pending += 1;
+
+	if (wheel->main_loop && !osmo_timer_pending(&wheel->timer))
+		osmo_timer_schedule(&wheel->timer, 0,
+				    mgcp_wheel_timeout(wheel) * 1000);
+}
+
+void mgcp_wheel_del(struct mgcp_timer_wheel *wheel,
+		    struct mgcp_wheel_timer *timer)
+{
+	if (!timer->pending)
+		return;
+
+	llist_del(&timer->entry);
+	timer->pending = 0;
+	wheel->pending -= 1;
+}
+
+static void wheel_run_slot(struct mgcp_timer_wheel *wheel, uint32_t tick,
+			   uint32_t now)
+{
+	struct mgcp_wheel_timer *timer;
+	LLIST_HEAD(expired);
+
+	/* callbacks may add timers again, work on a private list */
+	llist_splice_init(&wheel->slots[tick & (MGCP_WHEEL_SLOTS - 1)], &expired);
+
+	while (!llist_empty(&expired)) {
+		timer = llist_entry(expired.next, struct mgcp_wheel_timer, entry);
+		llist_del(&timer->entry);
+
+		if ((int32_t) (timer->expires - now) > 0) {
+			wheel_insert(wheel, timer);
+			continue;
+		}
+
+		timer->pending = 0;
+		wheel->pending -= 1;
+		timer->cb(timer);
+	}
+}
+
+void mgcp_wheel_run(struct mgcp_timer_wheel *wheel)
+{
+	uint32_t now = wheel_now(wheel);
+	int i;
+
+	for (i = 0; i < MGCP_WHEEL_SLOTS && (int32_t) (now - wheel->tick) >= 0; ++i) {
+		wheel_run_slot(wheel, wheel->tick, now);
+		wheel->tick += 1;
+	}
+
+	/* we fell behind by more than a turn, all slots ran once */
+	if ((int32_t) (now - wheel->tick) >= 0)
+		wheel->tick = now + 1;
+}
+
+/* milli seconds until the next tick is due, -1 when nothing is pending */
+int mgcp_wheel_timeout(struct mgcp_timer_wheel *wheel)
+{
+	int32_t left;
+
+	if (!wheel->pending)
+		return -1;
+
+	left = wheel->tick * MGCP_WHEEL_TICK_MS - wheel->now();
+	return left > 0 ? left : 0;
+}
+
+/*
+ * Jitter buffer
+ *
+ * Packets are stored by sequence number and played out every
+ * MGCP_JB_PLAYOUT_MS. The playout time is kept as an absolute time and
+ * advanced by MGCP_JB_PLAYOUT_MS, a late wheel tick does not delay the
+ * following packets. Playout starts once the buffer holds the target
+ * depth, which follows twice the measured inter-arrival jitter up to
+ * the configured maximum. Packets arriving after their slot was
+ * played are dropped as late, an empty buffer at playout time is an
+ * underrun and the buffer fills up again before playing on. A packet
+ * too far ahead is an overrun, the oldest frames are dropped to make
+ * room for it.
+ */
+
+static struct mgcp_timer_wheel *jb_wheel(struct mgcp_jitter_buffer *jb)
+{
+	if (jb->endp->worker)
+		return &jb->endp->worker->wheel;
+	return jb->endp->cfg->jb_wheel;
+}
+
+/*
+ * Arm the timer for the next playout. When we are behind by more than
+ * the buffer holds, e.g. after the endpoint was paused, continue from
+ * now instead of playing out everything at once.
+ */
+static void jb_schedule(struct mgcp_jitter_buffer *jb)
+{
+	struct mgcp_timer_wheel *wheel = jb_wheel(jb);
+	uint32_t now = wheel->now();
+
+	if ((int32_t) (now - jb->next_playout) >
+				jb->max_depth * MGCP_JB_PLAYOUT_MS)
+		jb->next_playout = now;
+	mgcp_wheel_add_at(wheel, &jb->timer, jb->next_playout);
+}
+
+/* Skip the oldest slots until seq is less than max_depth ahead */
+static void jb_drop_oldest(struct mgcp_jitter_buffer *jb, uint16_t seq)
+{
+	while ((int16_t) (seq - jb->next_seq) >= jb->max_depth) {
+		struct mgcp_jb_packet *pkt;
+
+		pkt = &jb->pkts[jb->next_seq & (MGCP_JB_SLOTS - 1)];
+		if (pkt->len > 0 && pkt->seq == jb->next_seq) {
+			pkt->len = 0;
+			jb->count -= 1;
+			jb->end->jb_overruns += 1;
+		}
+
+		/* nothing older is left, continue with the new packet */
+		if (jb->count == 0) {
+			jb->next_seq = seq;
+			break;
+		}
+		jb->next_seq += 1;
+	}
+}
+
+static void jb_playout(struct mgcp_wheel_timer *timer)
+{
+	struct mgcp_jitter_buffer *jb = timer->data;
+	struct mgcp_rtp_end *end = jb->end;
+	struct mgcp_jb_packet *pkt;
+
+	if (!jb->playing) {
+		/* nothing arrived in time, go idle until the next packet */
+		if (jb->count == 0)
+			return;
+		if (jb->count < jb->target) {
+			jb->next_playout += MGCP_JB_PLAYOUT_MS;
+			jb_schedule(jb);
+			return;
+		}
+		jb->playing = 1;
+	}
+
+	if (jb->count == 0) {
+		end->jb_underruns += 1;
+		jb->playing = 0;
+		return;
+	}
+
+	pkt = &jb->pkts[jb->next_seq & (MGCP_JB_SLOTS - 1)];
+	if (pkt->len > 0 && pkt->seq == jb->next_seq) {
+		mgcp_rtp_end_playout(jb->endp, end, jb->tap, pkt->data, pkt->len);
+		pkt->len = 0;
+		jb->count -= 1;
+	}
+
+	jb->next_seq += 1;
+	jb->next_playout += MGCP_JB_PLAYOUT_MS;
+	jb_schedule(jb);
+}
+
+static void jb_update_target(struct mgcp_jitter_buffer *jb)
+{
+	uint32_t now = jb_wheel(jb)->now();
+	int32_t d;
+
+	if (jb->last_arrival) {
+		d = now - jb->last_arrival - MGCP_JB_PLAYOUT_MS;
+		if (d < 0)
+			d = -d;
+		/* RFC 3550 style estimate, kept in 1/16 ms */
+		jb->jitter += d - ((jb->jitter + 8) >> 4);
+	}
+	jb->last_arrival = now;
+
+	jb->target = 1 + ((jb->jitter >> 3) + MGCP_JB_PLAYOUT_MS - 1)
+				/ MGCP_JB_PLAYOUT_MS;
+	jb->target = OSMO_MIN(jb->target, jb->max_depth);
+}
+
+/*
+ * Take the packet into the buffer. Returns 0 when the packet was
+ * consumed and -1 when it should be sent directly.
+ */
+int mgcp_jb_put(struct mgcp_jitter_buffer *jb, char *buf, int len)
+{
+	struct mgcp_jb_packet *pkt;
+	uint16_t seq;
+	int16_t delta;
+
+	if (len < 12 || len > MGCP_JB_PKT_SIZE)
+		return -1;
+
+	seq = ((uint8_t) buf[2] << 8) | (uint8_t) buf[3];
+	jb_update_target(jb);
+
+	/* start over at the first packet after being idle */
+	if (jb->count == 0 && !jb->playing && !jb->timer.pending)
+		jb->next_seq = seq;
+
+	delta = seq - jb->next_seq;
+	if (delta < 0) {
+		jb->end->jb_late += 1;
+		return 0;
+	}
+
+	if (delta >= jb->max_depth) {
+		LOGP_RTP(LOGL_DEBUG,
+			 "Jitter buffer of 0x%x overrun from %u to %u\n",
+			 ENDPOINT_NUMBER(jb->endp), jb->next_seq, seq);
+		jb_drop_oldest(jb, seq);
+	}
+
+	pkt = &jb->pkts[seq & (MGCP_JB_SLOTS - 1)];
+	if (pkt->len > 0 && pkt->seq == seq)
+		return 0;
+
+	memcpy(pkt->data, buf, len);
+	pkt->len = len;
+	pkt->seq = seq;
+	jb->count += 1;
+
+	if (!jb->timer.pending) {
+		jb->next_playout = jb->last_arrival + MGCP_JB_PLAYOUT_MS;
+		jb_schedule(jb);
+	}
+	return 0;
+}
+
+/* Called with the endpoint paused or owned by the main loop */
+void mgcp_jb_config(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end)
+{
+	struct mgcp_trunk_config *tcfg = endp->tcfg;
+	struct mgcp_config *cfg = endp->cfg;
+	struct mgcp_jitter_buffer *jb;
+
+	if (!tcfg->jitter_buffer_ms) {
+		mgcp_jb_free(end);
+		return;
+	}
+
+	if (!cfg->jb_wheel) {
+		cfg->jb_wheel = talloc_zero(cfg, struct mgcp_timer_wheel);
+		if (!cfg->jb_wheel)
+			return;
+		mgcp_wheel_init(cfg->jb_wheel, 1);
+	}
+
+	jb = end->jb;
+	if (!jb) {
+		jb = talloc_zero(tcfg->endpoints, struct mgcp_jitter_buffer);
+		if (!jb) {
+			LOGP(DMGCP, LOGL_ERROR,
+			     "Failed to allocate the jitter buffer on 0x%x\n",
+			     ENDPOINT_NUMBER(endp));
+			return;
+		}
+		jb->timer.cb = jb_playout;
+		jb->timer.data = jb;
+		end->jb = jb;
+	}
+
+	jb->endp = endp;
+	jb->end = end;
+	jb->tap = end == &endp->net_end ?
+			&endp->taps[MGCP_TAP_NET_OUT] : &endp->taps[MGCP_TAP_BTS_OUT];
+	jb->max_depth = tcfg->jitter_buffer_ms / MGCP_JB_PLAYOUT_MS;
+	jb->max_depth = OSMO_MIN(OSMO_MAX(jb->max_depth, 1), MGCP_JB_SLOTS);
+	jb->target = OSMO_MIN(jb->target, jb->max_depth);
+}
+
+void mgcp_jb_free(struct mgcp_rtp_end *end)
+{
+	struct mgcp_jitter_buffer *jb = end->jb;
+
+	if (!jb)
+		return;
+
+	/* the worker took it off its wheel when pausing */
+	if (jb->timer.pending)
+		mgcp_wheel_del(jb_wheel(jb), &jb->timer);
+	talloc_free(jb);
+	end->jb = NULL;
+}
+
+/* The owner of the endpoint stops or resumes the playout */
+void mgcp_jb_detach(struct mgcp_rtp_end *end)
+{
+	if (end->jb && end->jb->timer.pending)
+		mgcp_wheel_del(jb_wheel(end->jb), &end->jb->timer);
+}
+
+void mgcp_jb_attach(struct mgcp_rtp_end *end)
+{
+	if (end->jb && end->jb->count > 0 && !end->jb->timer.pending)
+		jb_schedule(end->jb);
+}
@@ -21,6 +21,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -31,6 +32,9 @@
 
 #include <osmocom/core/msgb.h>
 #include <osmocom/core/select.h>
+#include <osmocom/core/talloc.h>
+
+#include "bscconfig.h"
 
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
@@ -91,6 +95,46 @@ enum {
 
 #define MGCP_DUMMY_LOAD 0x23
 
+#define RTP_BUF_SIZE		4096
+#define RTP_HDR_LEN		sizeof(struct rtp_hdr)
+/* the peer and up to two taps per received datagram */
+#define RTP_TX_MAX		(3 * MGCP_RTP_BATCH_MAX)
+
+/**
+ * Receive buffers and send queue. Datagrams are read with one
+ * recvmmsg(), patched in place and the ones that need to be forwarded
+ * are queued as tx entries pointing into the rx buffers. All queued
+ * datagrams share the same socket and leave with one sendmmsg().
+ */
+struct mgcp_rtp_batch {
+	int rx_len[MGCP_RTP_BATCH_MAX];
+	struct sockaddr_in rx_addr[MGCP_RTP_BATCH_MAX];
+	struct iovec rx_iov[MGCP_RTP_BATCH_MAX];
+	struct mmsghdr rx_msgs[MGCP_RTP_BATCH_MAX];
+	char rx_buf[MGCP_RTP_BATCH_MAX][RTP_BUF_SIZE];
+
+	int tx_fd;
+	struct mgcp_rtp_end *tx_end;
+	unsigned int tx_count;
+	struct sockaddr_in tx_addr[RTP_TX_MAX];
+	struct iovec tx_iov[RTP_TX_MAX][2];
+	char tx_hdr[RTP_TX_MAX][RTP_HDR_LEN];
+	struct mmsghdr tx_msgs[RTP_TX_MAX];
+
+	/* incoming tap waiting for the first output of the packet */
+	struct mgcp_rtp_tap *tap_in;
+	int tap_in_fd;
+	char *tap_in_buf;
+	int tap_in_len;
+	char tap_in_hdr[RTP_HDR_LEN];
+
+	/* set while a socket is drained into this batch */
+	int active;
+};
+
+typedef int (*rtp_handler)(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+			   struct sockaddr_in *addr, char *buf, int len);
+
 
 /**
  * This does not need to be a precision timestamp and
@@ -104,7 +148,7 @@ uint32_t get_current_ts(void)
 
 	memset(&tp, 0, sizeof(tp));
 	if (clock_gettime(CLOCK_MONOTONIC, &tp) != 0)
-		LOGP(DMGCP, LOGL_NOTICE,
+		LOGP_RTP(LOGL_NOTICE,
 			"Getting the clock failed.\n");
 
 	/* convert it to useconds */
@@ -166,17 +210,17 @@ static int check_rtp_timestamp(struct mgcp_endpoint *endp,
 	if (seq == sstate->last_seq) {
 		if (timestamp != sstate->last_timestamp) {
 			sstate->err_ts_counter += 1;
-			LOGP(DMGCP, LOGL_ERROR,
-			     "The %s timestamp delta is != 0 but the sequence "
-			     "number %d is the same, "
-			     "TS offset: %d, SeqNo offset: %d "
-			     "on 0x%x SSRC: %u timestamp: %u "
-			     "from %s:%d in %d\n",
-			     text, seq,
-			     state->timestamp_offset, state->seq_offset,
-			     ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(LOGL_ERROR,
+				 "The %s timestamp delta is != 0 but the sequence "
+				 "number %d is the same, "
+				 "TS offset: %d, SeqNo offset: %d "
+				 "on 0x%x SSRC: %u timestamp: %u "
+				 "from %s:%d in %d\n",
+				 text, seq,
+				 state->timestamp_offset, state->seq_offset,
+				 ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
+				 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+				 endp->conn_mode);
 		}
 		return 0;
 	}
@@ -187,27 +231,27 @@ static int check_rtp_timestamp(struct mgcp_endpoint *endp,
 
 	if (tsdelta == 0) {
 		/* Don't update *tsdelta_out */
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "The %s timestamp delta is %d "
-		     "on 0x%x SSRC: %u timestamp: %u "
-		     "from %s:%d in %d\n",
-		     text, tsdelta,
-		     ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
-		     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-		     endp->conn_mode);
+		LOGP_RTP(LOGL_NOTICE,
+			 "The %s timestamp delta is %d "
+			 "on 0x%x SSRC: %u timestamp: %u "
+			 "from %s:%d in %d\n",
+			 text, tsdelta,
+			 ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
+			 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			 endp->conn_mode);
 
 		return 0;
 	}
 
 	if (sstate->last_tsdelta != tsdelta) {
 		if (sstate->last_tsdelta) {
-			LOGP(DMGCP, LOGL_INFO,
-			     "The %s timestamp delta changes from %d to %d "
-			     "on 0x%x SSRC: %u timestamp: %u from %s:%d in %d\n",
-			     text, sstate->last_tsdelta, tsdelta,
-			     ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(LOGL_INFO,
+				 "The %s timestamp delta changes from %d to %d "
+				 "on 0x%x SSRC: %u timestamp: %u from %s:%d in %d\n",
+				 text, sstate->last_tsdelta, tsdelta,
+				 ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
+				 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+				 endp->conn_mode);
 		}
 	}
 
@@ -220,18 +264,18 @@ static int check_rtp_timestamp(struct mgcp_endpoint *endp,
 
 	if (timestamp_error) {
 		sstate->err_ts_counter += 1;
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "The %s timestamp has an alignment error of %d "
-		     "on 0x%x SSRC: %u "
-		     "SeqNo delta: %d, TS delta: %d, dTS/dSeq: %d "
-		     "from %s:%d in %d\n",
-		     text, timestamp_error,
-		     ENDPOINT_NUMBER(endp), sstate->ssrc,
-		     (int16_t)(seq - sstate->last_seq),
-		     (int32_t)(timestamp - sstate->last_timestamp),
-		     tsdelta,
-		     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-		     endp->conn_mode);
+		LOGP_RTP(LOGL_NOTICE,
+			 "The %s timestamp has an alignment error of %d "
+			 "on 0x%x SSRC: %u "
+			 "SeqNo delta: %d, TS delta: %d, dTS/dSeq: %d "
+			 "from %s:%d in %d\n",
+			 text, timestamp_error,
+			 ENDPOINT_NUMBER(endp), sstate->ssrc,
+			 (int16_t)(seq - sstate->last_seq),
+			 (int32_t)(timestamp - sstate->last_timestamp),
+			 tsdelta,
+			 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			 endp->conn_mode);
 	}
 	return 1;
 }
@@ -249,23 +293,23 @@ static int adjust_rtp_timestamp_offset(struct mgcp_endpoint *endp,
 	if (tsdelta == 0) {
 		tsdelta = state->out_stream.last_tsdelta;
 		if (tsdelta != 0) {
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "A fixed packet duration is not available on 0x%x, "
-			     "using last output timestamp delta instead: %d "
-			     "from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), tsdelta,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(LOGL_NOTICE,
+				 "A fixed packet duration is not available on 0x%x, "
+				 "using last output timestamp delta instead: %d "
+				 "from %s:%d in %d\n",
+				 ENDPOINT_NUMBER(endp), tsdelta,
+				 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+				 endp->conn_mode);
 		} else {
 			tsdelta = rtp_end->rate * 20 / 1000;
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "Fixed packet duration and last timestamp delta "
-			     "are not available on 0x%x, "
-			     "using fixed 20ms instead: %d "
-			     "from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), tsdelta,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(LOGL_NOTICE,
+				 "Fixed packet duration and last timestamp delta "
+				 "are not available on 0x%x, "
+				 "using fixed 20ms instead: %d "
+				 "from %s:%d in %d\n",
+				 ENDPOINT_NUMBER(endp), tsdelta,
+				 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+				 endp->conn_mode);
 		}
 	}
 
@@ -276,14 +320,14 @@ static int adjust_rtp_timestamp_offset(struct mgcp_endpoint *endp,
 	if (state->timestamp_offset != timestamp_offset) {
 		state->timestamp_offset = timestamp_offset;
 
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "Timestamp offset change on 0x%x SSRC: %u "
-		     "SeqNo delta: %d, TS offset: %d, "
-		     "from %s:%d in %d\n",
-		     ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
-		     delta_seq, state->timestamp_offset,
-		     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-		     endp->conn_mode);
+		LOGP_RTP(LOGL_NOTICE,
+			 "Timestamp offset change on 0x%x SSRC: %u "
+			 "SeqNo delta: %d, TS offset: %d, "
+			 "from %s:%d in %d\n",
+			 ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
+			 delta_seq, state->timestamp_offset,
+			 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			 endp->conn_mode);
 	}
 
 	return timestamp_offset;
@@ -308,14 +352,14 @@ static int align_rtp_timestamp_offset(struct mgcp_endpoint *endp,
 	if (timestamp_error) {
 		state->timestamp_offset += ptime - timestamp_error;
 
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "Corrected timestamp alignment error of %d on 0x%x SSRC: %u "
-		     "new TS offset: %d, "
-		     "from %s:%d in %d\n",
-		     timestamp_error,
-		     ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
-		     state->timestamp_offset, inet_ntoa(addr->sin_addr),
-		     ntohs(addr->sin_port), endp->conn_mode);
+		LOGP_RTP(LOGL_NOTICE,
+			 "Corrected timestamp alignment error of %d on 0x%x SSRC: %u "
+			 "new TS offset: %d, "
+			 "from %s:%d in %d\n",
+			 timestamp_error,
+			 ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
+			 state->timestamp_offset, mgcp_inet_ntoa(addr->sin_addr),
+			 ntohs(addr->sin_port), endp->conn_mode);
 	}
 
 	OSMO_ASSERT(compute_timestamp_aligment_error(&state->out_stream, ptime,
@@ -365,29 +409,29 @@ void mgcp_patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *sta
 		state->out_stream = state->in_stream;
 		state->out_stream.last_timestamp = timestamp;
 		state->out_stream.ssrc = ssrc - 1; /* force output SSRC change */
-		LOGP(DMGCP, LOGL_INFO,
+		LOGP_RTP(LOGL_INFO,
 			"Initializing stream on 0x%x SSRC: %u timestamp: %u "
 			"pkt-duration: %d, from %s:%d in %d\n",
 			ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
 			state->seq_offset, state->packet_duration,
-			inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
 			endp->conn_mode);
 		if (state->packet_duration == 0) {
 			state->packet_duration = rtp_end->rate * 20 / 1000;
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "Fixed packet duration is not available on 0x%x, "
-			     "using fixed 20ms instead: %d from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), state->packet_duration,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(LOGL_NOTICE,
+				 "Fixed packet duration is not available on 0x%x, "
+				 "using fixed 20ms instead: %d from %s:%d in %d\n",
+				 ENDPOINT_NUMBER(endp), state->packet_duration,
+				 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+				 endp->conn_mode);
 		}
 	} else if (state->in_stream.ssrc != ssrc) {
-		LOGP(DMGCP, LOGL_NOTICE,
+		LOGP_RTP(LOGL_NOTICE,
 			"The SSRC changed on 0x%x: %u -> %u  "
 			"from %s:%d in %d\n",
 			ENDPOINT_NUMBER(endp),
 			state->in_stream.ssrc, rtp_hdr->ssrc,
-			inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
 			endp->conn_mode);
 
 		state->in_stream.ssrc = ssrc;
@@ -405,14 +449,14 @@ void mgcp_patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *sta
 			if (rtp_end->force_constant_ssrc != -1)
 				rtp_end->force_constant_ssrc -= 1;
 
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "SSRC patching enabled on 0x%x SSRC: %u "
-			     "SeqNo offset: %d, TS offset: %d "
-			     "from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
-			     state->seq_offset, state->timestamp_offset,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(LOGL_NOTICE,
+				 "SSRC patching enabled on 0x%x SSRC: %u "
+				 "SeqNo offset: %d, TS offset: %d "
+				 "from %s:%d in %d\n",
+				 ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
+				 state->seq_offset, state->timestamp_offset,
+				 mgcp_inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+				 endp->conn_mode);
 		}
 
 		state->in_stream.last_tsdelta = 0;
@@ -465,7 +509,7 @@ void mgcp_patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *sta
 		if (seq < state->out_stream.last_seq)
 			state->cycles += RTP_SEQ_MOD;
 	} else if (udelta <= RTP_SEQ_MOD - RTP_MAX_MISORDER) {
-		LOGP(DMGCP, LOGL_NOTICE,
+		LOGP_RTP(LOGL_NOTICE,
 			"RTP seqno made a very large jump on 0x%x delta: %u\n",
 			ENDPOINT_NUMBER(endp), udelta);
 	}
@@ -506,33 +550,210 @@ static int forward_data(int fd, struct mgcp_rtp_tap *tap, const char *buf, int l
 		      (struct sockaddr *)&tap->forward, sizeof(tap->forward));
 }
 
-static int mgcp_send_transcoder(struct mgcp_rtp_end *end,
-				struct mgcp_config *cfg, int is_rtp,
-				const char *buf, int len)
+static void batch_flush(struct mgcp_rtp_batch *batch)
 {
-	int rc;
-	int port;
+	int rc, i;
+
+	for (i = 0; i < batch->tx_count; i += rc) {
+		batch->tx_end->syscalls += 1;
+#ifdef HAVE_SENDMMSG
+		rc = sendmmsg(batch->tx_fd, &batch->tx_msgs[i],
+			      batch->tx_count - i, 0);
+#else
+		rc = sendmsg(batch->tx_fd, &batch->tx_msgs[i].msg_hdr, 0);
+		rc = rc < 0 ? rc : 1;
+#endif
+		if (rc <= 0) {
+			LOGP_RTP(LOGL_ERROR,
+				 "Failed to send batched RTP to %s:%d: %d\n",
+				 mgcp_inet_ntoa(batch->tx_addr[i].sin_addr),
+				 ntohs(batch->tx_addr[i].sin_port), errno);
+			/* skip the datagram that failed */
+			rc = 1;
+		}
+	}
+
+	batch->tx_count = 0;
+	batch->tx_fd = -1;
+	batch->tx_end = NULL;
+}
+
+/*
+ * Queue buf for sending on fd. With a hdr the first bytes are taken
+ * from it instead of buf, the rest of the datagram is not copied.
+ */
+static int batch_queue(struct mgcp_rtp_batch *batch, struct mgcp_rtp_end *end,
+		       int fd, const struct sockaddr_in *addr,
+		       const char *hdr, char *buf, int len)
+{
+	struct mmsghdr *msg;
+	struct iovec *iov;
+	int i, hdr_len = 0;
+
+	if (batch->tx_count > 0 && batch->tx_fd != fd)
+		batch_flush(batch);
+	if (batch->tx_count == ARRAY_SIZE(batch->tx_msgs))
+		batch_flush(batch);
+
+	i = batch->tx_count++;
+	batch->tx_fd = fd;
+	batch->tx_end = end;
+	batch->tx_addr[i] = *addr;
+
+	iov = batch->tx_iov[i];
+	if (hdr) {
+		hdr_len = OSMO_MIN(len, RTP_HDR_LEN);
+		memcpy(batch->tx_hdr[i], hdr, hdr_len);
+		iov->iov_base = batch->tx_hdr[i];
+		iov->iov_len = hdr_len;
+		iov += 1;
+	}
+	iov->iov_base = buf + hdr_len;
+	iov->iov_len = len - hdr_len;
+
+	msg = &batch->tx_msgs[i];
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_hdr.msg_name = &batch->tx_addr[i];
+	msg->msg_hdr.msg_namelen = sizeof(batch->tx_addr[i]);
+	msg->msg_hdr.msg_iov = batch->tx_iov[i];
+	msg->msg_hdr.msg_iovlen = hdr ? 2 : 1;
+	return len;
+}
+
+struct mgcp_rtp_batch *mgcp_rtp_batch_alloc(void *ctx)
+{
+	struct mgcp_rtp_batch *batch;
+
+	batch = talloc_zero(ctx, struct mgcp_rtp_batch);
+	if (!batch)
+		LOGP(DMGCP, LOGL_ERROR, "Failed to allocate the RTP batch.\n");
+	return batch;
+}
+
+/* Each worker has its own batch, the main loop uses the one of the config */
+static struct mgcp_rtp_batch *endp_batch(struct mgcp_endpoint *endp)
+{
+	struct mgcp_config *cfg = endp->cfg;
+
+	if (endp->worker)
+		return endp->worker->batch;
+
+	if (!cfg->rtp_batch_buf)
+		cfg->rtp_batch_buf = mgcp_rtp_batch_alloc(cfg);
+	return cfg->rtp_batch_buf;
+}
+
+/*
+ * The incoming tap needs the packet before it is patched. Keep a copy
+ * of the RTP header and send it together with the first output of the
+ * packet, so both share the sendmmsg() of the peer.
+ */
+static void tap_in(struct mgcp_endpoint *endp, int fd,
+		   struct mgcp_rtp_tap *tap, char *buf, int len)
+{
+	struct mgcp_rtp_batch *batch = endp_batch(endp);
+
+	if (!tap->enabled)
+		return;
+
+	if (!batch || !batch->active) {
+		forward_data(fd, tap, buf, len);
+		return;
+	}
+
+	batch->tap_in = tap;
+	batch->tap_in_fd = fd;
+	batch->tap_in_buf = buf;
+	batch->tap_in_len = len;
+	memcpy(batch->tap_in_hdr, buf, OSMO_MIN(len, RTP_HDR_LEN));
+}
+
+static void batch_queue_tap_in(struct mgcp_rtp_batch *batch,
+			       struct mgcp_rtp_end *end, int fd)
+{
+	struct mgcp_rtp_tap *tap = batch->tap_in;
+
+	if (!tap)
+		return;
+
+	batch->tap_in = NULL;
+	batch_queue(batch, end, fd, &tap->forward, batch->tap_in_hdr,
+		    batch->tap_in_buf, batch->tap_in_len);
+}
+
+static void tap_out(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
+		    struct mgcp_rtp_tap *tap, char *buf, int len)
+{
+	struct mgcp_rtp_batch *batch = endp_batch(endp);
+
+	if (!tap->enabled)
+		return;
+
+	if (!batch || !batch->active) {
+		forward_data(end->rtp.fd, tap, buf, len);
+		return;
+	}
+
+	batch_queue_tap_in(batch, end, end->rtp.fd);
+	batch_queue(batch, end, end->rtp.fd, &tap->forward, NULL, buf, len);
+}
+
+/* Send to the end directly or queue it when a batch is drained */
+static int rtp_send(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
+		    int fd, struct in_addr *ip, int port, char *buf, int len)
+{
+	struct mgcp_rtp_batch *batch = endp_batch(endp);
 	struct sockaddr_in addr;
 
-	port = is_rtp ? end->rtp_port : end->rtcp_port;
+	if (!batch || !batch->active) {
+		end->syscalls += 1;
+		return mgcp_udp_send(fd, ip, port, buf, len);
+	}
 
 	addr.sin_family = AF_INET;
-	addr.sin_addr = cfg->transcoder_in;
 	addr.sin_port = port;
+	addr.sin_addr = *ip;
+	batch_queue_tap_in(batch, end, fd);
+	return batch_queue(batch, end, fd, &addr, NULL, buf, len);
+}
 
-	rc = sendto(is_rtp ?
-		end->rtp.fd :
-		end->rtcp.fd, buf, len, 0,
-		(struct sockaddr *) &addr, sizeof(addr));
+static int mgcp_send_transcoder(struct mgcp_endpoint *endp,
+				struct mgcp_rtp_end *end,
+				struct mgcp_config *cfg, int is_rtp,
+				char *buf, int len)
+{
+	int rc;
+	int port;
+
+	port = is_rtp ? end->rtp_port : end->rtcp_port;
+
+	rc = rtp_send(endp, end, is_rtp ? end->rtp.fd : end->rtcp.fd,
+		      &cfg->transcoder_in, port, buf, len);
 
 	if (rc != len)
-		LOGP(DMGCP, LOGL_ERROR,
-			"Failed to send data to the transcoder: %s\n",
-			strerror(errno));
+		LOGP_RTP(LOGL_ERROR,
+			"Failed to send data to the transcoder: %d\n",
+			errno);
 
 	return rc;
 }
 
+static int rtp_relay(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
+		     int is_rtp, char *buf, int len)
+{
+	return rtp_send(endp, end, is_rtp ? end->rtp.fd : end->rtcp.fd,
+			&end->addr, is_rtp ? end->rtp_port : end->rtcp_port,
+			buf, len);
+}
+
+/* Send a packet played out by the jitter buffer of the end */
+void mgcp_rtp_end_playout(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
+			  struct mgcp_rtp_tap *tap, char *buf, int len)
+{
+	tap_out(endp, end, tap, buf, len);
+	rtp_relay(endp, end, 1, buf, len);
+}
+
 static int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
 		     struct sockaddr_in *addr, char *buf, int rc)
 {
@@ -550,92 +771,167 @@ static int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
 			mgcp_patch_and_count(endp, &endp->bts_state,
 					     &endp->net_end,
 					     addr, buf, rc);
-			forward_data(endp->net_end.rtp.fd,
-				     &endp->taps[MGCP_TAP_NET_OUT], buf, rc);
-			return mgcp_udp_send(endp->net_end.rtp.fd,
-					     &endp->net_end.addr,
-					     endp->net_end.rtp_port, buf, rc);
+			if (endp->net_end.jb &&
+			    mgcp_jb_put(endp->net_end.jb, buf, rc) == 0)
+				return rc;
+			tap_out(endp, &endp->net_end,
+				&endp->taps[MGCP_TAP_NET_OUT], buf, rc);
+			return rtp_relay(endp, &endp->net_end, 1, buf, rc);
 		} else if (!tcfg->omit_rtcp) {
-			return mgcp_udp_send(endp->net_end.rtcp.fd,
-					     &endp->net_end.addr,
-					     endp->net_end.rtcp_port, buf, rc);
+			return rtp_relay(endp, &endp->net_end, 0, buf, rc);
 		}
 	} else {
 		if (is_rtp) {
 			mgcp_patch_and_count(endp, &endp->net_state,
 					     &endp->bts_end,
 					     addr, buf, rc);
-			forward_data(endp->bts_end.rtp.fd,
-				     &endp->taps[MGCP_TAP_BTS_OUT], buf, rc);
-			return mgcp_udp_send(endp->bts_end.rtp.fd,
-					     &endp->bts_end.addr,
-					     endp->bts_end.rtp_port, buf, rc);
+			if (endp->bts_end.jb &&
+			    mgcp_jb_put(endp->bts_end.jb, buf, rc) == 0)
+				return rc;
+			tap_out(endp, &endp->bts_end,
+				&endp->taps[MGCP_TAP_BTS_OUT], buf, rc);
+			return rtp_relay(endp, &endp->bts_end, 1, buf, rc);
 		} else if (!tcfg->omit_rtcp) {
-			return mgcp_udp_send(endp->bts_end.rtcp.fd,
-					     &endp->bts_end.addr,
-					     endp->bts_end.rtcp_port, buf, rc);
+			return rtp_relay(endp, &endp->bts_end, 0, buf, rc);
 		}
 	}
 
 	return 0;
 }
 
-static int receive_from(struct mgcp_endpoint *endp, int fd, struct sockaddr_in *addr,
-			char *buf, int bufsize)
+/* Run the handler and send the incoming tap if nothing was forwarded */
+static int batch_dispatch(struct mgcp_rtp_batch *batch, struct mgcp_rtp_end *end,
+			  rtp_handler handler, struct mgcp_endpoint *endp,
+			  struct osmo_fd *fd, struct sockaddr_in *addr,
+			  char *buf, int len)
 {
 	int rc;
-	socklen_t slen = sizeof(*addr);
 
-	rc = recvfrom(fd, buf, bufsize, 0,
-			    (struct sockaddr *) addr, &slen);
-	if (rc < 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to receive message on: 0x%x errno: %d/%s\n",
-			ENDPOINT_NUMBER(endp), errno, strerror(errno));
+	rc = handler(endp, fd, addr, buf, len);
+	batch_queue_tap_in(batch, end, fd->fd);
+	return rc;
+}
+
+static int batch_receive(struct mgcp_rtp_batch *batch, struct mgcp_rtp_end *end,
+			 int fd, int max)
+{
+	int i, rc;
+
+#ifdef HAVE_RECVMMSG
+	for (i = 0; i < max; ++i) {
+		struct mmsghdr *msg = &batch->rx_msgs[i];
+
+		batch->rx_iov[i].iov_base = batch->rx_buf[i];
+		batch->rx_iov[i].iov_len = sizeof(batch->rx_buf[i]);
+
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_hdr.msg_name = &batch->rx_addr[i];
+		msg->msg_hdr.msg_namelen = sizeof(batch->rx_addr[i]);
+		msg->msg_hdr.msg_iov = &batch->rx_iov[i];
+		msg->msg_hdr.msg_iovlen = 1;
+	}
+
+	end->syscalls += 1;
+	rc = recvmmsg(fd, batch->rx_msgs, max, MSG_DONTWAIT, NULL);
+	for (i = 0; i < rc; ++i)
+		batch->rx_len[i] = batch->rx_msgs[i].msg_len;
+	return rc;
+#else
+	for (i = 0; i < max; ++i) {
+		socklen_t slen = sizeof(batch->rx_addr[i]);
+
+		end->syscalls += 1;
+		rc = recvfrom(fd, batch->rx_buf[i], sizeof(batch->rx_buf[i]),
+			      MSG_DONTWAIT, (struct sockaddr *) &batch->rx_addr[i],
+			      &slen);
+		if (rc < 0)
+			break;
+		batch->rx_len[i] = rc;
+	}
+	return i > 0 ? i : rc;
+#endif
+}
+
+/*
+ * Drain up to cfg->rtp_batch datagrams from the socket into the
+ * buffers of the batch and run them through the handler. The packets
+ * are patched in place and everything forwarded to the peer and the
+ * taps is flushed with as few sendmmsg() calls as possible before we
+ * return. Nothing is allocated or copied per packet.
+ */
+static int rtp_read(struct osmo_fd *fd, struct mgcp_rtp_end *end,
+		    rtp_handler handler)
+{
+	struct mgcp_endpoint *endp = (struct mgcp_endpoint *) fd->data;
+	struct mgcp_config *cfg = endp->cfg;
+	struct mgcp_rtp_batch *batch;
+	int i, num;
+
+	batch = endp_batch(endp);
+	if (!batch)
+		return -1;
+
+	num = batch_receive(batch, end, fd->fd,
+			    OSMO_MIN(OSMO_MAX(cfg->rtp_batch, 1),
+				     MGCP_RTP_BATCH_MAX));
+	if (num < 0) {
+		LOGP_RTP(LOGL_ERROR, "Failed to receive message on: 0x%x errno: %d\n",
+			ENDPOINT_NUMBER(endp), errno);
 		return -1;
 	}
 
+	if (endp->worker)
+		__atomic_store_n(&endp->worker->packets,
+				 endp->worker->packets + num, __ATOMIC_RELAXED);
+
 	/* do not forward aynthing... maybe there is a packet from the bts */
 	if (!endp->allocated)
 		return -1;
 
 	#warning "Slight spec violation. With connection mode recvonly we should attempt to forward."
 
-	return rc;
+	batch->tx_count = 0;
+	batch->tx_fd = -1;
+	batch->active = 1;
+	for (i = 0; i < num; ++i) {
+		if (batch->rx_len[i] <= 0)
+			continue;
+		batch_dispatch(batch, end, handler, endp, fd, &batch->rx_addr[i],
+			       batch->rx_buf[i], batch->rx_len[i]);
+	}
+	batch_flush(batch);
+	batch->active = 0;
+
+	return 0;
 }
 
-static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
+static int rtp_handle_net(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+			  struct sockaddr_in *addr, char *buf, int rc)
 {
-	char buf[4096];
-	struct sockaddr_in addr;
-	struct mgcp_endpoint *endp;
-	int rc, proto;
+	int proto;
 
-	endp = (struct mgcp_endpoint *) fd->data;
-
-	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
-	if (rc <= 0)
-		return -1;
+	if (memcmp(&addr->sin_addr, &endp->net_end.addr, sizeof(addr->sin_addr)) != 0) {
+		char expected[INET_ADDRSTRLEN];
 
-	if (memcmp(&addr.sin_addr, &endp->net_end.addr, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
-			"Endpoint 0x%x data from wrong address %s vs. ",
-			ENDPOINT_NUMBER(endp), inet_ntoa(addr.sin_addr));
-		LOGPC(DMGCP, LOGL_ERROR,
-			"%s\n", inet_ntoa(endp->net_end.addr));
+		inet_ntop(AF_INET, &endp->net_end.addr, expected, sizeof(expected));
+		LOGP_RTP(LOGL_ERROR,
+			"Endpoint 0x%x data from wrong address %s vs. %s\n",
+			ENDPOINT_NUMBER(endp), mgcp_inet_ntoa(addr->sin_addr),
+			expected);
 		return -1;
 	}
 
-	if (endp->net_end.rtp_port != addr.sin_port &&
-	    endp->net_end.rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+	if (endp->net_end.rtp_port != addr->sin_port &&
+	    endp->net_end.rtcp_port != addr->sin_port) {
+		LOGP_RTP(LOGL_ERROR,
 			"Data from wrong source port %d on 0x%x\n",
-			ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
+			ntohs(addr->sin_port), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == MGCP_DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from network on 0x%x\n",
+		LOGP_RTP(LOGL_NOTICE, "Filtered dummy from network on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
 	}
@@ -644,22 +940,30 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 	endp->net_end.packets += 1;
 	endp->net_end.octets += rc;
 
-	forward_data(fd->fd, &endp->taps[MGCP_TAP_NET_IN], buf, rc);
+	tap_in(endp, fd->fd, &endp->taps[MGCP_TAP_NET_IN], buf, rc);
 
 	switch (endp->type) {
 	case MGCP_RTP_DEFAULT:
 		return mgcp_send(endp, MGCP_DEST_BTS, proto == MGCP_PROTO_RTP,
-				 &addr, buf, rc);
+				 addr, buf, rc);
 	case MGCP_RTP_TRANSCODED:
-		return mgcp_send_transcoder(&endp->trans_net, endp->cfg,
+		return mgcp_send_transcoder(endp, &endp->trans_net, endp->cfg,
 					    proto == MGCP_PROTO_RTP, buf, rc);
 	}
 
-	LOGP(DMGCP, LOGL_ERROR, "Bad MGCP type %u on endpoint %u\n",
-	     endp->type, ENDPOINT_NUMBER(endp));
+	LOGP_RTP(LOGL_ERROR, "Bad MGCP type %u on endpoint %u\n",
+		 endp->type, ENDPOINT_NUMBER(endp));
 	return 0;
 }
 
+static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
+{
+	struct mgcp_endpoint *endp;
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	return rtp_read(fd, &endp->net_end, rtp_handle_net);
+}
+
 static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_in *addr)
 {
 	struct mgcp_config *cfg = endp->cfg;
@@ -674,10 +978,10 @@ static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_
 			endp->bts_end.rtp_port = addr->sin_port;
 			endp->bts_end.addr = addr->sin_addr;
 
-			LOGP(DMGCP, LOGL_NOTICE,
+			LOGP_RTP(LOGL_NOTICE,
 				"Found BTS for endpoint: 0x%x on port: %d/%d of %s\n",
 				ENDPOINT_NUMBER(endp), ntohs(endp->bts_end.rtp_port),
-				ntohs(endp->bts_end.rtcp_port), inet_ntoa(addr->sin_addr));
+				ntohs(endp->bts_end.rtcp_port), mgcp_inet_ntoa(addr->sin_addr));
 		}
 	} else if (proto == MGCP_PROTO_RTCP && endp->bts_end.rtcp_port == 0) {
 		if (memcmp(&endp->bts_end.addr, &addr->sin_addr,
@@ -687,43 +991,35 @@ static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_
 	}
 }
 
-static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
+static int rtp_handle_bts(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+			  struct sockaddr_in *addr, char *buf, int rc)
 {
-	char buf[4096];
-	struct sockaddr_in addr;
-	struct mgcp_endpoint *endp;
-	int rc, proto;
-
-	endp = (struct mgcp_endpoint *) fd->data;
-
-	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
-	if (rc <= 0)
-		return -1;
+	int proto;
 
 	proto = fd == &endp->bts_end.rtp ? MGCP_PROTO_RTP : MGCP_PROTO_RTCP;
 
 	/* We have no idea who called us, maybe it is the BTS. */
 	/* it was the BTS... */
-	discover_bts(endp, proto, &addr);
+	discover_bts(endp, proto, addr);
 
-	if (memcmp(&endp->bts_end.addr, &addr.sin_addr, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+	if (memcmp(&endp->bts_end.addr, &addr->sin_addr, sizeof(addr->sin_addr)) != 0) {
+		LOGP_RTP(LOGL_ERROR,
 			"Data from wrong bts %s on 0x%x\n",
-			inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(endp));
+			mgcp_inet_ntoa(addr->sin_addr), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
-	if (endp->bts_end.rtp_port != addr.sin_port &&
-	    endp->bts_end.rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+	if (endp->bts_end.rtp_port != addr->sin_port &&
+	    endp->bts_end.rtcp_port != addr->sin_port) {
+		LOGP_RTP(LOGL_ERROR,
 			"Data from wrong bts source port %d on 0x%x\n",
-			ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
+			ntohs(addr->sin_port), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == MGCP_DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from bts on 0x%x\n",
+		LOGP_RTP(LOGL_NOTICE, "Filtered dummy from bts on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
 	}
@@ -732,61 +1028,78 @@ static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
 	endp->bts_end.packets += 1;
 	endp->bts_end.octets += rc;
 
-	forward_data(fd->fd, &endp->taps[MGCP_TAP_BTS_IN], buf, rc);
+	tap_in(endp, fd->fd, &endp->taps[MGCP_TAP_BTS_IN], buf, rc);
 
 	switch (endp->type) {
 	case MGCP_RTP_DEFAULT:
 		return mgcp_send(endp, MGCP_DEST_NET, proto == MGCP_PROTO_RTP,
-				 &addr, buf, rc);
+				 addr, buf, rc);
 	case MGCP_RTP_TRANSCODED:
-		return mgcp_send_transcoder(&endp->trans_bts, endp->cfg,
+		return mgcp_send_transcoder(endp, &endp->trans_bts, endp->cfg,
 					    proto == MGCP_PROTO_RTP, buf, rc);
 	}
 
-	LOGP(DMGCP, LOGL_ERROR, "Bad MGCP type %u on endpoint %u\n",
-	     endp->type, ENDPOINT_NUMBER(endp));
+	LOGP_RTP(LOGL_ERROR, "Bad MGCP type %u on endpoint %u\n",
+		 endp->type, ENDPOINT_NUMBER(endp));
 	return 0;
 }
 
+static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
+{
+	struct mgcp_endpoint *endp;
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	return rtp_read(fd, &endp->bts_end, rtp_handle_bts);
+}
+
 static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_endp,
-			      int dest, struct osmo_fd *fd)
+			      int dest, struct osmo_fd *fd,
+			      struct sockaddr_in *addr, char *buf, int rc)
 {
-	char buf[4096];
-	struct sockaddr_in addr;
 	struct mgcp_config *cfg;
-	int rc, proto;
+	int proto;
 
 	cfg = _endp->cfg;
-	rc = receive_from(_endp, fd->fd, &addr, buf, sizeof(buf));
-	if (rc <= 0)
-		return -1;
-
 	proto = fd == &end->rtp ? MGCP_PROTO_RTP : MGCP_PROTO_RTCP;
 
-	if (memcmp(&addr.sin_addr, &cfg->transcoder_in, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+	if (memcmp(&addr->sin_addr, &cfg->transcoder_in, sizeof(addr->sin_addr)) != 0) {
+		LOGP_RTP(LOGL_ERROR,
 			"Data not coming from transcoder dest: %d %s on 0x%x\n",
-			dest, inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(_endp));
+			dest, mgcp_inet_ntoa(addr->sin_addr), ENDPOINT_NUMBER(_endp));
 		return -1;
 	}
 
-	if (end->rtp_port != addr.sin_port &&
-	    end->rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+	if (end->rtp_port != addr->sin_port &&
+	    end->rtcp_port != addr->sin_port) {
+		LOGP_RTP(LOGL_ERROR,
 			"Data from wrong transcoder dest %d source port %d on 0x%x\n",
-			dest, ntohs(addr.sin_port), ENDPOINT_NUMBER(_endp));
+			dest, ntohs(addr->sin_port), ENDPOINT_NUMBER(_endp));
 		return -1;
 	}
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == MGCP_DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from transcoder dest %d on 0x%x\n",
+		LOGP_RTP(LOGL_NOTICE, "Filtered dummy from transcoder dest %d on 0x%x\n",
 			dest, ENDPOINT_NUMBER(_endp));
 		return 0;
 	}
 
 	end->packets += 1;
-	return mgcp_send(_endp, dest, proto == MGCP_PROTO_RTP, &addr, buf, rc);
+	return mgcp_send(_endp, dest, proto == MGCP_PROTO_RTP, addr, buf, rc);
+}
+
+static int rtp_handle_trans_net(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+				struct sockaddr_in *addr, char *buf, int rc)
+{
+	return rtp_data_transcoder(&endp->trans_net, endp, MGCP_DEST_NET, fd,
+				   addr, buf, rc);
+}
+
+static int rtp_handle_trans_bts(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+				struct sockaddr_in *addr, char *buf, int rc)
+{
+	return rtp_data_transcoder(&endp->trans_bts, endp, MGCP_DEST_BTS, fd,
+				   addr, buf, rc);
 }
 
 static int rtp_data_trans_net(struct osmo_fd *fd, unsigned int what)
@@ -794,7 +1107,7 @@ static int rtp_data_trans_net(struct osmo_fd *fd, unsigned int what)
 	struct mgcp_endpoint *endp;
 	endp = (struct mgcp_endpoint *) fd->data;
 
-	return rtp_data_transcoder(&endp->trans_net, endp, MGCP_DEST_NET, fd);
+	return rtp_read(fd, &endp->trans_net, rtp_handle_trans_net);
 }
 
 static int rtp_data_trans_bts(struct osmo_fd *fd, unsigned int what)
@@ -802,7 +1115,7 @@ static int rtp_data_trans_bts(struct osmo_fd *fd, unsigned int what)
 	struct mgcp_endpoint *endp;
 	endp = (struct mgcp_endpoint *) fd->data;
 
-	return rtp_data_transcoder(&endp->trans_bts, endp, MGCP_DEST_BTS, fd);
+	return rtp_read(fd, &endp->trans_bts, rtp_handle_trans_bts);
 }
 
 static int mgcp_create_bind(const char *source_addr, struct osmo_fd *fd,
@@ -840,6 +1153,308 @@ static int set_ip_tos(int fd, int tos)
 	return ret != 0;
 }
 
+static int demux_socket(struct mgcp_rtp_demux *demux, struct osmo_fd *fd)
+{
+	struct mgcp_config *cfg = demux->cfg;
+	struct sockaddr_in addr;
+	int on = 1;
+
+	fd->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd->fd < 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create UDP port.\n");
+		return -1;
+	}
+
+	setsockopt(fd->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	if (setsockopt(fd->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+		LOGP(DMGCP, LOGL_ERROR, "Failed to set SO_REUSEPORT: %s\n",
+		     strerror(errno));
+#endif
+#ifdef IP_TRANSPARENT
+	if (setsockopt(fd->fd, SOL_IP, IP_TRANSPARENT, &on, sizeof(on)) != 0)
+		LOGP(DMGCP, LOGL_ERROR,
+		     "Failed to set IP_TRANSPARENT, only port %d will be received: %s\n",
+		     demux->port, strerror(errno));
+#endif
+#ifdef IP_RECVORIGDSTADDR
+	setsockopt(fd->fd, SOL_IP, IP_RECVORIGDSTADDR, &on, sizeof(on));
+#endif
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(demux->port);
+	inet_aton(cfg->source_addr, &addr.sin_addr);
+
+	if (bind(fd->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to bind demux port %s:%d: %s\n",
+		     cfg->source_addr, demux->port, strerror(errno));
+		close(fd->fd);
+		fd->fd = -1;
+		return -1;
+	}
+
+	set_ip_tos(fd->fd, cfg->endp_dscp);
+	return 0;
+}
+
+/* Ends are hashed by their RTP port, the RTCP port is the one above */
+static struct llist_head *demux_bucket(struct mgcp_rtp_demux *demux,
+				       int rtp_port)
+{
+	return &demux->buckets[(rtp_port >> 1) & (MGCP_DEMUX_BUCKETS - 1)];
+}
+
+static struct mgcp_rtp_end *demux_find(struct mgcp_rtp_demux *demux,
+				       int rtp_port)
+{
+	struct mgcp_rtp_end *end;
+
+	llist_for_each_entry(end, demux_bucket(demux, rtp_port), demux_entry)
+		if (end->local_port == rtp_port)
+			return end;
+	return NULL;
+}
+
+struct mgcp_rtp_end *mgcp_demux_lookup(struct mgcp_rtp_demux *demux,
+				       int port, int *is_rtp)
+{
+	struct mgcp_rtp_end *end;
+
+	end = demux_find(demux, port);
+	*is_rtp = end != NULL;
+	if (!end)
+		end = demux_find(demux, port - 1);
+	return end;
+}
+
+static int rtp_demux_read(struct osmo_fd *ofd, unsigned int what)
+{
+	struct mgcp_rtp_demux *demux = ofd->data;
+	struct mgcp_config *cfg = demux->cfg;
+	struct mgcp_rtp_batch *batch;
+	char *buf;
+	char control[256];
+	struct sockaddr_in addr;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct mgcp_rtp_end *end;
+	struct mgcp_endpoint *endp;
+	struct osmo_fd *fd;
+	int rc, is_rtp, port = demux->port;
+
+	if (!cfg->rtp_batch_buf)
+		cfg->rtp_batch_buf = mgcp_rtp_batch_alloc(cfg);
+	batch = cfg->rtp_batch_buf;
+	if (!batch)
+		return -1;
+
+	buf = batch->rx_buf[0];
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(batch->rx_buf[0]);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	rc = recvmsg(ofd->fd, &msg, 0);
+	if (rc < 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to receive on demux port %d: %s\n",
+		     demux->port, strerror(errno));
+		return -1;
+	}
+
+#ifdef IP_ORIGDSTADDR
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		struct sockaddr_in dst;
+
+		if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_ORIGDSTADDR)
+			continue;
+		memcpy(&dst, CMSG_DATA(cmsg), sizeof(dst));
+		port = ntohs(dst.sin_port);
+	}
+#else
+	(void) cmsg;
+#endif
+
+	end = mgcp_demux_lookup(demux, port, &is_rtp);
+	if (!end) {
+		demux->unknown += 1;
+		return 0;
+	}
+
+	end->syscalls += 1;
+	endp = (struct mgcp_endpoint *) end->rtp.data;
+	if (!endp->allocated)
+		return -1;
+
+	fd = is_rtp ? &end->rtp : &end->rtcp;
+	batch->tx_count = 0;
+	batch->tx_fd = -1;
+	batch->active = 1;
+	rc = batch_dispatch(batch, end,
+			    demux->is_bts ? rtp_handle_bts : rtp_handle_net,
+			    endp, fd, &addr, buf, rc);
+	batch_flush(batch);
+	batch->active = 0;
+	return rc;
+}
+
+static int demux_free(struct mgcp_rtp_demux *demux)
+{
+	int i;
+
+	for (i = 0; i < demux->num_fds; ++i) {
+		osmo_fd_unregister(&demux->fds[i]);
+		close(demux->fds[i].fd);
+	}
+	return 0;
+}
+
+static struct mgcp_rtp_demux *demux_get(struct mgcp_config *cfg,
+					struct mgcp_port_range *range, int is_bts)
+{
+	struct mgcp_rtp_demux *demux;
+	int i, num;
+
+	if (range->demux)
+		return range->demux;
+
+	demux = talloc_zero(cfg, struct mgcp_rtp_demux);
+	if (!demux)
+		return NULL;
+
+	demux->cfg = cfg;
+	demux->is_bts = is_bts;
+	demux->port = range->demux_port;
+	for (i = 0; i < ARRAY_SIZE(demux->buckets); ++i)
+		INIT_LLIST_HEAD(&demux->buckets[i]);
+
+	num = OSMO_MIN(OSMO_MAX(cfg->demux_sockets, 1), MGCP_DEMUX_SOCKETS_MAX);
+	for (i = 0; i < num; ++i) {
+		struct osmo_fd *fd = &demux->fds[i];
+
+		if (demux_socket(demux, fd) != 0)
+			break;
+
+		fd->when = BSC_FD_READ;
+		fd->cb = rtp_demux_read;
+		fd->data = demux;
+		if (osmo_fd_register(fd) != 0) {
+			close(fd->fd);
+			fd->fd = -1;
+			break;
+		}
+		demux->num_fds += 1;
+	}
+
+	if (demux->num_fds == 0) {
+		talloc_free(demux);
+		return NULL;
+	}
+
+	talloc_set_destructor(demux, demux_free);
+	range->demux = demux;
+	return demux;
+}
+
+/*
+ * Route the ports of the end through the shared sockets. The end still
+ * binds its own RTP/RTCP sockets and sends from them, so the peer sees
+ * the advertised ports as the source. They are never registered, the
+ * TPROXY rule hands everything for them to the shared sockets as long
+ * as they stay unconnected.
+ *
+ * This keeps the poll set independent of the number of endpoints but
+ * it does not save file descriptors, the shared sockets come on top of
+ * the ones of the ends. A UDP socket can not pick the source port per
+ * datagram, neither IP_TRANSPARENT nor IP_PKTINFO change that, so
+ * sending from the shared sockets would need raw sockets.
+ */
+static int demux_bind(const char *port, struct mgcp_port_range *range,
+		      int is_bts, struct mgcp_rtp_end *end,
+		      struct mgcp_endpoint *_endp, int rtp_port)
+{
+	struct mgcp_config *cfg = _endp->cfg;
+	struct mgcp_rtp_demux *demux;
+
+	if (end->rtp.fd != -1 || end->rtcp.fd != -1) {
+		LOGP(DMGCP, LOGL_ERROR, "Previous %s was still bound on %d\n",
+			port, ENDPOINT_NUMBER(_endp));
+		mgcp_free_rtp_port(end);
+	}
+
+	demux = demux_get(_endp->cfg, range, is_bts);
+	if (!demux) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create demux port %d on 0x%x\n",
+		     range->demux_port, ENDPOINT_NUMBER(_endp));
+		return -1;
+	}
+
+	end->local_port = rtp_port;
+	end->rtp.data = _endp;
+	end->rtcp.data = _endp;
+
+	if (mgcp_create_bind(cfg->source_addr, &end->rtp, rtp_port) != 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create RTP port: %s:%d on 0x%x\n",
+		     cfg->source_addr, rtp_port, ENDPOINT_NUMBER(_endp));
+		return -1;
+	}
+
+	if (mgcp_create_bind(cfg->source_addr, &end->rtcp, rtp_port + 1) != 0) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create RTCP port: %s:%d on 0x%x\n",
+		     cfg->source_addr, rtp_port + 1, ENDPOINT_NUMBER(_endp));
+		close(end->rtp.fd);
+		end->rtp.fd = -1;
+		return -1;
+	}
+
+	set_ip_tos(end->rtp.fd, cfg->endp_dscp);
+	set_ip_tos(end->rtcp.fd, cfg->endp_dscp);
+
+	end->demux = demux;
+	llist_add(&end->demux_entry, demux_bucket(demux, rtp_port));
+	demux->ends += 1;
+	return 0;
+}
+
+static void demux_unbind(struct mgcp_rtp_end *end)
+{
+	llist_del(&end->demux_entry);
+	end->demux->ends -= 1;
+	end->demux = NULL;
+	close(end->rtp.fd);
+	end->rtp.fd = -1;
+	close(end->rtcp.fd);
+	end->rtcp.fd = -1;
+}
+
+/*
+ * The sockets of an endpoint owned by a worker are only bound while
+ * the endpoint is paused, the worker picks them up on resume.
+ */
+static int rtp_fd_register(struct osmo_fd *fd)
+{
+	struct mgcp_endpoint *endp = (struct mgcp_endpoint *) fd->data;
+
+	if (endp->worker)
+		return 0;
+	return osmo_fd_register(fd);
+}
+
+static void rtp_fd_unregister(struct osmo_fd *fd)
+{
+	struct mgcp_endpoint *endp = (struct mgcp_endpoint *) fd->data;
+
+	if (endp->worker)
+		return;
+	osmo_fd_unregister(fd);
+}
+
 static int bind_rtp(struct mgcp_config *cfg, struct mgcp_rtp_end *rtp_end, int endpno)
 {
 	if (mgcp_create_bind(cfg->source_addr, &rtp_end->rtp,
@@ -860,14 +1475,14 @@ static int bind_rtp(struct mgcp_config *cfg, struct mgcp_rtp_end *rtp_end, int e
 	set_ip_tos(rtp_end->rtcp.fd, cfg->endp_dscp);
 
 	rtp_end->rtp.when = BSC_FD_READ;
-	if (osmo_fd_register(&rtp_end->rtp) != 0) {
+	if (rtp_fd_register(&rtp_end->rtp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTP port %d on 0x%x\n",
 			rtp_end->local_port, endpno);
 		goto cleanup2;
 	}
 
 	rtp_end->rtcp.when = BSC_FD_READ;
-	if (osmo_fd_register(&rtp_end->rtcp) != 0) {
+	if (rtp_fd_register(&rtp_end->rtcp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTCP port %d on 0x%x\n",
 			rtp_end->local_port + 1, endpno);
 		goto cleanup3;
@@ -876,7 +1491,7 @@ static int bind_rtp(struct mgcp_config *cfg, struct mgcp_rtp_end *rtp_end, int e
 	return 0;
 
 cleanup3:
-	osmo_fd_unregister(&rtp_end->rtp);
+	rtp_fd_unregister(&rtp_end->rtp);
 cleanup2:
 	close(rtp_end->rtcp.fd);
 	rtp_end->rtcp.fd = -1;
@@ -908,12 +1523,18 @@ static int int_bind(const char *port,
 
 int mgcp_bind_bts_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
+	if (endp->cfg->bts_ports.demux_port)
+		return demux_bind("bts-port", &endp->cfg->bts_ports, 1,
+				  &endp->bts_end, endp, rtp_port);
 	return int_bind("bts-port", &endp->bts_end,
 			rtp_data_bts, endp, rtp_port);
 }
 
 int mgcp_bind_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
+	if (endp->cfg->net_ports.demux_port)
+		return demux_bind("net-port", &endp->cfg->net_ports, 0,
+				  &endp->net_end, endp, rtp_port);
 	return int_bind("net-port", &endp->net_end,
 			rtp_data_net, endp, rtp_port);
 }
@@ -932,16 +1553,21 @@ int mgcp_bind_trans_bts_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 
 int mgcp_free_rtp_port(struct mgcp_rtp_end *end)
 {
+	if (end->demux) {
+		demux_unbind(end);
+		return 0;
+	}
+
 	if (end->rtp.fd != -1) {
 		close(end->rtp.fd);
 		end->rtp.fd = -1;
-		osmo_fd_unregister(&end->rtp);
+		rtp_fd_unregister(&end->rtp);
 	}
 
 	if (end->rtcp.fd != -1) {
 		close(end->rtcp.fd);
 		end->rtcp.fd = -1;
-		osmo_fd_unregister(&end->rtcp);
+		rtp_fd_unregister(&end->rtcp);
 	}
 
 	return 0;
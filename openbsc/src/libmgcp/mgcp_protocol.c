@@ -326,7 +326,13 @@ struct msgb *mgcp_handle_message(struct mgcp_config *cfg, struct msgb *msg)
 	for (i = 0; i < ARRAY_SIZE(mgcp_requests); ++i) {
 		if (strncmp(mgcp_requests[i].name, (const char *) &msg->l2h[0], 4) == 0) {
 			handled = 1;
-			resp = mgcp_requests[i].handle_request(&pdata);
+			/* the call agent will retry a transient error */
+			if (mgcp_endp_pause(pdata.endp) != 0)
+				resp = create_err_response(pdata.endp, 400,
+						mgcp_requests[i].name, pdata.trans);
+			else
+				resp = mgcp_requests[i].handle_request(&pdata);
+			mgcp_endp_resume(pdata.endp);
 			break;
 		}
 	}
@@ -702,12 +708,14 @@ void mgcp_rtp_end_config(struct mgcp_endpoint *endp, int expect_ssrc_change,
 
 	rtp->force_aligned_timing = tcfg->force_aligned_timing;
 	rtp->force_constant_ssrc = patch_ssrc ? 1 : 0;
+	mgcp_jb_config(endp, rtp);
 
 	LOGP(DMGCP, LOGL_DEBUG,
-	     "Configuring RTP endpoint: local port %d%s%s\n",
+	     "Configuring RTP endpoint: local port %d%s%s%s\n",
 	     ntohs(rtp->rtp_port),
 	     rtp->force_aligned_timing ? ", force constant timing" : "",
-	     rtp->force_constant_ssrc ? ", force constant ssrc" : "");
+	     rtp->force_constant_ssrc ? ", force constant ssrc" : "",
+	     rtp->jb ? ", jitter buffer" : "");
 }
 
 uint32_t mgcp_rtp_packet_duration(struct mgcp_endpoint *endp,
@@ -1178,6 +1186,11 @@ static void mgcp_rtp_end_reset(struct mgcp_rtp_end *end)
 
 	end->packets = 0;
 	end->octets = 0;
+	end->syscalls = 0;
+	end->jb_late = 0;
+	end->jb_underruns = 0;
+	end->jb_overruns = 0;
+	mgcp_jb_free(end);
 	memset(&end->addr, 0, sizeof(end->addr));
 	end->rtp_port = end->rtcp_port = 0;
 	end->payload_type = -1;
@@ -1227,6 +1240,8 @@ int mgcp_endpoints_allocate(struct mgcp_trunk_config *tcfg)
 void mgcp_free_endp(struct mgcp_endpoint *endp)
 {
 	LOGP(DMGCP, LOGL_DEBUG, "Deleting endpoint on: 0x%x\n", ENDPOINT_NUMBER(endp));
+	/* the endpoint has to go, even if its worker is stuck */
+	mgcp_endp_pause(endp);
 	endp->ci = CI_UNUSED;
 	endp->allocated = 0;
 
@@ -1248,6 +1263,7 @@ void mgcp_free_endp(struct mgcp_endpoint *endp)
 	endp->conn_mode = endp->orig_mode = MGCP_CONN_NONE;
 
 	memset(&endp->taps, 0, sizeof(endp->taps));
+	mgcp_endp_resume(endp);
 }
 
 static int send_trans(struct mgcp_config *cfg, const char *buf, int len)
@@ -85,6 +85,16 @@ static int config_write_mgcp(struct vty *vty)
 			g_cfg->net_ports.range_start, g_cfg->net_ports.range_end, VTY_NEWLINE);
 
 	vty_out(vty, "  rtp ip-dscp %d%s", g_cfg->endp_dscp, VTY_NEWLINE);
+	if (g_cfg->rtp_batch > 1)
+		vty_out(vty, "  rtp batch %d%s", g_cfg->rtp_batch, VTY_NEWLINE);
+	if (g_cfg->rtp_workers > 0)
+		vty_out(vty, "  rtp workers %d%s", g_cfg->rtp_workers, VTY_NEWLINE);
+	if (g_cfg->bts_ports.demux_port)
+		vty_out(vty, "  rtp demux bts %d%s", g_cfg->bts_ports.demux_port, VTY_NEWLINE);
+	if (g_cfg->net_ports.demux_port)
+		vty_out(vty, "  rtp demux net %d%s", g_cfg->net_ports.demux_port, VTY_NEWLINE);
+	if (g_cfg->demux_sockets > 1)
+		vty_out(vty, "  rtp demux-sockets %d%s", g_cfg->demux_sockets, VTY_NEWLINE);
 	if (g_cfg->trunk.omit_rtcp)
 		vty_out(vty, "  rtcp-omit%s", VTY_NEWLINE);
 	else
@@ -96,6 +106,9 @@ static int config_write_mgcp(struct vty *vty)
 			g_cfg->trunk.force_aligned_timing ? "" : "no ", VTY_NEWLINE);
 	} else
 		vty_out(vty, "  no rtp-patch%s", VTY_NEWLINE);
+	if (g_cfg->trunk.jitter_buffer_ms)
+		vty_out(vty, "  rtp jitter-buffer %d%s",
+			g_cfg->trunk.jitter_buffer_ms, VTY_NEWLINE);
 	if (g_cfg->trunk.audio_payload != -1)
 		vty_out(vty, "  sdp audio-payload number %d%s",
 			g_cfg->trunk.audio_payload, VTY_NEWLINE);
@@ -124,6 +137,37 @@ static int config_write_mgcp(struct vty *vty)
 	return CMD_SUCCESS;
 }
 
+static void dump_syscalls(struct vty *vty, struct mgcp_endpoint *endp)
+{
+	unsigned int packets, syscalls;
+	unsigned long long ratio;
+
+	packets = endp->bts_end.packets + endp->net_end.packets;
+	syscalls = endp->bts_end.syscalls + endp->net_end.syscalls +
+			endp->trans_bts.syscalls + endp->trans_net.syscalls;
+
+	if (packets == 0) {
+		vty_out(vty, "  Syscalls: %u, no packets relayed%s",
+			syscalls, VTY_NEWLINE);
+		return;
+	}
+
+	ratio = syscalls * 100ULL / packets;
+	vty_out(vty, "  Syscalls: %u for %u packets, %llu.%02llu per packet%s",
+		syscalls, packets, ratio / 100, ratio % 100, VTY_NEWLINE);
+}
+
+static void dump_jitter_buffer(struct vty *vty, const char *name,
+			       struct mgcp_rtp_end *end)
+{
+	struct mgcp_jitter_buffer *jb = end->jb;
+
+	vty_out(vty, "  Jitter buffer %s: depth %d/%d late %u underruns %u "
+		"overruns %u%s",
+		name, jb ? jb->count : 0, jb ? jb->target : 0,
+		end->jb_late, end->jb_underruns, end->jb_overruns, VTY_NEWLINE);
+}
+
 static void dump_trunk(struct vty *vty, struct mgcp_trunk_config *cfg, int verbose)
 {
 	int i;
@@ -158,9 +202,54 @@ static void dump_trunk(struct vty *vty, struct mgcp_trunk_config *cfg, int verbo
 				endp->net_state.in_stream.err_ts_counter,
 				endp->net_state.out_stream.err_ts_counter,
 				VTY_NEWLINE);
+		if (verbose)
+			dump_syscalls(vty, endp);
+		if (verbose && cfg->jitter_buffer_ms) {
+			dump_jitter_buffer(vty, "BTS", &endp->bts_end);
+			dump_jitter_buffer(vty, "Net", &endp->net_end);
+		}
 	}
 }
 
+static void dump_workers(struct vty *vty, struct mgcp_config *cfg)
+{
+	unsigned long long packets = 0, wakeups = 0, wp, ww;
+	int i;
+
+	if (!cfg->workers)
+		return;
+
+	/* the workers keep counting while we read */
+	for (i = 0; i < cfg->num_workers; ++i) {
+		struct mgcp_worker *worker = &cfg->workers[i];
+
+		wp = __atomic_load_n(&worker->packets, __ATOMIC_RELAXED);
+		ww = __atomic_load_n(&worker->wakeups, __ATOMIC_RELAXED);
+		vty_out(vty, " Worker %d: %u endpoints, %llu packets, "
+			"%llu wakeups, %u commands%s",
+			worker->nr, worker->endpoints, wp, ww,
+			__atomic_load_n(&worker->commands, __ATOMIC_RELAXED),
+			VTY_NEWLINE);
+		packets += wp;
+		wakeups += ww;
+	}
+
+	vty_out(vty, "RTP workers: %d, %llu packets, %llu wakeups%s",
+		cfg->num_workers, packets, wakeups, VTY_NEWLINE);
+}
+
+static void dump_demux(struct vty *vty, const char *name,
+		       struct mgcp_rtp_demux *demux)
+{
+	if (!demux)
+		return;
+
+	vty_out(vty, "RTP demux %s port %d: %d sockets, %u endpoints, "
+		"%u packets for unknown ports%s",
+		name, demux->port, demux->num_fds, demux->ends,
+		demux->unknown, VTY_NEWLINE);
+}
+
 DEFUN(show_mcgp, show_mgcp_cmd,
       "show mgcp [stats]",
       SHOW_STR
@@ -175,6 +264,10 @@ DEFUN(show_mcgp, show_mgcp_cmd,
 	llist_for_each_entry(trunk, &g_cfg->trunks, entry)
 		dump_trunk(vty, trunk, show_stats);
 
+	dump_workers(vty, g_cfg);
+	dump_demux(vty, "bts", g_cfg->bts_ports.demux);
+	dump_demux(vty, "net", g_cfg->net_ports.demux);
+
 	return CMD_SUCCESS;
 }
 
@@ -347,6 +440,92 @@ ALIAS_DEPRECATED(cfg_mgcp_rtp_ip_dscp, cfg_mgcp_rtp_ip_tos_cmd,
       RTP_STR
       "Apply IP_TOS to the audio stream\n" "The DSCP value\n")
 
+#define BATCH_STR "Relay several RTP/RTCP datagrams per system call\n"
+DEFUN(cfg_mgcp_rtp_batch,
+      cfg_mgcp_rtp_batch_cmd,
+      "rtp batch <2-64>",
+      RTP_STR BATCH_STR
+      "Maximum number of datagrams read from a socket at once\n")
+{
+	g_cfg->rtp_batch = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_batch,
+      cfg_mgcp_no_rtp_batch_cmd,
+      "no rtp batch",
+      NO_STR RTP_STR BATCH_STR)
+{
+	g_cfg->rtp_batch = 0;
+	return CMD_SUCCESS;
+}
+
+#define WORKERS_STR "Forward RTP in separate threads\n"
+DEFUN(cfg_mgcp_rtp_workers,
+      cfg_mgcp_rtp_workers_cmd,
+      "rtp workers <1-64>",
+      RTP_STR WORKERS_STR
+      "Number of threads, applied at start\n")
+{
+	g_cfg->rtp_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_workers,
+      cfg_mgcp_no_rtp_workers_cmd,
+      "no rtp workers",
+      NO_STR RTP_STR WORKERS_STR)
+{
+	g_cfg->rtp_workers = 0;
+	return CMD_SUCCESS;
+}
+
+#define DEMUX_STR "Receive all ports of a side on shared sockets\n"
+#define DEMUX_SIDE_STR "Ports of the BTS side\n" "Ports of the NET side\n"
+DEFUN(cfg_mgcp_rtp_demux,
+      cfg_mgcp_rtp_demux_cmd,
+      "rtp demux (bts|net) <1-65534>",
+      RTP_STR DEMUX_STR DEMUX_SIDE_STR
+      "Port of the shared sockets the advertised ports are redirected to\n")
+{
+	struct mgcp_port_range *range;
+
+	range = argv[0][0] == 'b' ? &g_cfg->bts_ports : &g_cfg->net_ports;
+	range->demux_port = atoi(argv[1]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_demux,
+      cfg_mgcp_no_rtp_demux_cmd,
+      "no rtp demux (bts|net)",
+      NO_STR RTP_STR DEMUX_STR DEMUX_SIDE_STR)
+{
+	struct mgcp_port_range *range;
+
+	range = argv[0][0] == 'b' ? &g_cfg->bts_ports : &g_cfg->net_ports;
+	range->demux_port = 0;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_rtp_demux_sockets,
+      cfg_mgcp_rtp_demux_sockets_cmd,
+      "rtp demux-sockets <1-16>",
+      RTP_STR "Number of SO_REUSEPORT sockets per shared side\n"
+      "Number of sockets\n")
+{
+	g_cfg->demux_sockets = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_demux_sockets,
+      cfg_mgcp_no_rtp_demux_sockets_cmd,
+      "no rtp demux-sockets",
+      NO_STR RTP_STR "Use a single socket per shared side\n")
+{
+	g_cfg->demux_sockets = 1;
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_mgcp_sdp_fmtp_extra,
       cfg_mgcp_sdp_fmtp_extra_cmd,
       "sdp audio fmtp-extra .NAME",
@@ -451,6 +630,27 @@ DEFUN(cfg_mgcp_no_omit_rtcp,
 	return CMD_SUCCESS;
 }
 
+#define JB_STR "Reorder and smooth the RTP sent to both sides\n"
+
+DEFUN(cfg_mgcp_rtp_jitter_buffer,
+      cfg_mgcp_rtp_jitter_buffer_cmd,
+      "rtp jitter-buffer <20-640>",
+      RTP_STR JB_STR
+      "Maximum depth in ms\n")
+{
+	g_cfg->trunk.jitter_buffer_ms = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_jitter_buffer,
+      cfg_mgcp_no_rtp_jitter_buffer_cmd,
+      "no rtp jitter-buffer",
+      NO_STR RTP_STR JB_STR)
+{
+	g_cfg->trunk.jitter_buffer_ms = 0;
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_mgcp_patch_rtp_ssrc,
       cfg_mgcp_patch_rtp_ssrc_cmd,
       "rtp-patch ssrc",
@@ -605,6 +805,9 @@ static int config_write_trunk(struct vty *vty)
 				trunk->force_aligned_timing ? "" : "no ", VTY_NEWLINE);
 		} else
 			vty_out(vty, "  no rtp-patch%s", VTY_NEWLINE);
+		if (trunk->jitter_buffer_ms)
+			vty_out(vty, "  rtp jitter-buffer %d%s",
+				trunk->jitter_buffer_ms, VTY_NEWLINE);
 		if (trunk->audio_fmtp_extra)
 			vty_out(vty, "   sdp audio fmtp-extra %s%s",
 				trunk->audio_fmtp_extra, VTY_NEWLINE);
@@ -715,6 +918,27 @@ DEFUN(cfg_trunk_no_omit_rtcp,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_trunk_rtp_jitter_buffer,
+      cfg_trunk_rtp_jitter_buffer_cmd,
+      "rtp jitter-buffer <20-640>",
+      RTP_STR JB_STR
+      "Maximum depth in ms\n")
+{
+	struct mgcp_trunk_config *trunk = vty->index;
+	trunk->jitter_buffer_ms = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_trunk_no_rtp_jitter_buffer,
+      cfg_trunk_no_rtp_jitter_buffer_cmd,
+      "no rtp jitter-buffer",
+      NO_STR RTP_STR JB_STR)
+{
+	struct mgcp_trunk_config *trunk = vty->index;
+	trunk->jitter_buffer_ms = 0;
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_trunk_patch_rtp_ssrc,
       cfg_trunk_patch_rtp_ssrc_cmd,
       "rtp-patch ssrc",
@@ -808,6 +1032,12 @@ DEFUN(loop_endp,
 	endp = &trunk->endpoints[endp_no];
 	int loop = atoi(argv[2]);
 
+	if (mgcp_endp_pause(endp) != 0) {
+		mgcp_endp_resume(endp);
+		vty_out(vty, "%%Endpoint %s is busy.%s", argv[1], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
 	if (loop)
 		endp->conn_mode = MGCP_CONN_LOOPBACK;
 	else
@@ -816,6 +1046,7 @@ DEFUN(loop_endp,
 	/* Handle it like a MDCX, switch on SSRC patching if enabled */
 	mgcp_rtp_end_config(endp, 1, &endp->bts_end);
 	mgcp_rtp_end_config(endp, 1, &endp->net_end);
+	mgcp_endp_resume(endp);
 
 	return CMD_SUCCESS;
 }
@@ -871,11 +1102,18 @@ DEFUN(tap_call,
 		return CMD_WARNING;
 	}
 
+	if (mgcp_endp_pause(endp) != 0) {
+		mgcp_endp_resume(endp);
+		vty_out(vty, "%%Endpoint %s is busy.%s", argv[1], VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
 	tap = &endp->taps[port];
 	memset(&tap->forward, 0, sizeof(tap->forward));
 	inet_aton(argv[3], &tap->forward.sin_addr);
 	tap->forward.sin_port = htons(atoi(argv[4]));
 	tap->enabled = 1;
+	mgcp_endp_resume(endp);
 	return CMD_SUCCESS;
 }
 
@@ -993,6 +1231,14 @@ int mgcp_vty_init(void)
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_transcoder_base_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_ip_dscp_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_ip_tos_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_batch_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_batch_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_workers_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_workers_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_demux_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_demux_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_demux_sockets_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_demux_sockets_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_agent_addr_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_agent_addr_cmd_old);
 	install_element(MGCP_NODE, &cfg_mgcp_transcoder_cmd);
@@ -1006,6 +1252,8 @@ int mgcp_vty_init(void)
 	install_element(MGCP_NODE, &cfg_mgcp_number_endp_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_omit_rtcp_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_no_omit_rtcp_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_jitter_buffer_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_jitter_buffer_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_patch_rtp_ssrc_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_no_patch_rtp_ssrc_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_patch_rtp_ts_cmd);
@@ -1025,6 +1273,8 @@ int mgcp_vty_init(void)
 	install_element(TRUNK_NODE, &cfg_trunk_loop_cmd);
 	install_element(TRUNK_NODE, &cfg_trunk_omit_rtcp_cmd);
 	install_element(TRUNK_NODE, &cfg_trunk_no_omit_rtcp_cmd);
+	install_element(TRUNK_NODE, &cfg_trunk_rtp_jitter_buffer_cmd);
+	install_element(TRUNK_NODE, &cfg_trunk_no_rtp_jitter_buffer_cmd);
 	install_element(TRUNK_NODE, &cfg_trunk_patch_rtp_ssrc_cmd);
 	install_element(TRUNK_NODE, &cfg_trunk_no_patch_rtp_ssrc_cmd);
 	install_element(TRUNK_NODE, &cfg_trunk_patch_rtp_ts_cmd);
@@ -0,0 +1,582 @@
+/* A Media Gateway Control Protocol Media Gateway: RFC 3435 */
+/* RTP forwarding worker threads */
+
+/*
+ * (C) 2009-2012 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2009-2012 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The endpoints are sharded over a fixed number of worker threads. A
+ * worker owns the RTP/RTCP sockets of its endpoints and waits for them
+ * with its own epoll set. The main thread keeps handling MGCP and the
+ * VTY. Before it touches an endpoint it pauses it: a DETACH command is
+ * queued to the owning worker, which removes the sockets from its epoll
+ * set and acknowledges. Once the main thread is done the endpoint gets
+ * resumed and the worker attaches whatever sockets are bound now.
+ *
+ * The main thread waits at most MGCP_WORKER_ACK_TIMEOUT ms for the
+ * acknowledgement so that a stalled worker does not stop the MGCP
+ * signalling. The MGCP command is refused in that case. An ack coming
+ * in later is matched by its sequence number and ignored.
+ *
+ * Commands travel over a single producer/single consumer ring. Only
+ * the main thread produces and only the worker consumes, so head and
+ * tail need no lock. The log lines of a worker travel back the same
+ * way and are written out by the main loop.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <poll.h>
+#include <time.h>
+
+#include <osmocom/core/talloc.h>
+
+#include "bscconfig.h"
+
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+
+#define LOG_MASK	(MGCP_WORKER_LOG_SIZE - 1)
+
+__thread struct mgcp_worker *mgcp_worker_self;
+
+/* inet_ntoa() with a buffer per thread */
+const char *mgcp_inet_ntoa(struct in_addr addr)
+{
+	static __thread char buf[INET_ADDRSTRLEN];
+
+	if (!inet_ntop(AF_INET, &addr, buf, sizeof(buf)))
+		return "invalid";
+	return buf;
+}
+
+/* Queue a line for the main loop, drop it when the ring is full */
+void mgcp_worker_log(int level, const char *fmt, ...)
+{
+	struct mgcp_worker *worker = mgcp_worker_self;
+	struct mgcp_worker_log *log;
+	unsigned int head = worker->log_head;
+	uint64_t one = 1;
+	va_list ap;
+
+	if (head - __atomic_load_n(&worker->log_tail, __ATOMIC_ACQUIRE)
+			>= MGCP_WORKER_LOG_SIZE) {
+		__atomic_add_fetch(&worker->log_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	log = &worker->logs[head & LOG_MASK];
+	log->level = level;
+	va_start(ap, fmt);
+	vsnprintf(log->text, sizeof(log->text), fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&worker->log_head, head + 1, __ATOMIC_RELEASE);
+
+	if (write(worker->log_fd.fd, &one, sizeof(one)) != sizeof(one))
+		__atomic_add_fetch(&worker->log_dropped, 1, __ATOMIC_RELAXED);
+}
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define WORKER_EVENTS	64
+#define RING_MASK	(MGCP_WORKER_RING_SIZE - 1)
+
+#define MGCP_WORKER_ACK_TIMEOUT	100
+
+static void worker_push(struct mgcp_worker *worker, int type,
+			struct mgcp_endpoint *endp)
+{
+	struct mgcp_worker_cmd *cmd;
+	unsigned int head = worker->ring_head;
+	uint64_t one = 1;
+
+	while (head - __atomic_load_n(&worker->ring_tail, __ATOMIC_ACQUIRE)
+			>= MGCP_WORKER_RING_SIZE)
+		sched_yield();
+
+	cmd = &worker->ring[head & RING_MASK];
+	cmd->type = type;
+	cmd->endp = endp;
+	__atomic_store_n(&worker->ring_head, head + 1, __ATOMIC_RELEASE);
+
+	if (write(worker->wake_fd, &one, sizeof(one)) != sizeof(one))
+		LOGP(DMGCP, LOGL_ERROR, "Failed to wake worker %d: %s\n",
+		     worker->nr, strerror(errno));
+}
+
+static int worker_acked(struct mgcp_worker *worker, unsigned int seq)
+{
+	return (int) (__atomic_load_n(&worker->detach_acked, __ATOMIC_ACQUIRE)
+			- seq) >= 0;
+}
+
+/* wait for the ack of the DETACH with the given sequence number */
+static int worker_wait_ack(struct mgcp_worker *worker, unsigned int seq)
+{
+	struct pollfd pfd;
+	struct timespec start, now;
+	int elapsed = 0, rc;
+	uint64_t val;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfd.fd = worker->ack_fd;
+	pfd.events = POLLIN;
+
+	while (!worker_acked(worker, seq)) {
+		if (elapsed >= MGCP_WORKER_ACK_TIMEOUT)
+			return -ETIMEDOUT;
+
+		rc = poll(&pfd, 1, MGCP_WORKER_ACK_TIMEOUT - elapsed);
+		if (rc > 0 && read(worker->ack_fd, &val, sizeof(val)) < 0
+		    && errno != EAGAIN)
+			return -errno;
+		if (rc < 0 && errno != EINTR)
+			return -errno;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000
+			+ (now.tv_nsec - start.tv_nsec) / 1000000;
+	}
+
+	return 0;
+}
+
+static void worker_ctl_fd(struct mgcp_worker *worker, int op,
+			  struct osmo_fd *ofd)
+{
+	struct epoll_event ev;
+
+	if (ofd->fd == -1)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = ofd;
+	if (epoll_ctl(worker->epoll_fd, op, ofd->fd, &ev) != 0)
+		LOGP_RTP(LOGL_ERROR,
+			 "Worker %d failed to %s fd %d: %d\n", worker->nr,
+			 op == EPOLL_CTL_ADD ? "add" : "remove",
+			 ofd->fd, errno);
+}
+
+static void worker_ctl_endp(struct mgcp_worker *worker, int op,
+			    struct mgcp_endpoint *endp)
+{
+	worker_ctl_fd(worker, op, &endp->bts_end.rtp);
+	worker_ctl_fd(worker, op, &endp->bts_end.rtcp);
+	worker_ctl_fd(worker, op, &endp->net_end.rtp);
+	worker_ctl_fd(worker, op, &endp->net_end.rtcp);
+	worker_ctl_fd(worker, op, &endp->trans_bts.rtp);
+	worker_ctl_fd(worker, op, &endp->trans_bts.rtcp);
+	worker_ctl_fd(worker, op, &endp->trans_net.rtp);
+	worker_ctl_fd(worker, op, &endp->trans_net.rtcp);
+}
+
+static void worker_process_ring(struct mgcp_worker *worker)
+{
+	unsigned int tail = worker->ring_tail;
+	unsigned int head = __atomic_load_n(&worker->ring_head, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	for (; tail != head; ++tail) {
+		struct mgcp_worker_cmd *cmd = &worker->ring[tail & RING_MASK];
+
+		__atomic_store_n(&worker->commands, worker->commands + 1,
+				 __ATOMIC_RELAXED);
+		switch (cmd->type) {
+		case MGCP_WORKER_ATTACH:
+			worker_ctl_endp(worker, EPOLL_CTL_ADD, cmd->endp);
+			mgcp_jb_attach(&cmd->endp->bts_end);
+			mgcp_jb_attach(&cmd->endp->net_end);
+			break;
+		case MGCP_WORKER_DETACH:
+			worker_ctl_endp(worker, EPOLL_CTL_DEL, cmd->endp);
+			mgcp_jb_detach(&cmd->endp->bts_end);
+			mgcp_jb_detach(&cmd->endp->net_end);
+			__atomic_store_n(&worker->detach_acked,
+					 worker->detach_acked + 1,
+					 __ATOMIC_RELEASE);
+			if (write(worker->ack_fd, &one, sizeof(one)) != sizeof(one))
+				LOGP_RTP(LOGL_ERROR,
+					 "Worker %d failed to ack: %d\n",
+					 worker->nr, errno);
+			break;
+		case MGCP_WORKER_STOP:
+			worker->running = 0;
+			break;
+		}
+	}
+
+	__atomic_store_n(&worker->ring_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void *worker_main(void *data)
+{
+	struct mgcp_worker *worker = data;
+	struct epoll_event events[WORKER_EVENTS];
+	uint64_t val;
+	int i, num;
+
+	mgcp_worker_self = worker;
+
+	while (worker->running) {
+		num = epoll_wait(worker->epoll_fd, events, ARRAY_SIZE(events),
+				 mgcp_wheel_timeout(&worker->wheel));
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGP_RTP(LOGL_FATAL, "Worker %d epoll failed: %d\n",
+				 worker->nr, errno);
+			break;
+		}
+
+		__atomic_store_n(&worker->wakeups, worker->wakeups + 1,
+				 __ATOMIC_RELAXED);
+		for (i = 0; i < num; ++i) {
+			struct osmo_fd *ofd = events[i].data.ptr;
+
+			/* the wake up event has no osmo_fd */
+			if (!ofd) {
+				if (read(worker->wake_fd, &val, sizeof(val)) < 0)
+					LOGP_RTP(LOGL_ERROR,
+						 "Worker %d wake read failed: %d\n",
+						 worker->nr, errno);
+				continue;
+			}
+
+			ofd->cb(ofd, BSC_FD_READ);
+		}
+
+		worker_process_ring(worker);
+
+		/* play out the jitter buffers */
+		if (worker->wheel.pending)
+			mgcp_wheel_run(&worker->wheel);
+	}
+
+	return NULL;
+}
+
+/* Write out the lines logged by the worker, runs in the main loop */
+static void worker_log_drain(struct mgcp_worker *worker)
+{
+	unsigned int tail = worker->log_tail;
+	unsigned int head = __atomic_load_n(&worker->log_head, __ATOMIC_ACQUIRE);
+	unsigned int dropped;
+
+	for (; tail != head; ++tail) {
+		struct mgcp_worker_log *log = &worker->logs[tail & LOG_MASK];
+		LOGP(DMGCP, log->level, "%s", log->text);
+	}
+	__atomic_store_n(&worker->log_tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_exchange_n(&worker->log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		LOGP(DMGCP, LOGL_NOTICE, "Worker %d dropped %u log lines.\n",
+		     worker->nr, dropped);
+}
+
+static int worker_log_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct mgcp_worker *worker = ofd->data;
+	uint64_t val;
+
+	if (read(ofd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		LOGP(DMGCP, LOGL_ERROR, "Worker %d log read failed: %s\n",
+		     worker->nr, strerror(errno));
+
+	worker_log_drain(worker);
+	return 0;
+}
+
+static void worker_close(int *fd)
+{
+	if (*fd < 0)
+		return;
+	close(*fd);
+	*fd = -1;
+}
+
+static void worker_release(struct mgcp_worker *worker)
+{
+	if (worker->log_fd.fd >= 0) {
+		osmo_fd_unregister(&worker->log_fd);
+		worker_close(&worker->log_fd.fd);
+	}
+	worker_close(&worker->epoll_fd);
+	worker_close(&worker->wake_fd);
+	worker_close(&worker->ack_fd);
+	talloc_free(worker->batch);
+	worker->batch = NULL;
+}
+
+static int worker_init(struct mgcp_config *cfg, struct mgcp_worker *worker,
+		       int nr)
+{
+	struct epoll_event ev;
+
+	worker->cfg = cfg;
+	worker->nr = nr;
+	worker->epoll_fd = worker->wake_fd = worker->ack_fd = -1;
+	worker->log_fd.fd = -1;
+	mgcp_wheel_init(&worker->wheel, 0);
+
+	worker->batch = mgcp_rtp_batch_alloc(cfg->workers);
+	if (!worker->batch)
+		return -1;
+
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epoll_fd < 0)
+		return -1;
+
+	worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->wake_fd < 0)
+		return -1;
+
+	worker->ack_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->ack_fd < 0)
+		return -1;
+
+	worker->log_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->log_fd.fd < 0)
+		return -1;
+	worker->log_fd.when = BSC_FD_READ;
+	worker->log_fd.cb = worker_log_cb;
+	worker->log_fd.data = worker;
+	if (osmo_fd_register(&worker->log_fd) != 0) {
+		close(worker->log_fd.fd);
+		worker->log_fd.fd = -1;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) != 0)
+		return -1;
+
+	worker->running = 1;
+	if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+		worker->running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void unregister_end(struct mgcp_rtp_end *end)
+{
+	if (end->rtp.fd != -1)
+		osmo_fd_unregister(&end->rtp);
+	if (end->rtcp.fd != -1)
+		osmo_fd_unregister(&end->rtcp);
+}
+
+/* Move the sockets of the endpoint from the main loop to the worker */
+static void assign_endpoint(struct mgcp_endpoint *endp,
+			    struct mgcp_worker *worker)
+{
+	unregister_end(&endp->bts_end);
+	unregister_end(&endp->net_end);
+	unregister_end(&endp->trans_bts);
+	unregister_end(&endp->trans_net);
+
+	endp->worker = worker;
+	endp->worker_pause = 0;
+	worker->endpoints += 1;
+	worker_push(worker, MGCP_WORKER_ATTACH, endp);
+}
+
+static void assign_trunk(struct mgcp_trunk_config *tcfg, int *next)
+{
+	struct mgcp_config *cfg = tcfg->cfg;
+	int i;
+
+	for (i = 1; i < tcfg->number_endpoints; ++i) {
+		assign_endpoint(&tcfg->endpoints[i],
+				&cfg->workers[*next % cfg->num_workers]);
+		*next += 1;
+	}
+}
+
+/* Join the threads and release what worker_init() created */
+static int workers_destroy(struct mgcp_worker *workers)
+{
+	struct mgcp_config *cfg = workers->cfg;
+	int i;
+
+	for (i = 0; i < cfg->num_workers; ++i)
+		worker_push(&workers[i], MGCP_WORKER_STOP, NULL);
+
+	for (i = 0; i < cfg->num_workers; ++i) {
+		struct mgcp_worker *worker = &workers[i];
+
+		pthread_join(worker->thread, NULL);
+		worker_log_drain(worker);
+		worker_release(worker);
+	}
+
+	cfg->num_workers = 0;
+	return 0;
+}
+
+int mgcp_workers_start(struct mgcp_config *cfg)
+{
+	struct mgcp_trunk_config *trunk;
+	int i, next = 0;
+
+	if (cfg->rtp_workers <= 0 || cfg->workers)
+		return 0;
+
+	if (cfg->bts_ports.demux_port || cfg->net_ports.demux_port) {
+		LOGP(DMGCP, LOGL_ERROR,
+		     "RTP workers can not be combined with the shared demux sockets.\n");
+		return -1;
+	}
+
+	cfg->workers = talloc_zero_array(cfg, struct mgcp_worker,
+					 cfg->rtp_workers);
+	if (!cfg->workers) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to allocate the RTP workers.\n");
+		return -1;
+	}
+
+	for (i = 0; i < cfg->rtp_workers; ++i) {
+		if (worker_init(cfg, &cfg->workers[i], i) != 0) {
+			LOGP(DMGCP, LOGL_ERROR,
+			     "Failed to start RTP worker %d: %s\n",
+			     i, strerror(errno));
+			worker_release(&cfg->workers[i]);
+			break;
+		}
+		cfg->num_workers += 1;
+	}
+
+	if (cfg->num_workers == 0) {
+		talloc_free(cfg->workers);
+		cfg->workers = NULL;
+		return -1;
+	}
+
+	talloc_set_destructor(cfg->workers, workers_destroy);
+
+	assign_trunk(&cfg->trunk, &next);
+	llist_for_each_entry(trunk, &cfg->trunks, entry)
+		assign_trunk(trunk, &next);
+
+	LOGP(DMGCP, LOGL_NOTICE, "Forwarding RTP of %d endpoints with %d workers.\n",
+	     next, cfg->num_workers);
+	return 0;
+}
+
+static void unassign_trunk(struct mgcp_trunk_config *tcfg)
+{
+	int i;
+
+	for (i = 1; i < tcfg->number_endpoints; ++i)
+		tcfg->endpoints[i].worker = NULL;
+}
+
+/*
+ * Stop the workers. The sockets are not handed back to the main loop,
+ * this is only used when the config is torn down. Freeing the config
+ * stops them as well.
+ */
+void mgcp_workers_stop(struct mgcp_config *cfg)
+{
+	struct mgcp_trunk_config *trunk;
+
+	if (!cfg->workers)
+		return;
+
+	talloc_free(cfg->workers);
+	cfg->workers = NULL;
+
+	unassign_trunk(&cfg->trunk);
+	llist_for_each_entry(trunk, &cfg->trunks, entry)
+		unassign_trunk(trunk);
+}
+
+int mgcp_endp_pause(struct mgcp_endpoint *endp)
+{
+	struct mgcp_worker *worker;
+	int rc;
+
+	if (!endp || !endp->worker)
+		return 0;
+
+	if (endp->worker_pause++ > 0)
+		return 0;
+
+	worker = endp->worker;
+	worker_push(worker, MGCP_WORKER_DETACH, endp);
+	rc = worker_wait_ack(worker, ++worker->detach_seq);
+	if (rc != 0)
+		LOGP(DMGCP, LOGL_ERROR,
+		     "Worker %d did not release endpoint 0x%x: %d\n",
+		     worker->nr, ENDPOINT_NUMBER(endp), rc);
+	return rc;
+}
+
+void mgcp_endp_resume(struct mgcp_endpoint *endp)
+{
+	if (!endp || !endp->worker)
+		return;
+
+	OSMO_ASSERT(endp->worker_pause > 0);
+	if (--endp->worker_pause > 0)
+		return;
+
+	worker_push(endp->worker, MGCP_WORKER_ATTACH, endp);
+}
+
+#else
+
+int mgcp_workers_start(struct mgcp_config *cfg)
+{
+	if (cfg->rtp_workers <= 0)
+		return 0;
+
+	LOGP(DMGCP, LOGL_ERROR,
+	     "RTP workers need epoll and eventfd. Forwarding in the main loop.\n");
+	return -1;
+}
+
+void mgcp_workers_stop(struct mgcp_config *cfg)
+{
+}
+
+int mgcp_endp_pause(struct mgcp_endpoint *endp)
+{
+	return 0;
+}
+
+void mgcp_endp_resume(struct mgcp_endpoint *endp)
+{
+}
+
+#endif
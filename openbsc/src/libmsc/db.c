@@ -26,13 +26,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <dbi/dbi.h>
 
 #include <openbsc/gsm_data.h>
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/gsm_04_11.h>
 #include <openbsc/db.h>
+#include <openbsc/db_worker.h>
 #include <openbsc/debug.h>
+#include <openbsc/ident_alloc.h>
+#include <openbsc/sms_outbox.h>
 
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/statistics.h>
@@ -41,6 +45,12 @@
 static char *db_basename = NULL;
 static char *db_dirname = NULL;
 static dbi_conn conn;
+static void *tall_db_ctx;
+static int use_wal = 1;
+
+/* the TMSIs and extensions stored in the Subscriber table */
+static struct ident_alloc tmsi_alloc;
+static struct ident_alloc exten_alloc;
 
 #define SCHEMA_REVISION "3"
 
@@ -152,8 +162,175 @@ static char *create_stmts[] = {
 		"sres BLOB NOT NULL, "
 		"kc BLOB NOT NULL "
 		")",
+	/* the unsent SMS ordered by receiver */
+	"CREATE INDEX IF NOT EXISTS SMS_unsent_by_receiver "
+		"ON SMS (sent, receiver_id, id)",
+	/* the location updates to expire */
+	"CREATE INDEX IF NOT EXISTS Subscriber_expire_lu "
+		"ON Subscriber (expire_lu)",
+};
+
+/*
+ * A query on the main connection, it does not wait for the worker. The
+ * callers reading a Subscriber or SMS row wait for the queued writes of
+ * that row, see below.
+ */
+static dbi_result db_queryf(const char *fmt, ...)
+{
+	dbi_result result;
+	va_list ap;
+	char *query;
+
+	va_start(ap, fmt);
+	query = talloc_vasprintf(tall_db_ctx, fmt, ap);
+	va_end(ap);
+	if (!query)
+		return NULL;
+
+	result = dbi_conn_query(conn, query);
+	talloc_free(query);
+	return result;
+}
+
+/*
+ * A query executed by the worker, the result gets evaluated by the
+ * run callback of the request embedding it.
+ */
+struct db_query_req {
+	struct db_req req;
+	char *query;
+};
+
+static struct db_query_req *db_query_req_alloc(size_t size, const char *what,
+					       const char *fmt, va_list ap)
+{
+	struct db_query_req *qreq;
+
+	qreq = talloc_zero_size(tall_db_ctx, size);
+	if (!qreq)
+		return NULL;
+
+	qreq->req.what = what;
+	qreq->query = talloc_vasprintf(qreq, fmt, ap);
+	if (!qreq->query) {
+		talloc_free(qreq);
+		return NULL;
+	}
+
+	return qreq;
+}
+
+static struct db_query_req *db_query_req_allocf(size_t size, const char *what,
+						const char *fmt, ...)
+{
+	struct db_query_req *qreq;
+	va_list ap;
+
+	va_start(ap, fmt);
+	qreq = db_query_req_alloc(size, what, fmt, ap);
+	va_end(ap);
+	return qreq;
+}
+
+static int db_write_run(dbi_conn wconn, struct db_req *req)
+{
+	struct db_query_req *qreq = (struct db_query_req *) req;
+	dbi_result result;
+
+	result = dbi_conn_query(wconn, qreq->query);
+	if (!result)
+		return -EIO;
+
+	dbi_result_free(result);
+	return 0;
+}
+
+/*
+ * Queue a query without any result to the worker. Without a worker it
+ * is executed right away and -EIO is returned when it failed.
+ */
+static int db_writef(const char *what, const char *fmt, ...)
+{
+	struct db_query_req *qreq;
+	dbi_result result;
+	va_list ap;
+	char *query;
+	int rc;
+
+	va_start(ap, fmt);
+	if (db_worker_running()) {
+		qreq = db_query_req_alloc(sizeof(*qreq), what, fmt, ap);
+		va_end(ap);
+		if (!qreq)
+			return -ENOMEM;
+
+		qreq->req.run = db_write_run;
+		rc = db_worker_submit(&qreq->req);
+		if (rc < 0)
+			talloc_free(qreq);
+		return rc;
+	}
+
+	query = talloc_vasprintf(tall_db_ctx, fmt, ap);
+	va_end(ap);
+	if (!query)
+		return -ENOMEM;
+
+	result = dbi_conn_query(conn, query);
+	talloc_free(query);
+	if (!result)
+		return -EIO;
+
+	dbi_result_free(result);
+	return 0;
+}
+
+/*
+ * The Subscriber and SMS rows are written by the worker. Remember the
+ * sequence number of the last write queued for each of them, hashed by
+ * the id, so a read on the main connection only waits when it might
+ * miss one of them. Nothing else is written by the worker and read back.
+ */
+#define DB_ROW_SLOTS	256
+
+struct db_pending {
+	/* the last write to any row */
+	uint64_t last;
+	/* the last write that was not limited to a single row */
+	uint64_t all;
+	uint64_t rows[DB_ROW_SLOTS];
 };
 
+static struct db_pending subscr_writes;
+static struct db_pending sms_writes;
+
+static void pending_row(struct db_pending *pending, unsigned long long id)
+{
+	pending->last = db_worker_submitted();
+	pending->rows[id % DB_ROW_SLOTS] = pending->last;
+}
+
+static void pending_all(struct db_pending *pending)
+{
+	pending->last = db_worker_submitted();
+	pending->all = pending->last;
+}
+
+/* returns 1 when a write to the row got executed in the meantime */
+static int wait_row(struct db_pending *pending, unsigned long long id)
+{
+	uint64_t seq = pending->rows[id % DB_ROW_SLOTS];
+
+	if (pending->all > seq)
+		seq = pending->all;
+	return db_worker_wait(seq);
+}
+
+static int wait_any(struct db_pending *pending)
+{
+	return db_worker_wait(pending->last);
+}
+
 void db_error_func(dbi_conn conn, void *data)
 {
 	const char *msg;
@@ -236,10 +413,26 @@ static int db_configure(void)
 	if (!result)
 		return -EINVAL;
 
+	dbi_result_free(result);
+
+	/* readers and the writer will not block each other */
+	result = dbi_conn_query(conn, use_wal ?
+				"PRAGMA journal_mode = WAL" :
+				"PRAGMA journal_mode = DELETE");
+	if (!result) {
+		LOGP(DDB, LOGL_ERROR, "Failed to set the journal mode.\n");
+		return -EINVAL;
+	}
+
 	dbi_result_free(result);
 	return 0;
 }
 
+void db_set_wal(int wal)
+{
+	use_wal = wal;
+}
+
 int db_init(const char *name)
 {
 	dbi_initialize(NULL);
@@ -265,6 +458,8 @@ int db_init(const char *name)
 	db_dirname = strdup(name);
 	dbi_conn_set_option(conn, "sqlite3_dbdir", dirname(db_dirname));
 	dbi_conn_set_option(conn, "dbname", basename(db_basename));
+	/* the worker might hold a lock */
+	dbi_conn_set_option(conn, "sqlite3_timeout", "5000");
 
 	if (dbi_conn_connect(conn) < 0)
 		goto out_err;
@@ -279,6 +474,135 @@ out_err:
 }
 
 
+static int exten_value(const char *extension, uint32_t *value)
+{
+	unsigned long val;
+	char *end;
+
+	if (!extension || !extension[0])
+		return -EINVAL;
+
+	errno = 0;
+	val = strtoul(extension, &end, 10);
+	if (errno || *end || val > UINT32_MAX - 1)
+		return -EINVAL;
+
+	*value = val;
+	return 0;
+}
+
+/*
+ * Move the reservations of a subscriber along with its TMSI and
+ * extension, the ones it had before are free again.
+ */
+static void reserve_identities(struct gsm_subscriber *subscr)
+{
+	uint32_t exten;
+
+	if (subscr->tmsi != subscr->db_tmsi) {
+		if (subscr->db_tmsi != GSM_RESERVED_TMSI)
+			ident_alloc_release(&tmsi_alloc, subscr->db_tmsi);
+		if (subscr->tmsi != GSM_RESERVED_TMSI)
+			ident_alloc_reserve(&tmsi_alloc, subscr->tmsi);
+		subscr->db_tmsi = subscr->tmsi;
+	}
+
+	if (exten_value(subscr->extension, &exten) != 0)
+		exten = 0;
+	if (exten != subscr->db_exten) {
+		if (subscr->db_exten)
+			ident_alloc_release(&exten_alloc, subscr->db_exten);
+		if (exten)
+			ident_alloc_reserve(&exten_alloc, exten);
+		subscr->db_exten = exten;
+	}
+}
+
+/* the identities of a subscriber read from the HLR are reserved already */
+static void loaded_identities(struct gsm_subscriber *subscr)
+{
+	uint32_t exten;
+
+	subscr->db_tmsi = subscr->tmsi;
+	if (exten_value(subscr->extension, &exten) == 0)
+		subscr->db_exten = exten;
+}
+
+void db_get_identity_stats(unsigned int *tmsis, unsigned int *extensions)
+{
+	*tmsis = tmsi_alloc.used;
+	*extensions = exten_alloc.used;
+}
+
+/* read all TMSIs and extensions once so allocating needs no queries */
+static int load_identities(void)
+{
+	dbi_result result;
+	const char *str;
+	uint32_t exten;
+	int rc;
+
+	rc = ident_alloc_init(&tmsi_alloc, tall_db_ctx, 0, 0x7fffffff, rand());
+	if (rc == 0)
+		rc = ident_alloc_init(&exten_alloc, tall_db_ctx,
+				      GSM_MIN_EXTEN, GSM_MAX_EXTEN, rand());
+	if (rc != 0)
+		return rc;
+
+	result = db_queryf("SELECT tmsi, extension FROM Subscriber");
+	if (!result)
+		return -EIO;
+
+	while (dbi_result_next_row(result)) {
+		str = dbi_result_get_string(result, "tmsi");
+		if (str)
+			ident_alloc_reserve(&tmsi_alloc, strtoul(str, NULL, 10));
+		str = dbi_result_get_string(result, "extension");
+		if (exten_value(str, &exten) == 0)
+			ident_alloc_reserve(&exten_alloc, exten);
+	}
+	dbi_result_free(result);
+
+	LOGP(DDB, LOGL_NOTICE, "Loaded %u TMSIs and %u extensions.\n",
+	     tmsi_alloc.used, exten_alloc.used);
+	return 0;
+}
+
+/* index the unsent SMS so the SMS queue does not need to search */
+static int load_outbox(void)
+{
+	dbi_result result;
+	unsigned int sms, subscrs;
+	int rc;
+
+	rc = sms_outbox_init(tall_db_ctx);
+	if (rc != 0)
+		return rc;
+
+	result = db_queryf(
+		"SELECT SMS.id, SMS.receiver_id, SMS.deliver_attempts, "
+			"Subscriber.lac "
+			"FROM SMS JOIN Subscriber ON "
+				"SMS.receiver_id = Subscriber.id "
+			"WHERE SMS.sent IS NULL ORDER BY SMS.id");
+	if (!result) {
+		sms_outbox_reset();
+		return -EIO;
+	}
+
+	while (dbi_result_next_row(result))
+		sms_outbox_add(dbi_result_get_ulonglong(result, "receiver_id"),
+			       dbi_result_get_ulonglong(result, "id"),
+			       dbi_result_get_uint(result, "deliver_attempts"),
+			       dbi_result_get_ulonglong(result, "lac") > 0);
+	dbi_result_free(result);
+
+	sms_outbox_get_stats(&sms, &subscrs);
+	LOGP(DDB, LOGL_NOTICE, "Loaded %u unsent SMS for %u subscribers.\n",
+	     sms, subscrs);
+	return 0;
+}
+
 int db_prepare(void)
 {
 	dbi_result result;
@@ -302,11 +626,38 @@ int db_prepare(void)
 
 	db_configure();
 
+	if (load_identities() != 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to load the TMSIs and extensions.\n");
+		return 1;
+	}
+
+	/* the queries below are used as long as there is no index */
+	if (load_outbox() != 0)
+		LOGP(DDB, LOGL_ERROR, "Failed to index the unsent SMS.\n");
+
 	return 0;
 }
 
+int db_start_worker(void)
+{
+	if (!tall_db_ctx)
+		tall_db_ctx = talloc_named_const(NULL, 1, "db_req");
+
+	return db_worker_start(dbi_conn_get_option(conn, "sqlite3_dbdir"),
+			       dbi_conn_get_option(conn, "dbname"));
+}
+
+void db_flush_worker(void)
+{
+	db_worker_flush();
+}
+
 int db_fini(void)
 {
+	db_worker_stop();
+	ident_alloc_reset(&tmsi_alloc);
+	ident_alloc_reset(&exten_alloc);
+	sms_outbox_reset();
 	dbi_conn_close(conn);
 	dbi_shutdown();
 
@@ -323,7 +674,7 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi)
 	/* Is this subscriber known in the db? */
 	subscr = db_get_subscriber(GSM_SUBSCRIBER_IMSI, imsi);
 	if (subscr) {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
                          "UPDATE Subscriber set updated = datetime('now') "
                          "WHERE imsi = %s " , imsi);
 		if (!result)
@@ -337,7 +688,7 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi)
 	if (!subscr)
 		return NULL;
 	subscr->flags |= GSM_SUBSCRIBER_FIRST_CONTACT;
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 		"INSERT INTO Subscriber "
 		"(imsi, created, updated) "
 		"VALUES "
@@ -347,7 +698,7 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi)
 	if (!result)
 		LOGP(DDB, LOGL_ERROR, "Failed to create Subscriber by IMSI.\n");
 	subscr->id = dbi_conn_sequence_last(conn, NULL);
-	strncpy(subscr->imsi, imsi, GSM_IMSI_LENGTH-1);
+	subscr_set_imsi(subscr, imsi);
 	dbi_result_free(result);
 	LOGP(DDB, LOGL_INFO, "New Subscriber: ID %llu, IMSI %s\n", subscr->id, subscr->imsi);
 	db_subscriber_alloc_exten(subscr);
@@ -356,27 +707,12 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi)
 
 osmo_static_assert(sizeof(unsigned char) == sizeof(struct gsm48_classmark1), classmark1_size);
 
-static int get_equipment_by_subscr(struct gsm_subscriber *subscr)
+static void equipment_from_result(struct gsm_equipment *equip,
+				  dbi_result result)
 {
-	dbi_result result;
 	const char *string;
 	unsigned char cm1;
 	const unsigned char *cm2, *cm3;
-	struct gsm_equipment *equip = &subscr->equipment;
-
-	result = dbi_conn_queryf(conn,
-		"SELECT Equipment.* "
-			"FROM Equipment JOIN EquipmentWatch ON "
-				"EquipmentWatch.equipment_id=Equipment.id "
-			"WHERE EquipmentWatch.subscriber_id = %llu "
-			"ORDER BY EquipmentWatch.updated DESC", subscr->id);
-	if (!result)
-		return -EIO;
-
-	if (!dbi_result_next_row(result)) {
-		dbi_result_free(result);
-		return -ENOENT;
-	}
 
 	equip->id = dbi_result_get_ulonglong(result, "id");
 
@@ -401,7 +737,29 @@ static int get_equipment_by_subscr(struct gsm_subscriber *subscr)
 	if (equip->classmark3_len > sizeof(equip->classmark3))
 		equip->classmark3_len = sizeof(equip->classmark3);
 	memcpy(equip->classmark3, cm3, equip->classmark3_len);
+}
+
+#define EQUIPMENT_QUERY \
+	"SELECT Equipment.* " \
+		"FROM Equipment JOIN EquipmentWatch ON " \
+			"EquipmentWatch.equipment_id=Equipment.id " \
+		"WHERE EquipmentWatch.subscriber_id = %llu " \
+		"ORDER BY EquipmentWatch.updated DESC"
+
+static int get_equipment_by_subscr(struct gsm_subscriber *subscr)
+{
+	dbi_result result;
+
+	result = db_queryf(EQUIPMENT_QUERY, subscr->id);
+	if (!result)
+		return -EIO;
+
+	if (!dbi_result_next_row(result)) {
+		dbi_result_free(result);
+		return -ENOENT;
+	}
 
+	equipment_from_result(&subscr->equipment, result);
 	dbi_result_free(result);
 
 	return 0;
@@ -413,7 +771,7 @@ int db_get_authinfo_for_subscr(struct gsm_auth_info *ainfo,
 	dbi_result result;
 	const unsigned char *a3a8_ki;
 
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 			"SELECT * FROM AuthKeys WHERE subscriber_id=%llu",
 			 subscr->id);
 	if (!result)
@@ -446,7 +804,7 @@ int db_sync_authinfo_for_subscr(struct gsm_auth_info *ainfo,
 
 	/* Deletion ? */
 	if (ainfo == NULL) {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			"DELETE FROM AuthKeys WHERE subscriber_id=%llu",
 			subscr->id);
 
@@ -469,13 +827,13 @@ int db_sync_authinfo_for_subscr(struct gsm_auth_info *ainfo,
 		ainfo->a3a8_ki, ainfo->a3a8_ki_len, &ki_str);
 
 	if (!upd) {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 				"INSERT INTO AuthKeys "
 				"(subscriber_id, algorithm_id, a3a8_ki) "
 				"VALUES (%llu, %u, %s)",
 				subscr->id, ainfo->auth_algo, ki_str);
 	} else {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 				"UPDATE AuthKeys "
 				"SET algorithm_id=%u, a3a8_ki=%s "
 				"WHERE subscriber_id=%llu",
@@ -499,7 +857,7 @@ int db_get_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 	int len;
 	const unsigned char *blob;
 
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 			"SELECT * FROM AuthLastTuples WHERE subscriber_id=%llu",
 			subscr->id);
 	if (!result)
@@ -555,7 +913,7 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 
 	/* Deletion ? */
 	if (atuple == NULL) {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			"DELETE FROM AuthLastTuples WHERE subscriber_id=%llu",
 			subscr->id);
 
@@ -582,7 +940,7 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 		atuple->kc, sizeof(atuple->kc), &kc_str);
 
 	if (!upd) {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 				"INSERT INTO AuthLastTuples "
 				"(subscriber_id, issued, use_count, "
 				 "key_seq, rand, sres, kc) "
@@ -593,7 +951,7 @@ int db_sync_lastauthtuple_for_subscr(struct gsm_auth_tuple *atuple,
 	} else {
 		char *issued = atuple->key_seq == atuple_old.key_seq ?
 					"issued" : "datetime('now')";
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 				"UPDATE AuthLastTuples "
 				"SET issued=%s, use_count=%u, "
 				 "key_seq=%u, rand=%s, sres=%s, kc=%s "
@@ -619,11 +977,11 @@ static void db_set_from_query(struct gsm_subscriber *subscr, dbi_conn result)
 	const char *string;
 	string = dbi_result_get_string(result, "imsi");
 	if (string)
-		strncpy(subscr->imsi, string, GSM_IMSI_LENGTH);
+		subscr_set_imsi(subscr, string);
 
 	string = dbi_result_get_string(result, "tmsi");
 	if (string)
-		subscr->tmsi = tmsi_from_string(string);
+		subscr_set_tmsi(subscr, tmsi_from_string(string));
 
 	string = dbi_result_get_string(result, "name");
 	if (string)
@@ -652,10 +1010,11 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 	char *quoted;
 	struct gsm_subscriber *subscr;
 
+again:
 	switch (field) {
 	case GSM_SUBSCRIBER_IMSI:
 		dbi_conn_quote_string_copy(conn, id, &quoted);
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			BASE_QUERY
 			"WHERE imsi = %s ",
 			quoted
@@ -664,7 +1023,7 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 		break;
 	case GSM_SUBSCRIBER_TMSI:
 		dbi_conn_quote_string_copy(conn, id, &quoted);
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			BASE_QUERY
 			"WHERE tmsi = %s ",
 			quoted
@@ -673,7 +1032,7 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 		break;
 	case GSM_SUBSCRIBER_EXTENSION:
 		dbi_conn_quote_string_copy(conn, id, &quoted);
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			BASE_QUERY
 			"WHERE extension = %s ",
 			quoted
@@ -682,7 +1041,7 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 		break;
 	case GSM_SUBSCRIBER_ID:
 		dbi_conn_quote_string_copy(conn, id, &quoted);
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			BASE_QUERY
 			"WHERE id = %s ", quoted);
 		free(quoted);
@@ -696,16 +1055,30 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 		return NULL;
 	}
 	if (!dbi_result_next_row(result)) {
+		/* a queued write might hand out the TMSI or extension */
+		if ((field == GSM_SUBSCRIBER_TMSI
+		     || field == GSM_SUBSCRIBER_EXTENSION)
+		    && wait_any(&subscr_writes)) {
+			dbi_result_free(result);
+			goto again;
+		}
 		DEBUGP(DDB, "Failed to find the Subscriber. '%u' '%s'\n",
 			field, id);
 		dbi_result_free(result);
 		return NULL;
 	}
 
+	/* the row is stale while the worker still has to update it */
+	if (wait_row(&subscr_writes, dbi_result_get_ulonglong(result, "id"))) {
+		dbi_result_free(result);
+		goto again;
+	}
+
 	subscr = subscr_alloc();
 	subscr->id = dbi_result_get_ulonglong(result, "id");
 
 	db_set_from_query(subscr, result);
+	loaded_identities(subscr);
 	DEBUGP(DDB, "Found Subscriber: ID %llu, IMSI %s, NAME '%s', TMSI %u, EXTEN '%s', LAC %hu, AUTH %u\n",
 		subscr->id, subscr->imsi, subscr->name, subscr->tmsi, subscr->extension,
 		subscr->lac, subscr->authorized);
@@ -716,14 +1089,212 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 	return subscr;
 }
 
+/*
+ * A subscriber looked up by the worker. The row is copied into the
+ * request and the subscriber is only allocated in the main loop.
+ */
+struct db_subscr_lookup {
+	struct db_query_req qreq;
+	struct gsm_network *net;
+	void (*cb)(struct gsm_subscriber *subscr, void *data);
+	void *data;
+
+	/* filled in by the worker */
+	int found;
+	unsigned long long id;
+	char imsi[GSM_IMSI_LENGTH];
+	char tmsi[14];
+	char name[GSM_NAME_LENGTH];
+	char extension[GSM_EXTENSION_LENGTH];
+	uint16_t lac;
+	int expires;
+	time_t expire_lu;
+	int authorized;
+	int has_equipment;
+	struct gsm_equipment equipment;
+};
+
+static void copy_string(char *dst, dbi_result result, const char *field,
+			size_t len)
+{
+	const char *string = dbi_result_get_string(result, field);
+
+	if (string)
+		strncpy(dst, string, len - 1);
+}
+
+static int db_lookup_run(dbi_conn wconn, struct db_req *req)
+{
+	struct db_subscr_lookup *lookup = (struct db_subscr_lookup *) req;
+	dbi_result result;
+
+	result = dbi_conn_query(wconn, lookup->qreq.query);
+	if (!result)
+		return -EIO;
+
+	if (!dbi_result_next_row(result)) {
+		dbi_result_free(result);
+		return 0;
+	}
+
+	lookup->found = 1;
+	lookup->id = dbi_result_get_ulonglong(result, "id");
+	copy_string(lookup->imsi, result, "imsi", sizeof(lookup->imsi));
+	copy_string(lookup->tmsi, result, "tmsi", sizeof(lookup->tmsi));
+	copy_string(lookup->name, result, "name", sizeof(lookup->name));
+	copy_string(lookup->extension, result, "extension",
+		    sizeof(lookup->extension));
+	lookup->lac = dbi_result_get_ulonglong(result, "lac");
+	lookup->expires = !dbi_result_field_is_null(result, "expire_lu");
+	if (lookup->expires)
+		lookup->expire_lu = dbi_result_get_datetime(result, "expire_lu");
+	lookup->authorized = dbi_result_get_ulonglong(result, "authorized");
+	dbi_result_free(result);
+
+	result = dbi_conn_queryf(wconn, EQUIPMENT_QUERY, lookup->id);
+	if (!result)
+		return 0;
+	if (dbi_result_next_row(result)) {
+		equipment_from_result(&lookup->equipment, result);
+		lookup->has_equipment = 1;
+	}
+	dbi_result_free(result);
+	return 0;
+}
+
+static struct gsm_subscriber *subscr_from_lookup(struct db_subscr_lookup *lookup)
+{
+	struct gsm_subscriber *subscr;
+
+	subscr = subscr_alloc();
+	if (!subscr)
+		return NULL;
+
+	subscr->id = lookup->id;
+	subscr->net = lookup->net;
+	subscr_set_imsi(subscr, lookup->imsi);
+	if (lookup->tmsi[0])
+		subscr_set_tmsi(subscr, tmsi_from_string(lookup->tmsi));
+	memcpy(subscr->name, lookup->name, GSM_NAME_LENGTH);
+	memcpy(subscr->extension, lookup->extension, GSM_EXTENSION_LENGTH);
+	subscr->lac = lookup->lac;
+	if (lookup->expires)
+		subscr->expire_lu = lookup->expire_lu;
+	else
+		subscr->expire_lu = GSM_SUBSCRIBER_NO_EXPIRATION;
+	subscr->authorized = lookup->authorized;
+	if (lookup->has_equipment)
+		subscr->equipment = lookup->equipment;
+	loaded_identities(subscr);
+
+	DEBUGP(DDB, "Found Subscriber: ID %llu, IMSI %s, NAME '%s', TMSI %u, EXTEN '%s', LAC %hu, AUTH %u\n",
+		subscr->id, subscr->imsi, subscr->name, subscr->tmsi, subscr->extension,
+		subscr->lac, subscr->authorized);
+	return subscr;
+}
+
+static void db_lookup_done(struct db_req *req)
+{
+	struct db_subscr_lookup *lookup = (struct db_subscr_lookup *) req;
+	struct gsm_subscriber *subscr = NULL;
+
+	/* cancelled */
+	if (!lookup->cb)
+		return;
+
+	/*
+	 * Somebody else might have loaded the subscriber in the meantime,
+	 * the one in RAM is at least as recent as the row.
+	 */
+	if (lookup->found) {
+		subscr = subscr_find_by_imsi(NULL, lookup->imsi);
+		if (subscr)
+			subscr_get(subscr);
+		else
+			subscr = subscr_from_lookup(lookup);
+	}
+
+	lookup->cb(subscr, lookup->data);
+}
+
+/*
+ * Like db_get_subscriber() for the IMSI or TMSI but the query is
+ * executed by the worker, which also orders it after all queued writes.
+ * The callback gets a reference to the subscriber or NULL when it is
+ * unknown. Without a worker it is invoked before returning and NULL is
+ * returned, otherwise the pending lookup that can be cancelled.
+ */
+struct db_subscr_lookup *db_get_subscriber_async(struct gsm_network *net,
+			enum gsm_subscriber_field field, const char *id,
+			void (*cb)(struct gsm_subscriber *subscr, void *data),
+			void *data)
+{
+	struct db_subscr_lookup *lookup;
+	struct gsm_subscriber *subscr;
+	const char *column;
+	char *quoted;
+
+	switch (field) {
+	case GSM_SUBSCRIBER_IMSI:
+		column = "imsi";
+		break;
+	case GSM_SUBSCRIBER_TMSI:
+		column = "tmsi";
+		break;
+	default:
+		LOGP(DDB, LOGL_NOTICE, "Unknown query selector for Subscriber.\n");
+		cb(NULL, data);
+		return NULL;
+	}
+
+	if (!db_worker_running()) {
+		subscr = db_get_subscriber(field, id);
+		if (subscr)
+			subscr->net = net;
+		cb(subscr, data);
+		return NULL;
+	}
+
+	dbi_conn_quote_string_copy(conn, id, &quoted);
+	lookup = (struct db_subscr_lookup *) db_query_req_allocf(
+				sizeof(*lookup), "look up the Subscriber",
+				BASE_QUERY "WHERE %s = %s", column, quoted);
+	free(quoted);
+	if (!lookup) {
+		cb(NULL, data);
+		return NULL;
+	}
+
+	lookup->qreq.req.run = db_lookup_run;
+	lookup->qreq.req.done = db_lookup_done;
+	lookup->net = net;
+	lookup->cb = cb;
+	lookup->data = data;
+	if (db_worker_submit(&lookup->qreq.req) != 0) {
+		talloc_free(lookup);
+		cb(NULL, data);
+		return NULL;
+	}
+
+	return lookup;
+}
+
+/* the callback of a pending lookup will not be invoked */
+void db_get_subscriber_cancel(struct db_subscr_lookup *lookup)
+{
+	lookup->cb = NULL;
+}
+
 int db_subscriber_update(struct gsm_subscriber *subscr)
 {
 	char buf[32];
 	dbi_result result;
 
+	wait_row(&subscr_writes, subscr->id);
+
 	/* Copy the id to a string as queryf with %llu is failing */
 	sprintf(buf, "%llu", subscr->id);
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 			BASE_QUERY
 			"WHERE id = %s", buf);
 
@@ -745,12 +1316,99 @@ int db_subscriber_update(struct gsm_subscriber *subscr)
 	return 0;
 }
 
-int db_sync_subscriber(struct gsm_subscriber *subscriber)
+struct db_subscr_req {
+	struct db_query_req qreq;
+	struct gsm_subscriber *subscr;
+
+	/* filled in by the worker */
+	int found;
+	char name[GSM_NAME_LENGTH];
+	char extension[GSM_EXTENSION_LENGTH];
+	int authorized;
+};
+
+static int db_subscr_req_run(dbi_conn wconn, struct db_req *req)
 {
+	struct db_subscr_req *sreq = (struct db_subscr_req *) req;
 	dbi_result result;
+	const char *string;
+
+	result = dbi_conn_query(wconn, sreq->qreq.query);
+	if (!result)
+		return -EIO;
+
+	if (dbi_result_next_row(result)) {
+		string = dbi_result_get_string(result, "name");
+		if (string)
+			strncpy(sreq->name, string, GSM_NAME_LENGTH);
+		string = dbi_result_get_string(result, "extension");
+		if (string)
+			strncpy(sreq->extension, string, GSM_EXTENSION_LENGTH);
+		sreq->authorized = dbi_result_get_ulonglong(result, "authorized");
+		sreq->found = 1;
+	}
+
+	dbi_result_free(result);
+	return 0;
+}
+
+static void db_subscr_req_done(struct db_req *req)
+{
+	struct db_subscr_req *sreq = (struct db_subscr_req *) req;
+	struct gsm_subscriber *subscr = sreq->subscr;
+
+	if (sreq->found) {
+		memcpy(subscr->name, sreq->name, GSM_NAME_LENGTH);
+		memcpy(subscr->extension, sreq->extension, GSM_EXTENSION_LENGTH);
+		subscr->authorized = sreq->authorized;
+	}
+
+	subscr_put(subscr);
+}
+
+/*
+ * Refresh the fields that are administered in the database. The
+ * location and the TMSI are left alone as they might have changed
+ * while the query was pending. Without a worker this is the same as
+ * db_subscriber_update().
+ */
+int db_subscriber_update_async(struct gsm_subscriber *subscr)
+{
+	struct db_subscr_req *sreq;
+	char buf[32];
+	int rc;
+
+	if (!db_worker_running())
+		return db_subscriber_update(subscr);
+
+	sprintf(buf, "%llu", subscr->id);
+	sreq = (struct db_subscr_req *) db_query_req_allocf(sizeof(*sreq),
+				"refresh the Subscriber",
+				BASE_QUERY "WHERE id = %s", buf);
+	if (!sreq)
+		return -ENOMEM;
+
+	sreq->qreq.req.run = db_subscr_req_run;
+	sreq->qreq.req.done = db_subscr_req_done;
+	sreq->subscr = subscr_get(subscr);
+	rc = db_worker_submit(&sreq->qreq.req);
+	if (rc < 0) {
+		subscr_put(subscr);
+		talloc_free(sreq);
+	}
+	return rc;
+}
+
+int db_sync_subscriber(struct gsm_subscriber *subscriber)
+{
 	char tmsi[14];
+	int rc;
 	char *q_tmsi, *q_name, *q_extension;
 
+	/* an extension might have been set through the VTY */
+	reserve_identities(subscriber);
+	sms_outbox_set_attached(subscriber->id, subscriber->lac > 0);
+
 	dbi_conn_quote_string_copy(conn, 
 				   subscriber->name, &q_name);
 	dbi_conn_quote_string_copy(conn, 
@@ -765,7 +1423,7 @@ int db_sync_subscriber(struct gsm_subscriber *subscriber)
 		q_tmsi = strdup("NULL");
 
 	if (subscriber->expire_lu == GSM_SUBSCRIBER_NO_EXPIRATION) {
-		result = dbi_conn_queryf(conn,
+		rc = db_writef("update the Subscriber",
 			"UPDATE Subscriber "
 			"SET updated = datetime('now'), "
 			"name = %s, "
@@ -782,7 +1440,7 @@ int db_sync_subscriber(struct gsm_subscriber *subscriber)
 			subscriber->lac,
 			subscriber->imsi);
 	} else {
-		result = dbi_conn_queryf(conn,
+		rc = db_writef("update the Subscriber",
 			"UPDATE Subscriber "
 			"SET updated = datetime('now'), "
 			"name = %s, "
@@ -805,13 +1463,12 @@ int db_sync_subscriber(struct gsm_subscriber *subscriber)
 	free(q_name);
 	free(q_extension);
 
-	if (!result) {
+	if (rc < 0) {
 		LOGP(DDB, LOGL_ERROR, "Failed to update Subscriber (by IMSI).\n");
 		return 1;
 	}
 
-	dbi_result_free(result);
-
+	pending_row(&subscr_writes, subscriber->id);
 	return 0;
 }
 
@@ -839,7 +1496,7 @@ int db_sync_equipment(struct gsm_equipment *equip)
 				   equip->classmark3_len, &cm3);
 	dbi_conn_quote_string_copy(conn, equip->imei, &q_imei);
 
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 		"UPDATE Equipment SET "
 			"updated = datetime('now'), "
 			"classmark1 = %u, "
@@ -861,98 +1518,164 @@ int db_sync_equipment(struct gsm_equipment *equip)
 	return 0;
 }
 
-int db_subscriber_expire(void *priv, void (*callback)(void *priv, long long unsigned int id))
+#define EXPIRED_SUBSCRIBERS \
+	"lac != 0 AND expire_lu IS NOT NULL AND expire_lu < datetime('now')"
+
+struct db_expire_req {
+	struct db_req req;
+	unsigned int max;
+	void (*cb)(void *priv, unsigned long long *ids, unsigned int num,
+		   unsigned int backlog);
+	void *priv;
+
+	/* filled in by the worker */
+	unsigned int num;
+	unsigned int backlog;
+	unsigned long long ids[0];
+};
+
+static int db_expire_req_run(dbi_conn wconn, struct db_req *req)
 {
+	struct db_expire_req *ereq = (struct db_expire_req *) req;
 	dbi_result result;
 
-	result = dbi_conn_query(conn,
-			"SELECT id "
-			"FROM Subscriber "
-			"WHERE lac != 0 AND "
-				"( expire_lu is NOT NULL "
-				"AND expire_lu < datetime('now') ) "
-			"LIMIT 1");
-	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to get expired subscribers\n");
+	result = dbi_conn_queryf(wconn,
+			"SELECT id FROM Subscriber "
+			"WHERE " EXPIRED_SUBSCRIBERS " "
+			"ORDER BY expire_lu LIMIT %u", ereq->max);
+	if (!result)
 		return -EIO;
-	}
 
-	while (dbi_result_next_row(result))
-		callback(priv, dbi_result_get_ulonglong(result, "id"));
+	while (ereq->num < ereq->max && dbi_result_next_row(result))
+		ereq->ids[ereq->num++] = dbi_result_get_ulonglong(result, "id");
+	dbi_result_free(result);
+
+	result = dbi_conn_query(wconn,
+			"SELECT count(*) AS backlog FROM Subscriber "
+			"WHERE " EXPIRED_SUBSCRIBERS);
+	if (!result)
+		return -EIO;
 
+	if (dbi_result_next_row(result))
+		ereq->backlog = dbi_result_get_ulonglong(result, "backlog");
 	dbi_result_free(result);
 	return 0;
 }
 
-int db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber)
+static void db_expire_req_done(struct db_req *req)
 {
-	dbi_result result = NULL;
-	char tmsi[14];
-	char *tmsi_quoted;
+	struct db_expire_req *ereq = (struct db_expire_req *) req;
 
-	for (;;) {
-		subscriber->tmsi = rand();
-		if (subscriber->tmsi == GSM_RESERVED_TMSI)
-			continue;
+	if (req->rc < 0)
+		ereq->num = ereq->backlog = 0;
+	ereq->cb(ereq->priv, ereq->ids, ereq->num, ereq->backlog);
+}
 
-		sprintf(tmsi, "%u", subscriber->tmsi);
-		dbi_conn_quote_string_copy(conn, tmsi, &tmsi_quoted);
-		result = dbi_conn_queryf(conn,
-			"SELECT * FROM Subscriber "
-			"WHERE tmsi = %s ",
-			tmsi_quoted);
+/*
+ * Look up to max subscribers with an expired location update and the
+ * number of all of them. The callback is invoked from the main loop,
+ * right away without a worker. Nothing is changed until the ids are
+ * passed to db_subscriber_expire_ids().
+ */
+int db_subscriber_expire(unsigned int max,
+			 void (*cb)(void *priv, unsigned long long *ids,
+				    unsigned int num, unsigned int backlog),
+			 void *priv)
+{
+	struct db_expire_req *ereq;
+	int rc;
+
+	ereq = talloc_zero_size(tall_db_ctx, sizeof(*ereq) +
+					max * sizeof(ereq->ids[0]));
+	if (!ereq)
+		return -ENOMEM;
+
+	ereq->req.what = "find the expired subscribers";
+	ereq->req.run = db_expire_req_run;
+	ereq->req.done = db_expire_req_done;
+	ereq->max = max;
+	ereq->cb = cb;
+	ereq->priv = priv;
+
+	if (db_worker_running()) {
+		rc = db_worker_submit(&ereq->req);
+		if (rc < 0)
+			talloc_free(ereq);
+		return rc;
+	}
 
-		free(tmsi_quoted);
+	ereq->req.rc = db_expire_req_run(conn, &ereq->req);
+	if (ereq->req.rc < 0)
+		LOGP(DDB, LOGL_ERROR, "Failed to get expired subscribers\n");
+	db_expire_req_done(&ereq->req);
+	talloc_free(ereq);
+	return 0;
+}
 
-		if (!result) {
-			LOGP(DDB, LOGL_ERROR, "Failed to query Subscriber "
-				"while allocating new TMSI.\n");
-			return 1;
-		}
-		if (dbi_result_get_numrows(result)) {
-			dbi_result_free(result);
-			continue;
-		}
-		if (!dbi_result_next_row(result)) {
-			dbi_result_free(result);
-			DEBUGP(DDB, "Allocated TMSI %u for IMSI %s.\n",
-				subscriber->tmsi, subscriber->imsi);
-			return db_sync_subscriber(subscriber);
-		}
-		dbi_result_free(result);
+/* detach all of them with one statement, unless they got updated since */
+int db_subscriber_expire_ids(unsigned long long *ids, unsigned int num)
+{
+	char *list;
+	unsigned int i;
+	int rc;
+
+	if (num == 0)
+		return 0;
+
+	list = talloc_asprintf(tall_db_ctx, "%llu", ids[0]);
+	for (i = 1; list && i < num; ++i)
+		list = talloc_asprintf_append(list, ",%llu", ids[i]);
+	if (!list)
+		return -ENOMEM;
+
+	rc = db_writef("expire the Subscribers",
+		"UPDATE Subscriber "
+		"SET updated = datetime('now'), lac = %i "
+		"WHERE " EXPIRED_SUBSCRIBERS " AND id IN (%s)",
+		GSM_LAC_RESERVED_DETACHED, list);
+	talloc_free(list);
+	if (rc < 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to expire %u subscribers.\n", num);
+		return rc;
 	}
+
+	pending_all(&subscr_writes);
+
+	for (i = 0; i < num; ++i)
+		sms_outbox_set_attached(ids[i], 0);
 	return 0;
 }
 
+int db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber)
+{
+	uint32_t tmsi;
+
+	if (ident_alloc_get(&tmsi_alloc, &tmsi) != 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to allocate a TMSI for "
+			"IMSI %s.\n", subscriber->imsi);
+		return 1;
+	}
+
+	/* the old one is released by the sync */
+	subscr_set_tmsi(subscriber, tmsi);
+
+	DEBUGP(DDB, "Allocated TMSI %u for IMSI %s.\n",
+		subscriber->tmsi, subscriber->imsi);
+	return db_sync_subscriber(subscriber);
+}
+
 int db_subscriber_alloc_exten(struct gsm_subscriber *subscriber)
 {
-	dbi_result result = NULL;
-	uint32_t try;
+	uint32_t exten;
 
-	for (;;) {
-		try = (rand()%(GSM_MAX_EXTEN-GSM_MIN_EXTEN+1)+GSM_MIN_EXTEN);
-		result = dbi_conn_queryf(conn,
-			"SELECT * FROM Subscriber "
-			"WHERE extension = %i",
-			try
-		);
-		if (!result) {
-			LOGP(DDB, LOGL_ERROR, "Failed to query Subscriber "
-				"while allocating new extension.\n");
-			return 1;
-		}
-		if (dbi_result_get_numrows(result)){
-			dbi_result_free(result);
-			continue;
-		}
-		if (!dbi_result_next_row(result)) {
-			dbi_result_free(result);
-			break;
-		}
-		dbi_result_free(result);
+	if (ident_alloc_get(&exten_alloc, &exten) != 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to allocate an extension for "
+			"IMSI %s.\n", subscriber->imsi);
+		return 1;
 	}
-	sprintf(subscriber->extension, "%i", try);
-	DEBUGP(DDB, "Allocated extension %i for IMSI %s.\n", try, subscriber->imsi);
+
+	sprintf(subscriber->extension, "%u", exten);
+	DEBUGP(DDB, "Allocated extension %u for IMSI %s.\n", exten, subscriber->imsi);
 	return db_sync_subscriber(subscriber);
 }
 /*
@@ -970,7 +1693,7 @@ int db_subscriber_alloc_token(struct gsm_subscriber *subscriber, uint32_t *token
 		try = rand();
 		if (!try) /* 0 is an invalid token */
 			continue;
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			"SELECT * FROM AuthToken "
 			"WHERE subscriber_id = %llu OR token = \"%08X\" ",
 			subscriber->id, try);
@@ -989,7 +1712,7 @@ int db_subscriber_alloc_token(struct gsm_subscriber *subscriber, uint32_t *token
 		}
 		dbi_result_free(result);
 	}
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 		"INSERT INTO AuthToken "
 		"(subscriber_id, created, token) "
 		"VALUES "
@@ -1015,7 +1738,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM_IM
 	strncpy(subscriber->equipment.imei, imei,
 		sizeof(subscriber->equipment.imei)-1);
 
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 		"INSERT OR IGNORE INTO Equipment "
 		"(imei, created, updated) "
 		"VALUES "
@@ -1035,7 +1758,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM_IM
 	if (equipment_id)
 		DEBUGP(DDB, "New Equipment: ID %llu, IMEI %s\n", equipment_id, imei);
 	else {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			"SELECT id FROM Equipment "
 			"WHERE imei = %s ",
 			imei
@@ -1053,7 +1776,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM_IM
 		dbi_result_free(result);
 	}
 
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 		"INSERT OR IGNORE INTO EquipmentWatch "
 		"(subscriber_id, equipment_id, created, updated) "
 		"VALUES "
@@ -1073,7 +1796,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM_IM
 		DEBUGP(DDB, "New EquipmentWatch: ID %llu, IMSI %s, IMEI %s\n",
 			equipment_id, subscriber->imsi, imei);
 	else {
-		result = dbi_conn_queryf(conn,
+		result = db_queryf(
 			"UPDATE EquipmentWatch "
 			"SET updated = datetime('now') "
 			"WHERE subscriber_id = %llu AND equipment_id = %llu ",
@@ -1105,7 +1828,7 @@ int db_sms_store(struct gsm_sms *sms)
 	dbi_conn_quote_binary_copy(conn, sms->user_data, sms->user_data_len,
 				   &q_udata);
 	/* FIXME: correct validity period */
-	result = dbi_conn_queryf(conn,
+	result = db_queryf(
 		"INSERT INTO SMS "
 		"(created, sender_id, receiver_id, valid_until, "
 		 "reply_path_req, status_rep_req, protocol_id, "
@@ -1126,27 +1849,25 @@ int db_sms_store(struct gsm_sms *sms)
 		return -EIO;
 
 	dbi_result_free(result);
+	if (sms->receiver)
+		sms_outbox_add(sms->receiver->id,
+			       dbi_conn_sequence_last(conn, NULL), 0,
+			       sms->receiver->lac > 0);
 	return 0;
 }
 
-static struct gsm_sms *sms_from_result(struct gsm_network *net, dbi_result result)
+/* fill in everything but the subscribers, this runs on the worker too */
+static void sms_fill_from_result(struct gsm_sms *sms,
+				 unsigned long long *sender_id,
+				 unsigned long long *receiver_id,
+				 dbi_result result)
 {
-	struct gsm_sms *sms = sms_alloc();
-	long long unsigned int sender_id, receiver_id;
 	const char *text, *daddr;
 	const unsigned char *user_data;
 
-	if (!sms)
-		return NULL;
-
 	sms->id = dbi_result_get_ulonglong(result, "id");
-
-	sender_id = dbi_result_get_ulonglong(result, "sender_id");
-	sms->sender = subscr_get_by_id(net, sender_id);
-	strncpy(sms->src.addr, sms->sender->extension, sizeof(sms->src.addr)-1);
-
-	receiver_id = dbi_result_get_ulonglong(result, "receiver_id");
-	sms->receiver = subscr_get_by_id(net, receiver_id);
+	*sender_id = dbi_result_get_ulonglong(result, "sender_id");
+	*receiver_id = dbi_result_get_ulonglong(result, "receiver_id");
 
 	/* FIXME: validity */
 	/* FIXME: those should all be get_uchar, but sqlite3 is braindead */
@@ -1175,6 +1896,28 @@ static struct gsm_sms *sms_from_result(struct gsm_network *net, dbi_result resul
 		strncpy(sms->text, text, sizeof(sms->text));
 		sms->text[sizeof(sms->text)-1] = '\0';
 	}
+}
+
+static void sms_set_subscribers(struct gsm_network *net, struct gsm_sms *sms,
+				unsigned long long sender_id,
+				unsigned long long receiver_id)
+{
+	sms->sender = subscr_get_by_id(net, sender_id);
+	strncpy(sms->src.addr, sms->sender->extension, sizeof(sms->src.addr)-1);
+
+	sms->receiver = subscr_get_by_id(net, receiver_id);
+}
+
+static struct gsm_sms *sms_from_result(struct gsm_network *net, dbi_result result)
+{
+	struct gsm_sms *sms = sms_alloc();
+	long long unsigned int sender_id, receiver_id;
+
+	if (!sms)
+		return NULL;
+
+	sms_fill_from_result(sms, &sender_id, &receiver_id, result);
+	sms_set_subscribers(net, sms, sender_id, receiver_id);
 	return sms;
 }
 
@@ -1183,7 +1926,8 @@ struct gsm_sms *db_sms_get(struct gsm_network *net, unsigned long long id)
 	dbi_result result;
 	struct gsm_sms *sms;
 
-	result = dbi_conn_queryf(conn,
+	wait_row(&sms_writes, id);
+	result = db_queryf(
 		"SELECT * FROM SMS WHERE SMS.id = %llu", id);
 	if (!result)
 		return NULL;
@@ -1206,7 +1950,9 @@ struct gsm_sms *db_sms_get_unsent(struct gsm_network *net, unsigned long long mi
 	dbi_result result;
 	struct gsm_sms *sms;
 
-	result = dbi_conn_queryf(conn,
+	wait_any(&subscr_writes);
+	wait_any(&sms_writes);
+	result = db_queryf(
 		"SELECT SMS.* "
 			"FROM SMS JOIN Subscriber ON "
 				"SMS.receiver_id = Subscriber.id "
@@ -1229,21 +1975,31 @@ struct gsm_sms *db_sms_get_unsent(struct gsm_network *net, unsigned long long mi
 	return sms;
 }
 
+#define UNSENT_BY_SUBSCR_QUERY \
+	"SELECT SMS.* " \
+		"FROM SMS JOIN Subscriber ON " \
+			"SMS.receiver_id = Subscriber.id " \
+		"WHERE SMS.receiver_id >= %llu AND SMS.sent IS NULL " \
+			"AND Subscriber.lac > 0 AND SMS.deliver_attempts < %u " \
+		"ORDER BY SMS.receiver_id, SMS.id LIMIT 1"
+
 struct gsm_sms *db_sms_get_unsent_by_subscr(struct gsm_network *net,
 					    unsigned long long min_subscr_id,
 					    unsigned int failed)
 {
 	dbi_result result;
 	struct gsm_sms *sms;
+	unsigned long long id;
 
-	result = dbi_conn_queryf(conn,
-		"SELECT SMS.* "
-			"FROM SMS JOIN Subscriber ON "
-				"SMS.receiver_id = Subscriber.id "
-			"WHERE SMS.receiver_id >= %llu AND SMS.sent IS NULL "
-				"AND Subscriber.lac > 0 AND SMS.deliver_attempts < %u "
-			"ORDER BY SMS.receiver_id, SMS.id LIMIT 1",
-		min_subscr_id, failed);
+	if (sms_outbox_active()) {
+		if (sms_outbox_next(min_subscr_id, failed, &id) != 0)
+			return NULL;
+		return db_sms_get(net, id);
+	}
+
+	wait_any(&subscr_writes);
+	wait_any(&sms_writes);
+	result = db_queryf(UNSENT_BY_SUBSCR_QUERY, min_subscr_id, failed);
 	if (!result)
 		return NULL;
 
@@ -1259,13 +2015,136 @@ struct gsm_sms *db_sms_get_unsent_by_subscr(struct gsm_network *net,
 	return sms;
 }
 
+struct db_sms_req {
+	struct db_query_req qreq;
+	struct gsm_network *net;
+	void (*cb)(struct gsm_sms *sms, void *data);
+	void *data;
+
+	/* the SMS picked from the outbox and how it was found */
+	unsigned long long sms_id;
+	unsigned long long min_subscr_id;
+	unsigned int failed;
+
+	/* filled in by the worker */
+	int found;
+	struct gsm_sms sms;
+	unsigned long long sender_id;
+	unsigned long long receiver_id;
+};
+
+static int db_sms_req_run(dbi_conn wconn, struct db_req *req)
+{
+	struct db_sms_req *sreq = (struct db_sms_req *) req;
+	dbi_result result;
+
+	result = dbi_conn_query(wconn, sreq->qreq.query);
+	if (!result)
+		return -EIO;
+
+	if (dbi_result_next_row(result)) {
+		sms_fill_from_result(&sreq->sms, &sreq->sender_id,
+				     &sreq->receiver_id, result);
+		sreq->found = 1;
+	}
+
+	dbi_result_free(result);
+	return 0;
+}
+
+static void db_sms_req_done(struct db_req *req)
+{
+	struct db_sms_req *sreq = (struct db_sms_req *) req;
+	struct gsm_sms *sms = NULL;
+
+	/*
+	 * Sent in the meantime, look for the next one. A failed query
+	 * leaves the outbox alone, the SMS is tried again later.
+	 */
+	if (req->rc == 0 && !sreq->found && sreq->sms_id) {
+		sms_outbox_remove(sreq->sms_id);
+		if (db_sms_get_unsent_by_subscr_async(sreq->net,
+					sreq->min_subscr_id, sreq->failed,
+					sreq->cb, sreq->data) == 0)
+			return;
+	}
+
+	if (sreq->found)
+		sms = sms_alloc();
+	if (sms) {
+		*sms = sreq->sms;
+		sms_set_subscribers(sreq->net, sms, sreq->sender_id,
+				    sreq->receiver_id);
+	}
+
+	sreq->cb(sms, sreq->data);
+}
+
+/*
+ * Like db_sms_get_unsent_by_subscr() but the query is executed by the
+ * worker. Without a worker the callback is invoked before returning.
+ */
+int db_sms_get_unsent_by_subscr_async(struct gsm_network *net,
+				      unsigned long long min_subscr_id,
+				      unsigned int failed,
+				      void (*cb)(struct gsm_sms *sms, void *data),
+				      void *data)
+{
+	struct db_sms_req *sreq;
+	unsigned long long id = 0;
+	int rc;
+
+	if (!db_worker_running()) {
+		cb(db_sms_get_unsent_by_subscr(net, min_subscr_id, failed), data);
+		return 0;
+	}
+
+	if (sms_outbox_active()) {
+		if (sms_outbox_next(min_subscr_id, failed, &id) != 0) {
+			cb(NULL, data);
+			return 0;
+		}
+		sreq = (struct db_sms_req *) db_query_req_allocf(sizeof(*sreq),
+				"query the unsent SMS",
+				"SELECT * FROM SMS "
+				"WHERE id = %llu AND sent IS NULL", id);
+	} else
+		sreq = (struct db_sms_req *) db_query_req_allocf(sizeof(*sreq),
+				"query the unsent SMS",
+				UNSENT_BY_SUBSCR_QUERY, min_subscr_id, failed);
+	if (!sreq)
+		return -ENOMEM;
+
+	sreq->qreq.req.run = db_sms_req_run;
+	sreq->qreq.req.done = db_sms_req_done;
+	sreq->net = net;
+	sreq->cb = cb;
+	sreq->data = data;
+	sreq->sms_id = id;
+	sreq->min_subscr_id = min_subscr_id;
+	sreq->failed = failed;
+	rc = db_worker_submit(&sreq->qreq.req);
+	if (rc < 0)
+		talloc_free(sreq);
+	return rc;
+}
+
 /* retrieve the next unsent SMS for a given subscriber */
 struct gsm_sms *db_sms_get_unsent_for_subscr(struct gsm_subscriber *subscr)
 {
 	dbi_result result;
 	struct gsm_sms *sms;
+	unsigned long long id;
 
-	result = dbi_conn_queryf(conn,
+	if (sms_outbox_active()) {
+		if (sms_outbox_first(subscr->id, &id) != 0)
+			return NULL;
+		return db_sms_get(subscr->net, id);
+	}
+
+	wait_row(&subscr_writes, subscr->id);
+	wait_any(&sms_writes);
+	result = db_queryf(
 		"SELECT SMS.* "
 			"FROM SMS JOIN Subscriber ON "
 				"SMS.receiver_id = Subscriber.id "
@@ -1291,37 +2170,43 @@ struct gsm_sms *db_sms_get_unsent_for_subscr(struct gsm_subscriber *subscr)
 /* mark a given SMS as read */
 int db_sms_mark_sent(struct gsm_sms *sms)
 {
-	dbi_result result;
+	int rc;
 
-	result = dbi_conn_queryf(conn,
+	rc = db_writef("mark a SMS as sent",
 		"UPDATE SMS "
 		"SET sent = datetime('now') "
 		"WHERE id = %llu", sms->id);
-	if (!result) {
+	if (rc < 0) {
 		LOGP(DDB, LOGL_ERROR, "Failed to mark SMS %llu as sent.\n", sms->id);
 		return 1;
 	}
 
-	dbi_result_free(result);
+	pending_row(&sms_writes, sms->id);
+
+	sms_outbox_remove(sms->id);
+
 	return 0;
 }
 
 /* increase the number of attempted deliveries */
 int db_sms_inc_deliver_attempts(struct gsm_sms *sms)
 {
-	dbi_result result;
+	int rc;
 
-	result = dbi_conn_queryf(conn,
+	rc = db_writef("increase the SMS deliver attempts",
 		"UPDATE SMS "
 		"SET deliver_attempts = deliver_attempts + 1 "
 		"WHERE id = %llu", sms->id);
-	if (!result) {
+	if (rc < 0) {
 		LOGP(DDB, LOGL_ERROR, "Failed to inc deliver attempts for "
 			"SMS %llu.\n", sms->id);
 		return 1;
 	}
 
-	dbi_result_free(result);
+	pending_row(&sms_writes, sms->id);
+
+	sms_outbox_inc_attempts(sms->id);
+
 	return 0;
 }
 
@@ -1329,82 +2214,106 @@ int db_apdu_blob_store(struct gsm_subscriber *subscr,
 			uint8_t apdu_id_flags, uint8_t len,
 			uint8_t *apdu)
 {
-	dbi_result result;
 	unsigned char *q_apdu;
+	int rc;
 
 	dbi_conn_quote_binary_copy(conn, apdu, len, &q_apdu);
 
-	result = dbi_conn_queryf(conn,
+	rc = db_writef("store an APDU",
 		"INSERT INTO ApduBlobs "
 		"(created,subscriber_id,apdu_id_flags,apdu) VALUES "
 		"(datetime('now'),%llu,%u,%s)",
 		subscr->id, apdu_id_flags, q_apdu);
 
 	free(q_apdu);
-
-	if (!result)
-		return -EIO;
-
-	dbi_result_free(result);
-	return 0;
+	return rc;
 }
 
 int db_store_counter(struct osmo_counter *ctr)
 {
-	dbi_result result;
 	char *q_name;
+	int rc;
 
 	dbi_conn_quote_string_copy(conn, ctr->name, &q_name);
 
-	result = dbi_conn_queryf(conn,
+	rc = db_writef("store a counter",
 		"INSERT INTO Counters "
 		"(timestamp,name,value) VALUES "
 		"(datetime('now'),%s,%lu)", q_name, ctr->value);
 
 	free(q_name);
-
-	if (!result)
-		return -EIO;
-
-	dbi_result_free(result);
-	return 0;
+	return rc;
 }
 
-static int db_store_rate_ctr(struct rate_ctr_group *ctrg, unsigned int num,
-			     char *q_prefix)
+struct db_counter_rows {
+	char *values;
+	int num;
+};
+
+static int db_append_counter(struct osmo_counter *ctr, void *data)
 {
-	dbi_result result;
+	struct db_counter_rows *rows = data;
 	char *q_name;
 
-	dbi_conn_quote_string_copy(conn, ctrg->desc->ctr_desc[num].name,
-				   &q_name);
+	dbi_conn_quote_string_copy(conn, ctr->name, &q_name);
+	rows->values = talloc_asprintf_append(rows->values,
+				"%s(datetime('now'),%s,%lu)",
+				rows->num++ ? "," : "", q_name, ctr->value);
+	free(q_name);
 
-	result = dbi_conn_queryf(conn,
-		"Insert INTO RateCounters "
-		"(timestamp,name,idx,value) VALUES "
-		"(datetime('now'),%s.%s,%u,%"PRIu64")",
-		q_prefix, q_name, ctrg->idx, ctrg->ctr[num].current);
+	return rows->values ? 0 : -ENOMEM;
+}
 
-	free(q_name);
+/* store a snapshot of all counters with a single statement */
+int db_store_counters(void)
+{
+	struct db_counter_rows rows = { NULL, 0 };
+	int rc;
 
-	if (!result)
-		return -EIO;
+	rows.values = talloc_strdup(tall_db_ctx, "");
+	if (!rows.values)
+		return -ENOMEM;
 
-	dbi_result_free(result);
-	return 0;
+	rc = osmo_counters_for_each(db_append_counter, &rows);
+	if (rc == 0 && rows.num > 0)
+		rc = db_writef("store the counters",
+			"INSERT INTO Counters "
+			"(timestamp,name,value) VALUES %s", rows.values);
+
+	talloc_free(rows.values);
+	return rc;
 }
 
 int db_store_rate_ctr_group(struct rate_ctr_group *ctrg)
 {
 	unsigned int i;
-	char *q_prefix;
+	char *q_prefix, *q_name, *values;
+	int rc;
+
+	if (ctrg->desc->num_ctr == 0)
+		return 0;
 
 	dbi_conn_quote_string_copy(conn, ctrg->desc->group_name_prefix, &q_prefix);
 
-	for (i = 0; i < ctrg->desc->num_ctr; i++)
-		db_store_rate_ctr(ctrg, i, q_prefix);
+	values = talloc_strdup(tall_db_ctx, "");
+	for (i = 0; values && i < ctrg->desc->num_ctr; i++) {
+		dbi_conn_quote_string_copy(conn, ctrg->desc->ctr_desc[i].name,
+					   &q_name);
+		values = talloc_asprintf_append(values,
+				"%s(datetime('now'),%s.%s,%u,%"PRIu64")",
+				i ? "," : "", q_prefix, q_name, ctrg->idx,
+				ctrg->ctr[i].current);
+		free(q_name);
+	}
 
 	free(q_prefix);
+	if (!values)
+		return -ENOMEM;
 
-	return 0;
+	rc = db_writef("store the rate counters",
+		"INSERT INTO RateCounters "
+		"(timestamp,name,idx,value) VALUES %s", values);
+
+	talloc_free(values);
+	return rc;
 }
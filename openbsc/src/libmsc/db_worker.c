@@ -0,0 +1,419 @@
+/* Execute database requests outside of the main loop */
+
+/* (C) 2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A single thread owns a second connection to the database and executes
+ * the requests in the order they got submitted. Completed requests are
+ * handed back through an eventfd that is part of the main loop.
+ *
+ * Requests are executed in batches inside a single transaction so that
+ * a burst of location updates costs one commit instead of one each. The
+ * worker waits up to DB_WORKER_BATCH_DELAY ms for a batch to fill up,
+ * unless somebody is waiting in db_worker_flush().
+ *
+ * Every request gets a sequence number on submit. A read running on the
+ * main connection passes the number of the last queued write it depends
+ * on to db_worker_wait(), so that it sees that write without waiting for
+ * the unrelated ones.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <osmocom/core/select.h>
+#include <osmocom/core/talloc.h>
+
+#include "bscconfig.h"
+
+#include <openbsc/db_worker.h>
+#include <openbsc/debug.h>
+
+/* wait this long for a lock held by the other connection */
+#define DB_WORKER_BUSY_TIMEOUT	"5000"
+
+#define DB_WORKER_BATCH		256
+#define DB_WORKER_BATCH_DELAY	10
+
+static struct db_worker_stats stats;
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+static struct {
+	int running;
+	int stopping;
+	int busy;
+	int flushing;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* signalled when a request got queued or on stop */
+	pthread_cond_t work;
+	/* signalled after every batch */
+	pthread_cond_t progress;
+
+	/* the sequence numbers of the last queued and executed request */
+	uint64_t submitted;
+	uint64_t executed;
+
+	struct llist_head pending;
+	struct llist_head completed;
+
+	dbi_conn conn;
+	struct osmo_fd event_fd;
+} worker = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.progress = PTHREAD_COND_INITIALIZER,
+	.pending = LLIST_HEAD_INIT(worker.pending),
+	.completed = LLIST_HEAD_INIT(worker.completed),
+};
+
+static uint64_t time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int worker_exec(const char *query)
+{
+	dbi_result result;
+
+	result = dbi_conn_query(worker.conn, query);
+	if (!result)
+		return -EIO;
+
+	dbi_result_free(result);
+	return 0;
+}
+
+/* called with the lock held, gives others a chance to join the batch */
+static void worker_wait_batch(void)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += DB_WORKER_BATCH_DELAY * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	while (stats.depth < DB_WORKER_BATCH
+	       && !worker.flushing && !worker.stopping) {
+		if (pthread_cond_timedwait(&worker.work, &worker.lock,
+					   &deadline) != 0)
+			break;
+	}
+}
+
+static void *worker_main(void *unused)
+{
+	struct db_req *req;
+	LLIST_HEAD(batch);
+	uint64_t one = 1;
+	int num, in_transaction;
+	ssize_t rc;
+
+	pthread_mutex_lock(&worker.lock);
+	for (;;) {
+		while (llist_empty(&worker.pending) && !worker.stopping)
+			pthread_cond_wait(&worker.work, &worker.lock);
+		if (llist_empty(&worker.pending))
+			break;
+
+		worker_wait_batch();
+
+		for (num = 0; num < DB_WORKER_BATCH
+				&& !llist_empty(&worker.pending); ++num)
+			llist_move_tail(worker.pending.next, &batch);
+		stats.depth -= num;
+		worker.busy = 1;
+		pthread_mutex_unlock(&worker.lock);
+
+		in_transaction = num > 1 && worker_exec("BEGIN") == 0;
+		llist_for_each_entry(req, &batch, entry) {
+			req->started = time_us();
+			req->rc = req->run(worker.conn, req);
+			req->finished = time_us();
+		}
+
+		/* nothing of the batch got stored when the commit failed */
+		if (in_transaction && worker_exec("COMMIT") != 0) {
+			llist_for_each_entry(req, &batch, entry)
+				req->rc = -EIO;
+			worker_exec("ROLLBACK");
+		}
+
+		pthread_mutex_lock(&worker.lock);
+		worker.executed = llist_entry(batch.prev, struct db_req, entry)->seq;
+		llist_splice_init(&batch, worker.completed.prev);
+		stats.batches += 1;
+		if (num > stats.max_batch)
+			stats.max_batch = num;
+		worker.busy = 0;
+		pthread_cond_broadcast(&worker.progress);
+
+		/* can only fail once the counter would overflow */
+		rc = write(worker.event_fd.fd, &one, sizeof(one));
+		(void) rc;
+	}
+	pthread_cond_broadcast(&worker.progress);
+	pthread_mutex_unlock(&worker.lock);
+
+	return NULL;
+}
+
+static void handle_completed(void)
+{
+	struct db_req *req, *tmp;
+	uint64_t latency, exec;
+	LLIST_HEAD(completed);
+
+	pthread_mutex_lock(&worker.lock);
+	llist_splice_init(&worker.completed, &completed);
+	pthread_mutex_unlock(&worker.lock);
+
+	llist_for_each_entry_safe(req, tmp, &completed, entry) {
+		llist_del(&req->entry);
+
+		latency = req->finished - req->queued;
+		exec = req->finished - req->started;
+		stats.queries += 1;
+		stats.latency_us += latency;
+		stats.exec_us += exec;
+		if (latency > stats.max_latency_us)
+			stats.max_latency_us = latency;
+		if (exec > stats.max_exec_us)
+			stats.max_exec_us = exec;
+
+		if (req->rc < 0) {
+			stats.failed += 1;
+			LOGP(DDB, LOGL_ERROR, "Failed to %s: %d\n",
+			     req->what, req->rc);
+		}
+
+		if (req->done)
+			req->done(req);
+		talloc_free(req);
+	}
+}
+
+static int worker_event_cb(struct osmo_fd *fd, unsigned int what)
+{
+	uint64_t events;
+
+	if (read(fd->fd, &events, sizeof(events)) != sizeof(events))
+		return 0;
+
+	handle_completed();
+	return 0;
+}
+
+int db_worker_start(const char *dir, const char *name)
+{
+	int fd;
+
+	if (worker.running)
+		return -EALREADY;
+
+	worker.conn = dbi_conn_new("sqlite3");
+	if (!worker.conn) {
+		LOGP(DDB, LOGL_ERROR, "Failed to create the worker connection.\n");
+		return -ENOMEM;
+	}
+
+	dbi_conn_set_option(worker.conn, "sqlite3_dbdir", dir);
+	dbi_conn_set_option(worker.conn, "dbname", name);
+	dbi_conn_set_option(worker.conn, "sqlite3_timeout",
+			    DB_WORKER_BUSY_TIMEOUT);
+	if (dbi_conn_connect(worker.conn) < 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to connect the worker.\n");
+		goto err_conn;
+	}
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to create the eventfd: %s\n",
+		     strerror(errno));
+		goto err_conn;
+	}
+
+	worker.event_fd.fd = fd;
+	worker.event_fd.when = BSC_FD_READ;
+	worker.event_fd.cb = worker_event_cb;
+	worker.event_fd.data = NULL;
+	if (osmo_fd_register(&worker.event_fd) != 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to register the eventfd.\n");
+		goto err_fd;
+	}
+
+	worker.stopping = 0;
+	if (pthread_create(&worker.thread, NULL, worker_main, NULL) != 0) {
+		LOGP(DDB, LOGL_ERROR, "Failed to start the database thread.\n");
+		osmo_fd_unregister(&worker.event_fd);
+		goto err_fd;
+	}
+
+	worker.running = 1;
+	LOGP(DDB, LOGL_NOTICE, "Started the database thread.\n");
+	return 0;
+
+err_fd:
+	close(fd);
+err_conn:
+	dbi_conn_close(worker.conn);
+	worker.conn = NULL;
+	return -EIO;
+}
+
+void db_worker_stop(void)
+{
+	if (!worker.running)
+		return;
+
+	pthread_mutex_lock(&worker.lock);
+	worker.stopping = 1;
+	pthread_cond_signal(&worker.work);
+	pthread_mutex_unlock(&worker.lock);
+
+	pthread_join(worker.thread, NULL);
+	worker.running = 0;
+
+	/* hand back what got finished in the meantime */
+	handle_completed();
+
+	osmo_fd_unregister(&worker.event_fd);
+	close(worker.event_fd.fd);
+	worker.event_fd.fd = -1;
+	dbi_conn_close(worker.conn);
+	worker.conn = NULL;
+}
+
+int db_worker_running(void)
+{
+	return worker.running;
+}
+
+int db_worker_submit(struct db_req *req)
+{
+	if (!worker.running)
+		return -ENOTCONN;
+
+	req->queued = time_us();
+
+	pthread_mutex_lock(&worker.lock);
+	req->seq = ++worker.submitted;
+	llist_add_tail(&req->entry, &worker.pending);
+	stats.depth += 1;
+	if (stats.depth > stats.max_depth)
+		stats.max_depth = stats.depth;
+	pthread_cond_signal(&worker.work);
+	pthread_mutex_unlock(&worker.lock);
+
+	return 0;
+}
+
+uint64_t db_worker_submitted(void)
+{
+	return worker.submitted;
+}
+
+int db_worker_wait(uint64_t seq)
+{
+	int waited = 0;
+
+	if (!worker.running)
+		return 0;
+
+	pthread_mutex_lock(&worker.lock);
+	if (worker.executed < seq) {
+		waited = 1;
+		worker.flushing += 1;
+		pthread_cond_signal(&worker.work);
+		while (worker.executed < seq)
+			pthread_cond_wait(&worker.progress, &worker.lock);
+		worker.flushing -= 1;
+	}
+	pthread_mutex_unlock(&worker.lock);
+
+	return waited;
+}
+
+void db_worker_flush(void)
+{
+	db_worker_wait(worker.submitted);
+}
+
+/* the worker updates some of them while running */
+void db_worker_get_stats(struct db_worker_stats *out)
+{
+	pthread_mutex_lock(&worker.lock);
+	*out = stats;
+	pthread_mutex_unlock(&worker.lock);
+}
+
+#else
+
+int db_worker_start(const char *dir, const char *name)
+{
+	LOGP(DDB, LOGL_ERROR, "The database thread is not available.\n");
+	return -ENOTSUP;
+}
+
+void db_worker_stop(void)
+{
+}
+
+int db_worker_running(void)
+{
+	return 0;
+}
+
+int db_worker_submit(struct db_req *req)
+{
+	return -ENOTCONN;
+}
+
+uint64_t db_worker_submitted(void)
+{
+	return 0;
+}
+
+int db_worker_wait(uint64_t seq)
+{
+	return 0;
+}
+
+void db_worker_flush(void)
+{
+}
+
+void db_worker_get_stats(struct db_worker_stats *out)
+{
+	*out = stats;
+}
+
+#endif
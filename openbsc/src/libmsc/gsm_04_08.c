@@ -277,6 +277,8 @@ static void release_loc_updating_req(struct gsm_subscriber_connection *conn)
 	/* No need to keep the connection up */
 	release_anchor(conn);
 
+	if (conn->loc_operation->lookup)
+		db_get_subscriber_cancel(conn->loc_operation->lookup);
 	osmo_timer_del(&conn->loc_operation->updating_timer);
 	talloc_free(conn->loc_operation);
 	conn->loc_operation = NULL;
@@ -475,6 +477,69 @@ static int mm_tx_identity_req(struct gsm_subscriber_connection *conn, uint8_t id
 }
 
 
+/*
+ * Continue the location updating once the database worker found the
+ * subscriber. Without a worker this is invoked from within the lookup,
+ * so the connection might be gone after it returned.
+ */
+static void loc_upd_subscr_cb(struct gsm_subscriber *subscr, void *data)
+{
+	struct gsm_subscriber_connection *conn = data;
+	struct gsm_loc_updating_operation *loc = conn->loc_operation;
+
+	loc->lookup = NULL;
+
+	if (!subscr && !loc->imsi[0]) {
+		/* unknown TMSI, send IDENTITY REQUEST message to get IMSI */
+		mm_tx_identity_req(conn, GSM_MI_TYPE_IMSI);
+		loc->waiting_for_imsi = 1;
+		return;
+	}
+
+	/* create the subscriber if the IMSI is not found */
+	if (!subscr)
+		subscr = subscr_create_subscriber(conn->bts->network, loc->imsi);
+	if (!subscr) {
+		DEBUGP(DMM, "<- Can't create a subscriber for IMSI %s\n",
+			loc->imsi);
+		return;
+	}
+
+	conn->subscr = subscr;
+	conn->subscr->equipment.classmark1 = loc->classmark1;
+	if (loc->imei[0]) {
+		db_subscriber_assoc_imei(conn->subscr, loc->imei);
+		db_sync_equipment(&conn->subscr->equipment);
+	}
+
+	/* check if we can let the subscriber into our network now */
+	gsm0408_authorize(conn, NULL);
+}
+
+static void loc_upd_lookup_imsi(struct gsm_subscriber_connection *conn,
+				const char *imsi)
+{
+	struct db_subscr_lookup *lookup;
+
+	strncpy(conn->loc_operation->imsi, imsi, GSM48_MI_SIZE);
+	lookup = subscr_get_by_imsi_async(conn->bts->network, imsi,
+					  loc_upd_subscr_cb, conn);
+	/* the callback already ran otherwise */
+	if (lookup)
+		conn->loc_operation->lookup = lookup;
+}
+
+static void loc_upd_lookup_tmsi(struct gsm_subscriber_connection *conn,
+				uint32_t tmsi)
+{
+	struct db_subscr_lookup *lookup;
+
+	lookup = subscr_get_by_tmsi_async(conn->bts->network, tmsi,
+					  loc_upd_subscr_cb, conn);
+	if (lookup)
+		conn->loc_operation->lookup = lookup;
+}
+
 /* Parse Chapter 9.2.11 Identity Response */
 static int mm_rx_id_resp(struct gsm_subscriber_connection *conn, struct msgb *msg)
 {
@@ -493,6 +558,13 @@ static int mm_rx_id_resp(struct gsm_subscriber_connection *conn, struct msgb *ms
 
 	switch (mi_type) {
 	case GSM_MI_TYPE_IMSI:
+		/* the location updating continues once it is looked up */
+		if (!conn->subscr && conn->loc_operation) {
+			conn->loc_operation->waiting_for_imsi = 0;
+			if (!conn->loc_operation->lookup)
+				loc_upd_lookup_imsi(conn, mi_string);
+			return 0;
+		}
 		/* look up subscriber based on IMSI, create if not found */
 		if (!conn->subscr) {
 			conn->subscr = subscr_get_by_imsi(net, mi_string);
@@ -508,7 +580,9 @@ static int mm_rx_id_resp(struct gsm_subscriber_connection *conn, struct msgb *ms
 		if (conn->subscr) {
 			db_subscriber_assoc_imei(conn->subscr, mi_string);
 			db_sync_equipment(&conn->subscr->equipment);
-		}
+		} else if (conn->loc_operation)
+			strncpy(conn->loc_operation->imei, mi_string,
+				GSM48_MI_SIZE);
 		if (conn->loc_operation)
 			conn->loc_operation->waiting_for_imei = 0;
 		break;
@@ -556,7 +630,6 @@ static int mm_rx_loc_upd_req(struct gsm_subscriber_connection *conn, struct msgb
 {
 	struct gsm48_hdr *gh = msgb_l3(msg);
 	struct gsm48_loc_upd_req *lu;
-	struct gsm_subscriber *subscr = NULL;
 	struct gsm_bts *bts = conn->bts;
 	uint8_t mi_type;
 	char mi_string[GSM48_MI_SIZE];
@@ -598,7 +671,15 @@ static int mm_rx_loc_upd_req(struct gsm_subscriber_connection *conn, struct msgb
 	allocate_loc_updating_req(conn);
 
 	conn->loc_operation->key_seq = lu->key_seq;
+	conn->loc_operation->classmark1 = lu->classmark1;
+
+	/* schedule the reject timer */
+	schedule_reject(conn);
 
+	/*
+	 * The subscriber is looked up by the database worker unless it is
+	 * in RAM already, the procedure continues in loc_upd_subscr_cb().
+	 */
 	switch (mi_type) {
 	case GSM_MI_TYPE_IMSI:
 		DEBUGPC(DMM, "\n");
@@ -607,50 +688,30 @@ static int mm_rx_loc_upd_req(struct gsm_subscriber_connection *conn, struct msgb
 		conn->loc_operation->waiting_for_imei = 1;
 
 		/* look up subscriber based on IMSI, create if not found */
-		subscr = subscr_get_by_imsi(bts->network, mi_string);
-		if (!subscr) {
-			subscr = subscr_create_subscriber(bts->network, mi_string);
-		}
+		loc_upd_lookup_imsi(conn, mi_string);
 		break;
 	case GSM_MI_TYPE_TMSI:
 		DEBUGPC(DMM, "\n");
-		/* look up the subscriber based on TMSI, request IMSI if it fails */
-		subscr = subscr_get_by_tmsi(bts->network,
-					    tmsi_from_string(mi_string));
-		if (!subscr) {
-			/* send IDENTITY REQUEST message to get IMSI */
-			mm_tx_identity_req(conn, GSM_MI_TYPE_IMSI);
-			conn->loc_operation->waiting_for_imsi = 1;
-		}
 		/* we always want the IMEI, too */
 		mm_tx_identity_req(conn, GSM_MI_TYPE_IMEI);
 		conn->loc_operation->waiting_for_imei = 1;
+
+		/* look up the subscriber based on TMSI, request IMSI if it fails */
+		loc_upd_lookup_tmsi(conn, tmsi_from_string(mi_string));
 		break;
 	case GSM_MI_TYPE_IMEI:
 	case GSM_MI_TYPE_IMEISV:
 		/* no sim card... FIXME: what to do ? */
 		DEBUGPC(DMM, "unimplemented mobile identity type\n");
-		break;
+		DEBUGPC(DRR, "<- Can't find any subscriber for this ID\n");
+		return -EINVAL;
 	default:	
 		DEBUGPC(DMM, "unknown mobile identity type\n");
-		break;
-	}
-
-	/* schedule the reject timer */
-	schedule_reject(conn);
-
-	if (!subscr) {
 		DEBUGPC(DRR, "<- Can't find any subscriber for this ID\n");
-		/* FIXME: request id? close channel? */
 		return -EINVAL;
 	}
 
-	conn->subscr = subscr;
-	conn->subscr->equipment.classmark1 = lu->classmark1;
-
-	/* check if we can let the subscriber into our network immediately
-	 * or if we need to wait for identity responses. */
-	return gsm0408_authorize(conn, msg);
+	return 0;
 }
 
 /* Turn int into semi-octet representation: 98 => 0x89 */
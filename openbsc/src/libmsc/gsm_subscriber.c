@@ -39,6 +39,10 @@
 #include <openbsc/db.h>
 #include <openbsc/chan_alloc.h>
 
+/* seconds between two runs of the expiry, shorter while there is a backlog */
+#define SUBSCR_EXPIRE_INTERVAL		10
+#define SUBSCR_EXPIRE_BACKLOG_INTERVAL	1
+
 void *tall_sub_req_ctx;
 
 extern struct llist_head *subscr_bsc_active_subscribers(void);
@@ -291,10 +295,9 @@ struct gsm_subscriber *subscr_get_by_tmsi(struct gsm_network *net,
 	struct gsm_subscriber *subscr;
 
 	/* we might have a record in memory already */
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (tmsi == subscr->tmsi)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_tmsi(NULL, tmsi);
+	if (subscr)
+		return subscr_get(subscr);
 
 	sprintf(tmsi_string, "%u", tmsi);
 	return get_subscriber(net, GSM_SUBSCRIBER_TMSI, tmsi_string);
@@ -305,14 +308,48 @@ struct gsm_subscriber *subscr_get_by_imsi(struct gsm_network *net,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_find_by_imsi(NULL, imsi);
+	if (subscr)
+		return subscr_get(subscr);
 
 	return get_subscriber(net, GSM_SUBSCRIBER_IMSI, imsi);
 }
 
+/*
+ * The subscriber is handed to the callback right away when it is in RAM,
+ * otherwise the database worker looks it up. See db_get_subscriber_async().
+ */
+struct db_subscr_lookup *subscr_get_by_tmsi_async(struct gsm_network *net,
+				uint32_t tmsi, subscr_lookup_cb *cb, void *data)
+{
+	char tmsi_string[14];
+	struct gsm_subscriber *subscr;
+
+	subscr = subscr_find_by_tmsi(NULL, tmsi);
+	if (subscr) {
+		cb(subscr_get(subscr), data);
+		return NULL;
+	}
+
+	sprintf(tmsi_string, "%u", tmsi);
+	return db_get_subscriber_async(net, GSM_SUBSCRIBER_TMSI, tmsi_string,
+				       cb, data);
+}
+
+struct db_subscr_lookup *subscr_get_by_imsi_async(struct gsm_network *net,
+				const char *imsi, subscr_lookup_cb *cb, void *data)
+{
+	struct gsm_subscriber *subscr;
+
+	subscr = subscr_find_by_imsi(NULL, imsi);
+	if (subscr) {
+		cb(subscr_get(subscr), data);
+		return NULL;
+	}
+
+	return db_get_subscriber_async(net, GSM_SUBSCRIBER_IMSI, imsi, cb, data);
+}
+
 struct gsm_subscriber *subscr_get_by_extension(struct gsm_network *net,
 					       const char *ext)
 {
@@ -359,7 +396,7 @@ int subscr_update_expire_lu(struct gsm_subscriber *s, struct gsm_bts *bts)
 			(bts->si_common.chan_desc.t3212 * 60 * 6 * 2) + 60;
 
 	rc = db_sync_subscriber(s);
-	db_subscriber_update(s);
+	db_subscriber_update_async(s);
 	return rc;
 }
 
@@ -390,14 +427,14 @@ int subscr_update(struct gsm_subscriber *s, struct gsm_bts *bts, int reason)
 			s->lac = GSM_LAC_RESERVED_DETACHED;
 		LOGP(DMM, LOGL_INFO, "Subscriber %s DETACHED\n", subscr_name(s));
 		rc = db_sync_subscriber(s);
-		db_subscriber_update(s);
+		db_subscriber_update_async(s);
 		osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_DETACHED, s);
 		break;
 	default:
 		fprintf(stderr, "subscr_update with unknown reason: %d\n",
 			reason);
 		rc = db_sync_subscriber(s);
-		db_subscriber_update(s);
+		db_subscriber_update_async(s);
 		break;
 	};
 
@@ -409,38 +446,101 @@ void subscr_update_from_db(struct gsm_subscriber *sub)
 	db_subscriber_update(sub);
 }
 
-static void subscr_expire_callback(void *data, long long unsigned int id)
+static int subscr_id_cmp(const void *_a, const void *_b)
+{
+	const unsigned long long *a = _a, *b = _b;
+
+	if (*a < *b)
+		return -1;
+	return *a > *b;
+}
+
+static void subscr_expire_done(void *data, unsigned long long *ids,
+			       unsigned int num, unsigned int backlog)
 {
 	struct gsm_network *net = data;
-	struct gsm_subscriber *s = subscr_get_by_id(net, id);
-	struct gsm_subscriber_connection *conn = connection_for_subscr(s);
+	struct subscr_expire_signal_data sig;
+	struct gsm_subscriber_connection *conn;
+	struct gsm_subscriber *s;
+	unsigned long long *id;
+	unsigned int i, expired = 0, left;
+	uint8_t *skip = NULL;
+	time_t now = time(NULL);
+
+	/* more might have expired while counting */
+	left = backlog > num ? backlog - num : 0;
+
+	if (num > 0)
+		skip = talloc_zero_array(NULL, uint8_t, num);
+	if (!skip)
+		goto out;
 
 	/*
-	 * The subscriber is active and the phone stopped the timer. As
-	 * we don't want to periodically update the database for active
-	 * subscribers we will just do it when the subscriber was selected
-	 * for expiration. This way on the next around another subscriber
-	 * will be selected.
+	 * Update the subscribers that are in memory as well. The phone of
+	 * an active subscriber might have stopped the timer. As we don't
+	 * want to periodically update the database for active subscribers
+	 * we will just do it when the subscriber was selected for
+	 * expiration. A location update might have happened since the
+	 * query as well.
 	 */
-	if (conn && conn->expire_timer_stopped) {
-		LOGP(DMM, LOGL_DEBUG, "Not expiring subscriber %s (ID %llu)\n",
-			subscr_name(s), id);
-		subscr_update_expire_lu(s, conn->bts);
-		return;
+	qsort(ids, num, sizeof(*ids), subscr_id_cmp);
+	llist_for_each_entry(s, subscr_bsc_active_subscribers(), entry) {
+		id = bsearch(&s->id, ids, num, sizeof(*ids), subscr_id_cmp);
+		if (!id)
+			continue;
+
+		conn = connection_for_subscr(s);
+		if (conn && conn->expire_timer_stopped) {
+			LOGP(DMM, LOGL_DEBUG, "Not expiring subscriber %s (ID %llu)\n",
+				subscr_name(s), s->id);
+			subscr_update_expire_lu(s, conn->bts);
+			skip[id - ids] = 1;
+			continue;
+		}
+
+		if (s->expire_lu == GSM_SUBSCRIBER_NO_EXPIRATION
+		    || s->expire_lu >= now) {
+			skip[id - ids] = 1;
+			continue;
+		}
+
+		LOGP(DMM, LOGL_DEBUG, "Expiring inactive subscriber %s (ID %llu)\n",
+			subscr_name(s), s->id);
+		s->lac = GSM_LAC_RESERVED_DETACHED;
 	}
 
+	for (i = 0; i < num; ++i)
+		if (!skip[i])
+			ids[expired++] = ids[i];
+	talloc_free(skip);
+
+	if (expired > 0 && db_subscriber_expire_ids(ids, expired) == 0) {
+		LOGP(DMM, LOGL_NOTICE, "Expired %u inactive subscribers, "
+			"%u left.\n", expired, left);
+		net->stats.subscr.expired->value += expired;
+
+		sig.net = net;
+		sig.ids = ids;
+		sig.num = expired;
+		osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_EXPIRED, &sig);
+	}
 
-	LOGP(DMM, LOGL_NOTICE, "Expiring inactive subscriber %s (ID %llu)\n",
-			subscr_name(s), id);
-	s->lac = GSM_LAC_RESERVED_DETACHED;
-	db_sync_subscriber(s);
+out:
+	net->stats.subscr.expire_backlog->value = left;
 
-	subscr_put(s);
+	/* work off a backlog in batches without starving everything else */
+	osmo_timer_schedule(&net->subscr_expire_timer,
+			    left ? SUBSCR_EXPIRE_BACKLOG_INTERVAL
+				 : SUBSCR_EXPIRE_INTERVAL, 0);
 }
 
+/* runs from the subscr_expire_timer which gets scheduled again */
 void subscr_expire(struct gsm_network *net)
 {
-	db_subscriber_expire(net, subscr_expire_callback);
+	if (db_subscriber_expire(net->subscr_expire_batch,
+				 subscr_expire_done, net) != 0)
+		osmo_timer_schedule(&net->subscr_expire_timer,
+				    SUBSCR_EXPIRE_INTERVAL, 0);
 }
 
 int subscr_pending_requests(struct gsm_subscriber *sub)
@@ -0,0 +1,218 @@
+/* Allocate unique TMSIs and extensions in memory */
+
+/* (C) 2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The sequence is a counter pushed through a permutation of the
+ * smallest power of two covering the range. Values outside of the
+ * range are skipped (cycle walking), so every number is visited exactly
+ * once per round and a released number will only be handed out again
+ * after all the others have been tried.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <osmocom/core/talloc.h>
+
+#include <openbsc/ident_alloc.h>
+
+#define IDENT_FREE		UINT32_MAX
+#define IDENT_MIN_SLOTS		64
+
+static uint32_t ident_mask(struct ident_alloc *alloc)
+{
+	return alloc->bits == 32 ? UINT32_MAX : (1u << alloc->bits) - 1;
+}
+
+/* a bijection on [0, 2^bits) */
+static uint32_t ident_scramble(struct ident_alloc *alloc, uint32_t x)
+{
+	uint32_t mask = ident_mask(alloc);
+	unsigned int shift = alloc->bits / 2;
+
+	x = (x ^ alloc->key) & mask;
+	x = (x * 0x9e3779b1u) & mask;
+	x ^= x >> shift;
+	x = (x * 0x85ebca6bu) & mask;
+	x ^= x >> shift;
+	x = (x * 0xc2b2ae35u) & mask;
+	x ^= x >> shift;
+	return x;
+}
+
+static unsigned int ident_slot(struct ident_alloc *alloc, uint32_t value)
+{
+	uint32_t hash = value * 2654435761u;
+
+	return (hash ^ (hash >> 16)) & (alloc->size - 1);
+}
+
+static int ident_find(struct ident_alloc *alloc, uint32_t value)
+{
+	unsigned int i = ident_slot(alloc, value);
+
+	while (alloc->slots[i] != IDENT_FREE) {
+		if (alloc->slots[i] == value)
+			return i;
+		i = (i + 1) & (alloc->size - 1);
+	}
+
+	return -1;
+}
+
+static void ident_insert(struct ident_alloc *alloc, uint32_t value)
+{
+	unsigned int i = ident_slot(alloc, value);
+
+	while (alloc->slots[i] != IDENT_FREE)
+		i = (i + 1) & (alloc->size - 1);
+	alloc->slots[i] = value;
+	alloc->used += 1;
+}
+
+static int ident_resize(struct ident_alloc *alloc, unsigned int size)
+{
+	uint32_t *old = alloc->slots;
+	unsigned int old_size = alloc->size, i;
+
+	alloc->slots = talloc_array(alloc->ctx, uint32_t, size);
+	if (!alloc->slots) {
+		alloc->slots = old;
+		return -ENOMEM;
+	}
+
+	memset(alloc->slots, 0xff, size * sizeof(uint32_t));
+	alloc->size = size;
+	alloc->used = 0;
+
+	for (i = 0; i < old_size; ++i)
+		if (old[i] != IDENT_FREE)
+			ident_insert(alloc, old[i]);
+
+	talloc_free(old);
+	return 0;
+}
+
+int ident_alloc_init(struct ident_alloc *alloc, void *ctx,
+		     uint32_t min, uint32_t max, uint32_t seed)
+{
+	uint64_t range = (uint64_t) max - min + 1;
+
+	memset(alloc, 0, sizeof(*alloc));
+	if (max < min || max == UINT32_MAX)
+		return -EINVAL;
+
+	alloc->ctx = ctx;
+	alloc->min = min;
+	alloc->max = max;
+
+	alloc->bits = 2;
+	while (((uint64_t) 1 << alloc->bits) < range)
+		alloc->bits += 1;
+	alloc->key = seed;
+	alloc->seq = seed * 2654435761u;
+
+	return ident_resize(alloc, IDENT_MIN_SLOTS);
+}
+
+void ident_alloc_reset(struct ident_alloc *alloc)
+{
+	talloc_free(alloc->slots);
+	alloc->slots = NULL;
+	alloc->size = alloc->used = 0;
+}
+
+int ident_alloc_in_use(struct ident_alloc *alloc, uint32_t value)
+{
+	if (!alloc->slots)
+		return 0;
+	return ident_find(alloc, value) >= 0;
+}
+
+int ident_alloc_reserve(struct ident_alloc *alloc, uint32_t value)
+{
+	if (!alloc->slots)
+		return -EINVAL;
+	if (value < alloc->min || value > alloc->max)
+		return -ERANGE;
+	if (ident_alloc_in_use(alloc, value))
+		return -EEXIST;
+
+	/* keep the load factor below one half */
+	if ((alloc->used + 1) * 2 > alloc->size
+	    && ident_resize(alloc, alloc->size * 2) != 0)
+		return -ENOMEM;
+
+	ident_insert(alloc, value);
+	return 0;
+}
+
+void ident_alloc_release(struct ident_alloc *alloc, uint32_t value)
+{
+	unsigned int mask = alloc->size - 1, home;
+	int i, j;
+
+	if (!alloc->slots)
+		return;
+
+	i = ident_find(alloc, value);
+	if (i < 0)
+		return;
+
+	/* move the following entries of the cluster into the gap */
+	for (j = (i + 1) & mask; alloc->slots[j] != IDENT_FREE;
+	     j = (j + 1) & mask) {
+		home = ident_slot(alloc, alloc->slots[j]);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			alloc->slots[i] = alloc->slots[j];
+			i = j;
+		}
+	}
+
+	alloc->slots[i] = IDENT_FREE;
+	alloc->used -= 1;
+}
+
+int ident_alloc_get(struct ident_alloc *alloc, uint32_t *value)
+{
+	uint32_t range = alloc->max - alloc->min;
+	uint32_t mask = ident_mask(alloc);
+	uint32_t candidate;
+	int rc;
+
+	if (!alloc->slots || (uint64_t) alloc->used > range)
+		return -ENOSPC;
+
+	for (;;) {
+		alloc->seq = (alloc->seq + 1) & mask;
+		candidate = ident_scramble(alloc, alloc->seq);
+		if (candidate > range)
+			continue;
+
+		rc = ident_alloc_reserve(alloc, alloc->min + candidate);
+		if (rc == -EEXIST)
+			continue;
+		if (rc != 0)
+			return rc;
+
+		*value = alloc->min + candidate;
+		return 0;
+	}
+}
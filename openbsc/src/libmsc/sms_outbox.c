@@ -0,0 +1,397 @@
+/* Index of the unsent SMS by receiver */
+
+/* (C) 2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Every receiver with unsent SMS has an entry with its SMS ordered by
+ * id. The entries are hashed by subscriber id and the ones of attached
+ * subscribers are additionally kept in a tree ordered by subscriber id.
+ * This is what the SMS queue iterates over, so detached subscribers do
+ * not cost anything. The SMS are hashed by their id for the updates.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/linuxrbtree.h>
+#include <osmocom/core/talloc.h>
+
+#include <openbsc/sms_outbox.h>
+
+#define OUTBOX_HASH_MIN_BITS	8
+
+struct outbox_subscr {
+	struct llist_head hash_entry;
+	struct rb_node node;
+
+	unsigned long long id;
+	int attached;
+	struct llist_head sms;
+};
+
+struct outbox_sms {
+	struct llist_head entry;
+	struct llist_head hash_entry;
+
+	unsigned long long id;
+	unsigned int attempts;
+	struct outbox_subscr *subscr;
+};
+
+struct outbox_hash {
+	struct llist_head *buckets;
+	unsigned int bits;
+	unsigned int count;
+};
+
+static struct {
+	void *ctx;
+	int active;
+
+	struct rb_root attached;
+	struct outbox_hash subscrs;
+	struct outbox_hash sms;
+} outbox = {
+	.attached = RB_ROOT,
+};
+
+static unsigned int hash_key(struct outbox_hash *hash, unsigned long long id)
+{
+	uint32_t key = id ^ (id >> 32);
+
+	return (key * 2654435761u) >> (32 - hash->bits);
+}
+
+static struct llist_head *subscr_bucket(unsigned long long id)
+{
+	return &outbox.subscrs.buckets[hash_key(&outbox.subscrs, id)];
+}
+
+static struct llist_head *sms_bucket(unsigned long long id)
+{
+	return &outbox.sms.buckets[hash_key(&outbox.sms, id)];
+}
+
+static int hash_init(struct outbox_hash *hash, unsigned int bits)
+{
+	unsigned int i, size = 1 << bits;
+
+	hash->buckets = talloc_array(outbox.ctx, struct llist_head, size);
+	if (!hash->buckets)
+		return -ENOMEM;
+
+	for (i = 0; i < size; ++i)
+		INIT_LLIST_HEAD(&hash->buckets[i]);
+	hash->bits = bits;
+	hash->count = 0;
+	return 0;
+}
+
+static void subscr_hash_grow(void)
+{
+	struct outbox_hash old = outbox.subscrs;
+	struct outbox_subscr *subscr, *tmp;
+	unsigned int i;
+
+	if (hash_init(&outbox.subscrs, old.bits + 1) != 0) {
+		outbox.subscrs = old;
+		return;
+	}
+
+	outbox.subscrs.count = old.count;
+	for (i = 0; i < (1u << old.bits); ++i)
+		llist_for_each_entry_safe(subscr, tmp, &old.buckets[i], hash_entry)
+			llist_add(&subscr->hash_entry, subscr_bucket(subscr->id));
+	talloc_free(old.buckets);
+}
+
+static void sms_hash_grow(void)
+{
+	struct outbox_hash old = outbox.sms;
+	struct outbox_sms *sms, *tmp;
+	unsigned int i;
+
+	if (hash_init(&outbox.sms, old.bits + 1) != 0) {
+		outbox.sms = old;
+		return;
+	}
+
+	outbox.sms.count = old.count;
+	for (i = 0; i < (1u << old.bits); ++i)
+		llist_for_each_entry_safe(sms, tmp, &old.buckets[i], hash_entry)
+			llist_add(&sms->hash_entry, sms_bucket(sms->id));
+	talloc_free(old.buckets);
+}
+
+static struct outbox_subscr *subscr_find(unsigned long long id)
+{
+	struct outbox_subscr *subscr;
+
+	llist_for_each_entry(subscr, subscr_bucket(id), hash_entry)
+		if (subscr->id == id)
+			return subscr;
+	return NULL;
+}
+
+static struct outbox_sms *sms_find(unsigned long long id)
+{
+	struct outbox_sms *sms;
+
+	llist_for_each_entry(sms, sms_bucket(id), hash_entry)
+		if (sms->id == id)
+			return sms;
+	return NULL;
+}
+
+static void tree_insert(struct outbox_subscr *subscr)
+{
+	struct rb_node **new = &outbox.attached.rb_node, *parent = NULL;
+	struct outbox_subscr *this;
+
+	while (*new) {
+		this = rb_entry(*new, struct outbox_subscr, node);
+		parent = *new;
+
+		if (subscr->id < this->id)
+			new = &((*new)->rb_left);
+		else
+			new = &((*new)->rb_right);
+	}
+
+	rb_link_node(&subscr->node, parent, new);
+	rb_insert_color(&subscr->node, &outbox.attached);
+}
+
+/* the attached subscriber with the smallest id >= min_id */
+static struct outbox_subscr *tree_lower_bound(unsigned long long min_id)
+{
+	struct rb_node *node = outbox.attached.rb_node;
+	struct outbox_subscr *this, *found = NULL;
+
+	while (node) {
+		this = rb_entry(node, struct outbox_subscr, node);
+		if (this->id >= min_id) {
+			found = this;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+
+	return found;
+}
+
+static void subscr_set_attached(struct outbox_subscr *subscr, int attached)
+{
+	attached = !!attached;
+	if (subscr->attached == attached)
+		return;
+
+	subscr->attached = attached;
+	if (attached)
+		tree_insert(subscr);
+	else
+		rb_erase(&subscr->node, &outbox.attached);
+}
+
+static void subscr_free(struct outbox_subscr *subscr)
+{
+	subscr_set_attached(subscr, 0);
+	llist_del(&subscr->hash_entry);
+	outbox.subscrs.count -= 1;
+	talloc_free(subscr);
+}
+
+int sms_outbox_init(void *ctx)
+{
+	sms_outbox_reset();
+
+	outbox.ctx = ctx;
+	if (hash_init(&outbox.subscrs, OUTBOX_HASH_MIN_BITS) != 0
+	    || hash_init(&outbox.sms, OUTBOX_HASH_MIN_BITS) != 0) {
+		sms_outbox_reset();
+		return -ENOMEM;
+	}
+
+	outbox.active = 1;
+	return 0;
+}
+
+void sms_outbox_reset(void)
+{
+	struct outbox_subscr *subscr, *tmp;
+	unsigned int i;
+
+	if (outbox.subscrs.buckets) {
+		for (i = 0; i < (1u << outbox.subscrs.bits); ++i)
+			llist_for_each_entry_safe(subscr, tmp,
+					&outbox.subscrs.buckets[i], hash_entry)
+				subscr_free(subscr);
+	}
+
+	talloc_free(outbox.subscrs.buckets);
+	talloc_free(outbox.sms.buckets);
+	outbox.subscrs.buckets = outbox.sms.buckets = NULL;
+	outbox.subscrs.count = outbox.sms.count = 0;
+	outbox.attached = RB_ROOT;
+	outbox.active = 0;
+}
+
+int sms_outbox_active(void)
+{
+	return outbox.active;
+}
+
+int sms_outbox_add(unsigned long long subscr_id, unsigned long long sms_id,
+		   unsigned int attempts, int attached)
+{
+	struct outbox_subscr *subscr;
+	struct outbox_sms *sms, *prev;
+
+	if (!outbox.active || sms_find(sms_id))
+		return -EINVAL;
+
+	subscr = subscr_find(subscr_id);
+	if (!subscr) {
+		subscr = talloc_zero(outbox.ctx, struct outbox_subscr);
+		if (!subscr)
+			return -ENOMEM;
+		subscr->id = subscr_id;
+		INIT_LLIST_HEAD(&subscr->sms);
+		llist_add(&subscr->hash_entry, subscr_bucket(subscr_id));
+		if (++outbox.subscrs.count > (1u << outbox.subscrs.bits))
+			subscr_hash_grow();
+		subscr_set_attached(subscr, attached);
+	}
+
+	sms = talloc_zero(subscr, struct outbox_sms);
+	if (!sms) {
+		if (llist_empty(&subscr->sms))
+			subscr_free(subscr);
+		return -ENOMEM;
+	}
+
+	sms->id = sms_id;
+	sms->attempts = attempts;
+	sms->subscr = subscr;
+
+	/* new SMS have the highest id, keep the list sorted anyway */
+	llist_for_each_entry_reverse(prev, &subscr->sms, entry)
+		if (prev->id < sms_id)
+			break;
+	llist_add(&sms->entry, &prev->entry);
+
+	llist_add(&sms->hash_entry, sms_bucket(sms_id));
+	if (++outbox.sms.count > (1u << outbox.sms.bits))
+		sms_hash_grow();
+	return 0;
+}
+
+void sms_outbox_remove(unsigned long long sms_id)
+{
+	struct outbox_subscr *subscr;
+	struct outbox_sms *sms;
+
+	if (!outbox.active)
+		return;
+
+	sms = sms_find(sms_id);
+	if (!sms)
+		return;
+
+	subscr = sms->subscr;
+	llist_del(&sms->entry);
+	llist_del(&sms->hash_entry);
+	outbox.sms.count -= 1;
+	talloc_free(sms);
+
+	if (llist_empty(&subscr->sms))
+		subscr_free(subscr);
+}
+
+void sms_outbox_inc_attempts(unsigned long long sms_id)
+{
+	struct outbox_sms *sms;
+
+	if (!outbox.active)
+		return;
+
+	sms = sms_find(sms_id);
+	if (sms)
+		sms->attempts += 1;
+}
+
+void sms_outbox_set_attached(unsigned long long subscr_id, int attached)
+{
+	struct outbox_subscr *subscr;
+
+	if (!outbox.active)
+		return;
+
+	subscr = subscr_find(subscr_id);
+	if (subscr)
+		subscr_set_attached(subscr, attached);
+}
+
+int sms_outbox_next(unsigned long long min_subscr_id, unsigned int failed,
+		    unsigned long long *sms_id)
+{
+	struct outbox_subscr *subscr;
+	struct outbox_sms *sms;
+	struct rb_node *node;
+
+	if (!outbox.active)
+		return -EINVAL;
+
+	subscr = tree_lower_bound(min_subscr_id);
+	while (subscr) {
+		llist_for_each_entry(sms, &subscr->sms, entry) {
+			if (sms->attempts < failed) {
+				*sms_id = sms->id;
+				return 0;
+			}
+		}
+
+		node = rb_next(&subscr->node);
+		subscr = node ? rb_entry(node, struct outbox_subscr, node) : NULL;
+	}
+
+	return -ENOENT;
+}
+
+int sms_outbox_first(unsigned long long subscr_id, unsigned long long *sms_id)
+{
+	struct outbox_subscr *subscr;
+
+	if (!outbox.active)
+		return -EINVAL;
+
+	subscr = subscr_find(subscr_id);
+	if (!subscr || !subscr->attached)
+		return -ENOENT;
+
+	*sms_id = llist_first_entry(&subscr->sms, struct outbox_sms, entry)->id;
+	return 0;
+}
+
+void sms_outbox_get_stats(unsigned int *sms, unsigned int *subscribers)
+{
+	*sms = outbox.sms.count;
+	*subscribers = outbox.subscrs.count;
+}
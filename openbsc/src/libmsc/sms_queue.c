@@ -36,16 +36,22 @@
 #include <openbsc/gsm_04_11.h>
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/signal.h>
+#include <openbsc/sms_outbox.h>
 
 #include <osmocom/core/talloc.h>
 
 #include <osmocom/vty/vty.h>
 
+/* max-pending is limited to 500 by the VTY */
+#define SMSQ_HASH_SIZE	128
+
 /*
  * One pending SMS that we wait for.
  */
 struct gsm_sms_pending {
 	struct llist_head entry;
+	struct llist_head sms_entry;
+	struct llist_head subscr_entry;
 
 	struct gsm_subscriber *subscr;
 	unsigned long long sms_id;
@@ -62,18 +68,43 @@ struct gsm_sms_queue {
 	int pending;
 
 	struct llist_head pending_sms;
+	/* the pending_sms hashed by SMS and by subscriber id */
+	struct llist_head pending_by_sms[SMSQ_HASH_SIZE];
+	struct llist_head pending_by_subscr[SMSQ_HASH_SIZE];
 	unsigned long long last_subscr_id;
+
+	/* the round of sms_submit_pending currently running */
+	struct {
+		int active;
+		int again;
+		int fetching;
+		int in_fetch;
+		int attempts;
+		int attempted;
+		int rounds;
+		int initialized;
+		unsigned long long first_sub;
+	} submit;
 };
 
 static int sms_subscr_cb(unsigned int, unsigned int, void *, void *);
 static int sms_sms_cb(unsigned int, unsigned int, void *, void *);
+static void sms_submit_pending(void *_data);
+
+static struct llist_head *pending_bucket(struct llist_head *hash,
+					 unsigned long long id)
+{
+	return &hash[(id ^ (id >> 32)) % SMSQ_HASH_SIZE];
+}
 
 static struct gsm_sms_pending *sms_find_pending(struct gsm_sms_queue *smsq,
 						struct gsm_sms *sms)
 {
 	struct gsm_sms_pending *pending;
 
-	llist_for_each_entry(pending, &smsq->pending_sms, entry) {
+	llist_for_each_entry(pending,
+			     pending_bucket(smsq->pending_by_sms, sms->id),
+			     sms_entry) {
 		if (pending->sms_id == sms->id)
 			return pending;
 	}
@@ -92,7 +123,9 @@ static struct gsm_sms_pending *sms_subscriber_find_pending(
 {
 	struct gsm_sms_pending *pending;
 
-	llist_for_each_entry(pending, &smsq->pending_sms, entry) {
+	llist_for_each_entry(pending,
+			     pending_bucket(smsq->pending_by_subscr, subscr->id),
+			     subscr_entry) {
 		if (pending->subscr == subscr)
 			return pending;
 	}
@@ -120,10 +153,23 @@ static struct gsm_sms_pending *sms_pending_from(struct gsm_sms_queue *smsq,
 	return pending;
 }
 
+static void sms_pending_add(struct gsm_sms_queue *smsq,
+			    struct gsm_sms_pending *pending)
+{
+	llist_add_tail(&pending->entry, &smsq->pending_sms);
+	llist_add_tail(&pending->sms_entry,
+		       pending_bucket(smsq->pending_by_sms, pending->sms_id));
+	llist_add_tail(&pending->subscr_entry,
+		       pending_bucket(smsq->pending_by_subscr,
+				      pending->subscr->id));
+}
+
 static void sms_pending_free(struct gsm_sms_pending *pending)
 {
 	subscr_put(pending->subscr);
 	llist_del(&pending->entry);
+	llist_del(&pending->sms_entry);
+	llist_del(&pending->subscr_entry);
 	talloc_free(pending);
 }
 
@@ -186,98 +232,149 @@ static void sms_resend_pending(void *_data)
 	}
 }
 
-static struct gsm_sms *take_next_sms(struct gsm_sms_queue *smsq)
+static void sms_fetch_next(struct gsm_sms_queue *smsq);
+
+static void sms_submit_done(struct gsm_sms_queue *smsq)
 {
-	struct gsm_sms *sms;
+	LOGP(DLSMS, LOGL_DEBUG, "SMSqueue added %d messages in %d rounds\n",
+	     smsq->submit.attempted, smsq->submit.rounds);
 
-	sms = db_sms_get_unsent_by_subscr(smsq->network, smsq->last_subscr_id, 10);
-	if (sms) {
-		smsq->last_subscr_id = sms->receiver->id + 1;
-		return sms;
+	smsq->submit.active = 0;
+	if (smsq->submit.again) {
+		smsq->submit.again = 0;
+		sms_submit_pending(smsq);
 	}
-
-	/* need to wrap around */
-	smsq->last_subscr_id = 0;
-	sms = db_sms_get_unsent_by_subscr(smsq->network,
-					  smsq->last_subscr_id, 10);
-	if (sms)
-		smsq->last_subscr_id = sms->receiver->id + 1;
-	return sms;
 }
 
-/**
- * I will submit up to max_pending - pending SMS to the
- * subsystem.
- */
-static void sms_submit_pending(void *_data)
+/* returns 1 when the round should be stopped */
+static int sms_submit_one(struct gsm_sms_queue *smsq, struct gsm_sms *sms)
 {
-	struct gsm_sms_queue *smsq = _data;
-	int attempts = smsq->max_pending - smsq->pending;
-	int initialized = 0;
-	unsigned long long first_sub = 0;
-	int attempted = 0, rounds = 0;
+	struct gsm_sms_pending *pending;
 
-	LOGP(DLSMS, LOGL_NOTICE, "Attempting to send %d SMS\n", attempts);
+	smsq->submit.rounds += 1;
 
-	do {
-		struct gsm_sms_pending *pending;
-		struct gsm_sms *sms;
+	/*
+	 * This code needs to detect a loop. It assumes that no SMS
+	 * will vanish during the time this is executed. We will remember
+	 * the id of the first GSM subscriber we see and then will
+	 * compare this. The Database code should make sure that we will
+	 * see all other subscribers first before seeing this one again.
+	 *
+	 * It is always scary to have an infinite loop like this.
+	 */
+	if (!smsq->submit.initialized) {
+		smsq->submit.first_sub = sms->receiver->id;
+		smsq->submit.initialized = 1;
+	} else if (smsq->submit.first_sub == sms->receiver->id) {
+		sms_free(sms);
+		return 1;
+	}
 
+	/* no need to send a pending sms */
+	if (sms_is_in_pending(smsq, sms)) {
+		LOGP(DLSMS, LOGL_DEBUG,
+		     "SMSqueue with pending sms: %llu. Skipping\n", sms->id);
+		sms_free(sms);
+		return 0;
+	}
 
-		sms = take_next_sms(smsq);
-		if (!sms)
-			break;
+	/* no need to send a SMS with the same receiver */
+	if (sms_subscriber_is_pending(smsq, sms->receiver)) {
+		LOGP(DLSMS, LOGL_DEBUG,
+		     "SMSqueue with pending sub: %llu. Skipping\n", sms->receiver->id);
+		sms_free(sms);
+		return 0;
+	}
 
-		rounds += 1;
+	pending = sms_pending_from(smsq, sms);
+	if (!pending) {
+		LOGP(DLSMS, LOGL_ERROR,
+		     "Failed to create pending SMS entry.\n");
+		sms_free(sms);
+		return 0;
+	}
 
-		/*
-		 * This code needs to detect a loop. It assumes that no SMS
-		 * will vanish during the time this is executed. We will remember
-		 * the id of the first GSM subscriber we see and then will
-		 * compare this. The Database code should make sure that we will
-		 * see all other subscribers first before seeing this one again.
-		 *
-		 * It is always scary to have an infinite loop like this.
-		 */
-		if (!initialized) {
-			first_sub = sms->receiver->id;
-			initialized = 1;
-		} else if (first_sub == sms->receiver->id) {
-			sms_free(sms);
-			break;
-		}
+	smsq->submit.attempted += 1;
+	smsq->pending += 1;
+	sms_pending_add(smsq, pending);
+	gsm411_send_sms_subscr(sms->receiver, sms);
+	return 0;
+}
 
-		/* no need to send a pending sms */
-		if (sms_is_in_pending(smsq, sms)) {
-			LOGP(DLSMS, LOGL_DEBUG,
-			     "SMSqueue with pending sms: %llu. Skipping\n", sms->id);
-			sms_free(sms);
-			continue;
-		}
+static void sms_fetched_cb(struct gsm_sms *sms, void *data)
+{
+	struct gsm_sms_queue *smsq = data;
 
-		/* no need to send a SMS with the same receiver */
-		if (sms_subscriber_is_pending(smsq, sms->receiver)) {
-			LOGP(DLSMS, LOGL_DEBUG,
-			     "SMSqueue with pending sub: %llu. Skipping\n", sms->receiver->id);
-			sms_free(sms);
-			continue;
+	smsq->submit.fetching = 0;
+
+	if (!sms) {
+		/* need to wrap around */
+		if (smsq->last_subscr_id != 0) {
+			smsq->last_subscr_id = 0;
+			goto next;
 		}
+		return sms_submit_done(smsq);
+	}
+
+	smsq->last_subscr_id = sms->receiver->id + 1;
+	if (sms_submit_one(smsq, sms)
+	    || smsq->submit.attempted >= smsq->submit.attempts
+	    || smsq->submit.rounds >= 1000)
+		return sms_submit_done(smsq);
+
+next:
+	/* the fetch loop is still running for a synchronous query */
+	if (!smsq->submit.in_fetch)
+		sms_fetch_next(smsq);
+}
 
-		pending = sms_pending_from(smsq, sms);
-		if (!pending) {
+static void sms_fetch_next(struct gsm_sms_queue *smsq)
+{
+	int rc;
+
+	while (smsq->submit.active && !smsq->submit.fetching) {
+		smsq->submit.fetching = 1;
+		smsq->submit.in_fetch = 1;
+		rc = db_sms_get_unsent_by_subscr_async(smsq->network,
+						smsq->last_subscr_id, 10,
+						sms_fetched_cb, smsq);
+		smsq->submit.in_fetch = 0;
+
+		if (rc < 0) {
 			LOGP(DLSMS, LOGL_ERROR,
-			     "Failed to create pending SMS entry.\n");
-			sms_free(sms);
-			continue;
+			     "Failed to query the next SMS: %d\n", rc);
+			smsq->submit.fetching = 0;
+			sms_submit_done(smsq);
 		}
+	}
+}
+
+/**
+ * I will submit up to max_pending - pending SMS to the
+ * subsystem. The SMS are fetched one after another by the
+ * database worker.
+ */
+static void sms_submit_pending(void *_data)
+{
+	struct gsm_sms_queue *smsq = _data;
+
+	/* the running round will pick it up */
+	if (smsq->submit.active) {
+		smsq->submit.again = 1;
+		return;
+	}
 
-		attempted += 1;
-		smsq->pending += 1;
-		llist_add_tail(&pending->entry, &smsq->pending_sms);
-		gsm411_send_sms_subscr(sms->receiver, sms);
-	} while (attempted < attempts && rounds < 1000);
+	smsq->submit.active = 1;
+	smsq->submit.attempts = smsq->max_pending - smsq->pending;
+	smsq->submit.attempted = 0;
+	smsq->submit.rounds = 0;
+	smsq->submit.initialized = 0;
+	smsq->submit.first_sub = 0;
 
-	LOGP(DLSMS, LOGL_DEBUG, "SMSqueue added %d messages in %d rounds\n", attempted, rounds);
+	LOGP(DLSMS, LOGL_NOTICE, "Attempting to send %d SMS\n",
+	     smsq->submit.attempts);
+
+	sms_fetch_next(smsq);
 }
 
 /*
@@ -295,6 +392,8 @@ int sms_queue_trigger(struct gsm_sms_queue *smsq)
 int sms_queue_start(struct gsm_network *network, int max_pending)
 {
 	struct gsm_sms_queue *sms = talloc_zero(network, struct gsm_sms_queue);
+	int i;
+
 	if (!sms) {
 		LOGP(DMSC, LOGL_ERROR, "Failed to create the SMS queue.\n");
 		return -1;
@@ -305,6 +404,10 @@ int sms_queue_start(struct gsm_network *network, int max_pending)
 
 	network->sms_queue = sms;
 	INIT_LLIST_HEAD(&sms->pending_sms);
+	for (i = 0; i < SMSQ_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&sms->pending_by_sms[i]);
+		INIT_LLIST_HEAD(&sms->pending_by_subscr[i]);
+	}
 	sms->max_fail = 1;
 	sms->network = network;
 	sms->max_pending = max_pending;
@@ -458,9 +561,15 @@ static int sms_sms_cb(unsigned int subsys, unsigned int signal,
 int sms_queue_stats(struct gsm_sms_queue *smsq, struct vty *vty)
 {
 	struct gsm_sms_pending *pending;
+	unsigned int unsent, subscrs;
 
 	vty_out(vty, "SMSqueue with max_pending: %d pending: %d%s",
 		smsq->max_pending, smsq->pending, VTY_NEWLINE);
+	if (sms_outbox_active()) {
+		sms_outbox_get_stats(&unsent, &subscrs);
+		vty_out(vty, "SMSqueue outbox with %u SMS for %u subscribers%s",
+			unsent, subscrs, VTY_NEWLINE);
+	}
 
 	llist_for_each_entry(pending, &smsq->pending_sms, entry)
 		vty_out(vty, " SMS Pending for Subscriber: %llu SMS: %llu Failed: %d.%s",
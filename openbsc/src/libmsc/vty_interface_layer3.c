@@ -39,6 +39,7 @@
 #include <osmocom/gsm/gsm_utils.h>
 #include <osmocom/core/utils.h>
 #include <openbsc/db.h>
+#include <openbsc/db_worker.h>
 #include <osmocom/core/talloc.h>
 #include <openbsc/signal.h>
 #include <openbsc/debug.h>
@@ -831,6 +832,24 @@ DEFUN(show_stats,
 	vty_out(vty, "MT Calls                : %lu setup, %lu connect%s",
 		osmo_counter_get(net->stats.call.mt_setup),
 		osmo_counter_get(net->stats.call.mt_connect), VTY_NEWLINE);
+	vty_out(vty, "Location Update Expiry  : %lu expired, %lu backlog%s",
+		osmo_counter_get(net->stats.subscr.expired),
+		osmo_counter_get(net->stats.subscr.expire_backlog), VTY_NEWLINE);
+	if (db_worker_running()) {
+		struct db_worker_stats db;
+
+		db_worker_get_stats(&db);
+		vty_out(vty, "Database Queue          : %u queued, %u max, %llu done, %llu failed%s",
+			db.depth, db.max_depth, db.queries, db.failed, VTY_NEWLINE);
+		vty_out(vty, "Database Transactions   : %llu, %u max queries%s",
+			db.batches, db.max_batch, VTY_NEWLINE);
+		vty_out(vty, "Database Latency        : %llu us avg, %llu us max, "
+			"%llu us avg exec, %llu us max exec%s",
+			db.queries ? db.latency_us / db.queries : 0,
+			db.max_latency_us,
+			db.queries ? db.exec_us / db.queries : 0,
+			db.max_exec_us, VTY_NEWLINE);
+	}
 	return CMD_SUCCESS;
 }
 
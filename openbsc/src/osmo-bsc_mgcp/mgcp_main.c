@@ -28,6 +28,7 @@
 #include <time.h>
 #include <limits.h>
 #include <unistd.h>
+#include <signal.h>
 
 #include <sys/socket.h>
 
@@ -61,6 +62,7 @@ static struct mgcp_config *cfg;
 static struct mgcp_trunk_config *reset_trunk;
 static int reset_endpoints = 0;
 static int daemonize = 0;
+static volatile sig_atomic_t quit = 0;
 
 const char *openbsc_copyright =
 	"Copyright (C) 2009-2010 Holger Freyther and On-Waves\r\n"
@@ -201,6 +203,18 @@ static struct vty_app_info vty_info = {
 	.is_config_node	= bsc_vty_is_config_node,
 };
 
+static void signal_handler(int signal)
+{
+	switch (signal) {
+	case SIGINT:
+	case SIGTERM:
+		quit = 1;
+		break;
+	default:
+		break;
+	}
+}
+
 int main(int argc, char **argv)
 {
 	struct gsm_network dummy_network;
@@ -294,11 +308,17 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (mgcp_workers_start(cfg) != 0)
+		LOGP(DMGCP, LOGL_ERROR, "Forwarding RTP in the main loop.\n");
+
+	signal(SIGINT, &signal_handler);
+	signal(SIGTERM, &signal_handler);
+
 	/* main loop */
-	while (1) {
+	while (!quit) {
 		osmo_select_main(0);
 	}
 
-
+	mgcp_workers_stop(cfg);
 	return 0;
 }
@@ -61,7 +61,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
 
 static void send_direct(struct bsc_nat *nat, struct msgb *output)
@@ -80,6 +83,31 @@ static void mgcp_queue_for_call_agent(struct bsc_nat *nat, struct msgb *output)
 		send_direct(nat, output);
 }
 
+/*
+ * Send data from the rewrite buffer. A msgb is only needed when the
+ * message has to wait in one of the queues.
+ */
+static void mgcp_send_to_call_agent(struct bsc_nat *nat,
+				    const char *data, int len)
+{
+	struct osmo_wqueue *queue = &nat->mgcp_cfg->gw_fd;
+	struct msgb *output;
+
+	if (!nat->mgcp_ipa && llist_empty(&queue->msg_queue)
+	    && write(queue->bfd.fd, data, len) == len)
+		return;
+
+	output = msgb_alloc_headroom(len + 128, 128, "MGCP to CA");
+	if (!output) {
+		LOGP(DMGCP, LOGL_ERROR, "Failed to allocate MGCP msg.\n");
+		return;
+	}
+
+	output->l2h = msgb_put(output, len);
+	memcpy(output->l2h, data, len);
+	mgcp_queue_for_call_agent(nat, output);
+}
+
 int bsc_mgcp_nr_multiplexes(int max_endpoints)
 {
 	int div = max_endpoints / 32;
@@ -90,6 +118,68 @@ int bsc_mgcp_nr_multiplexes(int max_endpoints)
 	return div;
 }
 
+/*
+ * The endpoints are indexed by the MSC endpoint number, the pending
+ * transactions are hashed by their id and each BSC keeps a list of the
+ * endpoints it is using. None of the per call handling needs to walk all
+ * endpoints or connections.
+ */
+static unsigned int trans_hash(const char *trans)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *trans; ++trans)
+		hash = (hash ^ (uint8_t) *trans) * 16777619u;
+	return hash % NAT_MGCP_HASH_SIZE;
+}
+
+static unsigned int dlcx_hash(struct bsc_connection *bsc, uint32_t trans_id)
+{
+	return ((uintptr_t) bsc / sizeof(void *) + trans_id) % NAT_MGCP_HASH_SIZE;
+}
+
+static void endp_set_transaction(struct bsc_nat *nat, struct bsc_endpoint *bsc_endp,
+				 const char *transaction_id, int state)
+{
+	bsc_endp->transaction_id = talloc_strdup(nat, transaction_id);
+	bsc_endp->transaction_state = state;
+	if (bsc_endp->transaction_id)
+		llist_add_tail(&bsc_endp->trans_entry,
+			       &nat->mgcp_trans[trans_hash(transaction_id)]);
+}
+
+static void endp_clear_transaction(struct bsc_endpoint *bsc_endp)
+{
+	if (bsc_endp->transaction_id) {
+		llist_del(&bsc_endp->trans_entry);
+		talloc_free(bsc_endp->transaction_id);
+		bsc_endp->transaction_id = NULL;
+	}
+
+	bsc_endp->transaction_state = 0;
+}
+
+static void endp_set_bsc(struct bsc_endpoint *bsc_endp, struct bsc_connection *bsc)
+{
+	if (bsc_endp->bsc)
+		llist_del(&bsc_endp->bsc_entry);
+	bsc_endp->bsc = bsc;
+	if (bsc)
+		llist_add_tail(&bsc_endp->bsc_entry, &bsc->mgcp_endpoints);
+}
+
+static void set_msc_endp(struct nat_sccp_connection *con, int endp)
+{
+	struct bsc_endpoint *endps = con->bsc->nat->bsc_endpoints;
+
+	if (con->msc_endp != -1 && endps[con->msc_endp].sccp == con)
+		endps[con->msc_endp].sccp = NULL;
+
+	con->msc_endp = endp;
+	if (endp != -1)
+		endps[endp].sccp = con;
+}
+
 static int bsc_init_endps_if_needed(struct bsc_connection *con)
 {
 	int multiplexes;
@@ -205,19 +295,18 @@ int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 		return -1;
 	}
 
-	/* find stale connections using that endpoint */
-	llist_for_each_entry(mcon, &con->bsc->nat->sccp_connections, list_entry) {
-		if (mcon->msc_endp == endp) {
-			LOGP(DNAT, LOGL_ERROR,
-			     "Endpoint %d was assigned to 0x%x and now 0x%x\n",
-			     endp,
-			     sccp_src_ref_to_int(&mcon->patched_ref),
-			     sccp_src_ref_to_int(&con->patched_ref));
-			bsc_mgcp_dlcx(mcon);
-		}
+	/* find a stale connection using that endpoint */
+	mcon = con->bsc->nat->bsc_endpoints[endp].sccp;
+	if (mcon) {
+		LOGP(DNAT, LOGL_ERROR,
+		     "Endpoint %d was assigned to 0x%x and now 0x%x\n",
+		     endp,
+		     sccp_src_ref_to_int(&mcon->patched_ref),
+		     sccp_src_ref_to_int(&con->patched_ref));
+		bsc_mgcp_dlcx(mcon);
 	}
 
-	con->msc_endp = endp;
+	set_msc_endp(con, endp);
 	if (bsc_init_endps_if_needed(con->bsc) != 0)
 		return -1;
 	if (bsc_assign_endpoint(con->bsc, con) != 0)
@@ -236,13 +325,8 @@ int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 
 static void bsc_mgcp_free_endpoint(struct bsc_nat *nat, int i)
 {
-	if (nat->bsc_endpoints[i].transaction_id) {
-		talloc_free(nat->bsc_endpoints[i].transaction_id);
-		nat->bsc_endpoints[i].transaction_id = NULL;
-	}
-
-	nat->bsc_endpoints[i].transaction_state = 0;
-	nat->bsc_endpoints[i].bsc = NULL;
+	endp_clear_transaction(&nat->bsc_endpoints[i]);
+	endp_set_bsc(&nat->bsc_endpoints[i], NULL);
 }
 
 void bsc_mgcp_free_endpoints(struct bsc_nat *nat)
@@ -347,6 +431,7 @@ static void remember_pending_dlcx(struct nat_sccp_connection *con, uint32_t tran
 
 	stats->trans_id = transaction;
 	stats->msc_endpoint = con->msc_endp;
+	stats->bsc = bsc;
 
 	/*
 	 * Too many pending requests.. let's remove the first two items.
@@ -360,11 +445,14 @@ static void remember_pending_dlcx(struct nat_sccp_connection *con, uint32_t tran
 		bsc->pending_dlcx_count -= 1;
 		tmp = (struct bsc_nat_call_stats *) bsc->pending_dlcx.next;
 		llist_del(&tmp->entry);
+		llist_del(&tmp->hash_entry);
 		talloc_free(tmp);
 	}
 
 	bsc->pending_dlcx_count += 1;
 	llist_add_tail(&stats->entry, &bsc->pending_dlcx);
+	llist_add_tail(&stats->hash_entry,
+		       &bsc->nat->pending_dlcx[dlcx_hash(bsc, transaction)]);
 }
 
 void bsc_mgcp_dlcx(struct nat_sccp_connection *con)
@@ -382,6 +470,7 @@ void bsc_mgcp_dlcx(struct nat_sccp_connection *con)
 		bsc_mgcp_free_endpoint(con->bsc->nat, con->msc_endp);
 	}
 
+	set_msc_endp(con, -1);
 	bsc_mgcp_init(con);
 
 }
@@ -407,8 +496,9 @@ static void handle_dlcx_response(struct bsc_connection *bsc, struct msgb *msg,
 	}
 
 	/* find the answer for the request we made */
-	llist_for_each_entry(tmp, &bsc->pending_dlcx, entry) {
-		if (trans_id != tmp->trans_id)
+	llist_for_each_entry(tmp, &bsc->nat->pending_dlcx[dlcx_hash(bsc, trans_id)],
+			     hash_entry) {
+		if (trans_id != tmp->trans_id || tmp->bsc != bsc)
 			continue;
 
 		stat = tmp;
@@ -472,23 +562,14 @@ static void handle_dlcx_response(struct bsc_connection *bsc, struct msgb *msg,
 free_stat:
 	bsc->pending_dlcx_count -= 1;
 	llist_del(&stat->entry);
+	llist_del(&stat->hash_entry);
 	talloc_free(stat);
 }
 
 
 struct nat_sccp_connection *bsc_mgcp_find_con(struct bsc_nat *nat, int endpoint)
 {
-	struct nat_sccp_connection *con = NULL;
-	struct nat_sccp_connection *sccp;
-
-	llist_for_each_entry(sccp, &nat->sccp_connections, list_entry) {
-		if (sccp->msc_endp == -1)
-			continue;
-		if (sccp->msc_endp != endpoint)
-			continue;
-
-		con = sccp;
-	}
+	struct nat_sccp_connection *con = nat->bsc_endpoints[endpoint].sccp;
 
 	if (con)
 		return con;
@@ -504,7 +585,7 @@ static int bsc_mgcp_policy_cb(struct mgcp_trunk_config *tcfg, int endpoint, int
 	struct bsc_endpoint *bsc_endp;
 	struct nat_sccp_connection *sccp;
 	struct mgcp_endpoint *mgcp_endp;
-	struct msgb *bsc_msg;
+	int len;
 
 	nat = tcfg->cfg->data;
 	bsc_endp = &nat->bsc_endpoints[endpoint];
@@ -513,11 +594,9 @@ static int bsc_mgcp_policy_cb(struct mgcp_trunk_config *tcfg, int endpoint, int
 	if (bsc_endp->transaction_id) {
 		LOGP(DMGCP, LOGL_ERROR, "Endpoint 0x%x had pending transaction: '%s'\n",
 		     endpoint, bsc_endp->transaction_id);
-		talloc_free(bsc_endp->transaction_id);
-		bsc_endp->transaction_id = NULL;
-		bsc_endp->transaction_state = 0;
+		endp_clear_transaction(bsc_endp);
 	}
-	bsc_endp->bsc = NULL;
+	endp_set_bsc(bsc_endp, NULL);
 
 	sccp = bsc_mgcp_find_con(nat, endpoint);
 
@@ -542,19 +621,19 @@ static int bsc_mgcp_policy_cb(struct mgcp_trunk_config *tcfg, int endpoint, int
 	}
 
 	/* we need to generate a new and patched message */
-	bsc_msg = bsc_mgcp_rewrite((char *) nat->mgcp_msg, nat->mgcp_length,
-				   sccp->bsc_endp, nat->mgcp_cfg->source_addr,
-				   mgcp_endp->bts_end.local_port,
-				   &mgcp_endp->net_end.payload_type);
-	if (!bsc_msg) {
+	len = bsc_mgcp_rewrite((char *) nat->mgcp_msg, nat->mgcp_length,
+			       sccp->bsc_endp, nat->mgcp_cfg->source_addr,
+			       mgcp_endp->bts_end.local_port,
+			       &mgcp_endp->net_end.payload_type,
+			       nat->mgcp_rewr, sizeof(nat->mgcp_rewr));
+	if (len < 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to patch the msg.\n");
 		return MGCP_POLICY_CONT;
 	}
 
 
-	bsc_endp->transaction_id = talloc_strdup(nat, transaction_id);
-	bsc_endp->transaction_state = state;
-	bsc_endp->bsc = sccp->bsc;
+	endp_set_transaction(nat, bsc_endp, transaction_id, state);
+	endp_set_bsc(bsc_endp, sccp->bsc);
 
 	/* we need to update some bits */
 	if (state == MGCP_ENDP_CRCX) {
@@ -568,16 +647,15 @@ static int bsc_mgcp_policy_cb(struct mgcp_trunk_config *tcfg, int endpoint, int
 		}
 
 		/* send the message and a fake MDCX to force sending of a dummy packet */
-		bsc_write(sccp->bsc, bsc_msg, IPAC_PROTO_MGCP_OLD);
+		bsc_write_mgcp(sccp->bsc, (uint8_t *) nat->mgcp_rewr, len);
 		bsc_mgcp_send_mdcx(sccp->bsc, sccp->bsc_endp, mgcp_endp);
 		return MGCP_POLICY_DEFER;
 	} else if (state == MGCP_ENDP_DLCX) {
 		/* we will free the endpoint now and send a DLCX to the BSC */
-		msgb_free(bsc_msg);
 		bsc_mgcp_dlcx(sccp);
 		return MGCP_POLICY_CONT;
 	} else {
-		bsc_write(sccp->bsc, bsc_msg, IPAC_PROTO_MGCP_OLD);
+		bsc_write_mgcp(sccp->bsc, (uint8_t *) nat->mgcp_rewr, len);
 		return MGCP_POLICY_DEFER;
 	}
 }
@@ -624,10 +702,10 @@ static void free_chan_downstream(struct mgcp_endpoint *endp, struct bsc_endpoint
  */
 void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 {
-	struct msgb *output;
-	struct bsc_endpoint *bsc_endp = NULL;
+	int len;
+	struct bsc_endpoint *bsc_endp = NULL, *tmp;
 	struct mgcp_endpoint *endp = NULL;
-	int i, code;
+	int code;
 	char transaction_id[60];
 
 	/* Some assumption that our buffer is big enough.. and null terminate */
@@ -643,17 +721,15 @@ void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 		return;
 	}
 
-	for (i = 1; i < bsc->nat->mgcp_cfg->trunk.number_endpoints; ++i) {
-		if (bsc->nat->bsc_endpoints[i].bsc != bsc)
-			continue;
-		/* no one listening? a bug? */
-		if (!bsc->nat->bsc_endpoints[i].transaction_id)
+	llist_for_each_entry(tmp, &bsc->nat->mgcp_trans[trans_hash(transaction_id)],
+			     trans_entry) {
+		if (tmp->bsc != bsc)
 			continue;
-		if (strcmp(transaction_id, bsc->nat->bsc_endpoints[i].transaction_id) != 0)
+		if (strcmp(transaction_id, tmp->transaction_id) != 0)
 			continue;
 
-		endp = &bsc->nat->mgcp_cfg->trunk.endpoints[i];
-		bsc_endp = &bsc->nat->bsc_endpoints[i];
+		endp = &bsc->nat->mgcp_cfg->trunk.endpoints[tmp - bsc->nat->bsc_endpoints];
+		bsc_endp = tmp;
 		break;
 	}
 
@@ -675,26 +751,25 @@ void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg)
 	}
 
 	/* free some stuff */
-	talloc_free(bsc_endp->transaction_id);
-	bsc_endp->transaction_id = NULL;
-	bsc_endp->transaction_state = 0;
+	endp_clear_transaction(bsc_endp);
 
 	/*
 	 * rewrite the information. In case the endpoint was deleted
 	 * there should be nothing for us to rewrite so putting endp->rtp_port
 	 * with the value of 0 should be no problem.
 	 */
-	output = bsc_mgcp_rewrite((char * ) msg->l2h, msgb_l2len(msg), -1,
-				  bsc->nat->mgcp_cfg->source_addr,
-				  endp->net_end.local_port,
-				  &endp->bts_end.payload_type);
+	len = bsc_mgcp_rewrite((char * ) msg->l2h, msgb_l2len(msg), -1,
+			       bsc->nat->mgcp_cfg->source_addr,
+			       endp->net_end.local_port,
+			       &endp->bts_end.payload_type,
+			       bsc->nat->mgcp_rewr, sizeof(bsc->nat->mgcp_rewr));
 
-	if (!output) {
+	if (len < 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to rewrite MGCP msg.\n");
 		return;
 	}
 
-	mgcp_queue_for_call_agent(bsc->nat, output);
+	mgcp_send_to_call_agent(bsc->nat, bsc->nat->mgcp_rewr, len);
 }
 
 int bsc_mgcp_parse_response(const char *str, int *code, char transaction[60])
@@ -723,33 +798,147 @@ uint32_t bsc_mgcp_extract_ci(const char *str)
 	return ci;
 }
 
-/**
- * Create a new MGCPCommand based on the input and endpoint from a message
+/*
+ * The rewritten message is gathered from spans of the input and from the
+ * few lines that had to be patched. The patched lines are formatted into
+ * the scratch space and spans that follow each other are merged, so a
+ * message is usually described by less than ten segments.
  */
-static void patch_mgcp(struct msgb *output, const char *op, const char *tok,
-		       int endp, int len, int cr)
+#define MGCP_REWRITE_SEGS	32
+
+struct mgcp_rewrite_seg {
+	const char *data;
+	int len;
+};
+
+struct mgcp_rewrite {
+	struct mgcp_rewrite_seg segs[MGCP_REWRITE_SEGS];
+	int num_segs;
+	int total;
+
+	char scratch[1024];
+	int used;
+};
+
+static int rewrite_add(struct mgcp_rewrite *rw, const char *data, int len)
+{
+	struct mgcp_rewrite_seg *seg;
+
+	if (rw->num_segs > 0) {
+		seg = &rw->segs[rw->num_segs - 1];
+		if (seg->data + seg->len == data) {
+			seg->len += len;
+			rw->total += len;
+			return 0;
+		}
+	}
+
+	if (rw->num_segs == MGCP_REWRITE_SEGS) {
+		LOGP(DMGCP, LOGL_ERROR, "Too many lines to rewrite.\n");
+		return -1;
+	}
+
+	seg = &rw->segs[rw->num_segs++];
+	seg->data = data;
+	seg->len = len;
+	rw->total += len;
+	return 0;
+}
+
+static int rewrite_put(struct mgcp_rewrite *rw, const char *data, int len)
 {
-	int slen;
-	int ret;
-	char buf[40];
+	if (len > sizeof(rw->scratch) - rw->used) {
+		LOGP(DMGCP, LOGL_ERROR, "Rewritten lines are too long.\n");
+		return -1;
+	}
+
+	memcpy(&rw->scratch[rw->used], data, len);
+	rw->used += len;
+	return rewrite_add(rw, &rw->scratch[rw->used - len], len);
+}
+
+static int rewrite_printf(struct mgcp_rewrite *rw, const char *fmt, ...)
+{
+	va_list ap;
+	int len, left;
+
+	left = sizeof(rw->scratch) - rw->used;
+	va_start(ap, fmt);
+	len = vsnprintf(&rw->scratch[rw->used], left, fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || len >= left) {
+		LOGP(DMGCP, LOGL_ERROR, "Rewritten lines are too long.\n");
+		return -1;
+	}
 
-	buf[0] = buf[39] = '\0';
-	ret = sscanf(tok, "%*s %s", buf);
-	if (ret != 1) {
+	rw->used += len;
+	return rewrite_add(rw, &rw->scratch[rw->used - len], len);
+}
+
+static int has_prefix(const char *line, int len, const char *str, int str_len)
+{
+	return len >= str_len && memcmp(line, str, str_len) == 0;
+}
+
+/**
+ * Create a new MGCPCommand based on the input and endpoint from a message.
+ * A line without a transaction id is dropped like before.
+ */
+static int patch_mgcp(struct mgcp_rewrite *rw, const char *op,
+		      const char *line, int len, int endp, int cr)
+{
+	const char *end = line + len;
+	const char *trans;
+	int trans_len = 0;
+
+	/* skip the verb, the line is known to start with it */
+	trans = line + 4;
+	while (trans < end && isspace(*trans))
+		trans += 1;
+	while (trans + trans_len < end && !isspace(trans[trans_len]))
+		trans_len += 1;
+
+	if (trans_len == 0 || trans_len > 39) {
 		LOGP(DMGCP, LOGL_ERROR,
-			"Failed to find Endpoint in: %s\n", tok);
-		return;
+			"Failed to find Endpoint in: %.*s\n", len, line);
+		return 0;
 	}
 
-	slen = sprintf((char *) output->l3h, "%s %s %x@mgw MGCP 1.0%s",
-			op, buf, endp, cr ? "\r\n" : "\n");
-	output->l3h = msgb_put(output, slen);
+	return rewrite_printf(rw, "%s %.*s %x@mgw MGCP 1.0%s",
+			      op, trans_len, trans, endp, cr ? "\r\n" : "\n");
 }
 
-/* we need to replace some strings... */
-struct msgb *bsc_mgcp_rewrite(char *input, int length, int endpoint,
-			      const char *ip, int port,
-			      int *payload_type)
+static int patch_audio(struct mgcp_rewrite *rw, const char *line, int len,
+		       int port, int cr, int *payload)
+{
+	char buf[128];
+
+	/* the line is not terminated in the input */
+	if (len > sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
+	memcpy(buf, line, len);
+	buf[len] = '\0';
+
+	if (sscanf(buf, "m=audio %*d RTP/AVP %d", payload) != 1) {
+		LOGP(DMGCP, LOGL_ERROR, "Could not parsed audio line.\n");
+		return -1;
+	}
+
+	return rewrite_printf(rw, "m=audio %d RTP/AVP %d%s",
+			      port, *payload, cr ? "\r\n" : "\n");
+}
+
+/*
+ * We need to replace some strings... The input is scanned once and is
+ * not modified, only the lines that change are formatted again. Like
+ * with the old strsep based code anything after the last newline is
+ * dropped. The result is written NUL terminated to the output and its
+ * length is returned.
+ */
+int bsc_mgcp_rewrite(const char *input, int length, int endpoint,
+		     const char *ip, int port, int *payload_type,
+		     char *output, int output_len)
 {
 	static const char crcx_str[] = "CRCX ";
 	static const char dlcx_str[] = "DLCX ";
@@ -759,9 +948,9 @@ struct msgb *bsc_mgcp_rewrite(char *input, int length, int endpoint,
 	static const char aud_str[] = "m=audio ";
 	static const char fmt_str[] = "a=fmtp:";
 
-	char buf[128];
-	char *running, *token;
-	struct msgb *output;
+	struct mgcp_rewrite rw;
+	const char *line, *next, *eol, *end;
+	int i, len, rc, ip_len;
 
 	/* keep state to add the a=fmtp line */
 	int found_fmtp = 0;
@@ -770,82 +959,68 @@ struct msgb *bsc_mgcp_rewrite(char *input, int length, int endpoint,
 
 	if (length > 4096 - 256) {
 		LOGP(DMGCP, LOGL_ERROR, "Input is too long.\n");
-		return NULL;
+		return -1;
 	}
 
-	output = msgb_alloc_headroom(4096, 128, "MGCP rewritten");
-	if (!output) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to allocate new MGCP msg.\n");
-		return NULL;
-	}
+	rw.num_segs = rw.total = rw.used = 0;
+	ip_len = strlen(ip);
+	end = input + length;
 
-	running = input;
-	output->l2h = output->data;
-	output->l3h = output->l2h;
-	for (token = strsep(&running, "\n"); running; token = strsep(&running, "\n")) {
-		int len = strlen(token);
-		cr = len > 0 && token[len - 1] == '\r';
-
-		if (strncmp(crcx_str, token, (sizeof crcx_str) - 1) == 0) {
-			patch_mgcp(output, "CRCX", token, endpoint, len, cr);
-		} else if (strncmp(dlcx_str, token, (sizeof dlcx_str) - 1) == 0) {
-			patch_mgcp(output, "DLCX", token, endpoint, len, cr);
-		} else if (strncmp(mdcx_str, token, (sizeof mdcx_str) - 1) == 0) {
-			patch_mgcp(output, "MDCX", token, endpoint, len, cr);
-		} else if (strncmp(ip_str, token, (sizeof ip_str) - 1) == 0) {
-			output->l3h = msgb_put(output, strlen(ip_str));
-			memcpy(output->l3h, ip_str, strlen(ip_str));
-			output->l3h = msgb_put(output, strlen(ip));
-			memcpy(output->l3h, ip, strlen(ip));
-
-			if (cr) {
-				output->l3h = msgb_put(output, 2);
-				output->l3h[0] = '\r';
-				output->l3h[1] = '\n';
-			} else {
-				output->l3h = msgb_put(output, 1);
-				output->l3h[0] = '\n';
-			}
-		} else if (strncmp(aud_str, token, (sizeof aud_str) - 1) == 0) {
-			if (sscanf(token, "m=audio %*d RTP/AVP %d", &payload) != 1) {
-				LOGP(DMGCP, LOGL_ERROR, "Could not parsed audio line.\n");
-				msgb_free(output);
-				return NULL;
-			}
-
-			snprintf(buf, sizeof(buf)-1, "m=audio %d RTP/AVP %d%s",
-				 port, payload, cr ? "\r\n" : "\n");
-			buf[sizeof(buf)-1] = '\0';
-
-			output->l3h = msgb_put(output, strlen(buf));
-			memcpy(output->l3h, buf, strlen(buf));
-		} else if (strncmp(fmt_str, token, (sizeof fmt_str) - 1) == 0) {
-			found_fmtp = 1;
-			goto copy;
-		} else {
-copy:
-			output->l3h = msgb_put(output, len + 1);
-			memcpy(output->l3h, token, len);
-			output->l3h[len] = '\n';
+	for (line = input; line < end; line = next) {
+		eol = memchr(line, '\n', end - line);
+		if (!eol)
+			break;
+		next = eol + 1;
+		len = eol - line;
+		cr = len > 0 && line[len - 1] == '\r';
+
+		if (has_prefix(line, len, crcx_str, sizeof(crcx_str) - 1))
+			rc = patch_mgcp(&rw, "CRCX", line, len, endpoint, cr);
+		else if (has_prefix(line, len, dlcx_str, sizeof(dlcx_str) - 1))
+			rc = patch_mgcp(&rw, "DLCX", line, len, endpoint, cr);
+		else if (has_prefix(line, len, mdcx_str, sizeof(mdcx_str) - 1))
+			rc = patch_mgcp(&rw, "MDCX", line, len, endpoint, cr);
+		else if (has_prefix(line, len, ip_str, sizeof(ip_str) - 1)) {
+			rc = rewrite_put(&rw, ip_str, sizeof(ip_str) - 1);
+			if (rc == 0)
+				rc = rewrite_put(&rw, ip, ip_len);
+			if (rc == 0)
+				rc = rewrite_put(&rw, cr ? "\r\n" : "\n",
+						 cr ? 2 : 1);
+		} else if (has_prefix(line, len, aud_str, sizeof(aud_str) - 1))
+			rc = patch_audio(&rw, line, len, port, cr, &payload);
+		else {
+			if (has_prefix(line, len, fmt_str, sizeof(fmt_str) - 1))
+				found_fmtp = 1;
+			rc = rewrite_add(&rw, line, len + 1);
 		}
+
+		if (rc != 0)
+			return -1;
 	}
 
-	/*
-	 * the above code made sure that we have 128 bytes lefts. So we can
-	 * safely append another line.
-	 */
 	if (!found_fmtp && payload != -1) {
-		snprintf(buf, sizeof(buf) - 1, "a=fmtp:%d mode-set=2%s",
-			payload, cr ? "\r\n" : "\n");
-		buf[sizeof(buf) - 1] = '\0';
-		output->l3h = msgb_put(output, strlen(buf));
-		memcpy(output->l3h, buf, strlen(buf));
+		if (rewrite_printf(&rw, "a=fmtp:%d mode-set=2%s",
+				   payload, cr ? "\r\n" : "\n") != 0)
+			return -1;
+	}
+
+	/* gather everything into the output, NUL terminated */
+	if (rw.total >= output_len) {
+		LOGP(DMGCP, LOGL_ERROR, "Rewritten MGCP msg is too long.\n");
+		return -1;
 	}
 
+	for (i = 0, len = 0; i < rw.num_segs; ++i) {
+		memcpy(&output[len], rw.segs[i].data, rw.segs[i].len);
+		len += rw.segs[i].len;
+	}
+	output[rw.total] = '\0';
+
 	if (payload != -1 && payload_type)
 		*payload_type = payload;
 
-	return output;
+	return rw.total;
 }
 
 /*
@@ -888,25 +1063,33 @@ static int mgcp_do_read(struct osmo_fd *fd)
 
 	nat = fd->data;
 
-	rc = read(fd->fd, nat->mgcp_msg, sizeof(nat->mgcp_msg) - 1);
+	/* the receive buffer is kept, the protocol code does not hold it */
+	if (!nat->mgcp_rx) {
+		nat->mgcp_rx = msgb_alloc(sizeof(nat->mgcp_msg), "MGCP GW Read");
+		if (!nat->mgcp_rx) {
+			LOGP(DMGCP, LOGL_ERROR, "Failed to create buffer.\n");
+			return -1;
+		}
+	}
+
+	msg = nat->mgcp_rx;
+	msgb_reset(msg);
+	rc = read(fd->fd, msg->data, msgb_tailroom(msg) - 1);
 	if (rc <= 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to read errno: %d\n", errno);
 		return -1;
 	}
+	msg->l2h = msgb_put(msg, rc);
 
+	/*
+	 * The protocol code tokenizes the msg in place, keep the original
+	 * for the rewriting done by the policy callback.
+	 */
+	memcpy(nat->mgcp_msg, msg->l2h, rc);
 	nat->mgcp_msg[rc] = '\0';
 	nat->mgcp_length = rc;
 
-	msg = msgb_alloc(sizeof(nat->mgcp_msg), "MGCP GW Read");
-	if (!msg) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to create buffer.\n");
-		return -1;
-	}
-
-	msg->l2h = msgb_put(msg, rc);
-	memcpy(msg->l2h, nat->mgcp_msg, msgb_l2len(msg));
 	resp = mgcp_handle_message(nat->mgcp_cfg, msg);
-	msgb_free(msg);
 
 	/* we do have a direct answer... e.g. AUEP */
 	if (resp)
@@ -1037,17 +1220,15 @@ int bsc_mgcp_nat_init(struct bsc_nat *nat)
 
 void bsc_mgcp_clear_endpoints_for(struct bsc_connection *bsc)
 {
+	struct bsc_endpoint *bsc_endp, *tmp;
+	struct bsc_nat_call_stats *stat, *stat_tmp;
 	struct rate_ctr *ctr = NULL;
-	int i;
 
 	if (bsc->cfg)
 		ctr = &bsc->cfg->stats.ctrg->ctr[BCFG_CTR_DROPPED_CALLS];
 
-	for (i = 1; i < bsc->nat->mgcp_cfg->trunk.number_endpoints; ++i) {
-		struct bsc_endpoint *bsc_endp = &bsc->nat->bsc_endpoints[i];
-
-		if (bsc_endp->bsc != bsc)
-			continue;
+	llist_for_each_entry_safe(bsc_endp, tmp, &bsc->mgcp_endpoints, bsc_entry) {
+		int i = bsc_endp - bsc->nat->bsc_endpoints;
 
 		if (ctr)
 			rate_ctr_inc(ctr);
@@ -1055,4 +1236,12 @@ void bsc_mgcp_clear_endpoints_for(struct bsc_connection *bsc)
 		bsc_mgcp_free_endpoint(bsc->nat, i);
 		mgcp_free_endp(&bsc->nat->mgcp_cfg->trunk.endpoints[i]);
 	}
+
+	/* the DLCX responses will not arrive anymore */
+	llist_for_each_entry_safe(stat, stat_tmp, &bsc->pending_dlcx, entry) {
+		llist_del(&stat->entry);
+		llist_del(&stat->hash_entry);
+		talloc_free(stat);
+	}
+	bsc->pending_dlcx_count = 0;
 }
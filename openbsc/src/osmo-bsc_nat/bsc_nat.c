@@ -73,6 +73,7 @@ static struct osmo_fd bsc_listen;
 static const char *msc_ip = NULL;
 static struct osmo_timer_list sccp_close;
 static int daemonize = 0;
+static volatile sig_atomic_t quit = 0;
 
 const char *openbsc_copyright =
 	"Copyright (C) 2010 Holger Hans Peter Freyther and On-Waves\r\n"
@@ -505,7 +506,7 @@ static void bsc_send_con_refuse(struct bsc_connection *bsc,
 		con->con_type = NAT_CON_TYPE_LOCAL_REJECT;
 		con->con_local = NAT_CON_END_LOCAL;
 		con->has_remote_ref = 1;
-		con->remote_ref = con->patched_ref;
+		sccp_connection_set_remote(con, &con->patched_ref);
 
 		/* 1. create a confirmation */
 		cc = sccp_create_cc(&con->remote_ref, &con->real_ref);
@@ -563,48 +564,13 @@ send_refuse:
 	bsc_write(bsc, refuse, IPAC_PROTO_SCCP);
 }
 
-static void bsc_nat_send_paging(struct bsc_connection *bsc, struct msgb *msg)
-{
-	if (bsc->cfg->forbid_paging) {
-		LOGP(DNAT, LOGL_DEBUG, "Paging forbidden for BTS: %d\n", bsc->cfg->nr);
-		return;
-	}
-
-	bsc_send_data(bsc, msg->l2h, msgb_l2len(msg), IPAC_PROTO_SCCP);
-}
-
 static void bsc_nat_handle_paging(struct bsc_nat *nat, struct msgb *msg)
 {
-	struct bsc_connection *bsc;
-	const uint8_t *paging_start;
-	int paging_length, i, ret;
-
-	ret = bsc_nat_find_paging(msg, &paging_start, &paging_length);
-	if (ret != 0) {
-		LOGP(DNAT, LOGL_ERROR, "Could not parse paging message: %d\n", ret);
-		return;
-	}
-
-	/* This is quite expensive now */
-	for (i = 0; i < paging_length; i += 2) {
-		unsigned int _lac = ntohs(*(unsigned int *) &paging_start[i]);
-		unsigned int paged = 0;
-		llist_for_each_entry(bsc, &nat->bsc_connections, list_entry) {
-			if (!bsc->cfg)
-				continue;
-			if (!bsc->authenticated)
-				continue;
-			if (!bsc_config_handles_lac(bsc->cfg, _lac))
-				continue;
-			bsc_nat_send_paging(bsc, msg);
-			paged += 1;
-		}
-
-		/* highlight a possible config issue */
-		if (paged == 0)
-			LOGP(DNAT, LOGL_ERROR, "No BSC for LAC %d/0x%d\n", _lac, _lac);
+	int ret;
 
-	}
+	ret = bsc_nat_forward_paging(nat, msg);
+	if (ret < 0)
+		LOGP(DNAT, LOGL_ERROR, "Could not forward paging message: %d\n", ret);
 }
 
 
@@ -880,10 +846,7 @@ void bsc_close_connection(struct bsc_connection *connection)
 		ctr = &connection->cfg->stats.ctrg->ctr[BCFG_CTR_DROPPED_SCCP];
 
 	/* remove all SCCP connections */
-	llist_for_each_entry_safe(sccp_patch, tmp, &nat->sccp_connections, list_entry) {
-		if (sccp_patch->bsc != connection)
-			continue;
-
+	llist_for_each_entry_safe(sccp_patch, tmp, &connection->sccp_connections, bsc_entry) {
 		if (ctr)
 			rate_ctr_inc(ctr);
 		if (sccp_patch->has_remote_ref) {
@@ -907,24 +870,27 @@ void bsc_close_connection(struct bsc_connection *connection)
 	/* close endpoints allocated by this BSC */
 	bsc_mgcp_clear_endpoints_for(connection);
 
-	osmo_fd_unregister(&connection->write_queue.bfd);
-	close(connection->write_queue.bfd.fd);
+	if (connection->worker_conn) {
+		bsc_nat_worker_detach(connection);
+	} else {
+		osmo_fd_unregister(&connection->write_queue.bfd);
+		close(connection->write_queue.bfd.fd);
+	}
 	osmo_wqueue_clear(&connection->write_queue);
 	llist_del(&connection->list_entry);
+	bsc_nat_paging_index_invalidate(connection->nat);
 
 	talloc_free(connection);
 }
 
 static void bsc_maybe_close(struct bsc_connection *bsc)
 {
-	struct nat_sccp_connection *sccp;
 	if (!bsc->nat->blocked)
 		return;
 
 	/* are there any connections left */
-	llist_for_each_entry(sccp, &bsc->nat->sccp_connections, list_entry)
-		if (sccp->bsc == bsc)
-			return;
+	if (!llist_empty(&bsc->sccp_connections))
+		return;
 
 	/* nothing left, close the BSC */
 	LOGP(DNAT, LOGL_NOTICE, "Cleaning up BSC %d in blocking mode.\n",
@@ -980,6 +946,7 @@ static void ipaccess_auth_bsc(struct tlv_parsed *tvp, struct bsc_connection *bsc
 			rate_ctr_inc(&conf->stats.ctrg->ctr[BCFG_CTR_NET_RECONN]);
 			bsc->authenticated = 1;
 			bsc->cfg = conf;
+			bsc_nat_paging_index_invalidate(bsc->nat);
 			osmo_timer_del(&bsc->id_timeout);
 			LOGP(DNAT, LOGL_NOTICE, "Authenticated bsc nr: %d on fd %d\n",
 			     conf->nr, bsc->write_queue.bfd.fd);
@@ -1007,6 +974,43 @@ static void handle_con_stats(struct nat_sccp_connection *con)
 	rate_ctr_inc(&ctrg->ctr[id]);
 }
 
+static void count_sccp_parsed(struct bsc_nat *nat, int sccp_type)
+{
+	int ctr;
+
+	switch (sccp_type) {
+	case SCCP_MSG_TYPE_DT1:
+		ctr = NAT_SCCP_DT1_PARSED;
+		break;
+	case SCCP_MSG_TYPE_CR:
+		ctr = NAT_SCCP_CR_PARSED;
+		break;
+	case SCCP_MSG_TYPE_CC:
+		ctr = NAT_SCCP_CC_PARSED;
+		break;
+	case SCCP_MSG_TYPE_CREF:
+		ctr = NAT_SCCP_CREF_PARSED;
+		break;
+	case SCCP_MSG_TYPE_RLSD:
+		ctr = NAT_SCCP_RLSD_PARSED;
+		break;
+	case SCCP_MSG_TYPE_RLC:
+		ctr = NAT_SCCP_RLC_PARSED;
+		break;
+	case SCCP_MSG_TYPE_IT:
+		ctr = NAT_SCCP_IT_PARSED;
+		break;
+	case SCCP_MSG_TYPE_UDT:
+		ctr = NAT_SCCP_UDT_PARSED;
+		break;
+	default:
+		ctr = NAT_SCCP_OTHER_PARSED;
+		break;
+	}
+
+	rate_ctr_inc(&nat->stats.sccp_path->ctr[ctr]);
+}
+
 static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg)
 {
 	int con_filter = 0;
@@ -1016,6 +1020,15 @@ static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg)
 	int con_type;
 	struct bsc_nat_parsed *parsed;
 	struct bsc_nat_reject_cause cause;
+	struct nat_sccp_connection *fast_con;
+
+	/* data on a known connection nobody wants to look at */
+	fast_con = bsc_nat_dt1_fast_path(bsc, msg);
+	if (fast_con) {
+		rate_ctr_inc(&bsc->nat->stats.sccp_path->ctr[NAT_SCCP_DT1_FAST]);
+		queue_for_msc(fast_con->msc_con, msg);
+		return 0;
+	}
 
 	/* Parse and filter messages */
 	parsed = bsc_nat_parse(msg);
@@ -1025,6 +1038,9 @@ static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg)
 		return -1;
 	}
 
+	if (parsed->ipa_proto == IPAC_PROTO_SCCP)
+		count_sccp_parsed(bsc->nat, parsed->sccp_type);
+
 	if (bsc_nat_filter_ipa(DIR_MSC, msg, parsed))
 		goto exit;
 
@@ -1203,29 +1219,24 @@ exit3:
 	return -1;
 }
 
-static int ipaccess_bsc_read_cb(struct osmo_fd *bfd)
+static void ipaccess_bsc_lost(struct bsc_connection *bsc, int ret)
 {
-	struct bsc_connection *bsc = bfd->data;
-	struct msgb *msg;
-	struct ipaccess_head *hh;
-	struct ipaccess_head_ext *hh_ext;
-	int ret;
-
-	ret = ipa_msg_recv(bfd->fd, &msg);
-	if (ret <= 0) {
-		if (ret == 0)
-			LOGP(DNAT, LOGL_ERROR,
-			     "The connection to the BSC Nr: %d was lost. Cleaning it\n",
-			     bsc->cfg ? bsc->cfg->nr : -1);
-		else
-			LOGP(DNAT, LOGL_ERROR,
-			     "Stream error on BSC Nr: %d. Failed to parse ip access message: %d\n",
-			     bsc->cfg ? bsc->cfg->nr : -1, ret);
+	if (ret == 0)
+		LOGP(DNAT, LOGL_ERROR,
+		     "The connection to the BSC Nr: %d was lost. Cleaning it\n",
+		     bsc->cfg ? bsc->cfg->nr : -1);
+	else
+		LOGP(DNAT, LOGL_ERROR,
+		     "Stream error on BSC Nr: %d. Failed to parse ip access message: %d\n",
+		     bsc->cfg ? bsc->cfg->nr : -1, ret);
 
-		bsc_close_connection(bsc);
-		return -1;
-	}
+	bsc_close_connection(bsc);
+}
 
+static int ipaccess_bsc_handle_msg(struct bsc_connection *bsc, struct msgb *msg)
+{
+	struct ipaccess_head *hh;
+	struct ipaccess_head_ext *hh_ext;
 
 	LOGP(DNAT, LOGL_DEBUG, "MSG from BSC: %s proto: %d\n", osmo_hexdump(msg->data, msg->len), msg->l2h[0]);
 
@@ -1262,6 +1273,21 @@ static int ipaccess_bsc_read_cb(struct osmo_fd *bfd)
 	return 0;
 }
 
+static int ipaccess_bsc_read_cb(struct osmo_fd *bfd)
+{
+	struct bsc_connection *bsc = bfd->data;
+	struct msgb *msg;
+	int ret;
+
+	ret = ipa_msg_recv(bfd->fd, &msg);
+	if (ret <= 0) {
+		ipaccess_bsc_lost(bsc, ret);
+		return -1;
+	}
+
+	return ipaccess_bsc_handle_msg(bsc, msg);
+}
+
 static int ipaccess_listen_bsc_cb(struct osmo_fd *bfd, unsigned int what)
 {
 	struct bsc_connection *bsc;
@@ -1324,7 +1350,14 @@ static int ipaccess_listen_bsc_cb(struct osmo_fd *bfd, unsigned int what)
 	bsc->write_queue.read_cb = ipaccess_bsc_read_cb;
 	bsc->write_queue.write_cb = bsc_write_cb;
 	bsc->write_queue.bfd.when = BSC_FD_READ;
-	if (osmo_fd_register(&bsc->write_queue.bfd) < 0) {
+	if (nat->workers) {
+		if (bsc_nat_worker_attach(bsc) != 0) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to hand the BSC fd to a worker.\n");
+			close(fd);
+			talloc_free(bsc);
+			return -2;
+		}
+	} else if (osmo_fd_register(&bsc->write_queue.bfd) < 0) {
 		LOGP(DNAT, LOGL_ERROR, "Failed to register BSC fd.\n");
 		close(fd);
 		talloc_free(bsc);
@@ -1430,6 +1463,10 @@ static void signal_handler(int signal)
 	case SIGUSR1:
 		talloc_report_full(tall_bsc_ctx, stderr);
 		break;
+	case SIGINT:
+	case SIGTERM:
+		quit = 1;
+		break;
 	default:
 		break;
 	}
@@ -1579,6 +1616,8 @@ int main(int argc, char **argv)
 
 	signal(SIGABRT, &signal_handler);
 	signal(SIGUSR1, &signal_handler);
+	signal(SIGINT, &signal_handler);
+	signal(SIGTERM, &signal_handler);
 	osmo_init_ignore_signals();
 
 	if (daemonize) {
@@ -1589,16 +1628,24 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (mgcp_workers_start(nat->mgcp_cfg) != 0)
+		LOGP(DNAT, LOGL_ERROR, "Forwarding RTP in the main loop.\n");
+	if (bsc_nat_workers_start(nat, ipaccess_bsc_handle_msg,
+				  ipaccess_bsc_lost) != 0)
+		LOGP(DNAT, LOGL_ERROR, "Handling the BSC connections in the main loop.\n");
+
 	/* recycle timer */
 	sccp_set_log_area(DSCCP);
 	sccp_close.cb = sccp_close_unconfirmed;
 	sccp_close.data = NULL;
 	osmo_timer_schedule(&sccp_close, SCCP_CLOSE_TIME, 0);
 
-	while (1) {
+	while (!quit) {
 		osmo_select_main(0);
 	}
 
+	bsc_nat_workers_stop(nat);
+	mgcp_workers_stop(nat->mgcp_cfg);
 	return 0;
 }
 
@@ -0,0 +1,678 @@
+/* Compile the IMSI access lists into one automaton */
+/*
+ * (C) 2010-2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010-2013 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The imsi-allow and imsi-deny expressions are POSIX basic regular
+ * expressions matched against an IMSI. Most of them are a sequence of
+ * digits, digit classes and repetitions. These are turned into one
+ * DFA over the digits for the whole list so an IMSI is checked in a
+ * single pass. Everything else (groups, back references, ...) and all
+ * IMSIs with non-digits are still handed to regexec.
+ */
+
+#include <openbsc/bsc_nat.h>
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+
+#include <osmocom/core/talloc.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ACC_MAX_ITEMS		64
+#define ACC_MAX_STATES		16384
+#define ACC_STATE_HASH		(2 * ACC_MAX_STATES)
+#define ACC_ALL_DIGITS		0x3ff
+
+/* the accepting bits of a DFA state */
+#define ACC_F_ALLOW		NAT_ACC_ALLOW
+#define ACC_F_DENY		NAT_ACC_DENY
+#define ACC_F_ALLOW_END		0x4
+#define ACC_F_DENY_END		0x8
+
+enum acc_rep {
+	ACC_REP_ONE,
+	ACC_REP_OPT,
+	ACC_REP_STAR,
+};
+
+typedef int32_t acc_row[10];
+
+struct acc_item {
+	uint16_t mask;
+	uint8_t rep;
+};
+
+struct acc_pattern {
+	int kind;
+	int anchor_start;
+	int anchor_end;
+	int num_items;
+	struct acc_item items[ACC_MAX_ITEMS];
+	regex_t *re;
+};
+
+struct bsc_nat_acc_match {
+	/* the DFA, state 0 is the start and -1 means no match */
+	int num_states;
+	acc_row *next;
+	uint8_t *flags;
+
+	/* the expressions that could not be compiled */
+	int num_slow_allow;
+	regex_t **slow_allow;
+	int num_slow_deny;
+	regex_t **slow_deny;
+};
+
+/* state of the subset construction */
+struct acc_builder {
+	struct acc_pattern *pats;
+	int num_pats;
+
+	/* NFA state n is position n - base[p] of pattern p */
+	int num_nfa;
+	int *base;
+	int *pat_of;
+	uint32_t *seen;
+	uint32_t stamp;
+
+	/* the NFA states of each DFA state */
+	uint32_t *pool;
+	size_t pool_len, pool_size;
+	size_t *set_off;
+	int *set_len;
+	int32_t *hash;
+
+	struct bsc_nat_acc_match *match;
+};
+
+static uint64_t acc_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_bracket(const char **_p, uint16_t *out)
+{
+	const char *p = *_p;
+	uint16_t mask = 0;
+	int neg = 0, first = 1;
+	char lo, hi, c;
+
+	if (*p == '^') {
+		neg = 1;
+		p += 1;
+	}
+
+	for (;;) {
+		c = *p;
+		if (c == '\0')
+			return -1;
+		if (c == ']' && !first) {
+			p += 1;
+			break;
+		}
+		first = 0;
+
+		if (c == '[' && p[1] == ':') {
+			const char *end = strstr(p + 2, ":]");
+			size_t len;
+
+			if (!end)
+				return -1;
+			len = end - (p + 2);
+			if ((len == 5 && strncmp(p + 2, "digit", 5) == 0)
+			    || (len == 5 && strncmp(p + 2, "alnum", 5) == 0)
+			    || (len == 6 && strncmp(p + 2, "xdigit", 6) == 0)
+			    || (len == 5 && strncmp(p + 2, "print", 5) == 0)
+			    || (len == 5 && strncmp(p + 2, "graph", 5) == 0))
+				mask |= ACC_ALL_DIGITS;
+			else if (!(len == 5 && strncmp(p + 2, "alpha", 5) == 0)
+				 && !(len == 5 && strncmp(p + 2, "upper", 5) == 0)
+				 && !(len == 5 && strncmp(p + 2, "lower", 5) == 0)
+				 && !(len == 5 && strncmp(p + 2, "space", 5) == 0)
+				 && !(len == 5 && strncmp(p + 2, "blank", 5) == 0)
+				 && !(len == 5 && strncmp(p + 2, "punct", 5) == 0)
+				 && !(len == 5 && strncmp(p + 2, "cntrl", 5) == 0))
+				return -1;
+			p = end + 2;
+			continue;
+		}
+		if (c == '[' && (p[1] == '.' || p[1] == '='))
+			return -1;
+
+		if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+			lo = c;
+			hi = p[2];
+			p += 3;
+		} else {
+			lo = hi = c;
+			p += 1;
+		}
+
+		for (c = lo > '0' ? lo : '0'; c <= hi && c <= '9'; ++c)
+			mask |= 1 << (c - '0');
+	}
+
+	*_p = p;
+	*out = neg ? ~mask & ACC_ALL_DIGITS : mask;
+	return 0;
+}
+
+static int add_item(struct acc_pattern *pat, uint16_t mask, int rep)
+{
+	if (pat->num_items >= ACC_MAX_ITEMS)
+		return -1;
+
+	pat->items[pat->num_items].mask = mask;
+	pat->items[pat->num_items].rep = rep;
+	pat->num_items += 1;
+	return 0;
+}
+
+/*
+ * Parse the subset of the basic regular expressions we can put into
+ * the DFA. Characters other than digits can never match and are kept
+ * as an empty digit set.
+ */
+static int parse_pattern(struct acc_pattern *pat, const char *re)
+{
+	const char *p = re;
+	uint16_t mask;
+	char *end;
+	int i, min, max;
+
+	pat->num_items = 0;
+	pat->anchor_start = pat->anchor_end = 0;
+
+	if (*p == '^') {
+		pat->anchor_start = 1;
+		p += 1;
+	}
+
+	while (*p) {
+		if (p[0] == '$' && p[1] == '\0') {
+			pat->anchor_end = 1;
+			break;
+		}
+
+		/* the atom */
+		if (*p == '.') {
+			mask = ACC_ALL_DIGITS;
+			p += 1;
+		} else if (*p == '[') {
+			p += 1;
+			if (parse_bracket(&p, &mask) != 0)
+				return -1;
+		} else if (*p == '\\') {
+			if (p[1] == '\0' || !strchr(".[]*^$\\", p[1]))
+				return -1;
+			mask = 0;
+			p += 2;
+		} else if (*p >= '0' && *p <= '9') {
+			mask = 1 << (*p - '0');
+			p += 1;
+		} else {
+			/* includes a leading '*' which is a literal */
+			mask = 0;
+			p += 1;
+		}
+
+		/* the repetition */
+		if (*p == '*') {
+			while (*p == '*')
+				p += 1;
+			if (add_item(pat, mask, ACC_REP_STAR) != 0)
+				return -1;
+		} else if (p[0] == '\\' && p[1] == '{') {
+			min = strtol(p + 2, &end, 10);
+			if (end == p + 2 || min < 0)
+				return -1;
+			max = min;
+			if (*end == ',') {
+				if (end[1] == '\\')
+					max = -1;
+				else {
+					max = strtol(end + 1, &end, 10);
+					if (max < min)
+						return -1;
+				}
+				if (max == -1)
+					end += 1;
+			}
+			if (end[0] != '\\' || end[1] != '}')
+				return -1;
+			p = end + 2;
+			if (*p == '*')
+				return -1;
+
+			for (i = 0; i < min; ++i)
+				if (add_item(pat, mask, ACC_REP_ONE) != 0)
+					return -1;
+			if (max == -1) {
+				if (add_item(pat, mask, ACC_REP_STAR) != 0)
+					return -1;
+			} else {
+				for (i = min; i < max; ++i)
+					if (add_item(pat, mask, ACC_REP_OPT) != 0)
+						return -1;
+			}
+		} else if (add_item(pat, mask, ACC_REP_ONE) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void set_add(struct acc_builder *b, uint32_t *set, int *len, uint32_t s)
+{
+	int p, pos;
+
+	/* add the state and everything reachable without input */
+	for (;;) {
+		if (b->seen[s] == b->stamp)
+			return;
+		b->seen[s] = b->stamp;
+		set[(*len)++] = s;
+
+		p = b->pat_of[s];
+		pos = s - b->base[p];
+		if (pos == b->pats[p].num_items
+		    || b->pats[p].items[pos].rep == ACC_REP_ONE)
+			return;
+		s += 1;
+	}
+}
+
+static int cmp_state(const void *_a, const void *_b)
+{
+	uint32_t a = *(const uint32_t *) _a, b = *(const uint32_t *) _b;
+
+	return a < b ? -1 : a > b;
+}
+
+static uint32_t set_hash(const uint32_t *set, int len)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; ++i)
+		hash = (hash ^ set[i]) * 16777619u;
+	return hash;
+}
+
+/* find or create the DFA state for the sorted set */
+static int intern_set(struct acc_builder *b, const uint32_t *set, int len)
+{
+	struct bsc_nat_acc_match *m = b->match;
+	uint32_t h = set_hash(set, len) & (ACC_STATE_HASH - 1);
+	struct acc_pattern *pat;
+	int state, i, p;
+
+	while ((state = b->hash[h]) >= 0) {
+		if (b->set_len[state] == len
+		    && memcmp(&b->pool[b->set_off[state]], set, len * sizeof(*set)) == 0)
+			return state;
+		h = (h + 1) & (ACC_STATE_HASH - 1);
+	}
+
+	if (m->num_states == ACC_MAX_STATES)
+		return -2;
+
+	if (b->pool_len + len > b->pool_size) {
+		uint32_t *pool;
+		size_t size = (b->pool_size + len) * 2;
+
+		pool = talloc_realloc(b->match, b->pool, uint32_t, size);
+		if (!pool)
+			return -2;
+		b->pool = pool;
+		b->pool_size = size;
+	}
+
+	state = m->num_states++;
+	b->hash[h] = state;
+	b->set_off[state] = b->pool_len;
+	b->set_len[state] = len;
+	memcpy(&b->pool[b->pool_len], set, len * sizeof(*set));
+	b->pool_len += len;
+
+	m->flags[state] = 0;
+	for (i = 0; i < len; ++i) {
+		p = b->pat_of[set[i]];
+		pat = &b->pats[p];
+		if (set[i] - b->base[p] != pat->num_items)
+			continue;
+		if (pat->anchor_end)
+			m->flags[state] |= pat->kind == NAT_ACC_ALLOW ?
+					ACC_F_ALLOW_END : ACC_F_DENY_END;
+		else
+			m->flags[state] |= pat->kind;
+	}
+
+	return state;
+}
+
+static int build_dfa(struct acc_builder *b)
+{
+	struct bsc_nat_acc_match *m = b->match;
+	struct acc_pattern *pat;
+	struct acc_item *item;
+	uint32_t *set, *cur;
+	int state, len, cur_len, i, d, p, pos, rc = -1;
+
+	set = talloc_array(m, uint32_t, b->num_nfa);
+	cur = talloc_array(m, uint32_t, b->num_nfa);
+	if (!set || !cur)
+		goto out;
+
+	/* the start state */
+	len = 0;
+	b->stamp += 1;
+	for (p = 0; p < b->num_pats; ++p)
+		set_add(b, set, &len, b->base[p]);
+	qsort(set, len, sizeof(*set), cmp_state);
+	if (intern_set(b, set, len) < 0)
+		goto out;
+
+	for (state = 0; state < m->num_states; ++state) {
+		cur_len = b->set_len[state];
+		memcpy(cur, &b->pool[b->set_off[state]], cur_len * sizeof(*cur));
+
+		for (d = 0; d < 10; ++d) {
+			len = 0;
+			b->stamp += 1;
+			for (i = 0; i < cur_len; ++i) {
+				p = b->pat_of[cur[i]];
+				pat = &b->pats[p];
+				pos = cur[i] - b->base[p];
+				if (pos == pat->num_items)
+					continue;
+
+				item = &pat->items[pos];
+				if (!(item->mask & (1 << d)))
+					continue;
+				set_add(b, set, &len,
+					item->rep == ACC_REP_STAR ? cur[i] : cur[i] + 1);
+			}
+
+			/* an unanchored expression may start everywhere */
+			for (p = 0; p < b->num_pats; ++p)
+				if (!b->pats[p].anchor_start)
+					set_add(b, set, &len, b->base[p]);
+
+			if (len == 0) {
+				m->next[state][d] = -1;
+				continue;
+			}
+
+			qsort(set, len, sizeof(*set), cmp_state);
+			m->next[state][d] = intern_set(b, set, len);
+			if (m->next[state][d] < 0)
+				goto out;
+		}
+	}
+
+	rc = 0;
+out:
+	talloc_free(set);
+	talloc_free(cur);
+	return rc;
+}
+
+static int add_slow(struct bsc_nat_acc_match *m, struct acc_pattern *pat)
+{
+	regex_t ***slow = pat->kind == NAT_ACC_ALLOW ? &m->slow_allow : &m->slow_deny;
+	int *num = pat->kind == NAT_ACC_ALLOW ? &m->num_slow_allow : &m->num_slow_deny;
+	regex_t **res;
+
+	res = talloc_realloc(m, *slow, regex_t *, *num + 1);
+	if (!res)
+		return -1;
+
+	res[(*num)++] = pat->re;
+	*slow = res;
+	return 0;
+}
+
+static int add_pattern(struct acc_builder *b, int kind, const char *str, regex_t *re)
+{
+	struct acc_pattern *pat = &b->pats[b->num_pats];
+
+	pat->kind = kind;
+	pat->re = re;
+	if (parse_pattern(pat, str) != 0) {
+		LOGP(DNAT, LOGL_DEBUG, "Using regexec for '%s'.\n", str);
+		return add_slow(b->match, pat);
+	}
+
+	b->num_pats += 1;
+	return 0;
+}
+
+/**
+ * Compile the filter list of an access list. This is called from the
+ * VTY once a list was changed and by the first lookup of a modified
+ * list. In case the DFA gets too large every expression falls back to
+ * regexec.
+ */
+int bsc_nat_acc_lst_compile(struct bsc_nat_acc_lst *lst)
+{
+	struct bsc_nat_acc_lst_entry *entry;
+	struct bsc_nat_acc_match *m;
+	struct acc_builder b;
+	acc_row *next;
+	uint8_t *flags;
+	uint64_t start;
+	int num, p, i, n;
+
+	start = acc_now_ns();
+
+	talloc_free(lst->match);
+	lst->match = NULL;
+	lst->dirty = 0;
+	lst->reg_gen = gsm_parse_reg_gen;
+
+	m = talloc_zero(lst, struct bsc_nat_acc_match);
+	if (!m)
+		goto fail;
+
+	num = 0;
+	llist_for_each_entry(entry, &lst->fltr_list, list)
+		num += 2;
+
+	memset(&b, 0, sizeof(b));
+	b.match = m;
+	b.pats = talloc_array(m, struct acc_pattern, num);
+	if (num && !b.pats)
+		goto fail;
+
+	llist_for_each_entry(entry, &lst->fltr_list, list) {
+		if (entry->imsi_allow
+		    && add_pattern(&b, NAT_ACC_ALLOW, entry->imsi_allow, &entry->imsi_allow_re) != 0)
+			goto fail;
+		if (entry->imsi_deny
+		    && add_pattern(&b, NAT_ACC_DENY, entry->imsi_deny, &entry->imsi_deny_re) != 0)
+			goto fail;
+	}
+
+	if (b.num_pats == 0)
+		goto done;
+
+	b.base = talloc_array(m, int, b.num_pats);
+	if (!b.base)
+		goto fail;
+	for (p = 0; p < b.num_pats; ++p) {
+		b.base[p] = b.num_nfa;
+		b.num_nfa += b.pats[p].num_items + 1;
+	}
+
+	b.pat_of = talloc_array(m, int, b.num_nfa);
+	b.seen = talloc_zero_array(m, uint32_t, b.num_nfa);
+	b.set_off = talloc_array(m, size_t, ACC_MAX_STATES);
+	b.set_len = talloc_array(m, int, ACC_MAX_STATES);
+	b.hash = talloc_array(m, int32_t, ACC_STATE_HASH);
+	m->next = talloc_array(m, acc_row, ACC_MAX_STATES);
+	m->flags = talloc_array(m, uint8_t, ACC_MAX_STATES);
+	if (!b.pat_of || !b.seen || !b.set_off || !b.set_len || !b.hash
+	    || !m->next || !m->flags)
+		goto fail;
+
+	for (p = 0; p < b.num_pats; ++p)
+		for (n = 0; n <= b.pats[p].num_items; ++n)
+			b.pat_of[b.base[p] + n] = p;
+	for (i = 0; i < ACC_STATE_HASH; ++i)
+		b.hash[i] = -1;
+
+	if (build_dfa(&b) != 0) {
+		LOGP(DNAT, LOGL_ERROR,
+		     "Access list %s is too complex, using regexec.\n", lst->name);
+		m->num_states = 0;
+		for (p = 0; p < b.num_pats; ++p)
+			if (add_slow(m, &b.pats[p]) != 0)
+				goto fail;
+		b.num_pats = 0;
+		goto done;
+	}
+
+	/* shrink to what was used */
+	next = talloc_realloc(m, m->next, acc_row, m->num_states);
+	if (next)
+		m->next = next;
+	flags = talloc_realloc(m, m->flags, uint8_t, m->num_states);
+	if (flags)
+		m->flags = flags;
+
+done:
+	talloc_free(b.pats);
+	talloc_free(b.base);
+	talloc_free(b.pat_of);
+	talloc_free(b.seen);
+	talloc_free(b.pool);
+	talloc_free(b.set_off);
+	talloc_free(b.set_len);
+	talloc_free(b.hash);
+
+	lst->match = m;
+	lst->perf.states = m->num_states;
+	lst->perf.compiled = b.num_pats;
+	lst->perf.fallback = m->num_slow_allow + m->num_slow_deny;
+	lst->perf.compile_ns = acc_now_ns() - start;
+	return 0;
+
+fail:
+	LOGP(DNAT, LOGL_ERROR,
+	     "Failed to compile access list %s, using regexec.\n", lst->name);
+	talloc_free(m);
+	lst->perf.states = lst->perf.compiled = lst->perf.fallback = 0;
+	lst->perf.compile_ns = acc_now_ns() - start;
+	return -1;
+}
+
+/* the old way, for lists that could not be compiled at all */
+static int match_regexec(struct bsc_nat_acc_lst *lst, const char *imsi)
+{
+	struct bsc_nat_acc_lst_entry *entry;
+	int res = 0;
+
+	llist_for_each_entry(entry, &lst->fltr_list, list) {
+		if (!(res & NAT_ACC_ALLOW) && entry->imsi_allow
+		    && regexec(&entry->imsi_allow_re, imsi, 0, NULL, 0) == 0)
+			res |= NAT_ACC_ALLOW;
+		if (!(res & NAT_ACC_DENY) && entry->imsi_deny
+		    && regexec(&entry->imsi_deny_re, imsi, 0, NULL, 0) == 0)
+			res |= NAT_ACC_DENY;
+	}
+
+	return res;
+}
+
+static int match_dfa(struct bsc_nat_acc_match *m, const char *imsi)
+{
+	const char *p;
+	unsigned int d;
+	int state = 0, res = 0, i;
+
+	if (m->num_states > 0) {
+		for (p = imsi; *p; ++p) {
+			res |= m->flags[state] & (ACC_F_ALLOW | ACC_F_DENY);
+
+			d = *p - '0';
+			if (d > 9)
+				return -1;
+
+			state = m->next[state][d];
+			if (state < 0)
+				break;
+		}
+
+		if (state >= 0) {
+			res |= m->flags[state] & (ACC_F_ALLOW | ACC_F_DENY);
+			if (m->flags[state] & ACC_F_ALLOW_END)
+				res |= NAT_ACC_ALLOW;
+			if (m->flags[state] & ACC_F_DENY_END)
+				res |= NAT_ACC_DENY;
+		}
+	}
+
+	for (i = 0; !(res & NAT_ACC_ALLOW) && i < m->num_slow_allow; ++i)
+		if (regexec(m->slow_allow[i], imsi, 0, NULL, 0) == 0)
+			res |= NAT_ACC_ALLOW;
+	for (i = 0; !(res & NAT_ACC_DENY) && i < m->num_slow_deny; ++i)
+		if (regexec(m->slow_deny[i], imsi, 0, NULL, 0) == 0)
+			res |= NAT_ACC_DENY;
+
+	return res;
+}
+
+/**
+ * Check an IMSI against the list. Returns a mask of NAT_ACC_ALLOW
+ * if an imsi-allow matched and NAT_ACC_DENY if an imsi-deny matched.
+ */
+int bsc_nat_acc_lst_match(struct bsc_nat_acc_lst *lst, const char *imsi)
+{
+	uint64_t start = 0;
+	int sample, res = -1;
+
+	/* an entry got a new regexp, e.g. from the VTY */
+	if (lst->dirty || lst->reg_gen != gsm_parse_reg_gen)
+		bsc_nat_acc_lst_compile(lst);
+
+	sample = (++lst->perf.lookups & 63) == 0;
+	if (sample)
+		start = acc_now_ns();
+
+	if (lst->match)
+		res = match_dfa(lst->match, imsi);
+	if (res < 0)
+		res = match_regexec(lst, imsi);
+
+	if (sample) {
+		lst->perf.lookup_ns += acc_now_ns() - start;
+		lst->perf.sampled += 1;
+	}
+
+	return res;
+}
@@ -25,6 +25,8 @@
 #include <openbsc/control_if.h>
 
 #include <openbsc/bsc_nat.h>
+#include <openbsc/ipaccess.h>
+#include <openbsc/debug.h>
 
 #include <unistd.h>
 
@@ -74,6 +76,22 @@ void bsc_nat_ctrl_del_pending(struct bsc_cmd_list *pending)
 	talloc_free(pending);
 }
 
+/* like ctrl_cmd_send but the BSC socket might be owned by a worker */
+static int bsc_ctrl_cmd_send(struct bsc_connection *bsc, struct ctrl_cmd *cmd)
+{
+	struct msgb *msg;
+
+	msg = ctrl_cmd_make(cmd);
+	if (!msg) {
+		LOGP(DCTRL, LOGL_ERROR, "Could not generate msg\n");
+		return -1;
+	}
+
+	ipaccess_prepend_header_ext(msg, IPAC_PROTO_EXT_CTRL);
+	ipaccess_prepend_header(msg, IPAC_PROTO_OSMO);
+	return bsc_send_msg(bsc, msg);
+}
+
 static struct bsc_cmd_list *bsc_get_pending(struct bsc_connection *bsc, char *id_str)
 {
 	struct bsc_cmd_list *cmd_entry;
@@ -157,7 +175,7 @@ int bsc_nat_handle_ctrlif_msg(struct bsc_connection *bsc, struct msgb *msg)
 	talloc_free(cmd);
 	return 0;
 err:
-	ctrl_cmd_send(&bsc->write_queue, cmd);
+	bsc_ctrl_cmd_send(bsc, cmd);
 	talloc_free(cmd);
 	return 0;
 }
@@ -251,7 +269,7 @@ static int forward_to_bsc(struct ctrl_cmd *cmd)
 				goto err;
 			}
 
-			if (ctrl_cmd_send(&bsc->write_queue, bsc_cmd)) {
+			if (bsc_ctrl_cmd_send(bsc, bsc_cmd)) {
 				cmd->reply = "Sending failed";
 				goto err;
 			}
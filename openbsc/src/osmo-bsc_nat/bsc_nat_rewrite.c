@@ -38,78 +38,700 @@
 
 #include <osmocom/sccp/sccp.h>
 
-static char *trie_lookup(struct nat_rewrite *trie, const char *number,
-			regoff_t off, void *ctx)
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The rules of a rewrite file are compiled into two tries. One is
+ * keyed by the IMSI prefix of the rules, the other by the literal
+ * prefix of the number expression in front of the group. Walking both
+ * once gives the candidate rules of each side in the order of the
+ * file and the first rule found on both sides wins. Expressions that
+ * do not fit are tried with regexec when their turn comes.
+ */
+
+#define REWR_MAX_ATOMS		16
+#define REWR_MAX_STREAMS	64
+#define REWR_IMSI_WILDCARD	10
+#define REWR_NUM_CHARS		16
+
+enum rewr_rep {
+	REWR_REP_ONE,
+	REWR_REP_OPT,
+	REWR_REP_STAR,
+};
+
+struct rewr_atom {
+	uint16_t mask;
+	uint8_t rep;
+};
+
+struct rewr_rule {
+	struct bsc_nat_num_rewr_entry *entry;
+
+	int imsi_slow;
+	int num_slow;
+
+	/* the number after the literal prefix */
+	int has_group;
+	int prefix_len;
+	int anchor_end;
+	int num_atoms;
+	struct rewr_atom atoms[REWR_MAX_ATOMS];
+};
+
+struct rewr_node {
+	int32_t child[REWR_NUM_CHARS];
+	int num_rules;
+	int *rules;
+};
+
+struct rewr_stream {
+	const int *idx;
+	int num;
+	int pos;
+};
+
+struct bsc_nat_num_rewr {
+	struct llist_head entries;
+
+	int num_rules;
+	struct rewr_rule *rules;
+
+	/* node 0 is the root, a child of 0 means no child */
+	int num_imsi_nodes;
+	struct rewr_node *imsi_nodes;
+	int num_num_nodes;
+	struct rewr_node *num_nodes;
+
+	/* the rules with an expression we could not compile */
+	int num_slow_imsi;
+	int *slow_imsi;
+	int num_slow_num;
+	int *slow_num;
+};
+
+/* digits, then + * # a b c as they can appear in a called number */
+static int num_char(char c)
+{
+	static const char extra[] = "+*#abc";
+	const char *pos;
+
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c == '\0')
+		return -1;
+	pos = strchr(extra, c);
+	return pos ? 10 + (pos - extra) : -1;
+}
+
+static int rewr_add_idx(void *ctx, int **array, int *num, int idx)
+{
+	int *res;
+
+	res = talloc_realloc(ctx, *array, int, *num + 1);
+	if (!res)
+		return -1;
+
+	res[(*num)++] = idx;
+	*array = res;
+	return 0;
+}
+
+static int rewr_node_child(struct bsc_nat_num_rewr *rewr, int imsi,
+			   int node, int c)
+{
+	struct rewr_node **nodes = imsi ? &rewr->imsi_nodes : &rewr->num_nodes;
+	int *num = imsi ? &rewr->num_imsi_nodes : &rewr->num_num_nodes;
+	struct rewr_node *res;
+
+	if ((*nodes)[node].child[c])
+		return (*nodes)[node].child[c];
+
+	res = talloc_realloc(rewr, *nodes, struct rewr_node, *num + 1);
+	if (!res)
+		return -1;
+
+	memset(&res[*num], 0, sizeof(res[*num]));
+	res[node].child[c] = *num;
+	*nodes = res;
+	return (*num)++;
+}
+
+/* a BRE of digits, '.' and [0-9] after a '^' matches a prefix */
+static int rewr_add_imsi(struct bsc_nat_num_rewr *rewr, int idx, const char *re)
+{
+	const char *p = re;
+	int node = 0, c;
+
+	if (*p++ != '^')
+		return 1;
+
+	while (*p) {
+		if (*p >= '0' && *p <= '9') {
+			c = *p - '0';
+			p += 1;
+		} else if (*p == '.') {
+			c = REWR_IMSI_WILDCARD;
+			p += 1;
+		} else if (strncmp(p, "[0-9]", 5) == 0) {
+			c = REWR_IMSI_WILDCARD;
+			p += 5;
+		} else
+			return 1;
+
+		/* a repetition changes the meaning of the last atom */
+		if (*p == '*' || (p[0] == '\\' && p[1] == '{'))
+			return 1;
+
+		node = rewr_node_child(rewr, 1, node, c);
+		if (node < 0)
+			return -1;
+	}
+
+	return rewr_add_idx(rewr, &rewr->imsi_nodes[node].rules,
+			    &rewr->imsi_nodes[node].num_rules, idx);
+}
+
+static int rewr_parse_class(const char **_p, uint16_t *out)
+{
+	const char *p = *_p;
+	uint16_t mask = 0;
+	int neg = 0, first = 1, c, lo, hi;
+
+	if (*p == '^') {
+		neg = 1;
+		p += 1;
+	}
+
+	for (;; first = 0) {
+		if (*p == '\0' || (p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')))
+			return -1;
+		if (*p == ']' && !first) {
+			p += 1;
+			break;
+		}
+
+		if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+			lo = p[0];
+			hi = p[2];
+			p += 3;
+		} else {
+			lo = hi = p[0];
+			p += 1;
+		}
+
+		for (c = lo; c <= hi; ++c)
+			if (num_char(c) >= 0)
+				mask |= 1 << num_char(c);
+	}
+
+	*_p = p;
+	*out = neg ? ~mask : mask;
+	return 0;
+}
+
+static int rewr_add_atom(struct rewr_rule *rule, uint16_t mask, int rep)
+{
+	if (rule->num_atoms == REWR_MAX_ATOMS)
+		return -1;
+
+	rule->atoms[rule->num_atoms].mask = mask;
+	rule->atoms[rule->num_atoms].rep = rep;
+	rule->num_atoms += 1;
+	return 0;
+}
+
+/*
+ * An ERE of a '^', literal characters and then one group followed by
+ * atoms with repetitions. The group starts after the literal prefix.
+ */
+static int rewr_add_num(struct bsc_nat_num_rewr *rewr, int idx, const char *re)
+{
+	struct rewr_rule *rule = &rewr->rules[idx];
+	const char *p = re;
+	char prefix[64];
+	uint16_t mask;
+	char *end;
+	int i, c, node = 0, in_prefix = 1, min, max;
+
+	rule->prefix_len = 0;
+	rule->num_atoms = 0;
+
+	if (*p++ != '^')
+		return 1;
+
+	while (*p) {
+		if (p[0] == '$' && p[1] == '\0') {
+			rule->anchor_end = 1;
+			break;
+		}
+
+		if (*p == '(') {
+			if (rule->has_group || !in_prefix)
+				return 1;
+			rule->has_group = 1;
+			in_prefix = 0;
+			p += 1;
+			continue;
+		}
+		if (*p == ')') {
+			if (!rule->has_group)
+				return 1;
+			p += 1;
+			continue;
+		}
+
+		/* the atom */
+		if (*p == '.') {
+			mask = 0xffff;
+			p += 1;
+		} else if (*p == '[') {
+			p += 1;
+			if (rewr_parse_class(&p, &mask) != 0)
+				return 1;
+		} else if (*p == '\\') {
+			if (p[1] == '\0' || isalnum(p[1]))
+				return 1;
+			c = num_char(p[1]);
+			mask = c < 0 ? 0 : 1 << c;
+			p += 2;
+		} else if (strchr("|{}+*?^$", *p))
+			return 1;
+		else {
+			c = num_char(*p);
+			mask = c < 0 ? 0 : 1 << c;
+			p += 1;
+		}
+
+		/* the repetition */
+		min = max = 1;
+		if (*p == '*') {
+			min = 0;
+			max = -1;
+			p += 1;
+		} else if (*p == '+') {
+			max = -1;
+			p += 1;
+		} else if (*p == '?') {
+			min = 0;
+			p += 1;
+		} else if (*p == '{') {
+			min = strtol(p + 1, &end, 10);
+			if (end == p + 1)
+				return 1;
+			max = min;
+			if (*end == ',') {
+				if (end[1] == '}') {
+					max = -1;
+					end += 1;
+				} else {
+					max = strtol(end + 1, &end, 10);
+					if (max < min)
+						return 1;
+				}
+			}
+			if (*end != '}')
+				return 1;
+			p = end + 1;
+		}
+		if (*p == '*' || *p == '+' || *p == '?' || *p == '{')
+			return 1;
+
+		/* single literal characters make up the prefix */
+		if (in_prefix && min == 1 && max == 1 && mask
+		    && (mask & (mask - 1)) == 0) {
+			if (rule->prefix_len == sizeof(prefix))
+				return 1;
+			for (c = 0; !(mask & (1 << c)); ++c)
+				;
+			prefix[rule->prefix_len++] = c;
+			continue;
+		}
+
+		/* the group has to start right after the prefix */
+		in_prefix = 0;
+		if (!rule->has_group && strchr(p, '('))
+			return 1;
+
+		for (i = 0; i < min; ++i)
+			if (rewr_add_atom(rule, mask, REWR_REP_ONE) != 0)
+				return 1;
+		if (max == -1) {
+			if (rewr_add_atom(rule, mask, REWR_REP_STAR) != 0)
+				return 1;
+		} else {
+			for (i = min; i < max; ++i)
+				if (rewr_add_atom(rule, mask, REWR_REP_OPT) != 0)
+					return 1;
+		}
+	}
+
+	for (i = 0; i < rule->prefix_len; ++i) {
+		node = rewr_node_child(rewr, 0, node, prefix[i]);
+		if (node < 0)
+			return -1;
+	}
+
+	return rewr_add_idx(rewr, &rewr->num_nodes[node].rules,
+			    &rewr->num_nodes[node].num_rules, idx);
+}
+
+static void num_rewr_free_data(struct bsc_nat_num_rewr_entry *entry)
+{
+	regfree(&entry->msisdn_reg);
+	regfree(&entry->num_reg);
+	talloc_free(entry->replace);
+}
+
+static void num_rewr_free_entries(struct llist_head *head)
+{
+	struct bsc_nat_num_rewr_entry *entry, *tmp;
+
+	llist_for_each_entry_safe(entry, tmp, head, list) {
+		num_rewr_free_data(entry);
+		llist_del(&entry->list);
+		talloc_free(entry);
+	}
+}
+
+static struct bsc_nat_num_rewr *rewr_compile(void *ctx, struct llist_head *entries,
+					     int num)
 {
-	struct nat_rewrite_rule *rule;
+	struct bsc_nat_num_rewr_entry *entry, *tmp;
+	struct bsc_nat_num_rewr *rewr;
+	int idx = 0, rc;
+
+	rewr = talloc_zero(ctx, struct bsc_nat_num_rewr);
+	if (!rewr)
+		return NULL;
+
+	INIT_LLIST_HEAD(&rewr->entries);
+	rewr->rules = talloc_zero_array(rewr, struct rewr_rule, num);
+	rewr->imsi_nodes = talloc_zero(rewr, struct rewr_node);
+	rewr->num_nodes = talloc_zero(rewr, struct rewr_node);
+	if (!rewr->rules || !rewr->imsi_nodes || !rewr->num_nodes) {
+		talloc_free(rewr);
+		return NULL;
+	}
+	rewr->num_imsi_nodes = rewr->num_num_nodes = 1;
+	rewr->num_rules = num;
+
+	llist_for_each_entry_safe(entry, tmp, entries, list) {
+		struct rewr_rule *rule = &rewr->rules[idx];
+
+		rule->entry = entry;
+		talloc_steal(rewr, entry);
+		llist_move_tail(&entry->list, &rewr->entries);
+
+		rc = rewr_add_imsi(rewr, idx, entry->msisdn_re);
+		if (rc > 0) {
+			rule->imsi_slow = 1;
+			rc = rewr_add_idx(rewr, &rewr->slow_imsi, &rewr->num_slow_imsi, idx);
+		}
+		if (rc < 0)
+			goto fail;
+
+		rc = rewr_add_num(rewr, idx, entry->num_re);
+		if (rc > 0) {
+			rule->num_slow = 1;
+			rc = rewr_add_idx(rewr, &rewr->slow_num, &rewr->num_slow_num, idx);
+		}
+		if (rc < 0)
+			goto fail;
+
+		idx += 1;
+	}
+
+	return rewr;
+
+fail:
+	LOGP(DNAT, LOGL_ERROR, "Failed to compile the rewrite rules.\n");
+	num_rewr_free_entries(&rewr->entries);
+	talloc_free(rewr);
+	return NULL;
+}
+
+/* check the number after the literal prefix against the atoms */
+static int rewr_match_tail(const struct rewr_rule *rule, const char *tail)
+{
+	uint32_t states = 1, next;
+	const uint32_t accept = 1 << rule->num_atoms;
+	int i, c;
+
+	for (;;) {
+		/* follow the optional atoms */
+		for (i = 0; i < rule->num_atoms; ++i)
+			if ((states & (1 << i)) && rule->atoms[i].rep != REWR_REP_ONE)
+				states |= 1 << (i + 1);
+
+		if ((states & accept) && !rule->anchor_end)
+			return 1;
+		if (*tail == '\0')
+			return (states & accept) != 0;
+
+		c = num_char(*tail++);
+		next = 0;
+		for (i = 0; i < rule->num_atoms; ++i) {
+			if (!(states & (1 << i)) || !(rule->atoms[i].mask & (1 << c)))
+				continue;
+			next |= rule->atoms[i].rep == REWR_REP_STAR ? 1 << i : 1 << (i + 1);
+		}
+
+		if (!next)
+			return 0;
+		states = next;
+	}
+}
+
+static int rewr_write(char *out, size_t out_len, const char *replace,
+		      const char *tail)
+{
+	size_t rlen = strlen(replace), tlen = strlen(tail);
+
+	if (rlen + tlen + 1 > out_len)
+		return -1;
+
+	memcpy(out, replace, rlen);
+	memcpy(out + rlen, tail, tlen + 1);
+	return 1;
+}
+
+/*
+ * Check one candidate and write the new number. Returns 1 on a match,
+ * 0 when the rule does not apply and -1 if the result did not fit.
+ * With literal the replacement text is used even for prefix_lookup.
+ */
+static int rewr_try(const struct rewr_rule *rule, const char *imsi,
+		    const char *number, struct nat_rewrite *trie, int literal,
+		    char *out, size_t out_len)
+{
+	struct bsc_nat_num_rewr_entry *entry = rule->entry;
+	const struct nat_rewrite_rule *trie_rule;
+	regmatch_t matches[2];
+	int off;
+
+	if (rule->imsi_slow && regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+		return 0;
+
+	if (rule->num_slow) {
+		if (regexec(&entry->num_reg, number, 2, matches, 0) != 0)
+			return 0;
+		if (!out)
+			return 1;
+		if (matches[1].rm_eo == -1)
+			return 0;
+		off = matches[1].rm_so;
+	} else {
+		if (out && !rule->has_group)
+			return 0;
+		if (!rewr_match_tail(rule, number + rule->prefix_len))
+			return 0;
+		if (!out)
+			return 1;
+		off = rule->prefix_len;
+	}
+
+	if (!entry->is_prefix_lookup || literal)
+		return rewr_write(out, out_len, entry->replace, &number[off]);
 
 	if (!trie) {
 		LOGP(DCC, LOGL_ERROR,
 			"Asked to do a table lookup but no table.\n");
-		return NULL;
+		return 0;
 	}
 
-	rule = nat_rewrite_lookup(trie, number);
-	if (!rule) {
+	trie_rule = nat_rewrite_lookup(trie, number);
+	if (!trie_rule) {
 		LOGP(DCC, LOGL_DEBUG,
 			"Couldn't find a prefix rule for %s\n", number);
-		return NULL;
+		return 0;
 	}
 
-	return talloc_asprintf(ctx, "%s%s", rule->rewrite, &number[off]);
+	return rewr_write(out, out_len, trie_rule->rewrite, &number[off]);
 }
 
-static char *match_and_rewrite_number(void *ctx, const char *number,
-				const char *imsi, struct llist_head *list,
-				struct nat_rewrite *trie)
+/* the smallest rule of all streams after the given one */
+static int rewr_next(struct rewr_stream *streams, int num, int after)
 {
-	struct bsc_nat_num_rewr_entry *entry;
-	char *new_number = NULL;
+	int i, best = INT_MAX;
 
-	/* need to find a replacement and then fix it */
-	llist_for_each_entry(entry, list, list) {
-		regmatch_t matches[2];
+	for (i = 0; i < num; ++i) {
+		struct rewr_stream *s = &streams[i];
 
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
+		while (s->pos < s->num && s->idx[s->pos] <= after)
+			s->pos += 1;
+		if (s->pos < s->num && s->idx[s->pos] < best)
+			best = s->idx[s->pos];
+	}
 
-		/* this regexp matches... */
-		if (regexec(&entry->num_reg, number, 2, matches, 0) == 0
-			&& matches[1].rm_eo != -1) {
-			if (entry->is_prefix_lookup)
-				new_number = trie_lookup(trie, number,
-						matches[1].rm_so, ctx);
-			else
-				new_number = talloc_asprintf(ctx, "%s%s",
-					entry->replace,
-					&number[matches[1].rm_so]);
+	return best;
+}
+
+static int rewr_add_stream(struct rewr_stream *streams, int *num,
+			   const int *idx, int len)
+{
+	if (len == 0)
+		return 0;
+	if (*num == REWR_MAX_STREAMS)
+		return -1;
+
+	streams[*num].idx = idx;
+	streams[*num].num = len;
+	streams[*num].pos = 0;
+	*num += 1;
+	return 0;
+}
+
+static int rewr_imsi_streams(const struct bsc_nat_num_rewr *rewr, const char *imsi,
+			     struct rewr_stream *streams, int *num)
+{
+	int active[REWR_MAX_STREAMS], next[REWR_MAX_STREAMS];
+	int num_active = 1, num_next, i, j, c, d;
+	const struct rewr_node *node;
+
+	active[0] = 0;
+	for (i = 0; num_active > 0; ++i) {
+		num_next = 0;
+		d = imsi[i] - '0';
+		if (imsi[i] != '\0' && (d < 0 || d > 9))
+			return -1;
+
+		for (j = 0; j < num_active; ++j) {
+			node = &rewr->imsi_nodes[active[j]];
+			if (rewr_add_stream(streams, num, node->rules, node->num_rules) != 0)
+				return -1;
+			if (imsi[i] == '\0')
+				continue;
+
+			for (c = 0; c < 2; ++c) {
+				int child = node->child[c ? REWR_IMSI_WILDCARD : d];
+
+				if (!child)
+					continue;
+				if (num_next == REWR_MAX_STREAMS)
+					return -1;
+				next[num_next++] = child;
+			}
 		}
 
-		if (new_number)
+		memcpy(active, next, num_next * sizeof(*active));
+		num_active = num_next;
+	}
+
+	return rewr_add_stream(streams, num, rewr->slow_imsi, rewr->num_slow_imsi);
+}
+
+static int rewr_num_streams(const struct bsc_nat_num_rewr *rewr, const char *number,
+			    struct rewr_stream *streams, int *num)
+{
+	const struct rewr_node *node = &rewr->num_nodes[0];
+	const char *p;
+	int c;
+
+	for (p = number; *p; ++p)
+		if (num_char(*p) < 0)
+			return -1;
+
+	for (p = number; ; ++p) {
+		if (rewr_add_stream(streams, num, node->rules, node->num_rules) != 0)
+			return -1;
+		if (*p == '\0')
 			break;
+
+		c = num_char(*p);
+		if (!node->child[c])
+			break;
+		node = &rewr->num_nodes[node->child[c]];
 	}
 
-	return new_number;
+	return rewr_add_stream(streams, num, rewr->slow_num, rewr->num_slow_num);
 }
 
-static char *rewrite_isdn_number(struct bsc_nat *nat, struct llist_head *rewr_list,
-				void *ctx, const char *imsi,
-				struct gsm_mncc_number *called)
+static int rewr_apply(struct bsc_nat_num_rewr *rewr, const char *imsi,
+		      const char *number, struct nat_rewrite *trie, int literal,
+		      char *out, size_t out_len)
+{
+	struct rewr_stream imsi_streams[REWR_MAX_STREAMS];
+	struct rewr_stream num_streams[REWR_MAX_STREAMS];
+	int num_imsi = 0, num_num = 0, a, b, i, rc;
+
+	if (!rewr)
+		return 0;
+
+	if (rewr_imsi_streams(rewr, imsi, imsi_streams, &num_imsi) != 0
+	    || rewr_num_streams(rewr, number, num_streams, &num_num) != 0)
+		goto slow;
+
+	a = rewr_next(imsi_streams, num_imsi, -1);
+	b = rewr_next(num_streams, num_num, -1);
+	while (a != INT_MAX && b != INT_MAX) {
+		if (a < b) {
+			a = rewr_next(imsi_streams, num_imsi, b - 1);
+			continue;
+		}
+		if (b < a) {
+			b = rewr_next(num_streams, num_num, a - 1);
+			continue;
+		}
+
+		rc = rewr_try(&rewr->rules[a], imsi, number, trie, literal,
+			      out, out_len);
+		if (rc != 0)
+			return rc;
+
+		a = rewr_next(imsi_streams, num_imsi, a);
+		b = rewr_next(num_streams, num_num, b);
+	}
+
+	return 0;
+
+slow:
+	/* odd characters, every rule has to be tried with regexec */
+	for (i = 0; i < rewr->num_rules; ++i) {
+		struct rewr_rule rule = rewr->rules[i];
+
+		rule.imsi_slow = rule.num_slow = 1;
+		rc = rewr_try(&rule, imsi, number, trie, literal, out, out_len);
+		if (rc != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the first rule matching the IMSI and the number and write the
+ * new number to out. Without an out buffer only the match is checked
+ * and the number expression does not need a group. Returns 1 on a
+ * match, 0 without one and -1 if the new number did not fit.
+ */
+int bsc_nat_num_rewr_apply(struct bsc_nat_num_rewr *rewr, const char *imsi,
+			   const char *number, struct nat_rewrite *trie,
+			   char *out, size_t out_len)
+{
+	return rewr_apply(rewr, imsi, number, trie, 0, out, out_len);
+}
+
+static int rewrite_isdn_number(struct bsc_nat *nat, struct bsc_nat_num_rewr *rewr,
+				const char *imsi, struct gsm_mncc_number *called,
+				char *out, size_t out_len)
 {
 	char int_number[sizeof(called->number) + 2];
 	char *number = called->number;
 
-	if (llist_empty(&nat->num_rewr)) {
+	if (!nat->num_rewr) {
 		LOGP(DCC, LOGL_DEBUG, "Rewrite rules empty.\n");
-		return NULL;
+		return 0;
 	}
 
 	/* only ISDN plan */
 	if (called->plan != 1) {
 		LOGP(DCC, LOGL_DEBUG, "Called plan is not 1 it was %d\n",
 			called->plan);
-		return NULL;
+		return 0;
 	}
 
 	/* international, prepend */
@@ -119,8 +741,8 @@ static char *rewrite_isdn_number(struct bsc_nat *nat, struct llist_head *rewr_li
 		number = int_number;
 	}
 
-	return match_and_rewrite_number(ctx, number,
-					imsi, rewr_list, nat->num_rewr_trie);
+	return bsc_nat_num_rewr_apply(rewr, imsi, number, nat->num_rewr_trie,
+				      out, out_len);
 }
 
 static void update_called_number(struct gsm_mncc_number *called,
@@ -150,10 +772,12 @@ static struct msgb *rewrite_setup(struct bsc_nat *nat, struct msgb *msg,
 	unsigned int payload_len;
 	struct gsm_mncc_number called;
 	struct msgb *out;
-	char *new_number_pre = NULL, *new_number_post = NULL, *chosen_number;
+	char new_number_pre[sizeof(called.number) + 1];
+	char new_number_post[sizeof(called.number) + 1];
+	const char *chosen_number;
 	uint8_t *outptr;
 	const uint8_t *msgptr;
-	int sec_len;
+	int sec_len, rc;
 
 	/* decode and rewrite the message */
 	payload_len = len - sizeof(*hdr48);
@@ -171,18 +795,18 @@ static struct msgb *rewrite_setup(struct bsc_nat *nat, struct msgb *msg,
 	LOGP(DCC, LOGL_DEBUG,
 		"Pre-Rewrite for IMSI(%s) Plan(%d) Type(%d) Number(%s)\n",
 		imsi, called.plan, called.type, called.number);
-	new_number_pre = rewrite_isdn_number(nat, &nat->num_rewr, msg, imsi, &called);
+	rc = rewrite_isdn_number(nat, nat->num_rewr, imsi, &called,
+				 new_number_pre, sizeof(new_number_pre));
 
-	if (!new_number_pre) {
+	if (rc == 0) {
 		LOGP(DCC, LOGL_DEBUG, "No IMSI(%s) match found, returning message.\n",
 			imsi);
 		return NULL;
 	}
 
-	if (strlen(new_number_pre) > sizeof(called.number)) {
-		LOGP(DCC, LOGL_ERROR, "Number %s is too long for structure.\n",
-				new_number_pre);
-		talloc_free(new_number_pre);
+	if (rc < 0) {
+		LOGP(DCC, LOGL_ERROR, "Number for IMSI(%s) is too long for structure.\n",
+				imsi);
 		return NULL;
 	}
 	update_called_number(&called, new_number_pre);
@@ -191,18 +815,14 @@ static struct msgb *rewrite_setup(struct bsc_nat *nat, struct msgb *msg,
 	LOGP(DCC, LOGL_DEBUG,
 		"Post-Rewrite for IMSI(%s) Plan(%d) Type(%d) Number(%s)\n",
 		imsi, called.plan, called.type, called.number);
-	new_number_post = rewrite_isdn_number(nat, &nat->num_rewr_post, msg,
-					imsi, &called);
-	chosen_number = new_number_post ? new_number_post : new_number_pre;
-
-
-	if (strlen(chosen_number) > sizeof(called.number)) {
-		LOGP(DCC, LOGL_ERROR, "Number %s is too long for structure.\n",
-			chosen_number);
-		talloc_free(new_number_pre);
-		talloc_free(new_number_post);
+	rc = rewrite_isdn_number(nat, nat->num_rewr_post, imsi, &called,
+				 new_number_post, sizeof(new_number_post));
+	if (rc < 0) {
+		LOGP(DCC, LOGL_ERROR, "Number for IMSI(%s) is too long for structure.\n",
+			imsi);
 		return NULL;
 	}
+	chosen_number = rc > 0 ? new_number_post : new_number_pre;
 
 	/*
 	 * Need to create a new message now based on the old onew
@@ -213,8 +833,6 @@ static struct msgb *rewrite_setup(struct bsc_nat *nat, struct msgb *msg,
 	out = msgb_alloc_headroom(4096, 128, "changed-setup");
 	if (!out) {
 		LOGP(DCC, LOGL_ERROR, "Failed to allocate.\n");
-		talloc_free(new_number_pre);
-		talloc_free(new_number_post);
 		return NULL;
 	}
 
@@ -241,63 +859,30 @@ static struct msgb *rewrite_setup(struct bsc_nat *nat, struct msgb *msg,
 	outptr = msgb_put(out, sec_len);
 	memcpy(outptr, msgptr, sec_len);
 
-	talloc_free(new_number_pre);
-	talloc_free(new_number_post);
 	return out;
 }
 
 /**
- * Find a new SMSC address, returns an allocated string that needs to be
- * freed or is NULL.
+ * Find a new SMSC address and write it to out. Returns 1 if there is
+ * a new one.
  */
-static char *find_new_smsc(struct bsc_nat *nat, void *ctx, const char *imsi,
-			   const char *smsc_addr, const char *dest_nr)
+static int find_new_smsc(struct bsc_nat *nat, const char *imsi,
+			 const char *smsc_addr, const char *dest_nr,
+			 char *out, size_t out_len)
 {
-	struct bsc_nat_num_rewr_entry *entry;
-	char *new_number = NULL;
-	uint8_t dest_match = llist_empty(&nat->tpdest_match);
-
-	/* We will find a new number now */
-	llist_for_each_entry(entry, &nat->smsc_rewr, list) {
-		regmatch_t matches[2];
-
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-
-		/* this regexp matches... */
-		if (regexec(&entry->num_reg, smsc_addr, 2, matches, 0) == 0 &&
-		    matches[1].rm_eo != -1)
-			new_number = talloc_asprintf(ctx, "%s%s",
-					entry->replace,
-					&smsc_addr[matches[1].rm_so]);
-		if (new_number)
-			break;
-	}
-
-	if (!new_number)
-		return NULL;
+	/* We will find a new number now, prefix_lookup is not special here */
+	if (rewr_apply(nat->smsc_rewr, imsi, smsc_addr, NULL, 1,
+		       out, out_len) <= 0)
+		return 0;
 
 	/*
 	 * now match the number against another list
 	 */
-	llist_for_each_entry(entry, &nat->tpdest_match, list) {
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
+	if (!nat->tpdest_match)
+		return 1;
 
-		if (regexec(&entry->num_reg, dest_nr, 0, NULL, 0) == 0) {
-			dest_match = 1;
-			break;
-		}
-	}
-
-	if (!dest_match) {
-		talloc_free(new_number);
-		return NULL;
-	}
-
-	return new_number;
+	return bsc_nat_num_rewr_apply(nat->tpdest_match, imsi, dest_nr,
+				      NULL, NULL, 0) > 0;
 }
 
 /**
@@ -306,19 +891,10 @@ static char *find_new_smsc(struct bsc_nat *nat, void *ctx, const char *imsi,
 static uint8_t sms_new_tpdu_hdr(struct bsc_nat *nat, const char *imsi,
 				const char *dest_nr, uint8_t hdr)
 {
-	struct bsc_nat_num_rewr_entry *entry;
-
-	/* We will find a new number now */
-	llist_for_each_entry(entry, &nat->sms_clear_tp_srr, list) {
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-		if (regexec(&entry->num_reg, dest_nr, 0, NULL, 0) != 0)
-			continue;
-
-		/* matched phone number and imsi */
+	/* matched phone number and imsi */
+	if (bsc_nat_num_rewr_apply(nat->sms_clear_tp_srr, imsi, dest_nr,
+				   NULL, NULL, 0) > 0)
 		return hdr & ~0x20;
-	}
 
 	return hdr;
 }
@@ -326,11 +902,11 @@ static uint8_t sms_new_tpdu_hdr(struct bsc_nat *nat, const char *imsi,
 /**
  * Check if we need to rewrite the number. For this SMS.
  */
-static char *sms_new_dest_nr(struct bsc_nat *nat, void *ctx,
-			     const char *imsi, const char *dest_nr)
+static int sms_new_dest_nr(struct bsc_nat *nat, const char *imsi,
+			   const char *dest_nr, char *out, size_t out_len)
 {
-	return match_and_rewrite_number(ctx, dest_nr, imsi,
-					&nat->sms_num_rewr, NULL);
+	return bsc_nat_num_rewr_apply(nat->sms_num_rewr, imsi, dest_nr, NULL,
+				      out, out_len) > 0;
 }
 
 /**
@@ -451,9 +1027,11 @@ static struct msgb *rewrite_sms(struct bsc_nat *nat, struct msgb *msg,
 	uint8_t dest_len, orig_dest_len;
 	char _dest_nr[30];
 	char *dest_nr;
-	char *new_dest_nr;
+	char new_dest_nr[64];
+	int has_new_dest_nr;
 
-	char *new_number = NULL;
+	char new_number[64];
+	int has_new_number;
 	uint8_t tpdu_hdr;
 	struct msgb *out;
 
@@ -555,19 +1133,19 @@ static struct msgb *rewrite_sms(struct bsc_nat *nat, struct msgb *msg,
 	 * Call functions to rewrite the data
 	 */
 	tpdu_hdr = sms_new_tpdu_hdr(nat, imsi, dest_nr, data_ptr[0]);
-	new_number = find_new_smsc(nat, msg, imsi, smsc_addr, dest_nr);
-	new_dest_nr = sms_new_dest_nr(nat, msg, imsi, dest_nr);
+	has_new_number = find_new_smsc(nat, imsi, smsc_addr, dest_nr,
+				       new_number, sizeof(new_number));
+	has_new_dest_nr = sms_new_dest_nr(nat, imsi, dest_nr,
+					  new_dest_nr, sizeof(new_dest_nr));
 
-	if (tpdu_hdr == data_ptr[0] && !new_number && !new_dest_nr)
+	if (tpdu_hdr == data_ptr[0] && !has_new_number && !has_new_dest_nr)
 		return NULL;
 
 	out = sms_create_new(GSM411_MT_RP_DATA_MO, ref, hdr48,
 			orig_addr_ptr, orig_addr_len,
-			new_number ? new_number : smsc_addr,
+			has_new_number ? new_number : smsc_addr,
 			data_ptr, data_len, tpdu_hdr,
-			dest_len, new_dest_nr);
-	talloc_free(new_number);
-	talloc_free(new_dest_nr);
+			dest_len, has_new_dest_nr ? new_dest_nr : NULL);
 	return out;
 }
 
@@ -622,29 +1200,17 @@ struct msgb *bsc_nat_rewrite_msg(struct bsc_nat *nat, struct msgb *msg, struct b
 	return sccp;
 }
 
-static void num_rewr_free_data(struct bsc_nat_num_rewr_entry *entry)
-{
-	regfree(&entry->msisdn_reg);
-	regfree(&entry->num_reg);
-	talloc_free(entry->replace);
-}
-
-void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
+void bsc_nat_num_rewr_entry_adapt(void *ctx, struct bsc_nat_num_rewr **rewr,
 				  const struct osmo_config_list *list)
 {
-	struct bsc_nat_num_rewr_entry *entry, *tmp;
+	struct bsc_nat_num_rewr_entry *entry;
+	struct bsc_nat_num_rewr *old = *rewr, *new = NULL;
 	struct osmo_config_entry *cfg_entry;
-
-	/* free the old data */
-	llist_for_each_entry_safe(entry, tmp, head, list) {
-		num_rewr_free_data(entry);
-		llist_del(&entry->list);
-		talloc_free(entry);
-	}
-
+	LLIST_HEAD(entries);
+	int num = 0;
 
 	if (!list)
-		return;
+		goto swap;
 
 	llist_for_each_entry(cfg_entry, &list->entry, list) {
 		char *regexp;
@@ -697,7 +1263,7 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 			continue;
 		}
 
-		talloc_free(regexp);
+		entry->msisdn_re = regexp;
 		if (regcomp(&entry->num_reg, cfg_entry->option, REG_EXTENDED) != 0) {
 			LOGP(DNAT, LOGL_ERROR,
 				"Failed to compile regexp '%s'\n", cfg_entry->option);
@@ -706,7 +1272,32 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 			continue;
 		}
 
+		entry->num_re = talloc_strdup(entry, cfg_entry->option);
+		if (!entry->num_re) {
+			LOGP(DNAT, LOGL_ERROR,
+				"Failed to copy the number regexp.\n");
+			regfree(&entry->msisdn_reg);
+			regfree(&entry->num_reg);
+			talloc_free(entry);
+			continue;
+		}
+
 		/* we have copied the number */
-		llist_add_tail(&entry->list, head);
+		llist_add_tail(&entry->list, &entries);
+		num += 1;
+	}
+
+	if (num > 0) {
+		new = rewr_compile(ctx, &entries, num);
+		if (!new)
+			num_rewr_free_entries(&entries);
+	}
+
+swap:
+	/* lookups only see the old or the new rules */
+	*rewr = new;
+	if (old) {
+		num_rewr_free_entries(&old->entries);
+		talloc_free(old);
 	}
 }
@@ -28,9 +28,13 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #define CHECK_IS_DIGIT_OR_FAIL(prefix, pos)						\
 	if (!isdigit(prefix[pos]) && prefix[pos] != '+') {				\
 			LOGP(DNAT, LOGL_ERROR,						\
@@ -41,75 +45,73 @@
 #define TO_INT(c) \
 	((c) == '+' ? 10 : ((c - '0') % 10))
 
-static void insert_rewrite_node(struct nat_rewrite_rule *rule, struct nat_rewrite *root)
+#define NAT_REWRITE_MAGIC	"NATTRIE1"
+#define NAT_REWRITE_ORDER	0x01020304
+
+/* The header of a compiled file, followed by the nodes and the rules */
+struct nat_rewrite_file_hdr {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t num_nodes;
+	uint32_t num_rules;
+	uint32_t _pad;
+};
+
+/* The rules of a file while it is being parsed */
+struct nat_rewrite_entry {
+	struct nat_rewrite_rule rule;
+	uint32_t line;
+};
+
+struct nat_rewrite_builder {
+	struct nat_rewrite *root;
+	struct nat_rewrite_entry *entries;
+	uint32_t num_entries;
+	uint32_t alloc_entries;
+};
+
+static int add_rewrite_entry(struct nat_rewrite_builder *build,
+			     const struct nat_rewrite_rule *rule)
 {
-	struct nat_rewrite_rule *new = &root->rule;
-
+	struct nat_rewrite_entry *entry;
 	const size_t len = strlen(rule->prefix);
 	int i;
 
 	if (len == 0) {
 		LOGP(DNAT, LOGL_ERROR, "An empty prefix does not make sense.\n");
-		goto fail;
+		return -1;
 	}
 
-	for (i = 0; i < len - 1; ++i) {
-		int pos;
-
-		/* check if the input is valid */
+	/* check if the input is valid */
+	for (i = 0; i < len; ++i)
 		CHECK_IS_DIGIT_OR_FAIL(rule->prefix, i);
 
-		/* check if the next node is already valid */
-		pos = TO_INT(rule->prefix[i]);
-		if (!new->rules[pos]) {
-			new->rules[pos] = talloc_zero(root, struct nat_rewrite_rule);
-			if (!new->rules[pos]) {
-				LOGP(DNAT, LOGL_ERROR,
-					"Failed to allocate memory.\n");
-				goto fail;
-			}
-
-			new->rules[pos]->empty = 1;
-		}
-
-		/* we continue here */
-		new = new->rules[pos];
-	}
+	if (build->num_entries == build->alloc_entries) {
+		uint32_t alloc = build->alloc_entries ? build->alloc_entries * 2 : 256;
 
-	/* new now points to the place where we want to add it */
-	int pos;
-
-	/* check if the input is valid */
-	CHECK_IS_DIGIT_OR_FAIL(rule->prefix, (len - 1));
-
-	/* check if the next node is already valid */
-	pos = TO_INT(rule->prefix[len - 1]);
-	if (!new->rules[pos])
-		new->rules[pos] = rule;
-	else if (new->rules[pos]->empty) {
-		/* copy over entries */
-		new->rules[pos]->empty = 0;
-		memcpy(new->rules[pos]->prefix, rule->prefix, sizeof(rule->prefix));
-		memcpy(new->rules[pos]->rewrite, rule->rewrite, sizeof(rule->rewrite));
-		talloc_free(rule);
-	} else {
-		LOGP(DNAT, LOGL_ERROR,
-			"Prefix(%s) is already installed\n", rule->prefix);
-		goto fail;
+		entry = talloc_realloc(build->root, build->entries,
+				       struct nat_rewrite_entry, alloc);
+		if (!entry) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to allocate memory.\n");
+			return -1;
+		}
+		build->entries = entry;
+		build->alloc_entries = alloc;
 	}
 
-	root->prefixes += 1;
-	return;
+	entry = &build->entries[build->num_entries];
+	entry->rule = *rule;
+	entry->line = build->num_entries++;
+	return 0;
 
 fail:
-	talloc_free(rule);
-	return;
+	return -1;
 }
 
-static void handle_line(struct nat_rewrite *rewrite, char *line)
+static void handle_line(struct nat_rewrite_builder *build, char *line)
 {
 	char *split;
-	struct nat_rewrite_rule *rule;
+	struct nat_rewrite_rule rule;
 	size_t size_prefix, size_end, len;
 
 
@@ -133,44 +135,295 @@ static void handle_line(struct nat_rewrite *rewrite, char *line)
 	size_end = strlen(split) - 1;
 
 	/* Check if both strings can fit into the static array */
-	if (size_prefix > sizeof(rule->prefix) - 1) {
+	if (size_prefix > sizeof(rule.prefix) - 1) {
 		LOGP(DNAT, LOGL_ERROR,
 			"Prefix is too long with %zu\n", size_prefix);
 		return;
 	}
 
-	if (size_end > sizeof(rule->rewrite) - 1) {
+	if (size_end > sizeof(rule.rewrite) - 1) {
 		LOGP(DNAT, LOGL_ERROR,
 			"Rewrite is too long with %zu on %s\n",
 			size_end, &line[size_prefix + 1]);
 		return;
 	}
 
-	/* Now create the entry and insert it into the trie */
-	rule = talloc_zero(rewrite, struct nat_rewrite_rule);
-	if (!rule) {
-		LOGP(DNAT, LOGL_ERROR, "Can not allocate memory\n");
-		return;
+	/* Now create the entry, the trie is built at the end */
+	memset(&rule, 0, sizeof(rule));
+	memcpy(rule.prefix, line, size_prefix);
+	assert(size_prefix < sizeof(rule.prefix));
+	rule.prefix[size_prefix] = '\0';
+
+	memcpy(rule.rewrite, split, size_end);
+	assert(size_end < sizeof(rule.rewrite));
+	rule.rewrite[size_end] = '\0';
+
+	add_rewrite_entry(build, &rule);
+}
+
+/*
+ * Order the prefixes like a walk through the trie. A prefix comes
+ * before the longer ones starting with it, the '+' after the digits
+ * and of two equal prefixes the first one of the file.
+ */
+static int cmp_rewrite_entry(const void *_a, const void *_b)
+{
+	const struct nat_rewrite_entry *a = _a, *b = _b;
+	int i;
+
+	for (i = 0; a->rule.prefix[i] || b->rule.prefix[i]; ++i) {
+		int ca, cb;
+
+		if (!a->rule.prefix[i])
+			return -1;
+		if (!b->rule.prefix[i])
+			return 1;
+		ca = TO_INT(a->rule.prefix[i]);
+		cb = TO_INT(b->rule.prefix[i]);
+		if (ca != cb)
+			return ca - cb;
+	}
+
+	return a->line < b->line ? -1 : a->line > b->line;
+}
+
+struct nat_rewrite_layout {
+	const struct nat_rewrite_rule *rules;
+	struct nat_rewrite_node *nodes;
+	uint32_t num_nodes;
+	uint32_t alloc_nodes;
+};
+
+/*
+ * The children of a node are stored in one block and the blocks of
+ * their subtrees follow depth first, down to the leaves. A lookup going down one number
+ * stays within a small part of the array after the first levels.
+ * The node covers the sorted rules lo to hi starting with its path.
+ */
+static int layout_children(void *ctx, struct nat_rewrite_layout *lay,
+			   uint32_t idx, uint32_t lo, uint32_t hi, int depth)
+{
+	uint32_t j, k, first, num = 0;
+	uint16_t bitmap = 0;
+
+	/* the rule of the node itself comes first */
+	if (lo < hi && lay->rules[lo].prefix[depth] == '\0')
+		lo += 1;
+
+	for (j = lo; j < hi; j = k) {
+		int c = TO_INT(lay->rules[j].prefix[depth]);
+
+		for (k = j + 1; k < hi; ++k)
+			if (TO_INT(lay->rules[k].prefix[depth]) != c)
+				break;
+		bitmap |= 1 << c;
+		num += 1;
+	}
+
+	first = lay->num_nodes;
+	if (lay->num_nodes + num > lay->alloc_nodes) {
+		struct nat_rewrite_node *nodes;
+		uint32_t alloc = lay->alloc_nodes * 2 + num;
+
+		nodes = talloc_realloc(ctx, lay->nodes,
+				       struct nat_rewrite_node, alloc);
+		if (!nodes)
+			return -1;
+		lay->nodes = nodes;
+		lay->alloc_nodes = alloc;
+	}
+	lay->num_nodes += num;
+
+	lay->nodes[idx].bitmap = bitmap;
+	lay->nodes[idx].first_child = first;
+
+	for (j = lo, num = 0; j < hi; j = k, ++num) {
+		struct nat_rewrite_node *child = &lay->nodes[first + num];
+		int c = TO_INT(lay->rules[j].prefix[depth]);
+
+		for (k = j + 1; k < hi; ++k)
+			if (TO_INT(lay->rules[k].prefix[depth]) != c)
+				break;
+
+		child->bitmap = 0;
+		child->flags = 0;
+		child->first_child = 0;
+		child->rule = lay->rules[j].prefix[depth + 1] == '\0' ? j : -1;
+
+		if (k - j == 1) {
+			child->flags = NAT_REWRITE_LEAF;
+			child->rule = j;
+			continue;
+		}
+
+		if (layout_children(ctx, lay, first + num, j, k, depth + 1) != 0)
+			return -1;
 	}
 
-	memcpy(rule->prefix, line, size_prefix);
-	assert(size_prefix < sizeof(rule->prefix));
-	rule->prefix[size_prefix] = '\0';
+	return 0;
+}
+
+static int build_rewrite_trie(struct nat_rewrite *res,
+			      const struct nat_rewrite_rule *rules,
+			      uint32_t num_rules)
+{
+	struct nat_rewrite_layout lay;
+
+	memset(&lay, 0, sizeof(lay));
+	lay.rules = rules;
+	lay.alloc_nodes = 64;
+	lay.nodes = talloc_array(res, struct nat_rewrite_node, lay.alloc_nodes);
+	if (!lay.nodes)
+		goto fail;
+
+	/* the root has no rule as an empty prefix is refused */
+	memset(&lay.nodes[0], 0, sizeof(lay.nodes[0]));
+	lay.nodes[0].rule = -1;
+	lay.num_nodes = 1;
+
+	if (layout_children(res, &lay, 0, 0, num_rules, 0) != 0)
+		goto fail;
 
-	memcpy(rule->rewrite, split, size_end);
-	assert(size_end < sizeof(rule->rewrite));
-	rule->rewrite[size_end] = '\0';
+	res->nodes = talloc_realloc(res, lay.nodes, struct nat_rewrite_node,
+				    lay.num_nodes);
+	if (!res->nodes)
+		res->nodes = lay.nodes;
+	res->num_nodes = lay.num_nodes;
+	return 0;
 
-	/* now insert and balance the tree */
-	insert_rewrite_node(rule, rewrite);
+fail:
+	LOGP(DNAT, LOGL_ERROR, "Failed to allocate memory.\n");
+	talloc_free(lay.nodes);
+	return -1;
 }
 
+static int finish_rewrite_trie(struct nat_rewrite_builder *build)
+{
+	struct nat_rewrite *res = build->root;
+	struct nat_rewrite_rule *rules;
+	uint32_t i, num = 0;
+
+	if (build->num_entries)
+		qsort(build->entries, build->num_entries,
+		      sizeof(*build->entries), cmp_rewrite_entry);
+
+	rules = talloc_array(res, struct nat_rewrite_rule,
+			     build->num_entries ? build->num_entries : 1);
+	if (!rules) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate memory.\n");
+		return -1;
+	}
+
+	for (i = 0; i < build->num_entries; ++i) {
+		const struct nat_rewrite_rule *rule = &build->entries[i].rule;
+
+		if (num > 0 && strcmp(rules[num - 1].prefix, rule->prefix) == 0) {
+			LOGP(DNAT, LOGL_ERROR,
+				"Prefix(%s) is already installed\n", rule->prefix);
+			continue;
+		}
+		rules[num++] = *rule;
+	}
+
+	talloc_free(build->entries);
+	build->entries = NULL;
+
+	res->rules = rules;
+	res->num_rules = num;
+	res->prefixes = num;
+	return build_rewrite_trie(res, rules, num);
+}
+
+static int nat_rewrite_unmap(struct nat_rewrite *rewrite)
+{
+	if (rewrite->map)
+		munmap(rewrite->map, rewrite->map_len);
+	return 0;
+}
+
+/*
+ * Map a file written by nat_rewrite_save. The nodes are checked once
+ * so a broken file can not make a lookup leave the arrays.
+ */
+static int map_rewrite_file(struct nat_rewrite *res, FILE *file)
+{
+	const struct nat_rewrite_file_hdr *hdr;
+	const struct nat_rewrite_node *nodes;
+	const struct nat_rewrite_rule *rules;
+	struct stat st;
+	uint32_t i;
+	void *map;
+
+	if (fstat(fileno(file), &st) != 0 || st.st_size < (off_t) sizeof(*hdr))
+		return -1;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (map == MAP_FAILED) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to map the prefix file.\n");
+		return -1;
+	}
+
+	res->map = map;
+	res->map_len = st.st_size;
+	talloc_set_destructor(res, nat_rewrite_unmap);
+
+	hdr = map;
+	if (hdr->byte_order != NAT_REWRITE_ORDER || hdr->num_nodes == 0
+	    || (size_t) st.st_size != sizeof(*hdr)
+			+ (size_t) hdr->num_nodes * sizeof(struct nat_rewrite_node)
+			+ (size_t) hdr->num_rules * sizeof(struct nat_rewrite_rule)) {
+		LOGP(DNAT, LOGL_ERROR, "The prefix file has a wrong size.\n");
+		return -1;
+	}
+
+	nodes = (const struct nat_rewrite_node *) (hdr + 1);
+	for (i = 0; i < hdr->num_nodes; ++i) {
+		uint32_t children = __builtin_popcount(nodes[i].bitmap);
+
+		if (nodes[i].bitmap >> 11
+		    || nodes[i].flags & ~NAT_REWRITE_LEAF
+		    || (nodes[i].flags & NAT_REWRITE_LEAF
+			&& (children || nodes[i].rule < 0))
+		    || (children && (nodes[i].first_child <= i
+			|| nodes[i].first_child + children > hdr->num_nodes))
+		    || (nodes[i].rule >= 0
+			&& (uint32_t) nodes[i].rule >= hdr->num_rules)) {
+			LOGP(DNAT, LOGL_ERROR,
+				"The prefix file has a broken node %u.\n", i);
+			return -1;
+		}
+	}
+
+	rules = (const struct nat_rewrite_rule *) (nodes + hdr->num_nodes);
+	for (i = 0; i < hdr->num_rules; ++i) {
+		if (!memchr(rules[i].prefix, '\0', sizeof(rules[i].prefix))
+		    || !memchr(rules[i].rewrite, '\0', sizeof(rules[i].rewrite))) {
+			LOGP(DNAT, LOGL_ERROR,
+				"The prefix file has a broken rule %u.\n", i);
+			return -1;
+		}
+	}
+
+	res->nodes = nodes;
+	res->num_nodes = hdr->num_nodes;
+	res->rules = rules;
+	res->num_rules = hdr->num_rules;
+	res->prefixes = hdr->num_rules;
+	return 0;
+}
+
+/**
+ * Load a prefix file. This is either a text file with one prefix and
+ * rewrite per line or a compiled one written by nat_rewrite_save.
+ */
 struct nat_rewrite *nat_rewrite_parse(void *ctx, const char *filename)
 {
 	FILE *file;
 	char *line = NULL;
 	size_t n = 2342;
 	struct nat_rewrite *res;
+	struct nat_rewrite_builder build;
+	char magic[sizeof(NAT_REWRITE_MAGIC) - 1];
 
 	file = fopen(filename, "r");
 	if (!file)
@@ -182,78 +435,132 @@ struct nat_rewrite *nat_rewrite_parse(void *ctx, const char *filename)
 		return NULL;
 	}
 
-	/* mark the root as empty */
-	res->rule.empty = 1;
+	if (fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+	    && memcmp(magic, NAT_REWRITE_MAGIC, sizeof(magic)) == 0) {
+		if (map_rewrite_file(res, file) != 0) {
+			talloc_free(res);
+			res = NULL;
+		}
+		fclose(file);
+		return res;
+	}
+	rewind(file);
+
+	memset(&build, 0, sizeof(build));
+	build.root = res;
 
 	while (getline(&line, &n, file) != -1) {
-		handle_line(res, line);
+		handle_line(&build, line);
 	}
 
 	free(line);
 	fclose(file);
+
+	if (finish_rewrite_trie(&build) != 0) {
+		talloc_free(res);
+		return NULL;
+	}
 	return res;
 }
 
+/**
+ * Write the trie in a form that nat_rewrite_parse can map directly.
+ * The file is only usable on hosts of the same byte order.
+ */
+int nat_rewrite_save(struct nat_rewrite *rewrite, const char *filename)
+{
+	struct nat_rewrite_file_hdr hdr;
+	FILE *file;
+	int rc = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, NAT_REWRITE_MAGIC, sizeof(hdr.magic));
+	hdr.byte_order = NAT_REWRITE_ORDER;
+	hdr.num_nodes = rewrite->num_nodes;
+	hdr.num_rules = rewrite->num_rules;
+
+	file = fopen(filename, "w");
+	if (!file)
+		return -1;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1
+	    || fwrite(rewrite->nodes, sizeof(*rewrite->nodes),
+		      rewrite->num_nodes, file) != rewrite->num_nodes
+	    || fwrite(rewrite->rules, sizeof(*rewrite->rules),
+		      rewrite->num_rules, file) != rewrite->num_rules)
+		rc = -1;
+
+	if (fclose(file) != 0)
+		rc = -1;
+	return rc;
+}
+
 /**
  * Simple find that tries to do a longest match...
  */
-struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *rewrite,
-					const char *prefix)
+const struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *rewrite,
+						  const char *prefix)
 {
-	struct nat_rewrite_rule *rule = &rewrite->rule;
-	struct nat_rewrite_rule *last = NULL;
-	const int len = OSMO_MIN(strlen(prefix), (sizeof(rule->prefix) - 1));
+	const struct nat_rewrite_node *node = &rewrite->nodes[0];
+	const struct nat_rewrite_rule *rule;
+	const int len = OSMO_MIN(strlen(prefix),
+				 (sizeof(rewrite->rules->prefix) - 1));
+	int32_t last = -1;
 	int i;
 
-	for (i = 0; rule && i < len; ++i) {
-		int pos;
+	for (i = 0; i < len; ++i) {
+		unsigned int bit;
 
 		CHECK_IS_DIGIT_OR_FAIL(prefix, i);
-		pos = TO_INT(prefix[i]);
+		bit = 1 << TO_INT(prefix[i]);
+		if (!(node->bitmap & bit))
+			break;
+
+		node = &rewrite->nodes[node->first_child
+				+ __builtin_popcount(node->bitmap & (bit - 1))];
+		if (node->flags & NAT_REWRITE_LEAF)
+			goto leaf;
+		if (node->rule >= 0)
+			last = node->rule;
+	}
 
-		rule = rule->rules[pos];
-		if (rule && !rule->empty)
-			last = rule;
+	return last >= 0 ? &rewrite->rules[last] : NULL;
+
+leaf:
+	/* the rest of the path is the prefix of the single rule */
+	rule = &rewrite->rules[node->rule];
+	for (i += 1; rule->prefix[i]; ++i) {
+		if (i == len)
+			goto out;
+		CHECK_IS_DIGIT_OR_FAIL(prefix, i);
+		if (prefix[i] != rule->prefix[i])
+			goto out;
 	}
+	if (i < len)
+		CHECK_IS_DIGIT_OR_FAIL(prefix, i);
+	return rule;
 
-	return last;
+out:
+	return last >= 0 ? &rewrite->rules[last] : NULL;
 
 fail:
 	return NULL;
 }
 
-static void nat_rewrite_dump_rec(struct nat_rewrite_rule *rule)
-{
-	int i;
-	if (!rule->empty)
-		printf("%s,%s\n", rule->prefix, rule->rewrite);
-
-	for (i = 0; i < ARRAY_SIZE(rule->rules); ++i) {
-		if (!rule->rules[i])
-			continue;
-		nat_rewrite_dump_rec(rule->rules[i]);
-	}
-}
-
 void nat_rewrite_dump(struct nat_rewrite *rewrite)
 {
-	nat_rewrite_dump_rec(&rewrite->rule);
-}
-
-static void nat_rewrite_dump_rec_vty(struct vty *vty, struct nat_rewrite_rule *rule)
-{
-	int i;
-	if (!rule->empty)
-		vty_out(vty, "%s,%s%s", rule->prefix, rule->rewrite, VTY_NEWLINE);
+	uint32_t i;
 
-	for (i = 0; i < ARRAY_SIZE(rule->rules); ++i) {
-		if (!rule->rules[i])
-			continue;
-		nat_rewrite_dump_rec_vty(vty, rule->rules[i]);
-	}
+	for (i = 0; i < rewrite->num_rules; ++i)
+		printf("%s,%s\n", rewrite->rules[i].prefix,
+			rewrite->rules[i].rewrite);
 }
 
 void nat_rewrite_dump_vty(struct vty *vty, struct nat_rewrite *rewrite)
 {
-	nat_rewrite_dump_rec_vty(vty, &rewrite->rule);
+	uint32_t i;
+
+	for (i = 0; i < rewrite->num_rules; ++i)
+		vty_out(vty, "%s,%s%s", rewrite->rules[i].prefix,
+			rewrite->rules[i].rewrite, VTY_NEWLINE);
 }
@@ -56,6 +56,7 @@ static const struct rate_ctr_desc bsc_cfg_ctr_description[] = {
 	[BCFG_CTR_CON_PAG_RESP]  = { "conn.pag",       "Conn Paging Response     "},
 	[BCFG_CTR_CON_SSA]       = { "conn.ssa",       "Conn USSD                "},
 	[BCFG_CTR_CON_OTHER]     = { "conn.other",     "Conn Other               "},
+	[BCFG_CTR_PAGING]        = { "paging",         "Paging commands forwarded"},
 };
 
 static const struct rate_ctr_group_desc bsc_cfg_ctrg_desc = {
@@ -65,6 +66,39 @@ static const struct rate_ctr_group_desc bsc_cfg_ctrg_desc = {
 	.ctr_desc = bsc_cfg_ctr_description,
 };
 
+static const struct rate_ctr_desc paging_ctr_description[] = {
+	[NAT_PAGING_RECEIVED]	= { "paging.received",  "Paging commands from the MSC"},
+	[NAT_PAGING_FORWARDED]	= { "paging.forwarded", "Paging commands sent to BSCs"},
+	[NAT_PAGING_UNROUTED]	= { "paging.unrouted",  "Paged LACs without a BSC   "},
+};
+
+static const struct rate_ctr_group_desc bsc_nat_paging_desc = {
+	.group_name_prefix = "nat.paging",
+	.group_description = "NAT Paging Statistics",
+	.num_ctr = ARRAY_SIZE(paging_ctr_description),
+	.ctr_desc = paging_ctr_description,
+};
+
+static const struct rate_ctr_desc sccp_path_ctr_description[] = {
+	[NAT_SCCP_DT1_FAST]	= { "sccp.dt1.fast",     "DT1 forwarded without parsing"},
+	[NAT_SCCP_DT1_PARSED]	= { "sccp.dt1.parsed",   "DT1 parsed"},
+	[NAT_SCCP_CR_PARSED]	= { "sccp.cr.parsed",    "CR parsed"},
+	[NAT_SCCP_CC_PARSED]	= { "sccp.cc.parsed",    "CC parsed"},
+	[NAT_SCCP_CREF_PARSED]	= { "sccp.cref.parsed",  "CREF parsed"},
+	[NAT_SCCP_RLSD_PARSED]	= { "sccp.rlsd.parsed",  "RLSD parsed"},
+	[NAT_SCCP_RLC_PARSED]	= { "sccp.rlc.parsed",   "RLC parsed"},
+	[NAT_SCCP_IT_PARSED]	= { "sccp.it.parsed",    "IT parsed"},
+	[NAT_SCCP_UDT_PARSED]	= { "sccp.udt.parsed",   "UDT parsed"},
+	[NAT_SCCP_OTHER_PARSED]	= { "sccp.other.parsed", "Other SCCP parsed"},
+};
+
+static const struct rate_ctr_group_desc bsc_nat_sccp_path_desc = {
+	.group_name_prefix = "nat.sccp",
+	.group_description = "NAT SCCP from the BSCs",
+	.num_ctr = ARRAY_SIZE(sccp_path_ctr_description),
+	.ctr_desc = sccp_path_ctr_description,
+};
+
 static const struct rate_ctr_desc acc_list_ctr_description[] = {
 	[ACC_LIST_BSC_FILTER]	= { "access-list.bsc-filter", "Rejected by rule for BSC"},
 	[ACC_LIST_NAT_FILTER]	= { "access-list.nat-filter", "Rejected by rule for NAT"},
@@ -79,6 +113,7 @@ static const struct rate_ctr_group_desc bsc_cfg_acc_list_desc = {
 
 struct bsc_nat *bsc_nat_alloc(void)
 {
+	int i;
 	struct bsc_nat *nat = talloc_zero(tall_bsc_ctx, struct bsc_nat);
 	if (!nat)
 		return NULL;
@@ -90,17 +125,34 @@ struct bsc_nat *bsc_nat_alloc(void)
 	}
 
 	INIT_LLIST_HEAD(&nat->sccp_connections);
+	nat->sccp_by_patched = talloc_array(nat, struct llist_head, NAT_SCCP_HASH_SIZE);
+	nat->sccp_by_real = talloc_array(nat, struct llist_head, NAT_SCCP_HASH_SIZE);
+	nat->sccp_by_remote = talloc_array(nat, struct llist_head, NAT_SCCP_HASH_SIZE);
+	nat->paging_lacs = talloc_array(nat, struct llist_head, NAT_PAGING_HASH_SIZE);
+	nat->mgcp_trans = talloc_array(nat, struct llist_head, NAT_MGCP_HASH_SIZE);
+	nat->pending_dlcx = talloc_array(nat, struct llist_head, NAT_MGCP_HASH_SIZE);
+	if (!nat->sccp_by_patched || !nat->sccp_by_real || !nat->sccp_by_remote
+	    || !nat->paging_lacs || !nat->mgcp_trans || !nat->pending_dlcx) {
+		talloc_free(nat);
+		return NULL;
+	}
+	for (i = 0; i < NAT_SCCP_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&nat->sccp_by_patched[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_real[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_remote[i]);
+	}
+	for (i = 0; i < NAT_PAGING_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&nat->paging_lacs[i]);
+	for (i = 0; i < NAT_MGCP_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&nat->mgcp_trans[i]);
+		INIT_LLIST_HEAD(&nat->pending_dlcx[i]);
+	}
+	nat->paging_index_dirty = 1;
 	INIT_LLIST_HEAD(&nat->bsc_connections);
 	INIT_LLIST_HEAD(&nat->paging_groups);
 	INIT_LLIST_HEAD(&nat->bsc_configs);
 	INIT_LLIST_HEAD(&nat->access_lists);
 	INIT_LLIST_HEAD(&nat->dests);
-	INIT_LLIST_HEAD(&nat->num_rewr);
-	INIT_LLIST_HEAD(&nat->num_rewr_post);
-	INIT_LLIST_HEAD(&nat->smsc_rewr);
-	INIT_LLIST_HEAD(&nat->tpdest_match);
-	INIT_LLIST_HEAD(&nat->sms_clear_tp_srr);
-	INIT_LLIST_HEAD(&nat->sms_num_rewr);
 
 	nat->stats.sccp.conn = osmo_counter_alloc("nat.sccp.conn");
 	nat->stats.sccp.calls = osmo_counter_alloc("nat.sccp.calls");
@@ -108,6 +160,12 @@ struct bsc_nat *bsc_nat_alloc(void)
 	nat->stats.bsc.auth_fail = osmo_counter_alloc("nat.bsc.auth_fail");
 	nat->stats.msc.reconn = osmo_counter_alloc("nat.msc.conn");
 	nat->stats.ussd.reconn = osmo_counter_alloc("nat.ussd.conn");
+	nat->stats.paging = rate_ctr_group_alloc(nat, &bsc_nat_paging_desc, 0);
+	nat->stats.sccp_path = rate_ctr_group_alloc(nat, &bsc_nat_sccp_path_desc, 0);
+	if (!nat->stats.paging || !nat->stats.sccp_path) {
+		talloc_free(nat);
+		return NULL;
+	}
 	nat->auth_timeout = 2;
 	nat->ping_timeout = 20;
 	nat->pong_timeout = 5;
@@ -134,6 +192,8 @@ struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat)
 	osmo_wqueue_init(&con->write_queue, 100);
 	INIT_LLIST_HEAD(&con->cmd_pending);
 	INIT_LLIST_HEAD(&con->pending_dlcx);
+	INIT_LLIST_HEAD(&con->mgcp_endpoints);
+	INIT_LLIST_HEAD(&con->sccp_connections);
 	return con;
 }
 
@@ -201,11 +261,13 @@ static void _del_lac(struct llist_head *list, int _lac)
 void bsc_config_add_lac(struct bsc_config *cfg, int _lac)
 {
 	_add_lac(cfg, &cfg->lac_list, _lac);
+	bsc_nat_paging_index_invalidate(cfg->nat);
 }
 
 void bsc_config_del_lac(struct bsc_config *cfg, int _lac)
 {
 	_del_lac(&cfg->lac_list, _lac);
+	bsc_nat_paging_index_invalidate(cfg->nat);
 }
 
 struct bsc_nat_paging_group *bsc_nat_paging_group_create(struct bsc_nat *nat, int group)
@@ -219,13 +281,16 @@ struct bsc_nat_paging_group *bsc_nat_paging_group_create(struct bsc_nat *nat, in
 	}
 
 	pgroup->nr = group;
+	pgroup->nat = nat;
 	INIT_LLIST_HEAD(&pgroup->lists);
 	llist_add_tail(&pgroup->entry, &nat->paging_groups);
+	bsc_nat_paging_index_invalidate(nat);
 	return pgroup;
 }
 
 void bsc_nat_paging_group_delete(struct bsc_nat_paging_group *pgroup)
 {
+	bsc_nat_paging_index_invalidate(pgroup->nat);
 	llist_del(&pgroup->entry);
 	talloc_free(pgroup);
 }
@@ -244,11 +309,13 @@ struct bsc_nat_paging_group *bsc_nat_paging_group_num(struct bsc_nat *nat, int g
 void bsc_nat_paging_group_add_lac(struct bsc_nat_paging_group *pgroup, int lac)
 {
 	_add_lac(pgroup, &pgroup->lists, lac);
+	bsc_nat_paging_index_invalidate(pgroup->nat);
 }
 
 void bsc_nat_paging_group_del_lac(struct bsc_nat_paging_group *pgroup, int lac)
 {
 	_del_lac(&pgroup->lists, lac);
+	bsc_nat_paging_index_invalidate(pgroup->nat);
 }
 
 int bsc_config_handles_lac(struct bsc_config *cfg, int lac_nr)
@@ -272,13 +339,186 @@ int bsc_config_handles_lac(struct bsc_config *cfg, int lac_nr)
 	return 0;
 }
 
+/*
+ * The LAC to BSC index used to fan out paging commands. Any change of
+ * the LACs, the paging groups or the set of authenticated BSCs marks
+ * it dirty and it is rebuilt once by the next paging command.
+ */
+void bsc_nat_paging_index_invalidate(struct bsc_nat *nat)
+{
+	nat->paging_index_dirty = 1;
+}
+
+static struct bsc_nat_paging_lac *paging_lac_get(struct bsc_nat *nat, uint16_t lac)
+{
+	struct bsc_nat_paging_lac *entry;
+	struct llist_head *head = &nat->paging_lacs[lac % NAT_PAGING_HASH_SIZE];
+
+	llist_for_each_entry(entry, head, entry)
+		if (entry->lac == lac)
+			return entry;
+
+	entry = talloc_zero(nat->paging_index, struct bsc_nat_paging_lac);
+	if (!entry)
+		return NULL;
+
+	entry->lac = lac;
+	llist_add_tail(&entry->entry, head);
+	return entry;
+}
+
+static void paging_index_add(struct bsc_nat *nat, struct llist_head *lacs,
+			     struct bsc_connection *bsc)
+{
+	struct bsc_lac_entry *lac;
+	struct bsc_nat_paging_lac *entry;
+	struct bsc_connection **bscs;
+
+	llist_for_each_entry(lac, lacs, entry) {
+		entry = paging_lac_get(nat, lac->lac);
+		if (!entry) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to allocate the paging index.\n");
+			continue;
+		}
+
+		/* the LAC is in the config and in the paging group */
+		if (entry->num_bscs > 0 && entry->bscs[entry->num_bscs - 1] == bsc)
+			continue;
+
+		bscs = talloc_realloc(nat->paging_index, entry->bscs,
+				      struct bsc_connection *, entry->num_bscs + 1);
+		if (!bscs) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to allocate the paging index.\n");
+			continue;
+		}
+
+		entry->bscs = bscs;
+		entry->bscs[entry->num_bscs++] = bsc;
+	}
+}
+
+static void paging_index_rebuild(struct bsc_nat *nat)
+{
+	int i;
+	struct bsc_connection *bsc;
+	struct bsc_nat_paging_group *pgroup;
+
+	talloc_free(nat->paging_index);
+	for (i = 0; i < NAT_PAGING_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&nat->paging_lacs[i]);
+
+	nat->paging_index = talloc_named_const(nat, 0, "paging index");
+	nat->paging_index_dirty = 0;
+
+	llist_for_each_entry(bsc, &nat->bsc_connections, list_entry) {
+		if (!bsc->cfg || !bsc->authenticated)
+			continue;
+
+		paging_index_add(nat, &bsc->cfg->lac_list, bsc);
+		pgroup = bsc_nat_paging_group_num(nat, bsc->cfg->paging_group);
+		if (pgroup)
+			paging_index_add(nat, &pgroup->lists, bsc);
+	}
+}
+
+struct bsc_nat_paging_lac *bsc_nat_paging_lac_find(struct bsc_nat *nat, uint16_t lac)
+{
+	struct bsc_nat_paging_lac *entry;
+
+	if (nat->paging_index_dirty)
+		paging_index_rebuild(nat);
+
+	llist_for_each_entry(entry, &nat->paging_lacs[lac % NAT_PAGING_HASH_SIZE], entry)
+		if (entry->lac == lac)
+			return entry;
+
+	return NULL;
+}
+
+/*
+ * Forward a paging command to every BSC handling one of the listed
+ * LACs. The command is framed once and every BSC is paged at most
+ * once. Returns the number of BSCs the command was queued for.
+ */
+int bsc_nat_forward_paging(struct bsc_nat *nat, struct msgb *msg)
+{
+	int lac, i, j, ret, data_length, sent = 0;
+	const uint8_t *paging_start;
+	struct bsc_nat_paging_lac *entry;
+	struct bsc_connection *bsc;
+	struct msgb *framed, *copy;
+
+	ret = bsc_nat_find_paging(msg, &paging_start, &data_length);
+	if (ret != 0)
+		return ret;
+
+	rate_ctr_inc(&nat->stats.paging->ctr[NAT_PAGING_RECEIVED]);
+
+	if (msgb_l2len(msg) > 4096 - 128) {
+		LOGP(DNAT, LOGL_ERROR, "Can not send message of that size.\n");
+		return -1;
+	}
+
+	framed = msgb_alloc_headroom(4096, 128, "paging");
+	if (!framed) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate memory for paging.\n");
+		return -1;
+	}
+
+	memcpy(msgb_put(framed, msgb_l2len(msg)), msg->l2h, msgb_l2len(msg));
+	ipaccess_prepend_header(framed, IPAC_PROTO_SCCP);
+
+	++nat->paging_round;
+
+	for (i = 0; i + 1 < data_length; i += 2) {
+		lac = paging_start[i] << 8 | paging_start[i + 1];
+
+		entry = bsc_nat_paging_lac_find(nat, lac);
+		if (!entry || entry->num_bscs == 0) {
+			rate_ctr_inc(&nat->stats.paging->ctr[NAT_PAGING_UNROUTED]);
+			LOGP(DNAT, LOGL_ERROR, "No BSC for LAC %d/0x%d\n", lac, lac);
+			continue;
+		}
+
+		for (j = 0; j < entry->num_bscs; ++j) {
+			bsc = entry->bscs[j];
+
+			if (bsc->paging_round == nat->paging_round)
+				continue;
+			bsc->paging_round = nat->paging_round;
+
+			if (bsc->cfg->forbid_paging) {
+				LOGP(DNAT, LOGL_DEBUG, "Paging forbidden for BTS: %d\n", bsc->cfg->nr);
+				continue;
+			}
+
+			copy = msgb_alloc(framed->len, "to-bsc");
+			if (!copy) {
+				LOGP(DNAT, LOGL_ERROR, "Failed to allocate memory for BSC msg.\n");
+				continue;
+			}
+
+			memcpy(msgb_put(copy, framed->len), framed->data, framed->len);
+			if (bsc_send_msg(bsc, copy) != 0)
+				continue;
+
+			rate_ctr_inc(&bsc->cfg->stats.ctrg->ctr[BCFG_CTR_PAGING]);
+			++sent;
+		}
+	}
+
+	rate_ctr_add(&nat->stats.paging->ctr[NAT_PAGING_FORWARDED], sent);
+	msgb_free(framed);
+	return sent;
+}
+
 void sccp_connection_destroy(struct nat_sccp_connection *conn)
 {
 	LOGP(DNAT, LOGL_DEBUG, "Destroy 0x%x <-> 0x%x mapping for con %p\n",
 	     sccp_src_ref_to_int(&conn->real_ref),
 	     sccp_src_ref_to_int(&conn->patched_ref), conn->bsc);
 	bsc_mgcp_dlcx(conn);
-	llist_del(&conn->list_entry);
+	sccp_connection_remove(conn);
 	talloc_free(conn);
 }
 
@@ -341,7 +581,9 @@ int bsc_write_mgcp(struct bsc_connection *bsc, const uint8_t *data, unsigned int
 
 int bsc_write(struct bsc_connection *bsc, struct msgb *msg, int proto)
 {
-	return bsc_do_write(&bsc->write_queue, msg, proto);
+	/* prepend the header */
+	ipaccess_prepend_header(msg, proto);
+	return bsc_send_msg(bsc, msg);
 }
 
 int bsc_do_write(struct osmo_wqueue *queue, struct msgb *msg, int proto)
@@ -362,17 +604,24 @@ int bsc_write_msg(struct osmo_wqueue *queue, struct msgb *msg)
 	return 0;
 }
 
-int bsc_nat_lst_check_allow(struct bsc_nat_acc_lst *lst, const char *mi_string)
+int bsc_send_msg(struct bsc_connection *bsc, struct msgb *msg)
 {
-	struct bsc_nat_acc_lst_entry *entry;
+	if (bsc->worker_conn)
+		return bsc_nat_worker_send(bsc, msg);
+	return bsc_write_msg(&bsc->write_queue, msg);
+}
 
-	llist_for_each_entry(entry, &lst->fltr_list, list) {
-		if (!entry->imsi_allow)
-			continue;
-		if (regexec(&entry->imsi_allow_re, mi_string, 0, NULL, 0) == 0)
-			return 0;
-	}
+int bsc_nat_lst_check_allow(struct bsc_nat_acc_lst *lst, const char *mi_string)
+{
+	if (bsc_nat_acc_lst_match(lst, mi_string) & NAT_ACC_ALLOW)
+		return 0;
+	return 1;
+}
 
+int bsc_nat_lst_check_deny(struct bsc_nat_acc_lst *lst, const char *mi_string)
+{
+	if (bsc_nat_acc_lst_match(lst, mi_string) & NAT_ACC_DENY)
+		return 0;
 	return 1;
 }
 
@@ -469,6 +718,7 @@ struct bsc_nat_acc_lst_entry *bsc_nat_acc_lst_entry_create(struct bsc_nat_acc_ls
 		return NULL;
 
 	llist_add_tail(&entry->list, &lst->fltr_list);
+	lst->dirty = 1;
 	return entry;
 }
 
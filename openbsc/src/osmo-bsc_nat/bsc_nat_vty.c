@@ -22,6 +22,7 @@
 #include <openbsc/gsm_data.h>
 #include <openbsc/bsc_nat.h>
 #include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/bsc_nat_worker.h>
 #include <openbsc/bsc_msc.h>
 #include <openbsc/gsm_04_08.h>
 #include <openbsc/mgcp.h>
@@ -153,6 +154,8 @@ static int config_write_nat(struct vty *vty)
 		write_pgroup_lst(vty, pgroup);
 	if (_nat->mgcp_ipa)
 		vty_out(vty, " use-msc-ipa-for-mgcp%s", VTY_NEWLINE);
+	if (_nat->bsc_workers > 0)
+		vty_out(vty, " bsc-workers %d%s", _nat->bsc_workers, VTY_NEWLINE);
 
 	return CMD_SUCCESS;
 }
@@ -281,6 +284,36 @@ DEFUN(show_bsc_cfg, show_bsc_cfg_cmd, "show bsc config",
 	return CMD_SUCCESS;
 }
 
+static void dump_workers(struct vty *vty, struct bsc_nat *nat)
+{
+	unsigned long long rx_msgs = 0, tx_msgs = 0, wakeups = 0;
+	int i;
+
+	if (!nat->workers)
+		return;
+
+	for (i = 0; i < nat->num_workers; ++i) {
+		struct bsc_nat_worker *worker = &nat->workers[i];
+		unsigned long long rx, tx, wake;
+
+		/* written by the worker threads */
+		rx = __atomic_load_n(&worker->rx_msgs, __ATOMIC_RELAXED);
+		tx = __atomic_load_n(&worker->tx_msgs, __ATOMIC_RELAXED);
+		wake = __atomic_load_n(&worker->wakeups, __ATOMIC_RELAXED);
+
+		vty_out(vty, "  Worker %d: %u BSCs, %llu msgs in, %llu msgs out, "
+			"%llu wakeups, %u backlogged%s",
+			worker->nr, worker->bscs, rx, tx, wake,
+			worker->backlogged, VTY_NEWLINE);
+		rx_msgs += rx;
+		tx_msgs += tx;
+		wakeups += wake;
+	}
+
+	vty_out(vty, " BSC workers: %d, %llu msgs in, %llu msgs out, %llu wakeups%s",
+		nat->num_workers, rx_msgs, tx_msgs, wakeups, VTY_NEWLINE);
+}
+
 static void dump_stat_total(struct vty *vty, struct bsc_nat *nat)
 {
 	vty_out(vty, "NAT statistics%s", VTY_NEWLINE);
@@ -294,6 +327,9 @@ static void dump_stat_total(struct vty *vty, struct bsc_nat *nat)
 	vty_out(vty, " BSC Connections %lu total, %lu auth failed.%s",
 		osmo_counter_get(nat->stats.bsc.reconn),
 		osmo_counter_get(nat->stats.bsc.auth_fail), VTY_NEWLINE);
+	vty_out_rate_ctr_group(vty, " ", nat->stats.paging);
+	vty_out_rate_ctr_group(vty, " ", nat->stats.sccp_path);
+	dump_workers(vty, nat);
 }
 
 static void dump_stat_bsc(struct vty *vty, struct bsc_config *conf)
@@ -537,7 +573,7 @@ DEFUN(cfg_nat_no_imsi_black_list_fn,
 }
 
 static int replace_rules(struct bsc_nat *nat, char **name,
-			 struct llist_head *head, const char *file)
+			 struct bsc_nat_num_rewr **head, const char *file)
 {
 	struct osmo_config_list *rewr = NULL;
 
@@ -667,22 +703,24 @@ DEFUN(cfg_nat_prefix_trie,
       "prefix-tree FILENAME",
       "Prefix tree for number rewriting\n" "File to load\n")
 {
-	/* give up the old data */
-	talloc_free(_nat->num_rewr_trie);
-	_nat->num_rewr_trie = NULL;
+	struct nat_rewrite *trie;
+
+	/* keep the old tree and name unless the new one can be used */
+	trie = nat_rewrite_parse(_nat, argv[0]);
+	if (!trie) {
+		vty_out(vty, "%% prefix-tree parsing has failed.%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
 
-	/* replace the file name */
 	bsc_replace_string(_nat, &_nat->num_rewr_trie_name, argv[0]);
 	if (!_nat->num_rewr_trie_name) {
 		vty_out(vty, "%% prefix-tree no filename is present.%s", VTY_NEWLINE);
+		talloc_free(trie);
 		return CMD_WARNING;
 	}
 
-	_nat->num_rewr_trie = nat_rewrite_parse(_nat, _nat->num_rewr_trie_name);
-	if (!_nat->num_rewr_trie) {
-		vty_out(vty, "%% prefix-tree parsing has failed.%s", VTY_NEWLINE);
-		return CMD_WARNING;
-	}
+	talloc_free(_nat->num_rewr_trie);
+	_nat->num_rewr_trie = trie;
 
 	vty_out(vty, "%% prefix-tree loaded %zu rules.%s",
 		_nat->num_rewr_trie->prefixes, VTY_NEWLINE);
@@ -706,7 +744,7 @@ DEFUN(show_prefix_tree, show_prefix_tree_cmd,
       SHOW_STR "Prefix tree for number rewriting\n")
 {
 	if (!_nat->num_rewr_trie) {
-		vty_out(vty, "%% there is now prefix tree loaded.%s",
+		vty_out(vty, "%% there is no prefix tree loaded.%s",
 			VTY_NEWLINE);
 		return CMD_WARNING;
 	}
@@ -715,6 +753,28 @@ DEFUN(show_prefix_tree, show_prefix_tree_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(save_prefix_tree, save_prefix_tree_cmd,
+      "save prefix-tree FILENAME",
+      "Save data\n" "Prefix tree for number rewriting\n"
+      "File for the compiled tree\n")
+{
+	if (!_nat->num_rewr_trie) {
+		vty_out(vty, "%% there is no prefix tree loaded.%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	if (nat_rewrite_save(_nat->num_rewr_trie, argv[0]) != 0) {
+		vty_out(vty, "%% saving the prefix tree has failed.%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	vty_out(vty, "%% prefix-tree saved %zu rules.%s",
+		_nat->num_rewr_trie->prefixes, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_nat_ussd_lst_name,
       cfg_nat_ussd_lst_name_cmd,
       "ussd-list-name NAME",
@@ -768,6 +828,25 @@ DEFUN(cfg_nat_use_ipa_for_mgcp,
 	return CMD_SUCCESS;
 }
 
+#define WORKERS_STR "Handle the socket I/O of the BSCs in separate threads\n"
+DEFUN(cfg_nat_bsc_workers,
+      cfg_nat_bsc_workers_cmd,
+      "bsc-workers <1-64>",
+      WORKERS_STR "Number of threads, applied at start\n")
+{
+	_nat->bsc_workers = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nat_no_bsc_workers,
+      cfg_nat_no_bsc_workers_cmd,
+      "no bsc-workers",
+      NO_STR WORKERS_STR)
+{
+	_nat->bsc_workers = 0;
+	return CMD_SUCCESS;
+}
+
 /* per BSC configuration */
 DEFUN(cfg_bsc, cfg_bsc_cmd, "bsc BSC_NR",
       "BSC configuration\n" "Identifier of the BSC\n")
@@ -865,6 +944,7 @@ DEFUN(cfg_lst_imsi_allow,
 
 	if (gsm_parse_reg(acc, &entry->imsi_allow_re, &entry->imsi_allow, argc - 1, &argv[1]) != 0)
 		return CMD_WARNING;
+	bsc_nat_acc_lst_compile(acc);
 	return CMD_SUCCESS;
 }
 
@@ -889,6 +969,7 @@ DEFUN(cfg_lst_imsi_deny,
 
 	if (gsm_parse_reg(acc, &entry->imsi_deny_re, &entry->imsi_deny, argc - 1, &argv[1]) != 0)
 		return CMD_WARNING;
+	bsc_nat_acc_lst_compile(acc);
 	return CMD_SUCCESS;
 }
 
@@ -920,6 +1001,15 @@ DEFUN(show_acc_lst,
 
 	vty_out(vty, "access-list %s%s", acc->name, VTY_NEWLINE);
 	vty_out_rate_ctr_group(vty, " ", acc->stats);
+	vty_out(vty, " Compiled %d expressions into %d states in %llu us, %d use regexec%s",
+		acc->perf.compiled, acc->perf.states,
+		(unsigned long long) acc->perf.compile_ns / 1000,
+		acc->perf.fallback, VTY_NEWLINE);
+	vty_out(vty, " Lookups %lu, %llu ns on average%s",
+		acc->perf.lookups,
+		(unsigned long long) (acc->perf.sampled ?
+			acc->perf.lookup_ns / acc->perf.sampled : 0),
+		VTY_NEWLINE);
 
 	return CMD_SUCCESS;
 }
@@ -1017,6 +1107,7 @@ DEFUN(cfg_bsc_paging_grp,
 {
 	struct bsc_config *conf = vty->index;
 	conf->paging_group = atoi(argv[0]);
+	bsc_nat_paging_index_invalidate(conf->nat);
 	return CMD_SUCCESS;
 }
 
@@ -1031,6 +1122,7 @@ DEFUN(cfg_bsc_no_paging_grp,
 {
 	struct bsc_config *conf = vty->index;
 	conf->paging_group = PAGIN_GROUP_UNASSIGNED;
+	bsc_nat_paging_index_invalidate(conf->nat);
 	return CMD_SUCCESS;
 }
 
@@ -1188,6 +1280,7 @@ int bsc_nat_vty_init(struct bsc_nat *nat)
 
 	install_element(ENABLE_NODE, &set_last_endp_cmd);
 	install_element(ENABLE_NODE, &block_new_conn_cmd);
+	install_element(ENABLE_NODE, &save_prefix_tree_cmd);
 
 	/* nat group */
 	install_element(CONFIG_NODE, &cfg_nat_cmd);
@@ -1210,6 +1303,8 @@ int bsc_nat_vty_init(struct bsc_nat *nat)
 	install_element(NAT_NODE, &cfg_nat_ussd_token_cmd);
 	install_element(NAT_NODE, &cfg_nat_ussd_local_cmd);
 	install_element(NAT_NODE, &cfg_nat_use_ipa_for_mgcp_cmd);
+	install_element(NAT_NODE, &cfg_nat_bsc_workers_cmd);
+	install_element(NAT_NODE, &cfg_nat_no_bsc_workers_cmd);
 
 	/* access-list */
 	install_element(NAT_NODE, &cfg_lst_imsi_allow_cmd);
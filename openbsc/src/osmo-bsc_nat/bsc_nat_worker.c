@@ -0,0 +1,796 @@
+/* BSC socket worker threads */
+
+/*
+ * (C) 2010-2012 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010-2012 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The BSC connections are spread over a fixed number of worker threads.
+ * A worker owns the sockets of its BSCs and waits for them with its own
+ * epoll set. It splits the incoming stream into IPA messages and writes
+ * out whatever the main thread queued. Everything else, the SCCP
+ * patching, MGCP, USSD, paging, the counters and the VTY, stays in the
+ * main thread and needs no locking.
+ *
+ * Only the socket I/O is sharded. The bsc_connection objects, the SCCP
+ * connection table, the filters and the rewriting as well as the MSC
+ * link are not, the select loop, the timers, talloc and the logging
+ * they use are single threaded. A NAT with workers is therefore still
+ * bound by the protocol handling of its main thread.
+ *
+ * Each worker has two single producer/single consumer rings, one with
+ * the commands of the main thread and one with the events it reports
+ * back. The main thread gets woken up through an eventfd in its select
+ * loop. It never waits for a worker, commands that do not fit into a
+ * full ring are kept in a backlog until the worker caught up.
+ *
+ * A worker does not log, errors are reported like any other event and
+ * logged by the main thread.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/gsm/protocol/ipaccess.h>
+
+#include "bscconfig.h"
+
+#include <openbsc/debug.h>
+#include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_worker.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define WORKER_EVENTS	64
+#define WORKER_IOV	16
+#define RING_MASK	(BSC_NAT_WORKER_RING_SIZE - 1)
+
+/* the largest message ipa_msg_recv accepts */
+#define IPA_MAX_MSG	1200
+
+struct worker_pending {
+	struct llist_head entry;
+	struct bsc_nat_worker_msg msg;
+};
+
+/* only the worker writes its statistics, the VTY reads them atomically */
+static void stat_add(unsigned long long *stat, unsigned long long n)
+{
+	__atomic_store_n(stat, *stat + n, __ATOMIC_RELAXED);
+}
+
+static int ring_push(struct bsc_nat_worker_ring *ring, int type,
+		     struct bsc_nat_worker_conn *wconn, void *data, int len)
+{
+	struct bsc_nat_worker_msg *msg;
+	unsigned int head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+			>= BSC_NAT_WORKER_RING_SIZE)
+		return -1;
+
+	msg = &ring->msgs[head & RING_MASK];
+	msg->type = type;
+	msg->wconn = wconn;
+	msg->data = data;
+	msg->len = len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int ring_empty(struct bsc_nat_worker_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail;
+}
+
+static int signal_fd(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		return -errno;
+	return 0;
+}
+
+/* the buffers of a BSC count against the bound of its write queue */
+static void release_buf(struct bsc_nat_worker_conn *wconn,
+			struct bsc_nat_worker_buf *buf)
+{
+	__atomic_sub_fetch(&wconn->queued, 1, __ATOMIC_RELAXED);
+	free(buf);
+}
+
+/*
+ * Main thread side
+ */
+static void wake_worker(struct bsc_nat_worker *worker)
+{
+	/* only pay for the syscall when the worker is blocked */
+	if (__atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST)
+	    && signal_fd(worker->wake_fd) != 0)
+		LOGP(DNAT, LOGL_ERROR, "Failed to signal BSC worker %d: %s\n",
+		     worker->nr, strerror(errno));
+}
+
+static void flush_backlog(struct bsc_nat_worker *worker)
+{
+	struct worker_pending *pending, *tmp;
+
+	llist_for_each_entry_safe(pending, tmp, &worker->backlog, entry) {
+		if (ring_push(&worker->to_worker, pending->msg.type,
+			      pending->msg.wconn, pending->msg.data,
+			      pending->msg.len) != 0)
+			break;
+		llist_del(&pending->entry);
+		talloc_free(pending);
+	}
+
+	/* ask the worker to tell us when there is room again */
+	if (!llist_empty(&worker->backlog))
+		__atomic_store_n(&worker->main_waiting, 1, __ATOMIC_SEQ_CST);
+	wake_worker(worker);
+}
+
+static void worker_push(struct bsc_nat_worker *worker, int type,
+			struct bsc_nat_worker_conn *wconn, void *data)
+{
+	struct worker_pending *pending;
+
+	if (llist_empty(&worker->backlog) &&
+	    ring_push(&worker->to_worker, type, wconn, data, 0) == 0) {
+		wake_worker(worker);
+		return;
+	}
+
+	pending = talloc_zero(worker->nat, struct worker_pending);
+	if (!pending) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to queue command for BSC worker %d.\n",
+		     worker->nr);
+		if (type == BSC_NAT_WORKER_SEND)
+			release_buf(wconn, data);
+		return;
+	}
+
+	pending->msg.type = type;
+	pending->msg.wconn = wconn;
+	pending->msg.data = data;
+	llist_add_tail(&pending->entry, &worker->backlog);
+	worker->backlogged += 1;
+	flush_backlog(worker);
+}
+
+static void deliver(struct bsc_nat *nat, struct bsc_nat_worker_conn *wconn,
+		    const uint8_t *data, int len)
+{
+	struct msgb *msg;
+	int off = 0, msg_len;
+
+	/* the BSC might be closed by one of the messages */
+	while (off < len && wconn->bsc) {
+		msg_len = sizeof(struct ipaccess_head) +
+				((data[off] << 8) | data[off + 1]);
+
+		msg = msgb_alloc(IPA_MAX_MSG, "Abis/IP");
+		if (!msg) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to allocate the BSC msg.\n");
+			return;
+		}
+
+		memcpy(msgb_put(msg, msg_len), &data[off], msg_len);
+		msg->l2h = msg->data + sizeof(struct ipaccess_head);
+		nat->worker_read_cb(wconn->bsc, msg);
+		off += msg_len;
+	}
+}
+
+static void drain_events(struct bsc_nat_worker *worker)
+{
+	struct bsc_nat_worker_ring *ring = &worker->to_main;
+	struct bsc_nat *nat = worker->nat;
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (; tail != head; ++tail) {
+		struct bsc_nat_worker_msg *msg = &ring->msgs[tail & RING_MASK];
+		struct bsc_nat_worker_conn *wconn = msg->wconn;
+
+		switch (msg->type) {
+		case BSC_NAT_WORKER_RECEIVED:
+			deliver(nat, wconn, msg->data, msg->len);
+			free(msg->data);
+			break;
+		case BSC_NAT_WORKER_CLOSED:
+			if (wconn->bsc)
+				nat->worker_close_cb(wconn->bsc, msg->len);
+			break;
+		case BSC_NAT_WORKER_DETACHED:
+			worker->bscs -= 1;
+			free(wconn);
+			break;
+		case BSC_NAT_WORKER_ERROR:
+			if (wconn)
+				LOGP(DNAT, LOGL_ERROR, "BSC worker %d %s fd %d: %s\n",
+				     worker->nr, (const char *) msg->data,
+				     wconn->fd, strerror(msg->len));
+			else
+				LOGP(DNAT, LOGL_ERROR, "BSC worker %d %s: %s\n",
+				     worker->nr, (const char *) msg->data,
+				     strerror(msg->len));
+			break;
+		}
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&worker->signal_errors, __ATOMIC_RELAXED))
+		LOGP(DNAT, LOGL_ERROR, "BSC worker %d failed to wake us up %u times.\n",
+		     worker->nr, __atomic_exchange_n(&worker->signal_errors, 0,
+						     __ATOMIC_RELAXED));
+}
+
+static int worker_event_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct bsc_nat_worker *worker = ofd->data;
+	uint64_t val;
+
+	if (read(ofd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		LOGP(DNAT, LOGL_ERROR, "Failed to read BSC worker %d event: %s\n",
+		     worker->nr, strerror(errno));
+
+	drain_events(worker);
+	if (!llist_empty(&worker->backlog))
+		flush_backlog(worker);
+	return 0;
+}
+
+/*
+ * Worker thread side
+ */
+static void wake_main(struct bsc_nat_worker *worker)
+{
+	/* a full eventfd counter means a wake up is pending anyway */
+	int rc = signal_fd(worker->event_fd.fd);
+
+	if (rc != 0 && rc != -EAGAIN)
+		__atomic_add_fetch(&worker->signal_errors, 1, __ATOMIC_RELAXED);
+}
+
+static void report(struct bsc_nat_worker *worker, int type,
+		   struct bsc_nat_worker_conn *wconn, void *data, int len)
+{
+	/* the main thread never waits for us, it will make room */
+	while (ring_push(&worker->to_main, type, wconn, data, len) != 0) {
+		wake_main(worker);
+		sched_yield();
+	}
+
+	worker->notify = 1;
+}
+
+/* the text has to be a constant, the main thread logs it later */
+static void report_error(struct bsc_nat_worker *worker,
+			 struct bsc_nat_worker_conn *wconn, const char *what,
+			 int err)
+{
+	report(worker, BSC_NAT_WORKER_ERROR, wconn, (void *) what, err);
+}
+
+static void conn_ctl(struct bsc_nat_worker_conn *wconn, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = wconn;
+	if (epoll_ctl(wconn->worker->epoll_fd, op, wconn->fd, &ev) != 0)
+		report_error(wconn->worker, wconn, "failed to change", errno);
+}
+
+static void conn_failed(struct bsc_nat_worker_conn *wconn, int ret)
+{
+	if (wconn->closed)
+		return;
+
+	wconn->closed = 1;
+	conn_ctl(wconn, EPOLL_CTL_DEL, 0);
+	report(wconn->worker, BSC_NAT_WORKER_CLOSED, wconn, NULL, ret);
+}
+
+static void conn_read(struct bsc_nat_worker_conn *wconn)
+{
+	struct bsc_nat_worker *worker = wconn->worker;
+	int rc, len, off = 0;
+	uint8_t *data;
+
+	rc = read(wconn->fd, &wconn->rx_buf[wconn->rx_len],
+		  sizeof(wconn->rx_buf) - wconn->rx_len);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (rc <= 0) {
+		conn_failed(wconn, rc == 0 ? 0 : -errno);
+		return;
+	}
+
+	wconn->rx_len += rc;
+	stat_add(&worker->rx_bytes, rc);
+
+	/* hand over the complete messages in one go */
+	while (wconn->rx_len - off >= sizeof(struct ipaccess_head)) {
+		len = sizeof(struct ipaccess_head) +
+			((wconn->rx_buf[off] << 8) | wconn->rx_buf[off + 1]);
+		if (len > IPA_MAX_MSG) {
+			conn_failed(wconn, -EIO);
+			return;
+		}
+		if (off + len > wconn->rx_len)
+			break;
+		off += len;
+		stat_add(&worker->rx_msgs, 1);
+	}
+
+	if (off == 0)
+		return;
+
+	data = malloc(off);
+	if (!data) {
+		conn_failed(wconn, -ENOMEM);
+		return;
+	}
+
+	memcpy(data, wconn->rx_buf, off);
+	wconn->rx_len -= off;
+	memmove(wconn->rx_buf, &wconn->rx_buf[off], wconn->rx_len);
+	report(worker, BSC_NAT_WORKER_RECEIVED, wconn, data, off);
+}
+
+static void conn_flush(struct bsc_nat_worker_conn *wconn)
+{
+	struct iovec iov[WORKER_IOV];
+	struct msghdr hdr;
+	struct bsc_nat_worker_buf *buf, *tmp;
+	int num, rc, want_write;
+
+	if (wconn->closed)
+		return;
+
+	while (!llist_empty(&wconn->tx_queue)) {
+		num = 0;
+		llist_for_each_entry(buf, &wconn->tx_queue, entry) {
+			int skip = num == 0 ? wconn->tx_offset : 0;
+
+			iov[num].iov_base = &buf->data[skip];
+			iov[num].iov_len = buf->len - skip;
+			if (++num == WORKER_IOV)
+				break;
+		}
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = iov;
+		hdr.msg_iovlen = num;
+		rc = sendmsg(wconn->fd, &hdr, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			conn_failed(wconn, -errno);
+			return;
+		}
+
+		stat_add(&wconn->worker->tx_bytes, rc);
+		rc += wconn->tx_offset;
+		llist_for_each_entry_safe(buf, tmp, &wconn->tx_queue, entry) {
+			if (rc < buf->len)
+				break;
+			rc -= buf->len;
+			llist_del(&buf->entry);
+			release_buf(wconn, buf);
+		}
+		wconn->tx_offset = rc;
+	}
+
+	/* wait for the socket to become writable again */
+	want_write = !llist_empty(&wconn->tx_queue);
+	if (want_write != wconn->want_write) {
+		wconn->want_write = want_write;
+		conn_ctl(wconn, EPOLL_CTL_MOD,
+			 EPOLLIN | (want_write ? EPOLLOUT : 0));
+	}
+}
+
+static void conn_queue(struct bsc_nat_worker_conn *wconn,
+		       struct bsc_nat_worker_buf *buf)
+{
+	struct bsc_nat_worker *worker = wconn->worker;
+
+	if (wconn->closed) {
+		release_buf(wconn, buf);
+		return;
+	}
+
+	llist_add_tail(&buf->entry, &wconn->tx_queue);
+	stat_add(&worker->tx_msgs, 1);
+
+	/* written after the ring has been processed */
+	if (!wconn->want_write && !wconn->flush_pending) {
+		wconn->flush_pending = 1;
+		llist_add_tail(&wconn->flush_entry, &worker->flush_list);
+	}
+}
+
+static void conn_detach(struct bsc_nat_worker_conn *wconn)
+{
+	struct bsc_nat_worker_buf *buf, *tmp;
+
+	if (!wconn->closed)
+		conn_ctl(wconn, EPOLL_CTL_DEL, 0);
+	wconn->closed = 1;
+
+	if (wconn->flush_pending) {
+		llist_del(&wconn->flush_entry);
+		wconn->flush_pending = 0;
+	}
+
+	llist_for_each_entry_safe(buf, tmp, &wconn->tx_queue, entry) {
+		llist_del(&buf->entry);
+		release_buf(wconn, buf);
+	}
+
+	close(wconn->fd);
+	report(wconn->worker, BSC_NAT_WORKER_DETACHED, wconn, NULL, 0);
+}
+
+static void worker_process_ring(struct bsc_nat_worker *worker)
+{
+	struct bsc_nat_worker_ring *ring = &worker->to_worker;
+	struct bsc_nat_worker_conn *wconn, *tmp;
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (; tail != head; ++tail) {
+		struct bsc_nat_worker_msg *msg = &ring->msgs[tail & RING_MASK];
+
+		switch (msg->type) {
+		case BSC_NAT_WORKER_ATTACH:
+			conn_ctl(msg->wconn, EPOLL_CTL_ADD, EPOLLIN);
+			break;
+		case BSC_NAT_WORKER_SEND:
+			conn_queue(msg->wconn, msg->data);
+			break;
+		case BSC_NAT_WORKER_DETACH:
+			conn_detach(msg->wconn);
+			break;
+		case BSC_NAT_WORKER_STOP:
+			worker->running = 0;
+			break;
+		}
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	/* one write for everything queued to a BSC */
+	llist_for_each_entry_safe(wconn, tmp, &worker->flush_list, flush_entry) {
+		llist_del(&wconn->flush_entry);
+		wconn->flush_pending = 0;
+		conn_flush(wconn);
+	}
+}
+
+static void *worker_main(void *data)
+{
+	struct bsc_nat_worker *worker = data;
+	struct epoll_event events[WORKER_EVENTS];
+	uint64_t val;
+	int i, num, timeout;
+
+	while (worker->running) {
+		/* announce the sleep before checking for work */
+		__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+		timeout = -1;
+		if (!ring_empty(&worker->to_worker) ||
+		    __atomic_load_n(&worker->main_waiting, __ATOMIC_SEQ_CST))
+			timeout = 0;
+
+		num = epoll_wait(worker->epoll_fd, events, ARRAY_SIZE(events),
+				 timeout);
+		__atomic_store_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			report_error(worker, NULL, "epoll failed", errno);
+			break;
+		}
+
+		stat_add(&worker->wakeups, 1);
+		for (i = 0; i < num; ++i) {
+			struct bsc_nat_worker_conn *wconn = events[i].data.ptr;
+
+			/* the wake up event has no connection */
+			if (!wconn) {
+				if (read(worker->wake_fd, &val, sizeof(val)) < 0
+				    && errno != EAGAIN)
+					report_error(worker, NULL,
+						     "wake read failed", errno);
+				continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				conn_read(wconn);
+			if (events[i].events & EPOLLOUT)
+				conn_flush(wconn);
+		}
+
+		worker_process_ring(worker);
+
+		if (worker->notify ||
+		    __atomic_exchange_n(&worker->main_waiting, 0, __ATOMIC_SEQ_CST)) {
+			worker->notify = 0;
+			wake_main(worker);
+		}
+	}
+
+	/* a failed epoll still has to be logged */
+	if (worker->notify)
+		wake_main(worker);
+	__atomic_store_n(&worker->stopped, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int worker_init(struct bsc_nat *nat, struct bsc_nat_worker *worker,
+		       int nr)
+{
+	struct epoll_event ev;
+
+	worker->nat = nat;
+	worker->nr = nr;
+	worker->wake_fd = worker->event_fd.fd = -1;
+	INIT_LLIST_HEAD(&worker->backlog);
+	INIT_LLIST_HEAD(&worker->flush_list);
+
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epoll_fd < 0)
+		return -1;
+
+	worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->wake_fd < 0)
+		return -1;
+
+	worker->event_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->event_fd.fd < 0)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) != 0)
+		return -1;
+
+	worker->event_fd.when = BSC_FD_READ;
+	worker->event_fd.data = worker;
+	worker->event_fd.cb = worker_event_cb;
+	if (osmo_fd_register(&worker->event_fd) != 0)
+		return -1;
+
+	worker->running = 1;
+	if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+		worker->running = 0;
+		osmo_fd_unregister(&worker->event_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+int bsc_nat_workers_start(struct bsc_nat *nat,
+			  int (*read_cb)(struct bsc_connection *, struct msgb *),
+			  void (*close_cb)(struct bsc_connection *, int ret))
+{
+	int i;
+
+	if (nat->bsc_workers <= 0 || nat->workers)
+		return 0;
+
+	nat->worker_read_cb = read_cb;
+	nat->worker_close_cb = close_cb;
+	nat->workers = talloc_zero_array(nat, struct bsc_nat_worker,
+					 nat->bsc_workers);
+	if (!nat->workers) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate the BSC workers.\n");
+		return -1;
+	}
+
+	for (i = 0; i < nat->bsc_workers; ++i) {
+		if (worker_init(nat, &nat->workers[i], i) != 0) {
+			LOGP(DNAT, LOGL_ERROR,
+			     "Failed to start BSC worker %d: %s\n",
+			     i, strerror(errno));
+			break;
+		}
+		nat->num_workers += 1;
+	}
+
+	if (nat->num_workers == 0) {
+		talloc_free(nat->workers);
+		nat->workers = NULL;
+		return -1;
+	}
+
+	LOGP(DNAT, LOGL_NOTICE, "Handling the BSC connections with %d workers.\n",
+	     nat->num_workers);
+	return 0;
+}
+
+void bsc_nat_workers_stop(struct bsc_nat *nat)
+{
+	int i;
+
+	for (i = 0; i < nat->num_workers; ++i)
+		worker_push(&nat->workers[i], BSC_NAT_WORKER_STOP, NULL, NULL);
+
+	for (i = 0; i < nat->num_workers; ++i) {
+		struct bsc_nat_worker *worker = &nat->workers[i];
+
+		/* the worker might wait for room to report something */
+		while (!__atomic_load_n(&worker->stopped, __ATOMIC_ACQUIRE)) {
+			drain_events(worker);
+			if (!llist_empty(&worker->backlog))
+				flush_backlog(worker);
+			sched_yield();
+		}
+
+		pthread_join(worker->thread, NULL);
+		drain_events(worker);
+		osmo_fd_unregister(&worker->event_fd);
+		close(worker->event_fd.fd);
+		close(worker->wake_fd);
+		close(worker->epoll_fd);
+	}
+
+	talloc_free(nat->workers);
+	nat->workers = NULL;
+	nat->num_workers = 0;
+}
+
+int bsc_nat_worker_attach(struct bsc_connection *bsc)
+{
+	struct bsc_nat *nat = bsc->nat;
+	struct bsc_nat_worker *worker;
+	struct bsc_nat_worker_conn *wconn;
+	int i, flags, fd = bsc->write_queue.bfd.fd;
+
+	if (!nat->workers)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to make fd %d non-blocking: %s\n",
+		     fd, strerror(errno));
+		return -1;
+	}
+
+	wconn = calloc(1, sizeof(*wconn));
+	if (!wconn) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate the BSC worker state.\n");
+		return -1;
+	}
+
+	/* pick the worker with the fewest BSCs */
+	worker = &nat->workers[0];
+	for (i = 1; i < nat->num_workers; ++i)
+		if (nat->workers[i].bscs < worker->bscs)
+			worker = &nat->workers[i];
+
+	wconn->worker = worker;
+	wconn->bsc = bsc;
+	wconn->fd = fd;
+	INIT_LLIST_HEAD(&wconn->tx_queue);
+	INIT_LLIST_HEAD(&wconn->flush_entry);
+
+	bsc->worker_conn = wconn;
+	worker->bscs += 1;
+	worker_push(worker, BSC_NAT_WORKER_ATTACH, wconn, NULL);
+	return 0;
+}
+
+void bsc_nat_worker_detach(struct bsc_connection *bsc)
+{
+	struct bsc_nat_worker_conn *wconn = bsc->worker_conn;
+
+	if (!wconn)
+		return;
+
+	/* the worker closes the socket, we free wconn once it is done */
+	wconn->bsc = NULL;
+	bsc->worker_conn = NULL;
+	worker_push(wconn->worker, BSC_NAT_WORKER_DETACH, wconn, NULL);
+}
+
+int bsc_nat_worker_send(struct bsc_connection *bsc, struct msgb *msg)
+{
+	struct bsc_nat_worker_conn *wconn = bsc->worker_conn;
+	struct bsc_nat_worker_buf *buf;
+
+	/* the same bound as for the write queue of the main loop */
+	if (__atomic_load_n(&wconn->queued, __ATOMIC_RELAXED)
+			>= bsc->write_queue.max_length) {
+		LOGP(DLINP, LOGL_ERROR, "Failed to enqueue the write.\n");
+		msgb_free(msg);
+		return -1;
+	}
+
+	buf = malloc(sizeof(*buf) + msg->len);
+	if (!buf) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate the BSC write.\n");
+		msgb_free(msg);
+		return -1;
+	}
+	__atomic_add_fetch(&wconn->queued, 1, __ATOMIC_RELAXED);
+
+	buf->len = msg->len;
+	memcpy(buf->data, msg->data, msg->len);
+	msgb_free(msg);
+
+	worker_push(wconn->worker, BSC_NAT_WORKER_SEND, wconn, buf);
+	return 0;
+}
+
+#else
+
+int bsc_nat_workers_start(struct bsc_nat *nat,
+			  int (*read_cb)(struct bsc_connection *, struct msgb *),
+			  void (*close_cb)(struct bsc_connection *, int ret))
+{
+	if (nat->bsc_workers <= 0)
+		return 0;
+
+	LOGP(DNAT, LOGL_ERROR,
+	     "BSC workers need epoll and eventfd. Handling the BSCs in the main loop.\n");
+	return -1;
+}
+
+void bsc_nat_workers_stop(struct bsc_nat *nat)
+{
+}
+
+int bsc_nat_worker_attach(struct bsc_connection *bsc)
+{
+	return -1;
+}
+
+void bsc_nat_worker_detach(struct bsc_connection *bsc)
+{
+}
+
+int bsc_nat_worker_send(struct bsc_connection *bsc, struct msgb *msg)
+{
+	msgb_free(msg);
+	return -1;
+}
+
+#endif
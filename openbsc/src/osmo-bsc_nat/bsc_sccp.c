@@ -22,11 +22,16 @@
 #include <openbsc/debug.h>
 #include <openbsc/bsc_nat.h>
 #include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/ipaccess.h>
 
 #include <osmocom/sccp/sccp.h>
 
 #include <osmocom/core/talloc.h>
+#include <osmocom/gsm/protocol/gsm_04_08.h>
+#include <osmocom/gsm/protocol/gsm_04_11.h>
+#include <osmocom/gsm/protocol/gsm_08_08.h>
 
+#include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
 
@@ -36,23 +41,114 @@ static int equal(struct sccp_source_reference *ref1, struct sccp_source_referenc
 }
 
 /*
- * SCCP patching below
+ * The connections are hashed by the patched, the real and the remote
+ * reference. The real and remote references are only unique per BSC,
+ * the hash ignores the BSC and the lookups compare it.
  */
+static unsigned int ref_hash(struct sccp_source_reference *ref)
+{
+	uint32_t val = ref->octet1 | (ref->octet2 << 8) | (ref->octet3 << 16);
 
-/* check if we are using this ref for patched already */
-static int sccp_ref_is_free(struct sccp_source_reference *ref, struct bsc_nat *nat)
+	return (val * 2654435761u) >> (32 - NAT_SCCP_HASH_BITS);
+}
+
+void sccp_connection_add(struct nat_sccp_connection *conn)
+{
+	struct bsc_nat *nat = conn->bsc->nat;
+
+	llist_add_tail(&conn->list_entry, &nat->sccp_connections);
+	llist_add_tail(&conn->bsc_entry, &conn->bsc->sccp_connections);
+	llist_add_tail(&conn->patched_entry,
+		       &nat->sccp_by_patched[ref_hash(&conn->patched_ref)]);
+	llist_add_tail(&conn->real_entry,
+		       &nat->sccp_by_real[ref_hash(&conn->real_ref)]);
+	llist_add_tail(&conn->remote_entry,
+		       &nat->sccp_by_remote[ref_hash(&conn->remote_ref)]);
+}
+
+void sccp_connection_remove(struct nat_sccp_connection *conn)
+{
+	llist_del(&conn->list_entry);
+	llist_del(&conn->bsc_entry);
+	llist_del(&conn->patched_entry);
+	llist_del(&conn->real_entry);
+	llist_del(&conn->remote_entry);
+}
+
+void sccp_connection_set_remote(struct nat_sccp_connection *conn,
+				struct sccp_source_reference *ref)
+{
+	conn->remote_ref = *ref;
+	llist_del(&conn->remote_entry);
+	llist_add_tail(&conn->remote_entry,
+		       &conn->bsc->nat->sccp_by_remote[ref_hash(ref)]);
+}
+
+static void set_patched(struct nat_sccp_connection *conn,
+			struct sccp_source_reference *ref)
+{
+	conn->patched_ref = *ref;
+	llist_del(&conn->patched_entry);
+	llist_add_tail(&conn->patched_entry,
+		       &conn->bsc->nat->sccp_by_patched[ref_hash(ref)]);
+}
+
+static struct nat_sccp_connection *find_by_patched(struct bsc_nat *nat,
+					struct sccp_source_reference *ref)
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (memcmp(ref, &conn->patched_ref, sizeof(*ref)) == 0)
-			return -1;
+	llist_for_each_entry(conn, &nat->sccp_by_patched[ref_hash(ref)], patched_entry)
+		if (equal(ref, &conn->patched_ref))
+			return conn;
+	return NULL;
+}
+
+/* find by the real reference, any BSC if bsc is NULL */
+static struct nat_sccp_connection *find_by_real(struct bsc_nat *nat,
+					struct bsc_connection *bsc,
+					struct sccp_source_reference *ref)
+{
+	struct nat_sccp_connection *conn;
+
+	llist_for_each_entry(conn, &nat->sccp_by_real[ref_hash(ref)], real_entry) {
+		if (bsc && conn->bsc != bsc)
+			continue;
+		if (equal(ref, &conn->real_ref))
+			return conn;
 	}
+	return NULL;
+}
 
-	return 0;
+static struct nat_sccp_connection *find_by_remote(struct bsc_connection *bsc,
+					struct sccp_source_reference *ref)
+{
+	struct nat_sccp_connection *conn;
+
+	llist_for_each_entry(conn, &bsc->nat->sccp_by_remote[ref_hash(ref)], remote_entry) {
+		if (conn->bsc != bsc)
+			continue;
+		if (equal(ref, &conn->remote_ref))
+			return conn;
+	}
+	return NULL;
+}
+
+/*
+ * SCCP patching below
+ */
+
+/* check if we are using this ref for patched already */
+static int sccp_ref_is_free(struct sccp_source_reference *ref, struct bsc_nat *nat)
+{
+	return find_by_patched(nat, ref) ? -1 : 0;
 }
 
-/* copied from sccp.c */
+/*
+ * copied from sccp.c, the references are handed out in sequence and
+ * the hash lookup makes checking a candidate cheap. With far fewer
+ * live connections than the 2^24 references this rarely probes twice.
+ */
 static int assign_src_local_reference(struct sccp_source_reference *ref, struct bsc_nat *nat)
 {
 	static uint32_t last_ref = 0x50000;
@@ -86,24 +182,23 @@ struct nat_sccp_connection *create_sccp_src_ref(struct bsc_connection *bsc,
 					     struct bsc_nat_parsed *parsed)
 {
 	struct nat_sccp_connection *conn;
+	struct sccp_source_reference ref;
 
 	/* Some commercial BSCs like to reassign there SRC ref */
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (conn->bsc != bsc)
-			continue;
-		if (memcmp(&conn->real_ref, parsed->src_local_ref, sizeof(conn->real_ref)) != 0)
-			continue;
-
+	conn = find_by_real(bsc->nat, bsc, parsed->src_local_ref);
+	if (conn) {
 		/* the BSC has reassigned the SRC ref and we failed to keep track */
-		memset(&conn->remote_ref, 0, sizeof(conn->remote_ref));
-		if (assign_src_local_reference(&conn->patched_ref, bsc->nat) != 0) {
+		memset(&ref, 0, sizeof(ref));
+		sccp_connection_set_remote(conn, &ref);
+		if (assign_src_local_reference(&ref, bsc->nat) != 0) {
 			LOGP(DNAT, LOGL_ERROR, "BSC %d reused src ref: %d and we failed to generate a new id.\n",
 			     bsc->cfg->nr, sccp_src_ref_to_int(parsed->src_local_ref));
 			bsc_mgcp_dlcx(conn);
-			llist_del(&conn->list_entry);
+			sccp_connection_remove(conn);
 			talloc_free(conn);
 			return NULL;
 		} else {
+			set_patched(conn, &ref);
 			clock_gettime(CLOCK_MONOTONIC, &conn->creation_time);
 			bsc_mgcp_dlcx(conn);
 			return conn;
@@ -127,7 +222,7 @@ struct nat_sccp_connection *create_sccp_src_ref(struct bsc_connection *bsc,
 	}
 
 	bsc_mgcp_init(conn);
-	llist_add_tail(&conn->list_entry, &bsc->nat->sccp_connections);
+	sccp_connection_add(conn);
 	rate_ctr_inc(&bsc->cfg->stats.ctrg->ctr[BCFG_CTR_SCCP_CONN]);
 	osmo_counter_inc(bsc->cfg->nat->stats.sccp.conn);
 
@@ -145,7 +240,7 @@ int update_sccp_src_ref(struct nat_sccp_connection *sccp, struct bsc_nat_parsed
 		return -1;
 	}
 
-	sccp->remote_ref = *parsed->src_local_ref;
+	sccp_connection_set_remote(sccp, parsed->src_local_ref);
 	sccp->has_remote_ref = 1;
 	LOGP(DNAT, LOGL_DEBUG, "Updating 0x%x to remote 0x%x on %p\n",
 	     sccp_src_ref_to_int(&sccp->patched_ref),
@@ -158,13 +253,10 @@ void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bs
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (memcmp(parsed->src_local_ref,
-			   &conn->patched_ref, sizeof(conn->patched_ref)) == 0) {
-
-			sccp_connection_destroy(conn);
-			return;
-		}
+	conn = find_by_patched(bsc->nat, parsed->src_local_ref);
+	if (conn) {
+		sccp_connection_destroy(conn);
+		return;
 	}
 
 	LOGP(DNAT, LOGL_ERROR, "Can not remove connection: 0x%x\n",
@@ -187,17 +279,13 @@ struct nat_sccp_connection *patch_sccp_src_ref_to_bsc(struct msgb *msg,
 		return NULL;
 	}
 
+	conn = find_by_patched(nat, parsed->dest_local_ref);
+	if (!conn)
+		return NULL;
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (!equal(parsed->dest_local_ref, &conn->patched_ref))
-			continue;
-
-		/* Change the dest address to the real one */
-		*parsed->dest_local_ref = conn->real_ref;
-		return conn;
-	}
-
-	return NULL;
+	/* Change the dest address to the real one */
+	*parsed->dest_local_ref = conn->real_ref;
+	return conn;
 }
 
 /*
@@ -214,36 +302,94 @@ struct nat_sccp_connection *patch_sccp_src_ref_to_msc(struct msgb *msg,
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (conn->bsc != bsc)
-			continue;
-
-		if (parsed->src_local_ref) {
-			if (equal(parsed->src_local_ref, &conn->real_ref)) {
-				*parsed->src_local_ref = conn->patched_ref;
-				return conn;
-			}
-		} else if (parsed->dest_local_ref) {
-			if (equal(parsed->dest_local_ref, &conn->remote_ref))
-				return conn;
-		} else {
-			LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
-			return NULL;
-		}
+	if (parsed->src_local_ref) {
+		conn = find_by_real(bsc->nat, bsc, parsed->src_local_ref);
+		if (conn)
+			*parsed->src_local_ref = conn->patched_ref;
+		return conn;
+	} else if (parsed->dest_local_ref) {
+		return find_by_remote(bsc, parsed->dest_local_ref);
 	}
 
+	LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
 	return NULL;
 }
 
 struct nat_sccp_connection *bsc_nat_find_con_by_bsc(struct bsc_nat *nat,
 						 struct sccp_source_reference *ref)
 {
-	struct nat_sccp_connection *conn;
+	return find_by_real(nat, NULL, ref);
+}
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (memcmp(ref, &conn->real_ref, sizeof(*ref)) == 0)
-			return conn;
-	}
+/* is this DTAP looked at by the filters, USSD or the number rewriting */
+static int dtap_needs_parse(struct nat_sccp_connection *con,
+			    const uint8_t *data, unsigned int len)
+{
+	uint8_t proto, msg_type;
+
+	/* the identity response is checked until the IMSI is known */
+	if (!con->imsi_checked)
+		return 1;
+
+	/* the USSD side channel */
+	if (con->con_type == NAT_CON_TYPE_SSA)
+		return 1;
+
+	/* call setup and SMS can be rewritten */
+	if (!con->imsi || strlen(con->imsi) < 5)
+		return 0;
+	if (len < 5)
+		return 1;
+
+	proto = data[3] & 0x0f;
+	msg_type = data[4] & 0xbf;
+	return (proto == GSM48_PDISC_CC && msg_type == GSM48_MT_CC_SETUP)
+		|| (proto == GSM48_PDISC_SMS && msg_type == GSM411_MT_CP_DATA);
+}
 
-	return NULL;
+/**
+ * Check if a DT1 of the BSC can go to the MSC as it is. The destination
+ * reference is the one of the MSC and does not need to be patched, so
+ * there is no need to parse the frame when nothing else will look at
+ * it. Returns the connection or NULL if the frame needs to be parsed.
+ */
+struct nat_sccp_connection *bsc_nat_dt1_fast_path(struct bsc_connection *bsc,
+						  struct msgb *msg)
+{
+	struct ipaccess_head *hh;
+	struct sccp_data_form1 *dt1;
+	struct nat_sccp_connection *con;
+	unsigned int len, data_len;
+	uint8_t *data;
+
+	if (!bsc->authenticated)
+		return NULL;
+
+	if (msg->len < sizeof(*hh) + sizeof(*dt1) + 1)
+		return NULL;
+
+	hh = (struct ipaccess_head *) msg->data;
+	len = msg->len - sizeof(*hh);
+	if (hh->proto != IPAC_PROTO_SCCP || ntohs(hh->len) != len)
+		return NULL;
+
+	/* a single variable part with all the data */
+	dt1 = (struct sccp_data_form1 *) &hh->data[0];
+	if (dt1->type != SCCP_MSG_TYPE_DT1 || dt1->variable_start != 1)
+		return NULL;
+	data_len = dt1->data[0];
+	if (data_len < 3 || sizeof(*dt1) + 1 + data_len != len)
+		return NULL;
+	data = &dt1->data[1];
+
+	con = find_by_remote(bsc, &dt1->destination_local_reference);
+	if (!con || con->con_local || !con->msc_con)
+		return NULL;
+
+	if (data[0] == BSSAP_MSG_DTAP && dtap_needs_parse(con, data, data_len))
+		return NULL;
+
+	msg->l2h = &hh->data[0];
+	msg->l3h = data;
+	return con;
 }
@@ -110,7 +110,7 @@ static int forward_sccp(struct bsc_nat *nat, struct msgb *msg)
 	}
 
 	talloc_free(parsed);
-	bsc_write_msg(&con->bsc->write_queue, msg);
+	bsc_send_msg(con->bsc, msg);
 	return 0;
 }
 
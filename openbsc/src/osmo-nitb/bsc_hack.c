@@ -102,6 +102,7 @@ static void print_help()
 	printf("  -e --log-level number. Set a global loglevel.\n");
 	printf("  -m --mncc-sock Disable built-in MNCC handler and offer socket\n");
 	printf("  -C --no-dbcounter Disable regular syncing of counters to database\n");
+	printf("  -W --no-wal Use a rollback journal instead of the write-ahead log\n");
 	printf("  -r --rf-ctl NAME. A unix domain socket to listen for cmds.\n");
 }
 
@@ -124,11 +125,12 @@ static void handle_options(int argc, char **argv)
 			{"log-level", 1, 0, 'e'},
 			{"mncc-sock", 0, 0, 'm'},
 			{"no-dbcounter", 0, 0, 'C'},
+			{"no-wal", 0, 0, 'W'},
 			{"rf-ctl", 1, 0, 'r'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "hd:Dsl:ar:p:TPVc:e:mCr:",
+		c = getopt_long(argc, argv, "hd:Dsl:ar:p:TPVc:e:mCWr:",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -171,6 +173,9 @@ static void handle_options(int argc, char **argv)
 		case 'C':
 			use_db_counter = 0;
 			break;
+		case 'W':
+			db_set_wal(0);
+			break;
 		case 'V':
 			print_version(1);
 			exit(0);
@@ -194,6 +199,7 @@ static void signal_handler(int signal)
 	case SIGINT:
 		bsc_shutdown_net(bsc_gsmnet);
 		osmo_signal_dispatch(SS_L_GLOBAL, S_L_GLOBAL_SHUTDOWN, NULL);
+		db_flush_worker();
 		sleep(3);
 		exit(0);
 		break;
@@ -213,22 +219,17 @@ static void signal_handler(int signal)
 }
 
 /* timer handling */
-static int _db_store_counter(struct osmo_counter *counter, void *data)
-{
-	return db_store_counter(counter);
-}
-
 static void db_sync_timer_cb(void *data)
 {
 	/* store counters to database and re-schedule */
-	osmo_counters_for_each(_db_store_counter, NULL);
+	db_store_counters();
 	osmo_timer_schedule(&db_sync_timer, DB_SYNC_INTERVAL);
 }
 
+/* subscr_expire() schedules the next run */
 static void subscr_expire_cb(void *data)
 {
 	subscr_expire(bsc_gsmnet);
-	osmo_timer_schedule(&bsc_gsmnet->subscr_expire_timer, EXPIRE_INTERVAL);
 }
 
 void talloc_ctx_init(void);
@@ -313,6 +314,9 @@ int main(int argc, char **argv)
 	}
 	printf("DB: Database prepared.\n");
 
+	if (db_start_worker() != 0)
+		printf("DB: Running the queries in the main loop.\n");
+
 	/* setup the timer */
 	db_sync_timer.cb = db_sync_timer_cb;
 	db_sync_timer.data = NULL;
@@ -0,0 +1,142 @@
+/*
+ * Prefix tree benchmark, not part of the testsuite
+ *
+ * (C) 2013 by On-Waves
+ * (C) 2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/nat_rewrite_trie.h>
+#include <openbsc/debug.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PREFIXES		1000000
+#define BENCH_LOOKUPS		1000000
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t next_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 1;
+}
+
+/* ported numbers below a few area codes, like the large table test */
+static void make_number(char *number, uint32_t *seed)
+{
+	unsigned int area = next_rand(seed) % 200;
+	unsigned int subscr = next_rand(seed) % 1000000;
+
+	snprintf(number, 12, "49%03u%06u", area, subscr);
+}
+
+static void write_table(const char *filename)
+{
+	uint32_t seed = 1;
+	char number[16];
+	FILE *file;
+	int i;
+
+	file = fopen(filename, "w");
+	OSMO_ASSERT(file);
+	for (i = 0; i < 200; ++i)
+		fprintf(file, "49%03d,%d\n", i, i);
+	for (i = 0; i < BENCH_PREFIXES; ++i) {
+		make_number(number, &seed);
+		fprintf(file, "%s,%s\n", number, &number[7]);
+	}
+	fclose(file);
+}
+
+int main(int argc, char **argv)
+{
+	struct nat_rewrite *trie, *mapped;
+	uint64_t start, t_parse, t_map, t_lookup, t_mapped;
+	char (*numbers)[16];
+	uint32_t seed = 1;
+	int i, found = 0;
+
+	osmo_init_logging(&log_info);
+
+	write_table("bench_prefixes.csv");
+
+	start = time_ns();
+	trie = nat_rewrite_parse(NULL, "bench_prefixes.csv");
+	t_parse = time_ns() - start;
+	OSMO_ASSERT(trie);
+
+	OSMO_ASSERT(nat_rewrite_save(trie, "bench_prefixes.bin") == 0);
+	start = time_ns();
+	mapped = nat_rewrite_parse(NULL, "bench_prefixes.bin");
+	t_map = time_ns() - start;
+	OSMO_ASSERT(mapped);
+
+	/* the table numbers with a suffix, every second one is unknown */
+	numbers = malloc(BENCH_LOOKUPS * sizeof(*numbers));
+	OSMO_ASSERT(numbers);
+	for (i = 0; i < BENCH_LOOKUPS; ++i) {
+		make_number(numbers[i], &seed);
+		if (i & 1)
+			numbers[i][6] = '0' + (numbers[i][6] - '0' + 5) % 10;
+		strcat(numbers[i], "123");
+	}
+
+	start = time_ns();
+	for (i = 0; i < BENCH_LOOKUPS; ++i)
+		found += nat_rewrite_lookup(trie, numbers[i]) != NULL;
+	t_lookup = time_ns() - start;
+
+	start = time_ns();
+	for (i = 0; i < BENCH_LOOKUPS; ++i)
+		found -= nat_rewrite_lookup(mapped, numbers[i]) != NULL;
+	t_mapped = time_ns() - start;
+	free(numbers);
+
+	printf("Loaded %zu prefixes, %u nodes and %u rules in %zu bytes\n",
+	       trie->prefixes, trie->num_nodes, trie->num_rules,
+	       trie->num_nodes * sizeof(*trie->nodes)
+		+ trie->num_rules * sizeof(*trie->rules));
+	printf("Parsed in %llu ms, mapped in %llu us\n",
+	       (unsigned long long) t_parse / 1000000,
+	       (unsigned long long) t_map / 1000);
+	printf("Lookup: %llu ns parsed, %llu ns mapped\n",
+	       (unsigned long long) t_lookup / BENCH_LOOKUPS,
+	       (unsigned long long) t_mapped / BENCH_LOOKUPS);
+	if (found != 0)
+		printf("The parsed and the mapped tree differ\n");
+
+	talloc_free(mapped);
+	talloc_free(trie);
+	unlink("bench_prefixes.csv");
+	unlink("bench_prefixes.bin");
+	return 0;
+}
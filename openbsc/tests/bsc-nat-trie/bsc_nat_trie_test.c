@@ -26,24 +26,13 @@
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/utils.h>
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-int main(int argc, char **argv)
+static void verify_trie(struct nat_rewrite *trie)
 {
-	struct nat_rewrite *trie;
-
-	osmo_init_logging(&log_info);
-
-	printf("Testing the trie\n");
-
-	trie = nat_rewrite_parse(NULL, "prefixes.csv");
-	OSMO_ASSERT(trie);
-
-	/* verify that it has been parsed */
-	OSMO_ASSERT(trie->prefixes == 17);
-	printf("Dumping the internal trie\n");
-	nat_rewrite_dump(trie);
-
 	/* now do the matching... */
 	OSMO_ASSERT(!nat_rewrite_lookup(trie, ""));
 	OSMO_ASSERT(!nat_rewrite_lookup(trie, "2"));
@@ -76,12 +65,139 @@ int main(int argc, char **argv)
 
 	/* invalid input */
 	OSMO_ASSERT(!nat_rewrite_lookup(trie, "12abc"));
+}
+
+#define LARGE_PREFIXES		10000
+#define LARGE_LOOKUPS		10000
+
+static uint32_t next_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 1;
+}
+
+/* ported numbers below a few area codes */
+static void make_number(char *number, uint32_t *seed)
+{
+	unsigned int area = next_rand(seed) % 200;
+	unsigned int subscr = next_rand(seed) % 1000000;
+
+	snprintf(number, 12, "49%03u%06u", area, subscr);
+}
+
+static void write_large_table(const char *filename)
+{
+	uint32_t seed = 1;
+	char number[16];
+	FILE *file;
+	int i;
+
+	file = fopen(filename, "w");
+	OSMO_ASSERT(file);
+	for (i = 0; i < 200; ++i)
+		fprintf(file, "49%03d,%d\n", i, i);
+	for (i = 0; i < LARGE_PREFIXES; ++i) {
+		make_number(number, &seed);
+		fprintf(file, "%s,%s\n", number, &number[7]);
+	}
+	fclose(file);
+}
+
+static void test_large_table(void)
+{
+	struct nat_rewrite *trie, *mapped;
+	const struct nat_rewrite_rule *rule, *mapped_rule;
+	int i, exact = 0, area = 0, missing = 0, mismatch = 0;
+	uint32_t seed;
+	char (*numbers)[16];
+
+	printf("Testing a large prefix table\n");
+	write_large_table("large_prefixes.csv");
+
+	trie = nat_rewrite_parse(NULL, "large_prefixes.csv");
+	OSMO_ASSERT(trie);
+	printf("Loaded %zu prefixes\n", trie->prefixes);
+
+	OSMO_ASSERT(nat_rewrite_save(trie, "large_prefixes.bin") == 0);
+	mapped = nat_rewrite_parse(NULL, "large_prefixes.bin");
+	OSMO_ASSERT(mapped);
+	OSMO_ASSERT(mapped->prefixes == trie->prefixes);
+
+	/* the table numbers with a suffix, every second one is unknown */
+	numbers = malloc(LARGE_LOOKUPS * sizeof(*numbers));
+	OSMO_ASSERT(numbers);
+	seed = 1;
+	for (i = 0; i < LARGE_LOOKUPS; ++i) {
+		make_number(numbers[i], &seed);
+		if (i & 1)
+			numbers[i][6] = '0' + (numbers[i][6] - '0' + 5) % 10;
+		strcat(numbers[i], "123");
+	}
+
+	for (i = 0; i < LARGE_LOOKUPS; ++i) {
+		rule = nat_rewrite_lookup(trie, numbers[i]);
+		if (!rule)
+			missing += 1;
+		else if (rule->prefix[7] != '\0')
+			exact += 1;
+		else
+			area += 1;
+	}
+
+	for (i = 0; i < LARGE_LOOKUPS; ++i) {
+		rule = nat_rewrite_lookup(trie, numbers[i]);
+		mapped_rule = nat_rewrite_lookup(mapped, numbers[i]);
+		if (!rule != !mapped_rule
+		    || (rule && strcmp(rule->prefix, mapped_rule->prefix) != 0)
+		    || (rule && strcmp(rule->rewrite, mapped_rule->rewrite) != 0))
+			mismatch += 1;
+	}
+	free(numbers);
+
+	printf("Found %d exact, %d by area, %d missing, mismatches %d\n",
+	       exact, area, missing, mismatch);
+
+	talloc_free(mapped);
+	talloc_free(trie);
+	unlink("large_prefixes.csv");
+	unlink("large_prefixes.bin");
+}
+
+int main(int argc, char **argv)
+{
+	struct nat_rewrite *trie, *mapped;
+
+	osmo_init_logging(&log_info);
+
+	printf("Testing the trie\n");
+
+	trie = nat_rewrite_parse(NULL, "prefixes.csv");
+	OSMO_ASSERT(trie);
+
+	/* verify that it has been parsed */
+	OSMO_ASSERT(trie->prefixes == 17);
+	printf("Dumping the internal trie\n");
+	nat_rewrite_dump(trie);
+	verify_trie(trie);
+
+	/* the compiled form gives the same answers */
+	OSMO_ASSERT(nat_rewrite_save(trie, "prefixes.bin") == 0);
+	mapped = nat_rewrite_parse(NULL, "prefixes.bin");
+	OSMO_ASSERT(mapped);
+	OSMO_ASSERT(mapped->prefixes == 17);
+	printf("Dumping the mapped trie\n");
+	nat_rewrite_dump(mapped);
+	verify_trie(mapped);
+	talloc_free(mapped);
+	unlink("prefixes.bin");
 
 	talloc_free(trie);
 
 	trie = nat_rewrite_parse(NULL, "does_not_exist.csv");
 	OSMO_ASSERT(!trie);
 
+	test_large_table();
+
 	printf("Done with the tests.\n");
 	return 0;
 }
@@ -0,0 +1,151 @@
+/*
+ * BSC NAT benchmarks, not part of the testsuite
+ *
+ * (C) 2010-2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010-2013 by On-Waves
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/bsc_nat.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/talloc.h>
+
+#include <osmocom/sccp/sccp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ACC_BENCH_ENTRIES	500
+#define ACC_BENCH_LOOKUPS	200000
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void make_imsi(char *imsi, unsigned int *seed)
+{
+	int i;
+
+	strcpy(imsi, "2620");
+	for (i = 4; i < 15; ++i) {
+		*seed = *seed * 1103515245 + 12345;
+		imsi[i] = '0' + (*seed >> 16) % 10;
+	}
+	imsi[15] = '\0';
+}
+
+/*
+ * The list of the access list test: allow ranges for every entry, a
+ * deny interval for every 7th and one group that is left to regexec.
+ * Time the compilation, the lookups through the automaton and the
+ * regexec of every entry as it was done before.
+ */
+static void bench_acc_lst(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_nat_acc_lst *lst;
+	struct bsc_nat_acc_lst_entry *entry;
+	char imsi[16], re[32];
+	const char *argv[1] = { re };
+	unsigned int seed = 1;
+	uint64_t start, compile, dfa, regex;
+	int i, res, matched = 0;
+
+	nat = bsc_nat_alloc();
+	lst = bsc_nat_acc_lst_get(nat, "bench");
+	for (i = 0; i < ACC_BENCH_ENTRIES; ++i) {
+		entry = bsc_nat_acc_lst_entry_create(lst);
+		snprintf(re, sizeof(re), "^2620%d%02d[0-9]*$", 1 + i % 3, i % 100);
+		if (gsm_parse_reg(entry, &entry->imsi_allow_re, &entry->imsi_allow, 1, argv) != 0)
+			abort();
+		if (i % 7 != 0)
+			continue;
+		snprintf(re, sizeof(re), "^2620[1-3]%02d\\{2\\}", i % 100);
+		if (gsm_parse_reg(entry, &entry->imsi_deny_re, &entry->imsi_deny, 1, argv) != 0)
+			abort();
+	}
+	entry = bsc_nat_acc_lst_entry_create(lst);
+	snprintf(re, sizeof(re), "\\(99\\)");
+	if (gsm_parse_reg(entry, &entry->imsi_deny_re, &entry->imsi_deny, 1, argv) != 0)
+		abort();
+
+	start = now_ns();
+	bsc_nat_acc_lst_compile(lst);
+	compile = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < ACC_BENCH_LOOKUPS; ++i) {
+		make_imsi(imsi, &seed);
+		matched += bsc_nat_acc_lst_match(lst, imsi) != 0;
+	}
+	dfa = now_ns() - start;
+
+	seed = 1;
+	start = now_ns();
+	for (i = 0; i < ACC_BENCH_LOOKUPS; ++i) {
+		res = 0;
+		make_imsi(imsi, &seed);
+		llist_for_each_entry(entry, &lst->fltr_list, list) {
+			if (entry->imsi_allow
+			    && regexec(&entry->imsi_allow_re, imsi, 0, NULL, 0) == 0)
+				res |= NAT_ACC_ALLOW;
+			if (entry->imsi_deny
+			    && regexec(&entry->imsi_deny_re, imsi, 0, NULL, 0) == 0)
+				res |= NAT_ACC_DENY;
+		}
+		matched -= res != 0;
+	}
+	regex = now_ns() - start;
+
+	printf("Access list with %d entries, %d states, %d expressions "
+	       "and %d using regexec\n", ACC_BENCH_ENTRIES, lst->perf.states,
+	       lst->perf.compiled, lst->perf.fallback);
+	printf("Compiled in %llu us\n", (unsigned long long) compile / 1000);
+	printf("Automaton: %llu ns per lookup\n",
+	       (unsigned long long) dfa / ACC_BENCH_LOOKUPS);
+	printf("regexec per entry: %llu ns per lookup\n",
+	       (unsigned long long) regex / ACC_BENCH_LOOKUPS);
+	if (matched != 0)
+		printf("The automaton and regexec matched %d IMSIs apart\n", matched);
+
+	talloc_free(nat);
+}
+
+int main(int argc, char **argv)
+{
+	sccp_set_log_area(DSCCP);
+	osmo_init_logging(&log_info);
+
+	bench_acc_lst();
+	return 0;
+}
+
+/* stub */
+void bsc_nat_send_mgcp_to_msc(struct bsc_nat *nat, struct msgb *msg)
+{
+	abort();
+}
@@ -24,18 +24,27 @@
 
 #include <openbsc/debug.h>
 #include <openbsc/gsm_data.h>
+#include <openbsc/bsc_msc.h>
 #include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_callstats.h>
 #include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/bsc_nat_worker.h>
+#include <openbsc/ipaccess.h>
 #include <openbsc/nat_rewrite_trie.h>
 
 #include <osmocom/core/application.h>
 #include <osmocom/core/backtrace.h>
+#include <osmocom/core/select.h>
 #include <osmocom/core/talloc.h>
 
 #include <osmocom/sccp/sccp.h>
 #include <osmocom/gsm/protocol/gsm_08_08.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
 
 /* test messages for ipa */
 static uint8_t ipa_id[] = {
@@ -428,6 +437,9 @@ static void test_paging(void)
 	struct bsc_nat *nat;
 	struct bsc_connection *con;
 	struct bsc_config *cfg;
+	struct bsc_nat_paging_lac *entry;
+	struct bsc_nat_paging_group *pgroup;
+	struct msgb *msg, *out;
 
 	printf("Testing paging by lac.\n");
 
@@ -453,6 +465,40 @@ static void test_paging(void)
 		abort();
 	}
 
+	/* Test the index */
+	if (bsc_nat_paging_lac_find(nat, 23) != NULL) {
+		printf("Should not be indexed.\n");
+		abort();
+	}
+	entry = bsc_nat_paging_lac_find(nat, 8213);
+	if (!entry || entry->num_bscs != 1 || entry->bscs[0] != con) {
+		printf("Should have indexed it.\n");
+		abort();
+	}
+
+	/* Forward the paging once, even with the LAC in a paging group */
+	pgroup = bsc_nat_paging_group_create(nat, 1);
+	bsc_nat_paging_group_add_lac(pgroup, 8213);
+	cfg->paging_group = 1;
+	bsc_nat_paging_index_invalidate(nat);
+
+	msg = msgb_alloc(4096, "test_paging");
+	copy_to_msg(msg, paging_by_lac_cmd, sizeof(paging_by_lac_cmd));
+	if (!bsc_nat_parse(msg)) {
+		printf("Failed to parse the paging.\n");
+		abort();
+	}
+
+	if (bsc_nat_forward_paging(nat, msg) != 1) {
+		printf("Should have paged the BSC once.\n");
+		abort();
+	}
+
+	out = (struct msgb *) con->write_queue.msg_queue.next;
+	verify_msg(out, paging_by_lac_cmd, sizeof(paging_by_lac_cmd));
+
+	osmo_wqueue_clear(&con->write_queue);
+	msgb_free(msg);
 	talloc_free(nat);
 }
 
@@ -590,6 +636,7 @@ static void test_mgcp_find(void)
 	printf("Testing finding of a BSC Connection\n");
 
 	nat = bsc_nat_alloc();
+	nat->bsc_endpoints = talloc_zero_array(nat, struct bsc_endpoint, 33);
 	con = bsc_connection_alloc(nat);
 	llist_add(&con->list_entry, &nat->bsc_connections);
 
@@ -598,6 +645,7 @@ static void test_mgcp_find(void)
 	sccp_con->bsc_endp = 12;
 	sccp_con->bsc = con;
 	llist_add(&sccp_con->list_entry, &nat->sccp_connections);
+	nat->bsc_endpoints[12].sccp = sccp_con;
 
 	if (bsc_mgcp_find_con(nat, 11) != NULL) {
 		printf("Found the wrong connection.\n");
@@ -615,8 +663,8 @@ static void test_mgcp_find(void)
 
 static void test_mgcp_rewrite(void)
 {
-	int i;
-	struct msgb *output;
+	int i, len;
+	char output[4096];
 	printf("Testing rewriting MGCP messages.\n");
 
 	for (i = 0; i < ARRAY_SIZE(mgcp_messages); ++i) {
@@ -629,8 +677,9 @@ static void test_mgcp_rewrite(void)
 
 		char *input = strdup(orig);
 
-		output = bsc_mgcp_rewrite(input, strlen(input), 0x1e,
-					  ip, port, &payload_type);
+		len = bsc_mgcp_rewrite(input, strlen(input), 0x1e,
+				       ip, port, &payload_type,
+				       output, sizeof(output));
 
 		if (payload_type != -1) {
 			fprintf(stderr, "Found media payload type %d in SDP data\n",
@@ -642,18 +691,17 @@ static void test_mgcp_rewrite(void)
 			}
 		}
 
-		if (msgb_l2len(output) != strlen(patc)) {
-			printf("Wrong sizes for test: %d  %d != %d != %d\n", i, msgb_l2len(output), strlen(patc), strlen(orig));
-			printf("String '%s' vs '%s'\n", (const char *) output->l2h, patc);
+		if (len != strlen(patc)) {
+			printf("Wrong sizes for test: %d  %d != %d != %d\n", i, len, strlen(patc), strlen(orig));
+			printf("String '%s' vs '%s'\n", output, patc);
 			abort();
 		}
 
-		if (memcmp(output->l2h, patc, msgb_l2len(output)) != 0) {
-			printf("Broken on %d msg: '%s'\n", i, (const char *) output->l2h);
+		if (memcmp(output, patc, len) != 0) {
+			printf("Broken on %d msg: '%s'\n", i, output);
 			abort();
 		}
 
-		msgb_free(output);
 		free(input);
 	}
 }
@@ -839,6 +887,757 @@ static void test_cr_filter()
 	talloc_free(nat);
 }
 
+static void int_to_ref(struct sccp_source_reference *ref, uint32_t val)
+{
+	ref->octet1 = (val >>  0) & 0xff;
+	ref->octet2 = (val >>  8) & 0xff;
+	ref->octet3 = (val >> 16) & 0xff;
+}
+
+#define SCCP_STRESS_BSCS	8
+#define SCCP_STRESS_CONS	100000
+
+/*
+ * Keep 100k connections of several BSCs alive at once. The BSCs use
+ * the same real references, the MSC hands out unique ones.
+ */
+static void test_sccp_stress(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *bsc[SCCP_STRESS_BSCS];
+	struct nat_sccp_connection **cons;
+	struct sccp_source_reference src, dst;
+	struct bsc_nat_parsed parsed;
+	int i, created = 0, by_real = 0, by_patched = 0, by_remote = 0;
+
+	printf("Testing SCCP connection tracking with %d connections.\n",
+	       SCCP_STRESS_CONS);
+
+	nat = bsc_nat_alloc();
+	for (i = 0; i < SCCP_STRESS_BSCS; ++i) {
+		bsc[i] = bsc_connection_alloc(nat);
+		bsc[i]->cfg = bsc_config_alloc(nat, "stress");
+	}
+	cons = talloc_zero_array(nat, struct nat_sccp_connection *, SCCP_STRESS_CONS);
+
+	/* 1.) the BSCs send a CR each */
+	for (i = 0; i < SCCP_STRESS_CONS; ++i) {
+		memset(&parsed, 0, sizeof(parsed));
+		int_to_ref(&src, i / SCCP_STRESS_BSCS);
+		parsed.src_local_ref = &src;
+		cons[i] = create_sccp_src_ref(bsc[i % SCCP_STRESS_BSCS], &parsed);
+		if (cons[i])
+			created += 1;
+	}
+
+	for (i = 0; i < SCCP_STRESS_CONS; ++i) {
+		struct bsc_connection *con = bsc[i % SCCP_STRESS_BSCS];
+
+		/* 2.) the BSC sends more data with its source ref */
+		memset(&parsed, 0, sizeof(parsed));
+		int_to_ref(&src, i / SCCP_STRESS_BSCS);
+		parsed.src_local_ref = &src;
+		if (patch_sccp_src_ref_to_msc(NULL, &parsed, con) == cons[i]
+		    && memcmp(&src, &cons[i]->patched_ref, sizeof(src)) == 0)
+			by_real += 1;
+
+		/* 3.) the MSC confirms it */
+		memset(&parsed, 0, sizeof(parsed));
+		dst = cons[i]->patched_ref;
+		int_to_ref(&src, 0x100000 + i);
+		parsed.dest_local_ref = &dst;
+		parsed.src_local_ref = &src;
+		if (patch_sccp_src_ref_to_bsc(NULL, &parsed, nat) == cons[i]
+		    && update_sccp_src_ref(cons[i], &parsed) == 0)
+			by_patched += 1;
+
+		/* 4.) the BSC answers to the remote ref */
+		memset(&parsed, 0, sizeof(parsed));
+		int_to_ref(&dst, 0x100000 + i);
+		parsed.dest_local_ref = &dst;
+		if (patch_sccp_src_ref_to_msc(NULL, &parsed, con) == cons[i])
+			by_remote += 1;
+	}
+
+	/* 5.) release everything */
+	for (i = 0; i < SCCP_STRESS_CONS; ++i) {
+		memset(&parsed, 0, sizeof(parsed));
+		src = cons[i]->patched_ref;
+		parsed.src_local_ref = &src;
+		remove_sccp_src_ref(bsc[i % SCCP_STRESS_BSCS], NULL, &parsed);
+	}
+
+	printf("Created %d, found by real %d, patched %d, remote %d, left %d\n",
+	       created, by_real, by_patched, by_remote,
+	       !llist_empty(&nat->sccp_connections));
+
+	talloc_free(nat);
+}
+
+#define PAGING_STORM_BSCS	200
+#define PAGING_STORM_LACS	4
+#define PAGING_STORM_PAGES	100000
+
+/*
+ * Page a single LAC per command with every LAC being served by two
+ * BSCs and every 100th command going to all of them.
+ */
+static void test_paging_storm(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *con, *bsc[PAGING_STORM_BSCS];
+	struct bsc_nat_paging_group *pgroup;
+	struct msgb *msg;
+	int i, lac, forwarded = 0;
+	const int num_lacs = PAGING_STORM_BSCS * PAGING_STORM_LACS / 2;
+
+	printf("Testing a paging storm to %d BSCs.\n", PAGING_STORM_BSCS);
+
+	nat = bsc_nat_alloc();
+	pgroup = bsc_nat_paging_group_create(nat, 1);
+	bsc_nat_paging_group_add_lac(pgroup, 8213);
+
+	for (i = 0; i < PAGING_STORM_BSCS; ++i) {
+		bsc[i] = bsc_connection_alloc(nat);
+		bsc[i]->cfg = bsc_config_alloc(nat, "storm");
+		bsc[i]->cfg->paging_group = 1;
+		bsc[i]->authenticated = 1;
+		llist_add(&bsc[i]->list_entry, &nat->bsc_connections);
+
+		for (lac = 0; lac < PAGING_STORM_LACS; ++lac)
+			bsc_config_add_lac(bsc[i]->cfg,
+				1000 + (i * PAGING_STORM_LACS / 2 + lac) % num_lacs);
+	}
+	bsc_nat_paging_index_invalidate(nat);
+
+	msg = msgb_alloc(4096, "test_paging");
+	copy_to_msg(msg, paging_by_lac_cmd, sizeof(paging_by_lac_cmd));
+	bsc_nat_parse(msg);
+
+	for (i = 0; i < PAGING_STORM_PAGES; ++i) {
+		lac = i % 100 == 0 ? 8213 : 1000 + i % num_lacs;
+		msg->tail[-2] = lac >> 8;
+		msg->tail[-1] = lac & 0xff;
+		forwarded += bsc_nat_forward_paging(nat, msg);
+
+		/* the BSCs are not reading */
+		if (i % 20 == 0)
+			llist_for_each_entry(con, &nat->bsc_connections, list_entry)
+				osmo_wqueue_clear(&con->write_queue);
+	}
+
+	/* and a LAC nobody handles */
+	msg->tail[-2] = 0;
+	msg->tail[-1] = 23;
+	forwarded += bsc_nat_forward_paging(nat, msg);
+
+	printf("Paged %d, forwarded %d, unrouted %d, first BSC %d\n",
+	       (int) nat->stats.paging->ctr[NAT_PAGING_RECEIVED].current,
+	       forwarded,
+	       (int) nat->stats.paging->ctr[NAT_PAGING_UNROUTED].current,
+	       (int) bsc[0]->cfg->stats.ctrg->ctr[BCFG_CTR_PAGING].current);
+
+	llist_for_each_entry(con, &nat->bsc_connections, list_entry)
+		osmo_wqueue_clear(&con->write_queue);
+	msgb_free(msg);
+	talloc_free(nat);
+}
+
+#define ACC_BENCH_ENTRIES	500
+#define ACC_BENCH_LOOKUPS	20000
+
+static void make_imsi(char *imsi, unsigned int *seed)
+{
+	int i;
+
+	strcpy(imsi, "2620");
+	for (i = 4; i < 15; ++i) {
+		*seed = *seed * 1103515245 + 12345;
+		imsi[i] = '0' + (*seed >> 16) % 10;
+	}
+	imsi[15] = '\0';
+}
+
+/*
+ * Compare the compiled access list with calling regexec for every
+ * entry on an operator sized list.
+ */
+static void test_acc_lst_bench(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_nat_acc_lst *lst;
+	struct bsc_nat_acc_lst_entry *entry;
+	char imsi[16], re[32];
+	const char *argv[1] = { re };
+	unsigned int seed = 1;
+	int i, res, allowed = 0, denied = 0, mismatch = 0;
+
+	printf("Testing an access list with %d entries.\n", ACC_BENCH_ENTRIES);
+
+	nat = bsc_nat_alloc();
+	lst = bsc_nat_acc_lst_get(nat, "bench");
+	for (i = 0; i < ACC_BENCH_ENTRIES; ++i) {
+		entry = bsc_nat_acc_lst_entry_create(lst);
+		snprintf(re, sizeof(re), "^2620%d%02d[0-9]*$", 1 + i % 3, i % 100);
+		gsm_parse_reg(entry, &entry->imsi_allow_re, &entry->imsi_allow, 1, argv);
+		if (i % 7 != 0)
+			continue;
+		snprintf(re, sizeof(re), "^2620[1-3]%02d\\{2\\}", i % 100);
+		gsm_parse_reg(entry, &entry->imsi_deny_re, &entry->imsi_deny, 1, argv);
+	}
+	entry = bsc_nat_acc_lst_entry_create(lst);
+	snprintf(re, sizeof(re), "\\(99\\)");
+	gsm_parse_reg(entry, &entry->imsi_deny_re, &entry->imsi_deny, 1, argv);
+	bsc_nat_acc_lst_compile(lst);
+
+	printf("Compiled %d expressions, %d use regexec\n",
+	       lst->perf.compiled, lst->perf.fallback);
+
+	for (i = 0; i < ACC_BENCH_LOOKUPS; ++i) {
+		make_imsi(imsi, &seed);
+		res = bsc_nat_acc_lst_match(lst, imsi);
+		allowed += !!(res & NAT_ACC_ALLOW);
+		denied += !!(res & NAT_ACC_DENY);
+	}
+
+	seed = 1;
+	for (i = 0; i < ACC_BENCH_LOOKUPS; ++i) {
+		res = 0;
+		make_imsi(imsi, &seed);
+		llist_for_each_entry(entry, &lst->fltr_list, list) {
+			if (entry->imsi_allow
+			    && regexec(&entry->imsi_allow_re, imsi, 0, NULL, 0) == 0)
+				res |= NAT_ACC_ALLOW;
+			if (entry->imsi_deny
+			    && regexec(&entry->imsi_deny_re, imsi, 0, NULL, 0) == 0)
+				res |= NAT_ACC_DENY;
+		}
+		if (res != bsc_nat_acc_lst_match(lst, imsi))
+			mismatch += 1;
+	}
+
+	printf("Allowed %d, denied %d, mismatches %d\n", allowed, denied, mismatch);
+
+	talloc_free(nat);
+}
+
+#define REWR_BENCH_RULES	500
+#define REWR_BENCH_LOOKUPS	20000
+
+static void make_number(char *number, unsigned int *seed)
+{
+	int i;
+
+	number[0] = '0';
+	for (i = 1; i < 12; ++i) {
+		*seed = *seed * 1103515245 + 12345;
+		number[i] = '0' + (*seed >> 16) % 10;
+	}
+	number[12] = '\0';
+}
+
+static void test_number_rewrite_bench(void)
+{
+	static struct osmo_config_entry cfg[REWR_BENCH_RULES];
+	static char mcc[REWR_BENCH_RULES][8], option[REWR_BENCH_RULES][24];
+	static char text[REWR_BENCH_RULES][8];
+	static regex_t imsi_re[REWR_BENCH_RULES], num_re[REWR_BENCH_RULES];
+	struct osmo_config_list entries;
+	struct bsc_nat *nat;
+	char imsi[16], number[13], out[34], ref[34];
+	unsigned int seed = 1;
+	int i, j, rc, rewritten = 0, mismatch = 0;
+
+	printf("Testing number rewriting with %d rules.\n", REWR_BENCH_RULES);
+
+	nat = bsc_nat_alloc();
+	INIT_LLIST_HEAD(&entries.entry);
+	for (i = 0; i < REWR_BENCH_RULES; ++i) {
+		static const char *forms[] = {
+			"^0%03d([0-9]+)$", "^0%03d([0-9]{4,8})",
+			"^00%03d(.*)$", "^0%03d()",
+		};
+
+		snprintf(mcc[i], sizeof(mcc[i]), "^2620%d", 1 + i % 3);
+		/* some rules only regexec can handle */
+		if (i % 100 == 99)
+			snprintf(option[i], sizeof(option[i]),
+				 "^0[0-9]%02d(.*)$", i % 100);
+		else
+			snprintf(option[i], sizeof(option[i]), forms[i % 4], i);
+		snprintf(text[i], sizeof(text[i]), "49%d", i % 100);
+		cfg[i].mcc = mcc[i];
+		cfg[i].mnc = "";
+		cfg[i].option = option[i];
+		cfg[i].text = text[i];
+		llist_add_tail(&cfg[i].list, &entries.entry);
+		regcomp(&imsi_re[i], mcc[i], 0);
+		regcomp(&num_re[i], option[i], REG_EXTENDED);
+	}
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, &entries);
+
+	for (i = 0; i < REWR_BENCH_LOOKUPS; ++i) {
+		make_imsi(imsi, &seed);
+		make_number(number, &seed);
+		rc = bsc_nat_num_rewr_apply(nat->num_rewr, imsi, number, NULL,
+					    out, sizeof(out));
+		rewritten += rc > 0;
+	}
+
+	seed = 1;
+	for (i = 0; i < REWR_BENCH_LOOKUPS; ++i) {
+		ref[0] = '\0';
+		make_imsi(imsi, &seed);
+		make_number(number, &seed);
+		for (j = 0; j < REWR_BENCH_RULES; ++j) {
+			regmatch_t matches[2];
+
+			if (regexec(&imsi_re[j], imsi, 0, NULL, 0) != 0)
+				continue;
+			if (regexec(&num_re[j], number, 2, matches, 0) == 0
+			    && matches[1].rm_eo != -1) {
+				snprintf(ref, sizeof(ref), "%s%s", text[j],
+					 &number[matches[1].rm_so]);
+				break;
+			}
+		}
+
+		rc = bsc_nat_num_rewr_apply(nat->num_rewr, imsi, number, NULL,
+					    out, sizeof(out));
+		if (rc < 0 || (rc > 0) != (ref[0] != '\0')
+		    || (rc > 0 && strcmp(out, ref) != 0))
+			mismatch += 1;
+	}
+
+	printf("Rewrote %d, mismatches %d\n", rewritten, mismatch);
+
+	/* too small for the new number */
+	rc = bsc_nat_num_rewr_apply(nat->num_rewr, "262010000000000",
+				    "000012345", NULL, out, 4);
+	printf("Short buffer %d\n", rc);
+
+	/* a reload replaces all rules at once */
+	INIT_LLIST_HEAD(&entries.entry);
+	llist_add_tail(&cfg[1].list, &entries.entry);
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, &entries);
+	rc = bsc_nat_num_rewr_apply(nat->num_rewr, "262020000000000",
+				    "000112345", NULL, out, sizeof(out));
+	printf("Reloaded %d '%s'\n", rc, rc > 0 ? out : "");
+	rc = bsc_nat_num_rewr_apply(nat->num_rewr, "262010000000000",
+				    "000012345", NULL, out, sizeof(out));
+	printf("Reloaded old rule %d\n", rc);
+
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, NULL);
+	printf("Unloaded %d\n", nat->num_rewr == NULL);
+
+	for (i = 0; i < REWR_BENCH_RULES; ++i) {
+		regfree(&imsi_re[i]);
+		regfree(&num_re[i]);
+	}
+	talloc_free(nat);
+}
+
+#define MGCP_REWRITE_ROUNDS	3
+
+static void test_mgcp_rewrite_buffer(void)
+{
+	char input[ARRAY_SIZE(mgcp_messages)][2048];
+	char output[4096];
+	int i, len, payload_type, mismatch = 0;
+	const int total = MGCP_REWRITE_ROUNDS * ARRAY_SIZE(mgcp_messages);
+
+	printf("Testing MGCP rewriting into one buffer.\n");
+
+	/* the length is honored and the input is left alone */
+	for (i = 0; i < ARRAY_SIZE(mgcp_messages); ++i) {
+		len = strlen(mgcp_messages[i].orig);
+		memcpy(input[i], mgcp_messages[i].orig, len);
+		memset(&input[i][len], 'x', sizeof(input[i]) - len);
+	}
+
+	/* the buffer is reused, nothing of a longer message may remain */
+	memset(output, 'y', sizeof(output));
+	for (i = 0; i < total; ++i) {
+		const struct mgcp_patch_test *test;
+		int nr = i % ARRAY_SIZE(mgcp_messages);
+
+		test = &mgcp_messages[nr];
+		len = bsc_mgcp_rewrite(input[nr], strlen(test->orig), 0x1e,
+				       test->ip, test->port, &payload_type,
+				       output, sizeof(output));
+		if (len != strlen(test->patch)
+		    || strcmp(output, test->patch) != 0)
+			mismatch += 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(mgcp_messages); ++i)
+		if (memcmp(input[i], mgcp_messages[i].orig,
+			   strlen(mgcp_messages[i].orig)) != 0)
+			mismatch += 1;
+
+	printf("Rewrote %d, mismatches %d\n", total, mismatch);
+
+	/* the output is refused when it does not fit */
+	len = bsc_mgcp_rewrite(crcx_resp, strlen(crcx_resp), -1,
+			       "10.0.0.1", 999, &payload_type, output, 16);
+	printf("Small buffer: %d\n", len);
+
+	/* like before the text after the last newline is dropped */
+	len = bsc_mgcp_rewrite(crcx_resp, strlen(crcx_resp) - 3, -1,
+			       "10.0.0.1", 999, &payload_type,
+			       output, sizeof(output));
+	printf("Partial line: %d bytes\n", len);
+
+	/* a command without transaction id is dropped */
+	len = bsc_mgcp_rewrite("CRCX \r\nC: 1\r\n", 13, 0x1e,
+			       "10.0.0.1", 999, &payload_type,
+			       output, sizeof(output));
+	printf("No transaction: '%.*s'\n", len - 2, output);
+}
+
+#define MGCP_TEARDOWN_CALLS	200
+
+static int mgcp_assign_cic(struct nat_sccp_connection *con, struct msgb *msg,
+			   int multiplex, int timeslot)
+{
+	struct bsc_nat_parsed *parsed;
+	uint16_t cic = (multiplex << 5) | timeslot;
+	int rc;
+
+	copy_to_msg(msg, ass_cmd, sizeof(ass_cmd));
+	parsed = bsc_nat_parse(msg);
+	msg->l2h[16] = cic >> 8;
+	msg->l2h[17] = cic & 0xff;
+	rc = bsc_mgcp_assign_patch(con, msg);
+	talloc_free(parsed);
+	return rc;
+}
+
+static int count_endpoints(struct bsc_connection *bsc)
+{
+	struct bsc_endpoint *bsc_endp;
+	int count = 0;
+
+	llist_for_each_entry(bsc_endp, &bsc->mgcp_endpoints, bsc_entry)
+		count += 1;
+	return count;
+}
+
+static int count_queued(struct bsc_connection *bsc)
+{
+	struct msgb *msg;
+	int count = 0;
+
+	llist_for_each_entry(msg, &bsc->write_queue.msg_queue, list)
+		count += 1;
+	return count;
+}
+
+static void test_mgcp_teardown(void)
+{
+	struct nat_sccp_connection *cons[2 * MGCP_TEARDOWN_CALLS];
+	struct nat_sccp_connection *con, *tmp, *stale;
+	struct bsc_nat_call_stats *stat;
+	struct bsc_connection *bsc[2];
+	struct sccp_source_reference src;
+	struct bsc_nat_parsed parsed;
+	struct bsc_nat *nat;
+	struct msgb *msg, *out;
+	char dlcx_endps[32 * 16 + 1];
+	char buf[64];
+	int i, endp, assigned = 0, cleared = 0, kept = 0, hashed = 0;
+	int dlcx = 0, wrong = 0, missing = 0, trans = 0;
+	unsigned int released;
+
+	printf("Testing MGCP teardown with %d calls.\n", 2 * MGCP_TEARDOWN_CALLS);
+
+	nat = bsc_nat_alloc();
+	nat->mgcp_ipa = 1;
+	nat->mgcp_cfg = mgcp_config_alloc();
+	nat->mgcp_cfg->call_agent_addr = talloc_strdup(nat->mgcp_cfg, "127.0.0.1");
+	nat->mgcp_cfg->trunk.number_endpoints = 32 * 16;
+	mgcp_endpoints_allocate(&nat->mgcp_cfg->trunk);
+	OSMO_ASSERT(bsc_mgcp_nat_init(nat) == 0);
+	for (i = 0; i < 2; ++i) {
+		bsc[i] = bsc_connection_alloc(nat);
+		bsc[i]->cfg = bsc_config_alloc(nat, "teardown");
+		bsc[i]->cfg->max_endpoints = 256;
+		bsc[i]->write_queue.max_length = 4 * MGCP_TEARDOWN_CALLS;
+	}
+	msg = msgb_alloc(4096, "test");
+
+	/* the MSC assigns a timeslot to every call */
+	for (i = 0; i < 2 * MGCP_TEARDOWN_CALLS; ++i) {
+		memset(&parsed, 0, sizeof(parsed));
+		int_to_ref(&src, i);
+		parsed.src_local_ref = &src;
+		cons[i] = create_sccp_src_ref(bsc[i % 2], &parsed);
+
+		endp = mgcp_timeslot_to_endpoint(i / 30, 1 + i % 30);
+		if (mgcp_assign_cic(cons[i], msg, i / 30, 1 + i % 30) == 0
+		    && bsc_mgcp_find_con(nat, endp) == cons[i])
+			assigned += 1;
+	}
+
+	/* a new call gets the timeslot of the first one */
+	memset(&parsed, 0, sizeof(parsed));
+	int_to_ref(&src, 2 * MGCP_TEARDOWN_CALLS);
+	parsed.src_local_ref = &src;
+	stale = create_sccp_src_ref(bsc[0], &parsed);
+	mgcp_assign_cic(stale, msg, 0, 1);
+	printf("Assigned %d, reassigned %d\n", assigned,
+	       bsc_mgcp_find_con(nat, 1) == stale && cons[0]->msc_endp == -1);
+	msgb_free(msg);
+
+	/* the call agent modifies every call, the BSCs did not answer yet */
+	nat->mgcp_length = strlen(mdcx);
+	memcpy(nat->mgcp_msg, mdcx, nat->mgcp_length);
+	for (i = 0; i < 2; ++i) {
+		llist_for_each_entry(con, &bsc[i]->sccp_connections, bsc_entry) {
+			if (con->msc_endp == -1)
+				continue;
+			snprintf(buf, sizeof(buf), "%d", trans++);
+			nat->mgcp_cfg->policy_cb(&nat->mgcp_cfg->trunk,
+						 con->msc_endp, MGCP_ENDP_MDCX,
+						 buf);
+		}
+	}
+	printf("Pending MDCX %d/%d\n",
+	       count_endpoints(bsc[0]), count_endpoints(bsc[1]));
+
+	/* these are the endpoints the first BSC has to release */
+	memset(dlcx_endps, 0, sizeof(dlcx_endps));
+	llist_for_each_entry(con, &bsc[0]->sccp_connections, bsc_entry)
+		if (con->bsc_endp != -1)
+			dlcx_endps[con->bsc_endp] = 1;
+	osmo_wqueue_clear(&bsc[0]->write_queue);
+	osmo_wqueue_clear(&bsc[1]->write_queue);
+
+	/* the first BSC goes away */
+	llist_for_each_entry_safe(con, tmp, &bsc[0]->sccp_connections, bsc_entry)
+		sccp_connection_destroy(con);
+	printf("Pending DLCX %u\n", bsc[0]->pending_dlcx_count);
+	bsc_mgcp_clear_endpoints_for(bsc[0]);
+
+	/* every endpoint of the BSC is released once and nothing else */
+	llist_for_each_entry(out, &bsc[0]->write_queue.msg_queue, list) {
+		snprintf(buf, sizeof(buf), "%.*s", out->len - 3,
+			 (const char *) out->data + 3);
+		dlcx += 1;
+		if (sscanf(buf, "DLCX nat-%*u %x@mgw", &released) != 1
+		    || released >= ARRAY_SIZE(dlcx_endps)
+		    || dlcx_endps[released] != 1)
+			wrong += 1;
+		else
+			dlcx_endps[released] = 2;
+	}
+	for (i = 0; i < ARRAY_SIZE(dlcx_endps); ++i)
+		if (dlcx_endps[i] == 1)
+			missing += 1;
+	printf("DLCX %d, wrong %d, missing %d, other BSC %d\n", dlcx, wrong,
+	       missing, count_queued(bsc[1]));
+
+	for (i = 0; i < 2 * MGCP_TEARDOWN_CALLS; ++i) {
+		con = bsc_mgcp_find_con(nat, mgcp_timeslot_to_endpoint(i / 30, 1 + i % 30));
+		if (i % 2 == 0 && !con)
+			cleared += 1;
+		else if (i % 2 == 1 && con == cons[i])
+			kept += 1;
+	}
+	for (i = 0; i < NAT_MGCP_HASH_SIZE; ++i)
+		llist_for_each_entry(stat, &nat->pending_dlcx[i], hash_entry)
+			hashed += 1;
+	printf("Cleared %d, kept %d, pending %u, hashed %d\n", cleared, kept,
+	       bsc[0]->pending_dlcx_count, hashed);
+	printf("Pending MDCX %d/%d\n",
+	       count_endpoints(bsc[0]), count_endpoints(bsc[1]));
+
+	osmo_wqueue_clear(&bsc[0]->write_queue);
+	osmo_wqueue_clear(&bsc[1]->write_queue);
+	talloc_free(nat);
+}
+
+#define WORKER_TEST_BSCS	8
+#define WORKER_TEST_MSGS	500
+
+static struct bsc_connection *worker_bscs[WORKER_TEST_BSCS];
+static int worker_received[WORKER_TEST_BSCS];
+static int worker_closed[WORKER_TEST_BSCS];
+static int worker_bad;
+
+static int worker_test_nr(struct bsc_connection *bsc)
+{
+	int i;
+
+	for (i = 0; i < WORKER_TEST_BSCS; ++i)
+		if (worker_bscs[i] == bsc)
+			return i;
+	abort();
+}
+
+static int worker_test_len(int nr, int seq)
+{
+	return 1 + (nr * 31 + seq * 7) % 200;
+}
+
+static int worker_test_frame(uint8_t *buf, int nr, int seq)
+{
+	int i, len = worker_test_len(nr, seq);
+
+	buf[0] = len >> 8;
+	buf[1] = len & 0xff;
+	buf[2] = IPAC_PROTO_SCCP;
+	for (i = 0; i < len; ++i)
+		buf[3 + i] = nr + seq + i;
+	return 3 + len;
+}
+
+static int worker_test_read(struct bsc_connection *bsc, struct msgb *msg)
+{
+	int nr = worker_test_nr(bsc);
+	uint8_t expected[256];
+	struct msgb *reply;
+	int len;
+
+	len = worker_test_frame(expected, nr, worker_received[nr]++);
+	if (msg->len != len || msg->l2h != &msg->data[3]
+	    || memcmp(msg->data, expected, len) != 0)
+		worker_bad += 1;
+
+	/* echo it back through the normal write path */
+	reply = msgb_alloc_headroom(4096, 128, "reply");
+	memcpy(msgb_put(reply, msgb_l2len(msg)), msg->l2h, msgb_l2len(msg));
+	bsc_write(bsc, reply, IPAC_PROTO_SCCP);
+	msgb_free(msg);
+	return 0;
+}
+
+static void worker_test_close(struct bsc_connection *bsc, int ret)
+{
+	worker_closed[worker_test_nr(bsc)] += 1;
+	bsc_nat_worker_detach(bsc);
+}
+
+static int worker_test_pending(struct bsc_nat *nat)
+{
+	int i, bscs = 0;
+
+	for (i = 0; i < nat->num_workers; ++i)
+		bscs += nat->workers[i].bscs;
+	return bscs;
+}
+
+static int read_all(int fd, uint8_t *buf, int len)
+{
+	int rc, off = 0;
+
+	while (off < len) {
+		rc = read(fd, &buf[off], len - off);
+		if (rc <= 0)
+			return -1;
+		off += rc;
+	}
+	return 0;
+}
+
+static void test_bsc_workers(void)
+{
+	int peers[WORKER_TEST_BSCS];
+	uint8_t buf[256], echo[256];
+	struct bsc_nat *nat;
+	struct msgb *msg;
+	int i, j, sv[2], len, received = 0, echoed = 0, bad_echo = 0;
+	int closed = 0, eof = 0, max_length;
+
+	printf("Testing BSC workers with %d BSCs.\n", WORKER_TEST_BSCS);
+
+	nat = bsc_nat_alloc();
+	nat->bsc_workers = 3;
+	if (bsc_nat_workers_start(nat, worker_test_read, worker_test_close) != 0) {
+		printf("Failed to start the workers.\n");
+		abort();
+	}
+
+	for (i = 0; i < WORKER_TEST_BSCS; ++i) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+			abort();
+		peers[i] = sv[1];
+		worker_bscs[i] = bsc_connection_alloc(nat);
+		worker_bscs[i]->write_queue.bfd.fd = sv[0];
+		/* all echoes might be queued at the same time */
+		worker_bscs[i]->write_queue.max_length = WORKER_TEST_MSGS;
+		if (bsc_nat_worker_attach(worker_bscs[i]) != 0)
+			abort();
+	}
+
+	for (i = 0; i < nat->num_workers; ++i)
+		printf("Worker %d: %u BSCs\n", i, nat->workers[i].bscs);
+
+	/* split every other message over two writes */
+	for (j = 0; j < WORKER_TEST_MSGS; ++j) {
+		for (i = 0; i < WORKER_TEST_BSCS; ++i) {
+			len = worker_test_frame(buf, i, j);
+			if (j % 2 == 1) {
+				if (write(peers[i], buf, 2) != 2
+				    || write(peers[i], &buf[2], len - 2) != len - 2)
+					abort();
+			} else if (write(peers[i], buf, len) != len)
+				abort();
+		}
+	}
+
+	while (received < WORKER_TEST_BSCS * WORKER_TEST_MSGS) {
+		osmo_select_main(0);
+		for (i = 0, received = 0; i < WORKER_TEST_BSCS; ++i)
+			received += worker_received[i];
+	}
+	printf("Received %d, bad %d\n", received, worker_bad);
+
+	for (i = 0; i < WORKER_TEST_BSCS; ++i) {
+		for (j = 0; j < WORKER_TEST_MSGS; ++j) {
+			len = worker_test_frame(buf, i, j);
+			if (read_all(peers[i], echo, len) != 0)
+				abort();
+			if (memcmp(buf, echo, len) == 0)
+				echoed += 1;
+			else
+				bad_echo += 1;
+		}
+	}
+	printf("Echoed %d, bad %d\n", echoed, bad_echo);
+
+	/* the write queue bound is kept for a BSC of a worker */
+	max_length = worker_bscs[0]->write_queue.max_length;
+	worker_bscs[0]->write_queue.max_length = 0;
+	msg = msgb_alloc_headroom(4096, 128, "full");
+	msgb_put(msg, 1);
+	printf("Write to a full queue: %d\n",
+	       bsc_write(worker_bscs[0], msg, IPAC_PROTO_SCCP));
+	worker_bscs[0]->write_queue.max_length = max_length;
+
+	/* the first half hangs up, the second half gets closed by us */
+	for (i = 0; i < WORKER_TEST_BSCS / 2; ++i)
+		close(peers[i]);
+	for (i = WORKER_TEST_BSCS / 2; i < WORKER_TEST_BSCS; ++i)
+		bsc_nat_worker_detach(worker_bscs[i]);
+	while (worker_test_pending(nat) > 0)
+		osmo_select_main(0);
+
+	for (i = 0; i < WORKER_TEST_BSCS; ++i) {
+		closed += worker_closed[i];
+		if (i >= WORKER_TEST_BSCS / 2) {
+			if (read(peers[i], buf, sizeof(buf)) == 0)
+				eof += 1;
+			close(peers[i]);
+		}
+		talloc_free(worker_bscs[i]);
+	}
+	printf("Hung up %d, closed %d\n", closed, eof);
+
+	bsc_nat_workers_stop(nat);
+	talloc_free(nat);
+}
+
 static void test_dt_filter()
 {
 	int i;
@@ -895,6 +1694,114 @@ static void test_dt_filter()
 	}
 }
 
+/* copy a BSC DT1 and address it to the MSC reference of test_dt1_fast_path */
+static void copy_dt1_to_msg(struct msgb *msg, const uint8_t *data, unsigned int length)
+{
+	copy_to_msg(msg, data, length);
+	msg->data[4] = 0x01;
+	msg->data[5] = 0x1f;
+	msg->data[6] = 0xe4;
+}
+
+static void check_dt1_path(struct bsc_connection *bsc, struct msgb *msg,
+			   const char *name)
+{
+	struct nat_sccp_connection *con;
+
+	con = bsc_nat_dt1_fast_path(bsc, msg);
+	printf("%s: %s\n", name, con ? "fast" : "parsed");
+	if (con && (msg->l2h != msg->data + 3 || msg->l3h != msg->data + 10)) {
+		printf("FAIL: layers are not set.\n");
+		abort();
+	}
+}
+
+static void test_dt1_fast_path(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *bsc;
+	struct nat_sccp_connection *con;
+	struct bsc_msc_connection *msc_con;
+	struct bsc_nat_parsed *parsed;
+	struct msgb *msg;
+
+	printf("Testing the DT1 fast path.\n");
+	nat = bsc_nat_alloc();
+	bsc = bsc_connection_alloc(nat);
+	bsc->cfg = bsc_config_alloc(nat, "foo");
+	bsc_config_add_lac(bsc->cfg, 23);
+	bsc->authenticated = 1;
+	msc_con = talloc_zero(nat, struct bsc_msc_connection);
+	msg = msgb_alloc(4096, "test");
+
+	/* nothing is known yet */
+	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap));
+	check_dt1_path(bsc, msg, "Unknown connection");
+
+	/* the connection of test_contrack */
+	copy_to_msg(msg, bsc_cr, sizeof(bsc_cr));
+	parsed = bsc_nat_parse(msg);
+	con = create_sccp_src_ref(bsc, parsed);
+	talloc_free(parsed);
+	copy_to_msg(msg, msc_cc, sizeof(msc_cc));
+	parsed = bsc_nat_parse(msg);
+	update_sccp_src_ref(con, parsed);
+	talloc_free(parsed);
+
+	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap));
+	check_dt1_path(bsc, msg, "No MSC connection");
+	con->msc_con = msc_con;
+
+	/* the identity response is needed for the IMSI filter */
+	copy_dt1_to_msg(msg, id_resp, sizeof(id_resp));
+	check_dt1_path(bsc, msg, "Unchecked identity response");
+	con->imsi_checked = 1;
+	copy_dt1_to_msg(msg, id_resp, sizeof(id_resp));
+	check_dt1_path(bsc, msg, "Checked identity response");
+
+	/* BSSMAP is never filtered */
+	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap));
+	check_dt1_path(bsc, msg, "BSSMAP");
+
+	/* call setup is only rewritten with a known subscriber */
+	copy_dt1_to_msg(msg, cc_setup_national, sizeof(cc_setup_national));
+	check_dt1_path(bsc, msg, "Setup without IMSI");
+	con->imsi = talloc_strdup(con, "901010000000001");
+	copy_dt1_to_msg(msg, cc_setup_national, sizeof(cc_setup_national));
+	check_dt1_path(bsc, msg, "Setup with IMSI");
+	copy_dt1_to_msg(msg, id_resp, sizeof(id_resp));
+	check_dt1_path(bsc, msg, "Other DTAP with IMSI");
+
+	/* the USSD side channel wants to see everything */
+	con->con_type = NAT_CON_TYPE_SSA;
+	copy_dt1_to_msg(msg, id_resp, sizeof(id_resp));
+	check_dt1_path(bsc, msg, "SSA connection");
+	con->con_type = NAT_CON_TYPE_NONE;
+
+	/* a local connection is not forwarded */
+	con->con_local = NAT_CON_END_LOCAL;
+	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap));
+	check_dt1_path(bsc, msg, "Local connection");
+	con->con_local = NAT_CON_END_MSC;
+
+	/* broken frames are left to the parser */
+	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap));
+	msg->data[10] += 1;
+	check_dt1_path(bsc, msg, "Wrong data length");
+	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap) - 1);
+	check_dt1_path(bsc, msg, "Short frame");
+	copy_to_msg(msg, bsc_rlc, sizeof(bsc_rlc));
+	check_dt1_path(bsc, msg, "RLC");
+
+	bsc->authenticated = 0;
+	copy_to_msg(msg, bsc_dtap, sizeof(bsc_dtap));
+	check_dt1_path(bsc, msg, "Unauthenticated BSC");
+
+	bsc_config_free(bsc->cfg);
+	talloc_free(nat);
+	msgb_free(msg);
+}
+
 static void test_setup_rewrite()
 {
 	struct msgb *msg = msgb_alloc(4096, "test_dt_filter");
@@ -1450,6 +2357,7 @@ int main(int argc, char **argv)
 	test_mgcp_parse();
 	test_cr_filter();
 	test_dt_filter();
+	test_dt1_fast_path();
 	test_setup_rewrite();
 	test_setup_rewrite_prefix();
 	test_setup_rewrite_post();
@@ -1458,6 +2366,13 @@ int main(int argc, char **argv)
 	test_mgcp_allocations();
 	test_barr_list_parsing();
 	test_nat_extract_lac();
+	test_sccp_stress();
+	test_paging_storm();
+	test_acc_lst_bench();
+	test_number_rewrite_bench();
+	test_mgcp_rewrite_buffer();
+	test_mgcp_teardown();
+	test_bsc_workers();
 
 	printf("Testing execution completed.\n");
 	return 0;
@@ -0,0 +1,303 @@
+/*
+ * BSC benchmarks, not part of the testsuite
+ *
+ * (C) 2010-2013 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2010-2013 by On-Waves
+ *
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/gsm_subscriber.h>
+#include <openbsc/paging.h>
+#include <openbsc/abis_rsl.h>
+#include <openbsc/system_information.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SUBSCR_BENCH_NUM	100000
+#define SUBSCR_BENCH_LOOKUPS	1000000
+#define SUBSCR_BENCH_WALKS	2000
+
+#define PAGING_BENCH_NUM	20000
+#define PAGING_BENCH_BUF_SPACE	200
+#define PAGING_BENCH_MAX_CYCLES	10000
+/* the old scheduler sent one paging command per tick of the timer */
+#define PAGING_OLD_TICK_MS	500
+
+#define SI_BENCH_NUM_BTS	500
+#define SI_BENCH_ROUNDS		10
+
+/* the paging commands handed to the BTS */
+static unsigned int paging_commands;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double per_second(unsigned int num, uint64_t ns)
+{
+	return ns ? num * 1000000000.0 / ns : 0;
+}
+
+static void subscr_bench_imsi(char *imsi, int nr)
+{
+	snprintf(imsi, GSM_IMSI_LENGTH, "90170%010d", nr);
+}
+
+/*
+ * Look up live subscribers by IMSI and TMSI through the hashes and,
+ * for comparison, by walking the list of active subscribers as it was
+ * done before they were hashed.
+ */
+static void bench_subscr_lookup(void)
+{
+	struct gsm_network *net;
+	struct gsm_subscriber **subscrs, *subscr;
+	char imsi[GSM_IMSI_LENGTH];
+	uint64_t start, by_imsi, by_tmsi, walk;
+	unsigned int seed = 1;
+	int i, nr, bad = 0;
+
+	net = talloc_zero(NULL, struct gsm_network);
+	subscrs = talloc_array(net, struct gsm_subscriber *, SUBSCR_BENCH_NUM);
+	for (i = 0; i < SUBSCR_BENCH_NUM; ++i) {
+		subscr_bench_imsi(imsi, i);
+		subscrs[i] = subscr_get_or_create(net, imsi);
+		subscr_set_tmsi(subscrs[i], i + 1);
+	}
+
+	start = now_ns();
+	for (i = 0; i < SUBSCR_BENCH_LOOKUPS; ++i) {
+		seed = seed * 1103515245 + 12345;
+		nr = (seed >> 8) % SUBSCR_BENCH_NUM;
+		subscr_bench_imsi(imsi, nr);
+		subscr = subscr_active_by_imsi(net, imsi);
+		if (subscr != subscrs[nr])
+			bad += 1;
+		if (subscr)
+			subscr_put(subscr);
+	}
+	by_imsi = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < SUBSCR_BENCH_LOOKUPS; ++i) {
+		seed = seed * 1103515245 + 12345;
+		nr = (seed >> 8) % SUBSCR_BENCH_NUM;
+		subscr = subscr_active_by_tmsi(net, nr + 1);
+		if (subscr != subscrs[nr])
+			bad += 1;
+		if (subscr)
+			subscr_put(subscr);
+	}
+	by_tmsi = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < SUBSCR_BENCH_WALKS; ++i) {
+		seed = seed * 1103515245 + 12345;
+		nr = (seed >> 8) % SUBSCR_BENCH_NUM;
+		subscr_bench_imsi(imsi, nr);
+		llist_for_each_entry(subscr, &active_subscribers, entry) {
+			if (subscr->net == net && strcmp(subscr->imsi, imsi) == 0)
+				break;
+		}
+		if (subscr != subscrs[nr])
+			bad += 1;
+	}
+	walk = now_ns() - start;
+
+	printf("Subscriber lookups with %d live subscribers\n",
+	       SUBSCR_BENCH_NUM);
+	printf("By IMSI: %.0f lookups/s\n",
+	       per_second(SUBSCR_BENCH_LOOKUPS, by_imsi));
+	printf("By TMSI: %.0f lookups/s\n",
+	       per_second(SUBSCR_BENCH_LOOKUPS, by_tmsi));
+	printf("Walking the list: %.0f lookups/s\n",
+	       per_second(SUBSCR_BENCH_WALKS, walk));
+	if (bad != 0)
+		printf("Found the wrong subscriber %d times\n", bad);
+
+	for (i = 0; i < SUBSCR_BENCH_NUM; ++i)
+		subscr_put(subscrs[i]);
+	talloc_free(net);
+}
+
+int abis_rsl_sendmsg(struct msgb *msg)
+{
+	struct abis_rsl_dchan_hdr *dh = (struct abis_rsl_dchan_hdr *) msg->data;
+
+	if (dh->c.msg_type == RSL_MT_PAGING_CMD)
+		paging_commands += 1;
+
+	msgb_free(msg);
+	return 0;
+}
+
+/*
+ * Page a crowd of subscribers, every fourth by IMSI, with the BTS
+ * reporting the same buffer space every paging cycle. Reports the pages
+ * per second the scheduler can prepare and how many fit into a paging
+ * cycle on the air compared to the one page per tick of the old one.
+ */
+static void bench_paging(void)
+{
+	struct gsm_network *net;
+	struct gsm_bts *bts;
+	struct gsm_subscriber **subscrs;
+	struct gsm_paging_request *req;
+	char imsi[GSM_IMSI_LENGTH];
+	unsigned int cycle_ms;
+	uint64_t start, elapsed = 0;
+	int i, cycles = 0, paged = 0;
+
+	net = gsm_network_init(1, 1, NULL);
+	bts = gsm_bts_alloc_register(net, GSM_BTS_TYPE_UNKNOWN, 0, 0);
+	/* page_ms() only wants to know that the BTS is up */
+	bts->oml_link = (struct e1inp_sign_link *) bts;
+	cycle_ms = (bts->si_common.chan_desc.bs_pa_mfrms + 2) * 235;
+
+	subscrs = talloc_array(net, struct gsm_subscriber *, PAGING_BENCH_NUM);
+	for (i = 0; i < PAGING_BENCH_NUM; ++i) {
+		snprintf(imsi, GSM_IMSI_LENGTH, "90180%010d", i);
+		subscrs[i] = subscr_get_or_create(net, imsi);
+		if (i % 4 != 0)
+			subscr_set_tmsi(subscrs[i], i + 1);
+	}
+
+	start = now_ns();
+	for (i = 0; i < PAGING_BENCH_NUM; ++i)
+		paging_request_bts(bts, subscrs[i], RSL_CHANNEED_ANY, NULL, NULL);
+	elapsed += now_ns() - start;
+
+	paging_commands = 0;
+	while (paged < PAGING_BENCH_NUM && cycles < PAGING_BENCH_MAX_CYCLES) {
+		start = now_ns();
+		paging_update_buffer_space(bts, PAGING_BENCH_BUF_SPACE);
+		bts->paging.work_timer.cb(bts->paging.work_timer.data);
+		elapsed += now_ns() - start;
+		cycles += 1;
+
+		paged = 0;
+		llist_for_each_entry(req, &bts->paging.pending_requests, entry)
+			if (req->attempts > 0)
+				paged += 1;
+	}
+
+	printf("Paging %d subscribers with a buffer space of %d\n",
+	       PAGING_BENCH_NUM, PAGING_BENCH_BUF_SPACE);
+	printf("Scheduler: %.0f pages/s of CPU time\n",
+	       per_second(paging_commands, elapsed));
+	printf("On the air: %d paging cycles of %u ms, %.1f pages/cycle, "
+	       "%.0f pages/s\n", cycles, cycle_ms,
+	       cycles ? (double) paging_commands / cycles : 0,
+	       per_second(paging_commands, (uint64_t) cycles * cycle_ms * 1000000));
+	printf("One page per tick: %.0f pages/s\n", 1000.0 / PAGING_OLD_TICK_MS);
+	if (paged < PAGING_BENCH_NUM)
+		printf("Only paged %d subscribers\n", paged);
+
+	for (i = 0; i < PAGING_BENCH_NUM; ++i) {
+		paging_request_stop(bts, subscrs[i], NULL, NULL);
+		subscr_put(subscrs[i]);
+	}
+	osmo_timer_del(&bts->paging.work_timer);
+	osmo_timer_del(&bts->paging.credit_timer);
+}
+
+/* bring up all TRX, returns the number of SI generated */
+static int si_bench_bootstrap(struct gsm_network *net, int uncached)
+{
+	struct gsm_bts *bts;
+	struct gsm_bts_trx *trx;
+	uint32_t clean;
+	int generated = 0;
+
+	llist_for_each_entry(bts, &net->bts_list, list) {
+		llist_for_each_entry(trx, &bts->trx_list, list) {
+			/* before the cache everything was generated per TRX */
+			if (uncached)
+				gsm_bts_si_changed(bts, SI_IN_ALL);
+			clean = bts->si_cache.clean;
+			gsm_bts_trx_set_system_infos(trx);
+			generated += __builtin_popcount(bts->si_cache.clean & ~clean);
+		}
+	}
+
+	return generated;
+}
+
+/*
+ * Bring up the two TRX of every BTS of a big network after a restart of
+ * the BSC, once generating all SI for every TRX as before the cache and
+ * once generating them per BTS and reusing them for the second TRX.
+ */
+static void bench_si_startup(void)
+{
+	struct gsm_network *net;
+	struct gsm_bts *bts;
+	struct gsm_bts_trx *trx;
+	uint64_t start, uncached = 0, cached = 0;
+	int i, num_uncached = 0, num_cached = 0;
+
+	net = gsm_network_init(1, 1, NULL);
+	for (i = 0; i < SI_BENCH_NUM_BTS; ++i) {
+		bts = gsm_bts_alloc_register(net, GSM_BTS_TYPE_UNKNOWN, 0, 0);
+		bts->band = GSM_BAND_900;
+		bts->c0->arfcn = 1 + i % 100;
+		trx = gsm_bts_trx_alloc(bts);
+		trx->arfcn = 1 + (i + 50) % 100;
+	}
+
+	for (i = 0; i < SI_BENCH_ROUNDS; ++i) {
+		start = now_ns();
+		num_uncached = si_bench_bootstrap(net, 1);
+		uncached += now_ns() - start;
+
+		/* a restart of the BSC with empty caches */
+		gsm_net_si_changed(net, SI_IN_ALL);
+		start = now_ns();
+		num_cached = si_bench_bootstrap(net, 0);
+		cached += now_ns() - start;
+	}
+
+	printf("Bringing up %d BTS with 2 TRX each\n", SI_BENCH_NUM_BTS);
+	printf("Before, every SI per TRX: %d SI in %llu us\n", num_uncached,
+	       (unsigned long long) uncached / SI_BENCH_ROUNDS / 1000);
+	printf("After, cached per BTS: %d SI in %llu us\n", num_cached,
+	       (unsigned long long) cached / SI_BENCH_ROUNDS / 1000);
+}
+
+int main(int argc, char **argv)
+{
+	osmo_init_logging(&log_info);
+
+	bench_subscr_lookup();
+	bench_paging();
+	bench_si_startup();
+	return 0;
+}
@@ -31,10 +31,16 @@
 #include <openbsc/osmo_msc_data.h>
 #include <openbsc/gsm_04_80.h>
 #include <openbsc/gsm_subscriber.h>
+#include <openbsc/paging.h>
+#include <openbsc/abis_rsl.h>
+#include <openbsc/chan_alloc.h>
+#include <openbsc/system_information.h>
 
+#include <osmocom/abis/e1_input.h>
 #include <osmocom/core/application.h>
 #include <osmocom/core/backtrace.h>
 #include <osmocom/core/talloc.h>
+#include <osmocom/gsm/protocol/gsm_04_08.h>
 
 #include <stdio.h>
 #include <search.h>
@@ -192,12 +198,487 @@ out:
 	talloc_free(net);
 }
 
+#define SUBSCR_CACHE_NUM	100000
+#define SUBSCR_CACHE_KEEP	1000
+
+static void subscr_cache_imsi(char *imsi, int nr)
+{
+	snprintf(imsi, GSM_IMSI_LENGTH, "90170%010d", nr);
+}
+
+static void test_subscr_cache(void)
+{
+	struct gsm_network *net;
+	struct gsm_subscriber **subscrs, *subscr;
+	char imsi[GSM_IMSI_LENGTH];
+	int i, by_imsi = 0, by_tmsi = 0, bad = 0, stale = 0, found = 0, purged;
+
+	printf("Testing the subscriber cache with %d subscribers.\n",
+		SUBSCR_CACHE_NUM);
+
+	net = talloc_zero(NULL, struct gsm_network);
+	net->keep_subscr = 1;
+	net->keep_subscr_max = SUBSCR_CACHE_KEEP;
+	subscrs = talloc_array(net, struct gsm_subscriber *, SUBSCR_CACHE_NUM);
+
+	for (i = 0; i < SUBSCR_CACHE_NUM; ++i) {
+		subscr_cache_imsi(imsi, i);
+		subscrs[i] = subscr_get_or_create(net, imsi);
+		subscr_set_tmsi(subscrs[i], i + 1);
+	}
+
+	for (i = 0; i < SUBSCR_CACHE_NUM; ++i) {
+		subscr_cache_imsi(imsi, i);
+		subscr = subscr_active_by_imsi(net, imsi);
+		if (subscr == subscrs[i])
+			by_imsi += 1;
+		else
+			bad += 1;
+		if (subscr)
+			subscr_put(subscr);
+
+		subscr = subscr_active_by_tmsi(net, i + 1);
+		if (subscr == subscrs[i])
+			by_tmsi += 1;
+		else
+			bad += 1;
+		if (subscr)
+			subscr_put(subscr);
+	}
+	printf("Found by IMSI %d, by TMSI %d, bad %d\n", by_imsi, by_tmsi, bad);
+
+	/* a new TMSI must replace the old one in the index */
+	for (i = 0; i < SUBSCR_CACHE_NUM; i += 2)
+		subscr_set_tmsi(subscrs[i], SUBSCR_CACHE_NUM + i + 1);
+	for (i = 0; i < SUBSCR_CACHE_NUM; i += 2) {
+		subscr = subscr_active_by_tmsi(net, i + 1);
+		if (subscr) {
+			stale += 1;
+			subscr_put(subscr);
+		}
+		subscr = subscr_active_by_tmsi(net, SUBSCR_CACHE_NUM + i + 1);
+		if (subscr == subscrs[i])
+			found += 1;
+		if (subscr)
+			subscr_put(subscr);
+	}
+	printf("Reallocated TMSI %d, stale %d, found %d\n",
+		SUBSCR_CACHE_NUM / 2, stale, found);
+
+	/* only the most recently used ones are kept */
+	for (i = 0; i < SUBSCR_CACHE_NUM; ++i)
+		subscr_put(subscrs[i]);
+
+	/* the unused ones are dropped when they are put, not on allocation */
+	printf("Idle %d, ", net->num_idle_subscr);
+	subscr_cache_imsi(imsi, SUBSCR_CACHE_NUM);
+	subscr = subscr_get_or_create(net, imsi);
+	printf("after an allocation %d\n", net->num_idle_subscr);
+	subscr_put(subscr);
+
+	subscr_cache_imsi(imsi, 0);
+	subscr = subscr_active_by_imsi(net, imsi);
+	printf("Kept %d, oldest gone %d, ", net->num_idle_subscr, subscr == NULL);
+	subscr_cache_imsi(imsi, SUBSCR_CACHE_NUM - 1);
+	subscr = subscr_active_by_imsi(net, imsi);
+	printf("newest kept %d\n", subscr == subscrs[SUBSCR_CACHE_NUM - 1]);
+	if (subscr)
+		subscr_put(subscr);
+
+	purged = subscr_purge_inactive(net);
+	printf("Purged %d, left %d\n", purged, net->num_idle_subscr);
+
+	talloc_free(net);
+}
+
+#define PAGING_NUM		2000
+#define PAGING_BUF_SPACE	200
+#define PAGING_MAX_CYCLES	1000
+#define PAGING_OLD_TICK_MS	500
+
+/* the paging commands sent in the current paging cycle */
+static struct {
+	int commands;
+	uint8_t tmsis[256];
+	uint8_t imsis[256];
+} paging_cycle;
+
+#define RACH_STORM_NUM		60
+
+/* the IMMEDIATE ASSIGN REJECTs sent for the RACH storm */
+static struct {
+	int messages;
+	int refs;
+	int rejected[RACH_STORM_NUM];
+} agch;
+
+/* the BCCH INFO and SACCH FILLING sent */
+static int si_sent;
+
+static int rach_storm_id(const struct gsm48_req_ref *ref)
+{
+	return ref->t1 | (ref->t2 << 5);
+}
+
+static void agch_count_rej(const struct gsm48_imm_ass_rej *iar)
+{
+	const struct gsm48_req_ref *refs[] = {
+		&iar->req_ref1, &iar->req_ref2, &iar->req_ref3, &iar->req_ref4,
+	};
+	int i, id;
+
+	agch.messages += 1;
+	for (i = 0; i < ARRAY_SIZE(refs); ++i) {
+		/* unused ones repeat the first reference */
+		if (i > 0 && memcmp(refs[i], refs[0], sizeof(*refs[0])) == 0)
+			break;
+		id = rach_storm_id(refs[i]);
+		if (id < RACH_STORM_NUM)
+			agch.rejected[id] += 1;
+		agch.refs += 1;
+	}
+}
+
+int abis_rsl_sendmsg(struct msgb *msg)
+{
+	struct abis_rsl_dchan_hdr *dh = (struct abis_rsl_dchan_hdr *) msg->data;
+	uint8_t group;
+
+	/* paging group TV followed by the MS identity TLV */
+	if (dh->c.msg_type == RSL_MT_PAGING_CMD) {
+		group = dh->data[1];
+		if ((dh->data[4] & GSM_MI_TYPE_MASK) == GSM_MI_TYPE_TMSI)
+			paging_cycle.tmsis[group] += 1;
+		else
+			paging_cycle.imsis[group] += 1;
+		paging_cycle.commands += 1;
+	}
+
+	if (dh->c.msg_type == RSL_MT_BCCH_INFO
+	    || dh->c.msg_type == RSL_MT_SACCH_FILL)
+		si_sent += 1;
+
+	/* full IMM ASS INFO TLV with the 04.08 message */
+	if (dh->c.msg_type == RSL_MT_IMMEDIATE_ASSIGN_CMD
+	    && dh->data[4] == GSM48_MT_RR_IMM_ASS_REJ)
+		agch_count_rej((struct gsm48_imm_ass_rej *) &dh->data[2]);
+
+	msgb_free(msg);
+	return 0;
+}
+
+/* what a Paging Request Type 1, 2 or 3 can carry */
+static int paging_block_ok(int tmsis, int imsis)
+{
+	return (imsis == 0 && tmsis <= 4)
+		|| (imsis == 1 && tmsis <= 2)
+		|| (imsis == 2 && tmsis == 0);
+}
+
+static void test_paging(void)
+{
+	struct gsm_network *net;
+	struct gsm_bts *bts;
+	struct gsm_subscriber **subscrs;
+	struct gsm_paging_request *req;
+	char imsi[GSM_IMSI_LENGTH];
+	int i, cycles = 0, commands = 0, paged = 0, overfull = 0, over_budget = 0;
+	unsigned int cycle_ms;
+
+	printf("Testing the paging scheduler with %d subscribers.\n", PAGING_NUM);
+
+	net = gsm_network_init(1, 1, NULL);
+	bts = gsm_bts_alloc_register(net, GSM_BTS_TYPE_UNKNOWN, 0, 0);
+	/* page_ms() only wants to know that the BTS is up */
+	bts->oml_link = (struct e1inp_sign_link *) bts;
+	cycle_ms = (bts->si_common.chan_desc.bs_pa_mfrms + 2) * 235;
+
+	/* every fourth subscriber has to be paged by IMSI */
+	subscrs = talloc_array(net, struct gsm_subscriber *, PAGING_NUM);
+	for (i = 0; i < PAGING_NUM; ++i) {
+		snprintf(imsi, GSM_IMSI_LENGTH, "90180%010d", i);
+		subscrs[i] = subscr_get_or_create(net, imsi);
+		if (i % 4 != 0)
+			subscr_set_tmsi(subscrs[i], i + 1);
+		paging_request_bts(bts, subscrs[i], RSL_CHANNEED_ANY, NULL, NULL);
+	}
+
+	while (paged < PAGING_NUM && cycles < PAGING_MAX_CYCLES) {
+		memset(&paging_cycle, 0, sizeof(paging_cycle));
+
+		/* the BTS reports its buffer space and the cycle is over */
+		paging_update_buffer_space(bts, PAGING_BUF_SPACE);
+		bts->paging.work_timer.cb(bts->paging.work_timer.data);
+		cycles += 1;
+
+		commands += paging_cycle.commands;
+		if (paging_cycle.commands > PAGING_BUF_SPACE)
+			over_budget += 1;
+		for (i = 0; i < ARRAY_SIZE(paging_cycle.tmsis); ++i)
+			if (!paging_block_ok(paging_cycle.tmsis[i],
+					     paging_cycle.imsis[i]))
+				overfull += 1;
+
+		paged = 0;
+		llist_for_each_entry(req, &bts->paging.pending_requests, entry)
+			if (req->attempts > 0)
+				paged += 1;
+	}
+
+	printf("Paged %d subscribers, overfull blocks %d, over budget %d\n",
+		paged, overfull, over_budget);
+	printf("A paging command for each of them: %d\n",
+		commands >= PAGING_NUM);
+	printf("Faster than one page per tick: %d\n",
+		cycles * cycle_ms < PAGING_NUM * PAGING_OLD_TICK_MS);
+
+	for (i = 0; i < PAGING_NUM; ++i) {
+		paging_request_stop(bts, subscrs[i], NULL, NULL);
+		subscr_put(subscrs[i]);
+	}
+	printf("Pending after the stop: %u\n", paging_pending_requests_nr(bts));
+
+	osmo_timer_del(&bts->paging.work_timer);
+	osmo_timer_del(&bts->paging.credit_timer);
+}
+
+static void rach_storm_send(struct e1inp_sign_link *sign_link, int id, uint8_t ra)
+{
+	struct msgb *msg = msgb_alloc(128, "CHAN RQD");
+	struct abis_rsl_dchan_hdr *dh;
+	struct gsm48_req_ref *ref;
+
+	msg->l2h = msgb_put(msg, sizeof(*dh));
+	dh = (struct abis_rsl_dchan_hdr *) msg->l2h;
+	dh->c.msg_discr = ABIS_RSL_MDISC_COM_CHAN;
+	dh->c.msg_type = RSL_MT_CHAN_RQD;
+	dh->ie_chan = RSL_IE_CHAN_NR;
+	dh->chan_nr = RSL_CHAN_RACH;
+
+	/* the frame number of the request reference tells them apart */
+	msgb_put_u8(msg, RSL_IE_REQ_REFERENCE);
+	ref = (struct gsm48_req_ref *) msgb_put(msg, sizeof(*ref));
+	memset(ref, 0, sizeof(*ref));
+	ref->ra = ra;
+	ref->t1 = id & 0x1f;
+	ref->t2 = id >> 5;
+	msgb_put_u8(msg, RSL_IE_ACCESS_DELAY);
+	msgb_put_u8(msg, 1);
+
+	msg->dst = sign_link;
+	abis_rsl_rcvmsg(msg);
+}
+
+/* the requests that got a channel activated */
+static int rach_storm_served(struct gsm_bts_trx *trx, int *served)
+{
+	int i, j, num = 0;
+
+	memset(served, 0, RACH_STORM_NUM * sizeof(*served));
+	for (i = 0; i < ARRAY_SIZE(trx->ts); ++i) {
+		for (j = 0; j < ARRAY_SIZE(trx->ts[i].lchan); ++j) {
+			struct gsm_lchan *lchan = &trx->ts[i].lchan[j];
+
+			if (lchan->rqd_ref) {
+				served[rach_storm_id(lchan->rqd_ref)] += 1;
+				num += 1;
+			}
+		}
+	}
+
+	return num;
+}
+
+static void test_rach_storm(void)
+{
+	struct gsm_network *net;
+	struct gsm_bts *bts;
+	struct gsm_bts_trx *trx;
+	struct e1inp_sign_link sign_link;
+	enum gsm_chreq_reason_t reasons[RACH_STORM_NUM];
+	int served[RACH_STORM_NUM];
+	int i, j, early = 0, num_served = 0, lost = 0, twice = 0;
+	int emerg = 0, emerg_served = 0, lu_rejected = 0, other_served = 0;
+	int inverted;
+
+	printf("Testing a RACH storm of %d channel requests.\n", RACH_STORM_NUM);
+
+	net = gsm_network_init(1, 1, NULL);
+	bts = gsm_bts_alloc_register(net, GSM_BTS_TYPE_UNKNOWN, 0, 0);
+	trx = bts->c0;
+	trx->ts[0].pchan = GSM_PCHAN_CCCH_SDCCH4;
+	trx->ts[1].pchan = GSM_PCHAN_SDCCH8_SACCH8C;
+	for (i = 2; i < ARRAY_SIZE(trx->ts); ++i)
+		trx->ts[i].pchan = GSM_PCHAN_TCH_F;
+	bts_update_chan_load(bts);
+
+	memset(&sign_link, 0, sizeof(sign_link));
+	sign_link.trx = trx;
+	memset(&agch, 0, sizeof(agch));
+
+	/* emergency calls, location updates and calls on TCH/F */
+	for (i = 0; i < RACH_STORM_NUM; ++i) {
+		if (i % 20 == 0) {
+			reasons[i] = GSM_CHREQ_REASON_EMERG;
+			rach_storm_send(&sign_link, i, 0xa0 | (i & 0x1f));
+			emerg += 1;
+		} else if (i % 3 == 0) {
+			reasons[i] = GSM_CHREQ_REASON_LOCATION_UPD;
+			rach_storm_send(&sign_link, i, i & 0x0f);
+		} else {
+			reasons[i] = GSM_CHREQ_REASON_OTHER;
+			rach_storm_send(&sign_link, i, 0xe0 | (i & 0x1f));
+		}
+	}
+	early = agch.messages + rach_storm_served(trx, served);
+
+	/* the coalescing window is over */
+	bts->chan_rqd.window_timer.cb(bts->chan_rqd.window_timer.data);
+
+	num_served = rach_storm_served(trx, served);
+	for (i = 0; i < RACH_STORM_NUM; ++i) {
+		if (served[i] + agch.rejected[i] == 0)
+			lost += 1;
+		else if (served[i] + agch.rejected[i] > 1)
+			twice += 1;
+
+		if (reasons[i] == GSM_CHREQ_REASON_EMERG && served[i])
+			emerg_served += 1;
+		else if (reasons[i] == GSM_CHREQ_REASON_LOCATION_UPD && !served[i])
+			lu_rejected += 1;
+		else if (reasons[i] == GSM_CHREQ_REASON_OTHER && served[i])
+			other_served += 1;
+	}
+
+	printf("Answered before the window was over: %d\n", early);
+	printf("Served %d, rejected %d in %d IMMEDIATE ASSIGN REJECT, lost %d, twice %d\n",
+		num_served, agch.refs, agch.messages, lost, twice);
+	/* nothing else gets a channel while a location update has none */
+	inverted = other_served > 0 && lu_rejected > 0;
+	printf("Emergency calls served %d of %d, calls served with LU rejected %d\n",
+		emerg_served, emerg, inverted);
+	printf("AGCH counters: %lu IMM ASS REJ for %lu requests\n",
+		osmo_counter_get(net->stats.agch.imm_ass_rej),
+		osmo_counter_get(net->stats.agch.rejected));
+
+	for (i = 0; i < ARRAY_SIZE(trx->ts); ++i)
+		for (j = 0; j < ARRAY_SIZE(trx->ts[i].lchan); ++j)
+			osmo_timer_del(&trx->ts[i].lchan[j].act_timer);
+}
+
+#define SI_CACHE_NUM_BTS	500
+
+/* bring up all TRX, returns the number of SI generated */
+static int si_bootstrap(struct gsm_network *net, int uncached)
+{
+	struct gsm_bts *bts;
+	struct gsm_bts_trx *trx;
+	uint32_t clean;
+	int generated = 0;
+
+	llist_for_each_entry(bts, &net->bts_list, list) {
+		llist_for_each_entry(trx, &bts->trx_list, list) {
+			/* like before the cache, everything for every TRX */
+			if (uncached)
+				gsm_bts_si_changed(bts, SI_IN_ALL);
+			clean = bts->si_cache.clean;
+			if (gsm_bts_trx_set_system_infos(trx) != 0)
+				return -1;
+			generated += __builtin_popcount(bts->si_cache.clean & ~clean);
+		}
+	}
+
+	return generated;
+}
+
+/* the cached SI are the same as freshly generated ones */
+static int si_cache_ok(struct gsm_network *net)
+{
+	struct gsm_bts *bts;
+	sysinfo_buf_t cached[_MAX_SYSINFO_TYPE];
+	uint32_t valid;
+
+	llist_for_each_entry(bts, &net->bts_list, list) {
+		memcpy(cached, bts->si_buf, sizeof(cached));
+		valid = bts->si_valid;
+
+		gsm_bts_si_changed(bts, SI_IN_ALL);
+		if (gsm_bts_trx_set_system_infos(bts->c0) != 0
+		    || bts->si_valid != valid
+		    || memcmp(cached, bts->si_buf, sizeof(cached)) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void test_si_cache(void)
+{
+	struct gsm_network *net;
+	struct gsm_bts *bts, *bts1;
+	struct gsm_bts_trx *trx;
+	sysinfo_buf_t si2;
+	int i, uncached, generated, sent, changed;
+
+	printf("Testing the SI cache with %d BTS.\n", SI_CACHE_NUM_BTS);
+
+	/* automatic neighbor lists in a bit map of ARFCN 1-100 */
+	net = gsm_network_init(1, 1, NULL);
+	for (i = 0; i < SI_CACHE_NUM_BTS; ++i) {
+		bts = gsm_bts_alloc_register(net, GSM_BTS_TYPE_UNKNOWN, 0, 0);
+		bts->band = GSM_BAND_900;
+		bts->c0->arfcn = 1 + i % 100;
+		trx = gsm_bts_trx_alloc(bts);
+		trx->arfcn = 1 + (i + 50) % 100;
+	}
+	bts = gsm_bts_num(net, 0);
+	bts1 = gsm_bts_num(net, 1);
+
+	uncached = si_bootstrap(net, 1);
+
+	/* a restart of the BSC with empty caches */
+	gsm_net_si_changed(net, SI_IN_ALL);
+	si_sent = 0;
+	generated = si_bootstrap(net, 0);
+	sent = si_sent;
+
+	printf("Generated %d SI instead of %d, sent %d\n",
+		generated, uncached, sent);
+
+	/* all the RSL links come back */
+	si_sent = 0;
+	generated = si_bootstrap(net, 0);
+	printf("Reconnected: generated %d SI, sent %d\n", generated, si_sent);
+
+	/* a cell option of one BTS */
+	bts->si_common.rach_control.tx_integer = 5;
+	gsm_bts_si_changed(bts, SI_IN_CELL_OPTS);
+	generated = si_bootstrap(net, 0);
+	printf("Changed the RACH control: generated %d SI\n", generated);
+
+	/* a new BCCH ARFCN is in the neighbor lists of all the others */
+	memcpy(si2, GSM_BTS_SI(bts1, SYSINFO_TYPE_2), sizeof(si2));
+	bts->c0->arfcn = 101;
+	gsm_bts_si_changed(bts, SI_IN_CELL_CHAN);
+	gsm_net_si_changed(net, SI_IN_NEIGH);
+	generated = si_bootstrap(net, 0);
+	changed = memcmp(si2, GSM_BTS_SI(bts1, SYSINFO_TYPE_2), sizeof(si2)) != 0;
+	printf("Changed the ARFCN: generated %d SI, SI2 of the neighbor changed %d\n",
+		generated, changed);
+
+	printf("Cached SI up to date: %d\n", si_cache_ok(net));
+}
+
 
 int main(int argc, char **argv)
 {
 	osmo_init_logging(&log_info);
 
 	test_scan();
+	test_subscr_cache();
+	test_paging();
+	test_rach_storm();
+	test_si_cache();
 
 	printf("Testing execution completed.\n");
 	return 0;
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <assert.h>
 
@@ -26,6 +27,7 @@
 #include <osmocom/core/select.h>
 
 #include <openbsc/abis_rsl.h>
+#include <openbsc/chan_alloc.h>
 #include <openbsc/debug.h>
 #include <openbsc/gsm_subscriber.h>
 
@@ -51,6 +53,170 @@ void paging_request(struct gsm_bts *bts, struct gsm_subscriber *subscriber, int
 	cbfn(101, 200, (void*)0x1323L, &s_conn, data);
 }
 
+static void nm_set_running(struct gsm_abis_mo *mo, int running)
+{
+	mo->nm_state.operational = running ? NM_OPSTATE_ENABLED : NM_OPSTATE_DISABLED;
+	mo->nm_state.availability = NM_AVSTATE_OK;
+}
+
+static void dump_chan_load(struct gsm_bts *bts)
+{
+	struct pchan_load pl;
+
+	memset(&pl, 0, sizeof(pl));
+	bts_chan_load(&pl, bts);
+	printf("SDCCH/4 %u/%u SDCCH/8 %u/%u TCH/F %u/%u, check %d\n",
+		pl.pchan[GSM_PCHAN_CCCH_SDCCH4].used,
+		pl.pchan[GSM_PCHAN_CCCH_SDCCH4].total,
+		pl.pchan[GSM_PCHAN_SDCCH8_SACCH8C].used,
+		pl.pchan[GSM_PCHAN_SDCCH8_SACCH8C].total,
+		pl.pchan[GSM_PCHAN_TCH_F].used,
+		pl.pchan[GSM_PCHAN_TCH_F].total,
+		bts_chan_load_check(bts));
+}
+
+static void test_chan_load(struct gsm_network *network)
+{
+	struct gsm_bts *bts;
+	struct gsm_bts_trx *trx;
+	struct gsm_lchan *lchan, *sdcch = NULL, *tch = NULL;
+	int i, allocated = 0, failed = 0;
+
+	printf("Testing the channel load counters\n");
+
+	bts = gsm_bts_alloc_register(network, GSM_BTS_TYPE_UNKNOWN, 0, 0);
+	bts->type = GSM_BTS_TYPE_NANOBTS;
+	trx = bts->c0;
+	trx->ts[1].pchan = GSM_PCHAN_SDCCH8_SACCH8C;
+	for (i = 2; i < ARRAY_SIZE(trx->ts); i++)
+		trx->ts[i].pchan = GSM_PCHAN_TCH_F;
+	dump_chan_load(bts);
+
+	/* the BTS reports the TRX and the timeslots as enabled */
+	nm_set_running(&trx->mo, 1);
+	nm_set_running(&trx->bb_transc.mo, 1);
+	for (i = 0; i < ARRAY_SIZE(trx->ts); i++)
+		nm_set_running(&trx->ts[i].mo, 1);
+	bts_update_chan_load(bts);
+	dump_chan_load(bts);
+
+	for (i = 0; i < 3; i++) {
+		sdcch = lchan_alloc(bts, GSM_LCHAN_SDCCH, 0);
+		rsl_lchan_set_state(sdcch, LCHAN_S_ACT_REQ);
+	}
+	for (i = 0; i < 7; i++) {
+		lchan = lchan_alloc(bts, GSM_LCHAN_TCH_F, 0);
+		if (!lchan) {
+			failed += 1;
+			continue;
+		}
+		rsl_lchan_set_state(lchan, LCHAN_S_ACTIVE);
+		allocated += 1;
+		tch = lchan;
+	}
+	printf("Allocated TCH/F %d, failed %d\n", allocated, failed);
+	dump_chan_load(bts);
+
+	rsl_lchan_set_state(sdcch, LCHAN_S_NONE);
+	lchan_reset(tch);
+	dump_chan_load(bts);
+
+	/* the TRX goes away */
+	nm_set_running(&trx->mo, 0);
+	bts_update_chan_load(bts);
+	dump_chan_load(bts);
+}
+
+static void test_link_down(struct gsm_network *network)
+{
+	struct gsm_bts *bts;
+	struct gsm_bts_trx *trx;
+	struct gsm_lchan *lchan;
+	int i;
+
+	printf("Testing the channel load after a link drop\n");
+
+	bts = gsm_bts_alloc_register(network, GSM_BTS_TYPE_UNKNOWN, 0, 0);
+	bts->type = GSM_BTS_TYPE_NANOBTS;
+	trx = bts->c0;
+	for (i = 1; i < ARRAY_SIZE(trx->ts); i++)
+		trx->ts[i].pchan = GSM_PCHAN_TCH_F;
+
+	nm_set_running(&trx->mo, 1);
+	nm_set_running(&trx->bb_transc.mo, 1);
+	for (i = 0; i < ARRAY_SIZE(trx->ts); i++)
+		nm_set_running(&trx->ts[i].mo, 1);
+	bts_update_chan_load(bts);
+
+	lchan = lchan_alloc(bts, GSM_LCHAN_SDCCH, 0);
+	rsl_lchan_set_state(lchan, LCHAN_S_ACTIVE);
+	for (i = 0; i < 3; i++) {
+		lchan = lchan_alloc(bts, GSM_LCHAN_TCH_F, 0);
+		rsl_lchan_set_state(lchan, LCHAN_S_ACTIVE);
+	}
+	dump_chan_load(bts);
+
+	/* the OML link went away with the channels still in use */
+	trx_link_down(trx);
+	dump_chan_load(bts);
+	printf("Allocated after the drop: %d\n",
+		lchan_alloc(bts, GSM_LCHAN_TCH_F, 0) != NULL);
+}
+
+#define BTS_LOOKUP_NUM	300
+
+static void test_bts_lookup(void)
+{
+	struct gsm_network *net;
+	struct gsm_bts *bts, *prev;
+	int i, lac, by_nr = 0, by_lac = 0, unordered = 0, by_arfcn = 0;
+
+	printf("Testing the BTS lookups\n");
+
+	net = gsm_network_init(1, 1, NULL);
+	for (i = 0; i < BTS_LOOKUP_NUM; i++) {
+		bts = gsm_bts_alloc_register(net, GSM_BTS_TYPE_UNKNOWN, 0, i % 64);
+		bts->location_area_code = 100 + i % 7;
+		bts->c0->arfcn = i;
+		gsm_bts_update_index(bts);
+	}
+
+	for (i = 0; i < BTS_LOOKUP_NUM; i++) {
+		bts = gsm_bts_num(net, i);
+		if (bts && bts->nr == i)
+			by_nr += 1;
+		if (gsm_bts_neighbor(bts, i, i % 64) == bts)
+			by_arfcn += 1;
+	}
+
+	for (lac = 100; lac < 107; lac++) {
+		prev = NULL;
+		for (bts = gsm_bts_by_lac(net, lac, NULL); bts;
+		     bts = gsm_bts_by_lac(net, lac, bts)) {
+			if (prev && prev->nr >= bts->nr)
+				unordered += 1;
+			prev = bts;
+			by_lac += 1;
+		}
+	}
+
+	printf("Found by nr %d, by LAC %d unordered %d, by ARFCN %d\n",
+		by_nr, by_lac, unordered, by_arfcn);
+	printf("Out of range %d, unknown neighbor %d\n",
+		gsm_bts_num(net, BTS_LOOKUP_NUM) == NULL,
+		gsm_bts_neighbor(gsm_bts_num(net, 0), 1, 0) == NULL);
+
+	/* move BTS 10 to another LAC and ARFCN */
+	bts = gsm_bts_num(net, 10);
+	bts->location_area_code = 200;
+	bts->c0->arfcn = 900;
+	gsm_bts_update_index(bts);
+	printf("Moved BTS by LAC %d, old LAC %d, by ARFCN %d, old ARFCN %d\n",
+		gsm_bts_by_lac(net, 200, NULL) == bts,
+		gsm_bts_by_lac(net, 103, gsm_bts_num(net, 3)) == gsm_bts_num(net, 17),
+		gsm_bts_neighbor(bts, 900, 10) == bts,
+		gsm_bts_neighbor(bts, 10, 10) == NULL);
+}
 
 int main(int argc, char **argv)
 {
@@ -80,6 +246,10 @@ int main(int argc, char **argv)
 		osmo_select_main(0);
 	}
 
+	test_chan_load(network);
+	test_link_down(network);
+	test_bts_lookup();
+
 	return EXIT_SUCCESS;
 }
 
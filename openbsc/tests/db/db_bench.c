@@ -0,0 +1,130 @@
+/* Location update benchmark for the HLR, not part of the testsuite */
+
+/*
+ * (C) 2008 by Jan Luebbe <jluebbe@debian.org>
+ * (C) 2009 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/debug.h>
+#include <openbsc/db.h>
+#include <openbsc/db_worker.h>
+#include <openbsc/gsm_subscriber.h>
+
+#include <osmocom/core/application.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#define LU_BENCH_SUBSCRS	1000
+
+static struct gsm_network dummy_net;
+static struct gsm_subscriber *lu_subscrs[LU_BENCH_SUBSCRS];
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void remove_db(const char *name)
+{
+	char path[64];
+
+	unlink(name);
+	snprintf(path, sizeof(path), "%s-wal", name);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s-shm", name);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s-journal", name);
+	unlink(path);
+}
+
+/*
+ * The database part of a location update, see subscr_update_expire_lu()
+ * and the refresh after it, for each subscriber of a fresh HLR. Before
+ * the worker all of it ran in the main loop with a rollback journal.
+ */
+static void bench_location_updates(const char *what, const char *name,
+				   int wal, int worker)
+{
+	char imsi[GSM_IMSI_LENGTH];
+	uint64_t start, elapsed;
+	int i, bad = 0;
+
+	remove_db(name);
+	db_set_wal(wal);
+	if (db_init(name) != 0 || db_prepare() != 0) {
+		printf("%s: failed to open %s\n", what, name);
+		return;
+	}
+	if (worker && db_start_worker() != 0) {
+		printf("%s: failed to start the worker\n", what);
+		db_fini();
+		return;
+	}
+
+	for (i = 0; i < LU_BENCH_SUBSCRS; ++i) {
+		snprintf(imsi, sizeof(imsi), "90170000000%04d", i);
+		lu_subscrs[i] = db_create_subscriber(imsi);
+		lu_subscrs[i]->net = &dummy_net;
+	}
+	db_flush_worker();
+
+	start = time_ns();
+	for (i = 0; i < LU_BENCH_SUBSCRS; ++i) {
+		lu_subscrs[i]->lac = 42;
+		lu_subscrs[i]->expire_lu = time(NULL) + 3600;
+		if (db_sync_subscriber(lu_subscrs[i]) != 0)
+			bad += 1;
+		db_subscriber_update_async(lu_subscrs[i]);
+	}
+	db_flush_worker();
+	elapsed = time_ns() - start;
+
+	printf("%s: %.0f location updates/s", what,
+	       LU_BENCH_SUBSCRS * 1e9 / (elapsed ? elapsed : 1));
+	if (bad)
+		printf(", %d failed", bad);
+	printf("\n");
+
+	for (i = 0; i < LU_BENCH_SUBSCRS; ++i)
+		subscr_put(lu_subscrs[i]);
+	db_fini();
+	remove_db(name);
+}
+
+int main(int argc, char **argv)
+{
+	osmo_init_logging(&log_info);
+	log_set_log_level(osmo_stderr_target, LOGL_ERROR);
+
+	printf("Location updates of %d subscribers\n", LU_BENCH_SUBSCRS);
+	bench_location_updates("Before, rollback journal in the main loop",
+			       "hlr_bench_before.sqlite3", 0, 0);
+	bench_location_updates("WAL in the main loop",
+			       "hlr_bench_wal.sqlite3", 1, 0);
+	bench_location_updates("After, WAL and batched in the worker",
+			       "hlr_bench_after.sqlite3", 1, 1);
+	return 0;
+}
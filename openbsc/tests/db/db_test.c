@@ -19,13 +19,20 @@
 
 #include <openbsc/debug.h>
 #include <openbsc/db.h>
+#include <openbsc/db_worker.h>
 #include <openbsc/gsm_subscriber.h>
+#include <openbsc/gsm_04_11.h>
+#include <openbsc/ident_alloc.h>
 
 #include <osmocom/core/application.h>
+#include <osmocom/core/select.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 
 static struct gsm_network dummy_net;
 
@@ -57,6 +64,453 @@ static struct gsm_network dummy_net;
 		printf("Extensions do not match in %s:%d '%s' '%s'\n", \
 			__FUNCTION__, __LINE__, original->extension, copy->extension); \
 
+#define LU_SUBSCRS		200
+
+static struct gsm_subscriber *lu_subscrs[LU_SUBSCRS];
+
+static void create_lu_subscribers(void)
+{
+	char imsi[GSM_IMSI_LENGTH];
+	int i;
+
+	for (i = 0; i < LU_SUBSCRS; ++i) {
+		snprintf(imsi, sizeof(imsi), "90170000000%04d", i);
+		lu_subscrs[i] = db_create_subscriber(imsi);
+		lu_subscrs[i]->net = &dummy_net;
+	}
+}
+
+/* the database part of subscr_update_expire_lu() */
+static void run_location_updates(const char *where, uint16_t lac)
+{
+	struct gsm_subscriber *subscr;
+	int i, bad = 0;
+
+	for (i = 0; i < LU_SUBSCRS; ++i) {
+		lu_subscrs[i]->lac = lac;
+		lu_subscrs[i]->expire_lu = time(NULL) + 3600;
+		db_sync_subscriber(lu_subscrs[i]);
+		db_subscriber_update_async(lu_subscrs[i]);
+	}
+	db_flush_worker();
+
+	for (i = 0; i < LU_SUBSCRS; ++i) {
+		subscr = db_get_subscriber(GSM_SUBSCRIBER_IMSI,
+					   lu_subscrs[i]->imsi);
+		if (!subscr || subscr->lac != lac)
+			bad += 1;
+		if (subscr) {
+			SUBSCR_PUT(subscr);
+		}
+	}
+	printf("Location updates %s: %d, bad %d.\n", where,
+		LU_SUBSCRS, bad);
+}
+
+#define CHURN_RANGE	1000
+#define CHURN_OPS	100000
+
+static void test_ident_alloc(void)
+{
+	struct ident_alloc alloc;
+	uint8_t used[CHURN_RANGE];
+	uint32_t held[CHURN_RANGE / 2], value;
+	int i, k, bad = 0;
+
+	printf("Testing the identity allocator.\n");
+	memset(used, 0, sizeof(used));
+	ident_alloc_init(&alloc, NULL, 100, 100 + CHURN_RANGE - 1, 23);
+
+	/* every number exactly once */
+	for (i = 0; i < CHURN_RANGE; ++i) {
+		if (ident_alloc_get(&alloc, &value) != 0 || used[value - 100]++)
+			bad += 1;
+	}
+	if (ident_alloc_get(&alloc, &value) != -ENOSPC)
+		bad += 1;
+
+	for (i = 0; i < CHURN_RANGE; ++i)
+		ident_alloc_release(&alloc, 100 + i);
+	memset(used, 0, sizeof(used));
+
+	/* keep half of the range busy and replace random ones */
+	for (i = 0; i < ARRAY_SIZE(held); ++i) {
+		ident_alloc_get(&alloc, &held[i]);
+		used[held[i] - 100] = 1;
+	}
+	for (i = 0; i < CHURN_OPS; ++i) {
+		k = rand() % ARRAY_SIZE(held);
+		ident_alloc_release(&alloc, held[k]);
+		used[held[k] - 100] = 0;
+
+		if (ident_alloc_get(&alloc, &held[k]) != 0
+		    || used[held[k] - 100])
+			bad += 1;
+		used[held[k] - 100] = 1;
+	}
+	for (i = 0; i < CHURN_RANGE; ++i)
+		if (ident_alloc_in_use(&alloc, 100 + i) != used[i])
+			bad += 1;
+
+	printf("Allocated %d numbers in use %u, bad %d.\n",
+		CHURN_OPS, alloc.used, bad);
+	ident_alloc_reset(&alloc);
+}
+
+#define CHURN_SUBSCRS	100
+#define CHURN_ROUNDS	100
+
+static int check_identities(struct gsm_subscriber **subscrs)
+{
+	struct gsm_subscriber *subscr;
+	char tmsi[14];
+	int i, bad = 0;
+
+	for (i = 0; i < CHURN_SUBSCRS; ++i) {
+		snprintf(tmsi, sizeof(tmsi), "%u", subscrs[i]->tmsi);
+		subscr = db_get_subscriber(GSM_SUBSCRIBER_TMSI, tmsi);
+		if (!subscr || subscr->id != subscrs[i]->id)
+			bad += 1;
+		if (subscr) {
+			SUBSCR_PUT(subscr);
+		}
+
+		subscr = db_get_subscriber(GSM_SUBSCRIBER_EXTENSION,
+					   subscrs[i]->extension);
+		if (!subscr || subscr->id != subscrs[i]->id)
+			bad += 1;
+		if (subscr) {
+			SUBSCR_PUT(subscr);
+		}
+	}
+
+	return bad;
+}
+
+static void test_tmsi_churn(void)
+{
+	struct gsm_subscriber *subscrs[CHURN_SUBSCRS];
+	char imsi[GSM_IMSI_LENGTH];
+	unsigned int tmsis, extensions, tmsis_after, extensions_after;
+	uint32_t old_tmsi;
+	int i, round, failed = 0;
+
+	printf("Testing the TMSI allocation.\n");
+	for (i = 0; i < CHURN_SUBSCRS; ++i) {
+		snprintf(imsi, sizeof(imsi), "90180000000%04d", i);
+		subscrs[i] = db_create_subscriber(imsi);
+		subscrs[i]->net = &dummy_net;
+	}
+
+	/* the old TMSI is only released once the new one got picked */
+	for (round = 0; round < CHURN_ROUNDS; ++round)
+		for (i = 0; i < CHURN_SUBSCRS; ++i) {
+			old_tmsi = subscrs[i]->tmsi;
+			if (db_subscriber_alloc_tmsi(subscrs[i]) != 0
+			    || subscrs[i]->tmsi == old_tmsi)
+				failed += 1;
+		}
+	printf("Allocated %d TMSIs, failed %d, bad %d.\n",
+		CHURN_SUBSCRS * CHURN_ROUNDS, failed,
+		check_identities(subscrs));
+
+	/* the numbers in use are loaded again on startup */
+	db_fini();
+	if (db_init("hlr.sqlite3") || db_prepare()) {
+		printf("DB: Failed to open the database again.\n");
+		return;
+	}
+
+	for (i = 0; i < CHURN_SUBSCRS; ++i) {
+		db_subscriber_alloc_tmsi(subscrs[i]);
+		db_subscriber_alloc_exten(subscrs[i]);
+	}
+	printf("After the restart, bad %d.\n", check_identities(subscrs));
+
+	/* the old numbers are free again once the new ones are stored */
+	db_get_identity_stats(&tmsis, &extensions);
+	for (round = 0; round < CHURN_ROUNDS / 10; ++round)
+		for (i = 0; i < CHURN_SUBSCRS; ++i) {
+			db_subscriber_alloc_tmsi(subscrs[i]);
+			db_subscriber_alloc_exten(subscrs[i]);
+		}
+	db_get_identity_stats(&tmsis_after, &extensions_after);
+	printf("Reallocated %d TMSIs and extensions, %d more in use.\n",
+		CHURN_SUBSCRS * CHURN_ROUNDS / 10,
+		(int) (tmsis_after - tmsis + extensions_after - extensions));
+
+	for (i = 0; i < CHURN_SUBSCRS; ++i) {
+		SUBSCR_PUT(subscrs[i]);
+	}
+}
+
+static struct gsm_sms *store_sms(struct gsm_subscriber *receiver,
+				 const char *text)
+{
+	struct gsm_sms *sms;
+
+	sms = sms_alloc();
+	sms->sender = subscr_get(receiver);
+	sms->receiver = subscr_get(receiver);
+	strcpy(sms->dst.addr, receiver->extension);
+	strcpy(sms->text, text);
+	if (db_sms_store(sms) != 0)
+		printf("Failed to store the SMS.\n");
+	return sms;
+}
+
+static void print_next_sms(unsigned long long min_subscr_id,
+			   unsigned int failed, int mark_sent)
+{
+	struct gsm_sms *sms;
+
+	sms = db_sms_get_unsent_by_subscr(&dummy_net, min_subscr_id, failed);
+	if (!sms) {
+		printf("No SMS to deliver.\n");
+		return;
+	}
+
+	printf("Next SMS '%s'.\n", sms->text);
+	if (mark_sent)
+		db_sms_mark_sent(sms);
+	sms_free(sms);
+}
+
+static void test_sms_outbox(void)
+{
+	struct gsm_subscriber *carol, *dave;
+	struct gsm_sms *sms;
+
+	printf("Testing the SMS outbox.\n");
+	carol = db_create_subscriber("5553245423445");
+	carol->net = &dummy_net;
+	carol->lac = 23;
+	db_sync_subscriber(carol);
+	dave = db_create_subscriber("5563245423445");
+	dave->net = &dummy_net;
+	dave->lac = 0;
+	db_sync_subscriber(dave);
+
+	sms_free(store_sms(dave, "Hello Dave"));
+	sms_free(store_sms(carol, "Hello Carol"));
+	sms_free(store_sms(carol, "Bye Carol"));
+
+	/* the detached receiver is skipped */
+	print_next_sms(0, 10, 0);
+	print_next_sms(carol->id + 1, 10, 0);
+
+	sms = db_sms_get_unsent_for_subscr(carol);
+	printf("First SMS for Carol '%s'.\n", sms ? sms->text : "none");
+	if (sms) {
+		db_sms_inc_deliver_attempts(sms);
+		sms_free(sms);
+	}
+	sms = db_sms_get_unsent_for_subscr(dave);
+	printf("First SMS for Dave '%s'.\n", sms ? sms->text : "none");
+	if (sms)
+		sms_free(sms);
+
+	/* the first one failed once already */
+	print_next_sms(0, 1, 0);
+
+	dave->lac = 42;
+	db_sync_subscriber(dave);
+
+	/* the index is built again on startup */
+	db_fini();
+	if (db_init("hlr.sqlite3") || db_prepare()) {
+		printf("DB: Failed to open the database again.\n");
+		return;
+	}
+
+	print_next_sms(0, 10, 1);
+	print_next_sms(0, 10, 1);
+	print_next_sms(0, 10, 1);
+	print_next_sms(0, 10, 1);
+
+	SUBSCR_PUT(carol);
+	SUBSCR_PUT(dave);
+}
+
+#define EXPIRE_SUBSCRS	6
+
+static struct gsm_subscriber *expire_subscrs[EXPIRE_SUBSCRS];
+
+static void expire_cb(void *priv, unsigned long long *ids, unsigned int num,
+		      unsigned int backlog)
+{
+	unsigned int *expired = priv;
+	int i;
+
+	printf("Expiring %u of %u subscribers.\n", num, backlog);
+
+	/* a location update while the query was running */
+	if (*expired == 0 && num > 0) {
+		for (i = 0; i < EXPIRE_SUBSCRS; ++i) {
+			if (expire_subscrs[i]->id != ids[0])
+				continue;
+			expire_subscrs[i]->expire_lu = time(NULL) + 3600;
+			db_sync_subscriber(expire_subscrs[i]);
+		}
+	}
+
+	db_subscriber_expire_ids(ids, num);
+	*expired += num;
+}
+
+static void test_subscr_expire(void)
+{
+	struct gsm_subscriber *subscr;
+	char imsi[GSM_IMSI_LENGTH];
+	unsigned int expired = 0, last;
+	int i, attached = 0, detached = 0;
+
+	printf("Testing the expiry of location updates.\n");
+	for (i = 0; i < EXPIRE_SUBSCRS; ++i) {
+		snprintf(imsi, sizeof(imsi), "90190000000%04d", i);
+		expire_subscrs[i] = db_create_subscriber(imsi);
+		expire_subscrs[i]->net = &dummy_net;
+		expire_subscrs[i]->lac = 23;
+		expire_subscrs[i]->expire_lu = time(NULL) - 60;
+		db_sync_subscriber(expire_subscrs[i]);
+	}
+
+	/* this one is still fine */
+	expire_subscrs[0]->expire_lu = time(NULL) + 3600;
+	db_sync_subscriber(expire_subscrs[0]);
+
+	do {
+		last = expired;
+		db_subscriber_expire(2, expire_cb, &expired);
+	} while (expired != last);
+
+	for (i = 0; i < EXPIRE_SUBSCRS; ++i) {
+		subscr = db_get_subscriber(GSM_SUBSCRIBER_IMSI,
+					   expire_subscrs[i]->imsi);
+		if (subscr && subscr->lac == 23)
+			attached += 1;
+		else if (subscr && subscr->lac == 0)
+			detached += 1;
+		if (subscr) {
+			SUBSCR_PUT(subscr);
+		}
+		SUBSCR_PUT(expire_subscrs[i]);
+	}
+	printf("Detached %d, still attached %d.\n", detached, attached);
+}
+
+static void sms_fetched(struct gsm_sms *sms, void *data)
+{
+	int *fetched = data;
+
+	*fetched += 1;
+	if (!sms) {
+		printf("No unsent SMS left.\n");
+		return;
+	}
+
+	printf("Fetched SMS '%s' for %s.\n", sms->text, sms->receiver->imsi);
+	db_sms_mark_sent(sms);
+	sms_free(sms);
+}
+
+static void subscr_found(struct gsm_subscriber *subscr, void *data)
+{
+	int *found = data;
+
+	*found += 1;
+	if (!subscr) {
+		printf("Subscriber not found.\n");
+		return;
+	}
+
+	printf("Found subscriber %s in LAC %u.\n", subscr->imsi, subscr->lac);
+	SUBSCR_PUT(subscr);
+}
+
+static void test_db_worker(void)
+{
+	struct gsm_subscriber *bob, *bob_db, *carol;
+	struct db_subscr_lookup *lookup;
+	struct db_worker_stats stats;
+	struct gsm_sms *sms;
+	char tmsi[14];
+	int fetched = 0, found = 0, i;
+
+	printf("Testing the database worker.\n");
+	create_lu_subscribers();
+	run_location_updates("in the main loop", 23);
+
+	if (db_start_worker() != 0) {
+		printf("Failed to start the worker.\n");
+		return;
+	}
+
+	run_location_updates("in the worker", 42);
+
+	/* the update and the refresh of all of them went in as a burst */
+	db_worker_get_stats(&stats);
+	printf("Executed %d requests in fewer batches: %d.\n",
+		2 * LU_SUBSCRS, stats.batches < 2 * LU_SUBSCRS);
+
+	/* the read has to wait for the queued write */
+	bob = db_create_subscriber("4443245423445");
+	bob->net = &dummy_net;
+	db_subscriber_alloc_tmsi(bob);
+	bob->lac = 23;
+	db_sync_subscriber(bob);
+	bob_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI, bob->imsi);
+	COMPARE(bob, bob_db);
+	SUBSCR_PUT(bob_db);
+
+	sms = sms_alloc();
+	sms->sender = subscr_get(bob);
+	sms->receiver = subscr_get(bob);
+	strcpy(sms->dst.addr, bob->extension);
+	strcpy(sms->text, "Hello Bob");
+	if (db_sms_store(sms) != 0)
+		printf("Failed to store the SMS.\n");
+	sms_free(sms);
+
+	db_sms_get_unsent_by_subscr_async(&dummy_net, 0, 10,
+					  sms_fetched, &fetched);
+	while (fetched < 1)
+		osmo_select_main(0);
+
+	/* the SMS got marked as sent before this query is executed */
+	db_sms_get_unsent_by_subscr_async(&dummy_net, 0, 10,
+					  sms_fetched, &fetched);
+	while (fetched < 2)
+		osmo_select_main(0);
+
+	/* the lookup sees the queued write of a subscriber not in RAM */
+	carol = db_create_subscriber("901700000009999");
+	db_subscriber_alloc_tmsi(carol);
+	carol->lac = 77;
+	db_sync_subscriber(carol);
+	sprintf(tmsi, "%u", carol->tmsi);
+	SUBSCR_PUT(carol);
+
+	db_get_subscriber_async(&dummy_net, GSM_SUBSCRIBER_TMSI, tmsi,
+				subscr_found, &found);
+	db_get_subscriber_async(&dummy_net, GSM_SUBSCRIBER_IMSI,
+				"901700000009998", subscr_found, &found);
+	lookup = db_get_subscriber_async(&dummy_net, GSM_SUBSCRIBER_IMSI,
+				"901700000009999", subscr_found, &found);
+	db_get_subscriber_cancel(lookup);
+	while (found < 2)
+		osmo_select_main(0);
+
+	SUBSCR_PUT(bob);
+	for (i = 0; i < LU_SUBSCRS; ++i) {
+		SUBSCR_PUT(lu_subscrs[i]);
+	}
+
+	db_fini();
+	db_worker_get_stats(&stats);
+	printf("Worker queued %u, failed %llu.\n", stats.depth, stats.failed);
+}
+
 int main()
 {
 	printf("Testing subscriber database code.\n");
@@ -108,7 +562,11 @@ int main()
 	SUBSCR_PUT(alice);
 	SUBSCR_PUT(alice_db);
 
-	db_fini();
+	test_ident_alloc();
+	test_tmsi_churn();
+	test_sms_outbox();
+	test_subscr_expire();
+	test_db_worker();
 
 	printf("Done\n");
 	return 0;
@@ -0,0 +1,267 @@
+/* Forwarding benchmark for the MGCP RTP path, not part of the testsuite */
+
+/*
+ * (C) 2011-2012 by Holger Hans Peter Freyther <zecke@selfish.org>
+ * (C) 2011-2012 by On-Waves
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/talloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define BENCH_ROUNDS	1024
+#define BENCH_PACKETS	64
+
+void mgcp_patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *state,
+			  struct mgcp_rtp_end *rtp_end, struct sockaddr_in *addr,
+			  char *data, int len);
+
+#if defined(__i386__) || defined(__x86_64__)
+#define BENCH_UNIT	"cycles"
+static uint64_t bench_now(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+#else
+#define BENCH_UNIT	"ns"
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static int bench_socket(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(fd >= 0);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	OSMO_ASSERT(bind(fd, (struct sockaddr *) addr, sizeof(*addr)) == 0);
+	OSMO_ASSERT(getsockname(fd, (struct sockaddr *) addr, &len) == 0);
+	return fd;
+}
+
+static int bench_drain(int fd)
+{
+	char buf[256];
+	int num = 0;
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+		num += 1;
+	return num;
+}
+
+static int forward_data(int fd, struct mgcp_rtp_tap *tap, const char *buf,
+			int len, unsigned int *syscalls)
+{
+	if (!tap->enabled)
+		return 0;
+
+	*syscalls += 1;
+	return sendto(fd, buf, len, 0,
+		      (struct sockaddr *)&tap->forward, sizeof(tap->forward));
+}
+
+/*
+ * The path of a BTS packet before the batching: rtp_data_bts() reads
+ * it into a stack buffer, sends it to the incoming tap, then mgcp_send()
+ * patches it and sends it to the outgoing tap and to the network with
+ * a sendto() each.
+ */
+static int reference_data_bts(struct mgcp_endpoint *endp, unsigned int *syscalls)
+{
+	char buf[4096];
+	struct sockaddr_in addr, out;
+	socklen_t slen = sizeof(addr);
+	int rc;
+
+	*syscalls += 1;
+	rc = recvfrom(endp->bts_end.rtp.fd, buf, sizeof(buf), MSG_DONTWAIT,
+		      (struct sockaddr *) &addr, &slen);
+	if (rc <= 0)
+		return -1;
+
+	endp->bts_end.packets += 1;
+	endp->bts_end.octets += rc;
+	forward_data(endp->bts_end.rtp.fd, &endp->taps[MGCP_TAP_BTS_IN],
+		     buf, rc, syscalls);
+
+	mgcp_patch_and_count(endp, &endp->bts_state, &endp->net_end,
+			     &addr, buf, rc);
+	forward_data(endp->net_end.rtp.fd, &endp->taps[MGCP_TAP_NET_OUT],
+		     buf, rc, syscalls);
+
+	out.sin_family = AF_INET;
+	out.sin_port = endp->net_end.rtp_port;
+	out.sin_addr = endp->net_end.addr;
+	*syscalls += 1;
+	return sendto(endp->net_end.rtp.fd, buf, rc, 0,
+		      (struct sockaddr *) &out, sizeof(out));
+}
+
+static const char *mode_name(int mode)
+{
+	switch (mode) {
+	case 0:
+		return "Reference";
+	case 1:
+		return "Single";
+	default:
+		return "Batched";
+	}
+}
+
+/*
+ * Forward BTS packets to the network with a tap on the incoming and
+ * one on the outgoing side, once through the old path and once through
+ * rtp_read() without and with batching. Copies are the datagrams handed
+ * to or taken from the kernel per forwarded packet, each of them copies
+ * the payload once. The packet is not copied in user space by any path.
+ */
+static void bench_forward(void)
+{
+	static const char packet[] =
+		"\x80\x62\x00\x13\x00\x00\x8B\xB8\x10\x20\x30\x40"
+		"\x01\x23\x45\x67\x89\xAB\xCD\xEF";
+	const int len = sizeof(packet) - 1;
+	struct sockaddr_in bts_addr, net_addr, tap_in_addr, tap_out_addr, dst;
+	int bts_fd, net_fd, tap_in_fd, tap_out_fd;
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	int port, round, i, mode;
+
+	bts_fd = bench_socket(&bts_addr);
+	net_fd = bench_socket(&net_addr);
+	tap_in_fd = bench_socket(&tap_in_addr);
+	tap_out_fd = bench_socket(&tap_out_addr);
+
+	cfg = mgcp_config_alloc();
+	talloc_free(cfg->source_addr);
+	cfg->source_addr = talloc_strdup(cfg, "127.0.0.1");
+	cfg->trunk.number_endpoints = 2;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp = &cfg->trunk.endpoints[1];
+
+	for (port = 47000; port < 48000; port += 2)
+		if (mgcp_bind_bts_rtp_port(endp, port) == 0)
+			break;
+	OSMO_ASSERT(endp->bts_end.rtp.fd >= 0);
+	for (port += 2; port < 49000; port += 2)
+		if (mgcp_bind_net_rtp_port(endp, port) == 0)
+			break;
+	OSMO_ASSERT(endp->net_end.rtp.fd >= 0);
+
+	endp->allocated = 1;
+	endp->conn_mode = MGCP_CONN_RECV_SEND;
+	endp->bts_end.addr = bts_addr.sin_addr;
+	endp->bts_end.rtp_port = bts_addr.sin_port;
+	endp->net_end.addr = net_addr.sin_addr;
+	endp->net_end.rtp_port = net_addr.sin_port;
+	endp->taps[MGCP_TAP_BTS_IN].enabled = 1;
+	endp->taps[MGCP_TAP_BTS_IN].forward = tap_in_addr;
+	endp->taps[MGCP_TAP_NET_OUT].enabled = 1;
+	endp->taps[MGCP_TAP_NET_OUT].forward = tap_out_addr;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	dst.sin_port = htons(endp->bts_end.local_port);
+
+	for (mode = 0; mode < 3; ++mode) {
+		unsigned int syscalls = 0, datagrams = 0, peer = 0;
+		uint64_t elapsed = 0;
+
+		cfg->rtp_batch = mode == 2 ? BENCH_PACKETS : 1;
+		endp->bts_end.syscalls = endp->net_end.syscalls = 0;
+
+		for (round = 0; round < BENCH_ROUNDS; ++round) {
+			uint64_t start;
+			int num;
+
+			for (i = 0; i < BENCH_PACKETS; ++i)
+				sendto(bts_fd, packet, len, 0,
+				       (struct sockaddr *) &dst, sizeof(dst));
+
+			start = bench_now();
+			for (i = 0; i < BENCH_PACKETS; ) {
+				if (mode == 0) {
+					reference_data_bts(endp, &syscalls);
+					i += 1;
+				} else {
+					endp->bts_end.rtp.cb(&endp->bts_end.rtp,
+							     BSC_FD_READ);
+					i += cfg->rtp_batch;
+				}
+			}
+			elapsed += bench_now() - start;
+
+			num = bench_drain(net_fd);
+			peer += num;
+			datagrams += BENCH_PACKETS + num;
+			datagrams += bench_drain(tap_in_fd);
+			datagrams += bench_drain(tap_out_fd);
+		}
+
+		if (mode > 0)
+			syscalls = endp->bts_end.syscalls +
+				   endp->net_end.syscalls;
+		if (peer == 0) {
+			printf("%s: nothing was forwarded\n", mode_name(mode));
+			continue;
+		}
+
+		printf("%s: %u packets, %.2f syscalls, %.2f copies, "
+		       "%llu %s per forwarded packet\n",
+		       mode_name(mode), peer, (double) syscalls / peer,
+		       (double) datagrams / peer,
+		       (unsigned long long) elapsed / peer, BENCH_UNIT);
+	}
+
+	mgcp_free_endp(endp);
+	mgcp_free_rtp_port(&endp->bts_end);
+	mgcp_free_rtp_port(&endp->net_end);
+	close(bts_fd);
+	close(net_fd);
+	close(tap_in_fd);
+	close(tap_out_fd);
+	talloc_free(cfg);
+}
+
+int main(int argc, char **argv)
+{
+	osmo_init_logging(&log_info);
+
+	bench_forward();
+	return EXIT_SUCCESS;
+}
@@ -24,6 +24,9 @@
 #include <osmocom/core/talloc.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 char *strline_r(char *str, char **saveptr);
 
@@ -711,6 +714,430 @@ static void test_packet_error_detection(int patch_ssrc, int patch_ts)
 	}
 }
 
+static int bench_socket(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(fd >= 0);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	OSMO_ASSERT(bind(fd, (struct sockaddr *) addr, sizeof(*addr)) == 0);
+	OSMO_ASSERT(getsockname(fd, (struct sockaddr *) addr, &len) == 0);
+	return fd;
+}
+
+/* count the datagrams waiting on fd, compare them with the reference */
+static int bench_drain(int fd, const char *ref, int ref_len, int *mismatch)
+{
+	char buf[256];
+	int rc, num = 0;
+
+	while ((rc = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+		num += 1;
+		if (ref && (rc != ref_len || memcmp(buf, ref, rc) != 0))
+			*mismatch += 1;
+	}
+	return num;
+}
+
+#define BENCH_ROUNDS	64
+#define BENCH_PACKETS	64
+
+/*
+ * Forward BTS packets to the network with a tap on the incoming and
+ * one on the outgoing side. The reference forwards the same packets
+ * the way it was done before: one recvfrom() into a stack buffer and
+ * one sendto() per destination. mgcp_bench measures the time and the
+ * copies of the same paths.
+ */
+static void test_forward_taps(void)
+{
+	static const char packet[] =
+		"\x80\x62\x00\x13\x00\x00\x8B\xB8\x10\x20\x30\x40"
+		"\x01\x23\x45\x67\x89\xAB\xCD\xEF";
+	const int len = sizeof(packet) - 1;
+	struct sockaddr_in bts_addr, net_addr, tap_in_addr, tap_out_addr, dst;
+	int bts_fd, net_fd, tap_in_fd, tap_out_fd;
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	unsigned int syscalls[3];
+	int port, round, i, mode;
+
+	printf("Testing forwarding with taps\n");
+
+	bts_fd = bench_socket(&bts_addr);
+	net_fd = bench_socket(&net_addr);
+	tap_in_fd = bench_socket(&tap_in_addr);
+	tap_out_fd = bench_socket(&tap_out_addr);
+
+	cfg = mgcp_config_alloc();
+	talloc_free(cfg->source_addr);
+	cfg->source_addr = talloc_strdup(cfg, "127.0.0.1");
+	cfg->trunk.number_endpoints = 2;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp = &cfg->trunk.endpoints[1];
+
+	for (port = 47000; port < 48000; port += 2)
+		if (mgcp_bind_bts_rtp_port(endp, port) == 0)
+			break;
+	OSMO_ASSERT(endp->bts_end.rtp.fd >= 0);
+	for (port += 2; port < 49000; port += 2)
+		if (mgcp_bind_net_rtp_port(endp, port) == 0)
+			break;
+	OSMO_ASSERT(endp->net_end.rtp.fd >= 0);
+
+	endp->allocated = 1;
+	endp->conn_mode = MGCP_CONN_RECV_SEND;
+	endp->bts_end.addr = bts_addr.sin_addr;
+	endp->bts_end.rtp_port = bts_addr.sin_port;
+	endp->net_end.addr = net_addr.sin_addr;
+	endp->net_end.rtp_port = net_addr.sin_port;
+	endp->taps[MGCP_TAP_BTS_IN].enabled = 1;
+	endp->taps[MGCP_TAP_BTS_IN].forward = tap_in_addr;
+	endp->taps[MGCP_TAP_NET_OUT].enabled = 1;
+	endp->taps[MGCP_TAP_NET_OUT].forward = tap_out_addr;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	dst.sin_port = htons(endp->bts_end.local_port);
+
+	for (mode = 0; mode < 3; ++mode) {
+		int peer = 0, tapped_in = 0, tapped_out = 0, mismatch = 0;
+
+		cfg->rtp_batch = mode == 2 ? BENCH_PACKETS : 1;
+		endp->bts_end.syscalls = endp->net_end.syscalls = 0;
+		syscalls[mode] = 0;
+
+		for (round = 0; round < BENCH_ROUNDS; ++round) {
+			for (i = 0; i < BENCH_PACKETS; ++i)
+				sendto(bts_fd, packet, len, 0,
+				       (struct sockaddr *) &dst, sizeof(dst));
+
+			for (i = 0; i < BENCH_PACKETS; ) {
+				char buf[4096];
+				int rc, fd = endp->bts_end.rtp.fd;
+
+				if (mode > 0) {
+					i += cfg->rtp_batch;
+					endp->bts_end.rtp.cb(&endp->bts_end.rtp,
+							     BSC_FD_READ);
+					continue;
+				}
+
+				rc = recvfrom(fd, buf, sizeof(buf), 0, NULL, NULL);
+				sendto(fd, buf, rc, 0, (struct sockaddr *) &tap_in_addr,
+				       sizeof(tap_in_addr));
+				sendto(endp->net_end.rtp.fd, buf, rc, 0,
+				       (struct sockaddr *) &tap_out_addr,
+				       sizeof(tap_out_addr));
+				sendto(endp->net_end.rtp.fd, buf, rc, 0,
+				       (struct sockaddr *) &net_addr, sizeof(net_addr));
+				syscalls[mode] += 4;
+				i += 1;
+			}
+
+			peer += bench_drain(net_fd, NULL, 0, &mismatch);
+			tapped_in += bench_drain(tap_in_fd, packet, len, &mismatch);
+			tapped_out += bench_drain(tap_out_fd, NULL, 0, &mismatch);
+		}
+
+		if (mode > 0)
+			syscalls[mode] = endp->bts_end.syscalls +
+					 endp->net_end.syscalls;
+
+		printf("%s: peer %d, tap in %d, tap out %d, mismatches %d\n",
+		       mode == 0 ? "Reference" : mode == 1 ? "Single" : "Batched",
+		       peer, tapped_in, tapped_out, mismatch);
+	}
+
+	/*
+	 * The peer and both taps share a sendmmsg() and a batch shares one
+	 * recvmmsg(). Without them it is one call per datagram, as before.
+	 */
+	OSMO_ASSERT(syscalls[1] <= syscalls[0]);
+	OSMO_ASSERT(syscalls[2] <= syscalls[1]);
+
+	mgcp_free_endp(endp);
+	mgcp_free_rtp_port(&endp->bts_end);
+	mgcp_free_rtp_port(&endp->net_end);
+	close(bts_fd);
+	close(net_fd);
+	close(tap_in_fd);
+	close(tap_out_fd);
+	talloc_free(cfg);
+}
+
+static int local_port(int fd)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	OSMO_ASSERT(getsockname(fd, (struct sockaddr *) &addr, &len) == 0);
+	return ntohs(addr.sin_port);
+}
+
+/*
+ * Bind two endpoints with an odd base port behind the shared sockets.
+ * RTCP must find the end one port below and both must send from their
+ * own ports.
+ */
+static void test_demux_odd_port(void)
+{
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp1, *endp2;
+	struct mgcp_rtp_end *end;
+	int port, base, is_rtp;
+
+	printf("Testing demux with an odd base port\n");
+
+	cfg = mgcp_config_alloc();
+	talloc_free(cfg->source_addr);
+	cfg->source_addr = talloc_strdup(cfg, "127.0.0.1");
+	cfg->trunk.number_endpoints = 3;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp1 = &cfg->trunk.endpoints[1];
+	endp2 = &cfg->trunk.endpoints[2];
+
+	for (port = 46000; port < 46100; ++port) {
+		cfg->bts_ports.demux_port = port;
+		if (mgcp_bind_bts_rtp_port(endp1, 45001) == 0)
+			break;
+	}
+	OSMO_ASSERT(cfg->bts_ports.demux);
+
+	for (base = 45001; base < 46000; base += 4) {
+		mgcp_free_rtp_port(&endp1->bts_end);
+		mgcp_free_rtp_port(&endp2->bts_end);
+		if (mgcp_bind_bts_rtp_port(endp1, base) == 0 &&
+		    mgcp_bind_bts_rtp_port(endp2, base + 2) == 0)
+			break;
+	}
+	OSMO_ASSERT(endp2->bts_end.demux);
+
+	end = mgcp_demux_lookup(cfg->bts_ports.demux, base, &is_rtp);
+	printf("base: %s %s\n", end == &endp1->bts_end ? "endp1" : "wrong",
+	       is_rtp ? "RTP" : "RTCP");
+	end = mgcp_demux_lookup(cfg->bts_ports.demux, base + 1, &is_rtp);
+	printf("base + 1: %s %s\n", end == &endp1->bts_end ? "endp1" : "wrong",
+	       is_rtp ? "RTP" : "RTCP");
+	end = mgcp_demux_lookup(cfg->bts_ports.demux, base + 2, &is_rtp);
+	printf("base + 2: %s %s\n", end == &endp2->bts_end ? "endp2" : "wrong",
+	       is_rtp ? "RTP" : "RTCP");
+	end = mgcp_demux_lookup(cfg->bts_ports.demux, base + 3, &is_rtp);
+	printf("base + 3: %s %s\n", end == &endp2->bts_end ? "endp2" : "wrong",
+	       is_rtp ? "RTP" : "RTCP");
+	end = mgcp_demux_lookup(cfg->bts_ports.demux, base - 1, &is_rtp);
+	printf("base - 1: %s\n", end ? "found" : "unknown");
+
+	/* the peer has to see the advertised ports as the source */
+	OSMO_ASSERT(local_port(endp1->bts_end.rtp.fd) == base);
+	OSMO_ASSERT(local_port(endp1->bts_end.rtcp.fd) == base + 1);
+	OSMO_ASSERT(local_port(endp2->bts_end.rtp.fd) == base + 2);
+	OSMO_ASSERT(local_port(endp2->bts_end.rtcp.fd) == base + 3);
+
+	mgcp_free_rtp_port(&endp1->bts_end);
+	mgcp_free_rtp_port(&endp2->bts_end);
+	OSMO_ASSERT(endp1->bts_end.rtp.fd == -1);
+	OSMO_ASSERT(cfg->bts_ports.demux->ends == 0);
+	talloc_free(cfg);
+}
+
+/*
+ * Hand reordered, duplicated and late packets to the jitter buffer
+ * of the network side and check what gets played out.
+ */
+/* the jitter tests drive the wheel with this clock instead of sleeping */
+static uint32_t fake_ms;
+
+static uint32_t fake_now(void)
+{
+	return fake_ms;
+}
+
+static void test_jitter_buffer(void)
+{
+	static const int seqs[] = { 1, 3, 2, 5, 2, 4, 0 };
+	char packet[20];
+	struct sockaddr_in peer_addr, src_addr;
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	struct mgcp_jitter_buffer *jb;
+	int peer_fd, src_fd, i, rc;
+
+	printf("Testing jitter buffer\n");
+
+	peer_fd = bench_socket(&peer_addr);
+	src_fd = bench_socket(&src_addr);
+
+	cfg = mgcp_config_alloc();
+	cfg->trunk.number_endpoints = 2;
+	cfg->trunk.jitter_buffer_ms = 200;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp = &cfg->trunk.endpoints[1];
+
+	endp->net_end.rtp.fd = src_fd;
+	endp->net_end.addr = peer_addr.sin_addr;
+	endp->net_end.rtp_port = peer_addr.sin_port;
+	mgcp_rtp_end_config(endp, 0, &endp->net_end);
+	jb = endp->net_end.jb;
+	OSMO_ASSERT(jb);
+	OSMO_ASSERT(jb->max_depth == 10);
+	fake_ms = 1000;
+	mgcp_wheel_set_clock(cfg->jb_wheel, fake_now);
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = 0x80;
+	for (i = 0; i < ARRAY_SIZE(seqs); ++i) {
+		packet[3] = seqs[i];
+		OSMO_ASSERT(mgcp_jb_put(jb, packet, sizeof(packet)) == 0);
+	}
+	printf("Buffered %d, late %u\n", jb->count, endp->net_end.jb_late);
+
+	for (i = 0; i < 200 && (jb->count > 0 || jb->timer.pending); ++i) {
+		fake_ms += MGCP_WHEEL_TICK_MS;
+		mgcp_wheel_run(cfg->jb_wheel);
+	}
+
+	printf("Played out:");
+	while ((rc = recv(peer_fd, packet, sizeof(packet), MSG_DONTWAIT)) >= 0)
+		printf(" %d", packet[3]);
+	printf("\nBuffered %d, underruns %u\n",
+	       jb->count, endp->net_end.jb_underruns);
+
+	endp->net_end.rtp.fd = -1;
+	mgcp_free_endp(endp);
+	OSMO_ASSERT(!endp->net_end.jb);
+	osmo_timer_del(&cfg->jb_wheel->timer);
+	close(peer_fd);
+	close(src_fd);
+	talloc_free(cfg);
+}
+
+/*
+ * A burst one packet larger than the buffer only drops the oldest
+ * frame, the rest is played out.
+ */
+static void test_jitter_overrun(int depth)
+{
+	char packet[20];
+	struct sockaddr_in peer_addr, src_addr;
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	struct mgcp_jitter_buffer *jb;
+	int peer_fd, src_fd, i, rc;
+
+	printf("Testing jitter buffer overrun with depth %d\n", depth);
+
+	peer_fd = bench_socket(&peer_addr);
+	src_fd = bench_socket(&src_addr);
+
+	cfg = mgcp_config_alloc();
+	cfg->trunk.number_endpoints = 2;
+	cfg->trunk.jitter_buffer_ms = depth * MGCP_JB_PLAYOUT_MS;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp = &cfg->trunk.endpoints[1];
+
+	endp->net_end.rtp.fd = src_fd;
+	endp->net_end.addr = peer_addr.sin_addr;
+	endp->net_end.rtp_port = peer_addr.sin_port;
+	mgcp_rtp_end_config(endp, 0, &endp->net_end);
+	jb = endp->net_end.jb;
+	OSMO_ASSERT(jb);
+	OSMO_ASSERT(jb->max_depth == depth);
+	fake_ms = 1000;
+	mgcp_wheel_set_clock(cfg->jb_wheel, fake_now);
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = 0x80;
+	for (i = 1; i <= depth + 1; ++i) {
+		packet[3] = i;
+		OSMO_ASSERT(mgcp_jb_put(jb, packet, sizeof(packet)) == 0);
+	}
+	printf("Buffered %d, overruns %u\n", jb->count, endp->net_end.jb_overruns);
+
+	for (i = 0; i < 200 && (jb->count > 0 || jb->timer.pending); ++i) {
+		fake_ms += MGCP_WHEEL_TICK_MS;
+		mgcp_wheel_run(cfg->jb_wheel);
+	}
+
+	printf("Played out:");
+	while ((rc = recv(peer_fd, packet, sizeof(packet), MSG_DONTWAIT)) >= 0)
+		printf(" %d", packet[3]);
+	printf("\n");
+
+	endp->net_end.rtp.fd = -1;
+	mgcp_free_endp(endp);
+	osmo_timer_del(&cfg->jb_wheel->timer);
+	close(peer_fd);
+	close(src_fd);
+	talloc_free(cfg);
+}
+
+/*
+ * The wheel runs every 7 ms, later than the 5 ms tick. The playout
+ * keeps its 20 ms period and is never late by more than one run.
+ */
+static void test_jitter_drift(void)
+{
+	char packet[20];
+	struct sockaddr_in peer_addr, src_addr;
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	struct mgcp_jitter_buffer *jb;
+	int peer_fd, src_fd, i, num = 0, late = 0;
+
+	printf("Testing jitter buffer playout period\n");
+
+	peer_fd = bench_socket(&peer_addr);
+	src_fd = bench_socket(&src_addr);
+
+	cfg = mgcp_config_alloc();
+	cfg->trunk.number_endpoints = 2;
+	cfg->trunk.jitter_buffer_ms = 200;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	endp = &cfg->trunk.endpoints[1];
+
+	endp->net_end.rtp.fd = src_fd;
+	endp->net_end.addr = peer_addr.sin_addr;
+	endp->net_end.rtp_port = peer_addr.sin_port;
+	mgcp_rtp_end_config(endp, 0, &endp->net_end);
+	jb = endp->net_end.jb;
+	OSMO_ASSERT(jb);
+	fake_ms = 1000;
+	mgcp_wheel_set_clock(cfg->jb_wheel, fake_now);
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = 0x80;
+	for (i = 1; i <= 10; ++i) {
+		packet[3] = i;
+		OSMO_ASSERT(mgcp_jb_put(jb, packet, sizeof(packet)) == 0);
+	}
+
+	for (i = 0; i < 200 && (jb->count > 0 || jb->timer.pending); ++i) {
+		fake_ms += 7;
+		mgcp_wheel_run(cfg->jb_wheel);
+
+		while (recv(peer_fd, packet, sizeof(packet), MSG_DONTWAIT) >= 0) {
+			num += 1;
+			if (fake_ms - 1000 >= num * MGCP_JB_PLAYOUT_MS + 7)
+				late += 1;
+		}
+	}
+	printf("Played out %d, late %d\n", num, late);
+
+	endp->net_end.rtp.fd = -1;
+	mgcp_free_endp(endp);
+	osmo_timer_del(&cfg->jb_wheel->timer);
+	close(peer_fd);
+	close(src_fd);
+	talloc_free(cfg);
+}
+
 int main(int argc, char **argv)
 {
 	osmo_init_logging(&log_info);
@@ -725,6 +1152,12 @@ int main(int argc, char **argv)
 	test_packet_error_detection(0, 0);
 	test_packet_error_detection(0, 1);
 	test_packet_error_detection(1, 1);
+	test_forward_taps();
+	test_demux_odd_port();
+	test_jitter_buffer();
+	test_jitter_overrun(1);
+	test_jitter_overrun(3);
+	test_jitter_drift();
 
 	printf("Done\n");
 	return EXIT_SUCCESS;
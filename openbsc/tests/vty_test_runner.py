@@ -443,7 +443,7 @@ class TestVTYNAT(TestVTYGenericBSC):
         self.vty.command("end")
 
         res = self.vty.command("show prefix-tree")
-        self.assertEqual(res, "% there is now prefix tree loaded.")
+        self.assertEqual(res, "% there is no prefix tree loaded.")
 
     def testUssdSideChannelProvider(self):
         self.vty.command("end")